@@ -0,0 +1,254 @@
+/*
+ * Cache of the flash memory read during a session, in front of ems_read() and
+ * of the read queues.
+ *
+ * The flash memory is cached by aligned lines of CACHE_LINESIZE bytes. A line
+ * holds one range of valid bytes, so the headers read by list() are cached as
+ * well as whole blocks. A read is served from the cache only when all its bytes
+ * are valid. The memory used is bounded by cache_setsize(): the lines are
+ * recycled in the order of a clock, the lines read since the last pass getting a
+ * second chance.
+ *
+ * A write to the flash memory invalidates the lines of its erase-blocks
+ * (cache_invalidate() is called by ems_writev()). A read in flight when a
+ * write is sent may return the data preceding the write: reads are stamped
+ * with cache_stamp() when they are sent and their data is cached only if their
+ * erase-blocks haven't been written since.
+ *
+ * The SRAM is not cached. The hits and the misses are accounted by --stats.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "ems.h"
+#include "stats.h"
+
+#define CACHE_END (2*PAGESIZE)
+#define NLINES (CACHE_END/CACHE_LINESIZE)
+#define NBLOCKS (CACHE_END/ERASEBLOCKSIZE)
+#define LINESPERBLOCK (ERASEBLOCKSIZE/CACHE_LINESIZE)
+
+#define NOSLOT (-1)
+
+/*
+ * struct slot: memory of a line, CACHE_LINESIZE bytes of "data"
+ *   line: number of the line cached, NOSLOT if the slot is free
+ *   lo, hi: range of the valid bytes in the line
+ *   ref: the line has been used since the last pass of the clock
+ */
+struct slot {
+    int line;
+    unsigned lo, hi;
+    int ref;
+};
+
+static size_t cachesize = CACHE_DEFAULTSIZE;
+static int nslots, hand;
+static struct slot *slots;
+static unsigned char *data;
+
+/* slot of each line, NOSLOT if it is not cached */
+static int map[NLINES];
+
+/* stamp of the last write to each erase-block */
+static unsigned long stampclock, written[NBLOCKS];
+
+/**
+ * Set the size of the memory of the cache, 0 to disable it. The lines cached
+ * are dropped.
+ */
+void
+cache_setsize(size_t size) {
+    free(slots);
+    free(data);
+    slots = NULL;
+    data = NULL;
+    nslots = hand = 0;
+    cachesize = size;
+}
+
+/**
+ * Allocate the slots on first use. Returns non-zero if the cache is disabled.
+ */
+static int
+cache_init(void) {
+    if (slots != NULL)
+        return 0;
+
+    if ((nslots = cachesize/CACHE_LINESIZE) > NLINES)
+        nslots = NLINES;
+    if (nslots == 0)
+        return 1;
+
+    if ((slots = malloc(nslots * sizeof(*slots))) == NULL ||
+        (data = malloc((size_t)nslots * CACHE_LINESIZE)) == NULL)
+            err(1, "malloc");
+    for (int i = 0; i < nslots; i++)
+        slots[i].line = NOSLOT;
+    for (int i = 0; i < NLINES; i++)
+        map[i] = NOSLOT;
+
+    return 0;
+}
+
+/* the range is in the flash memory */
+static int
+inrange(uint32_t offset, size_t count) {
+    return count > 0 && offset < CACHE_END && count <= CACHE_END - offset;
+}
+
+/**
+ * Read "count" bytes at "offset" from the cache.
+ *
+ * Returns 1 if the data was read, 0 if it is not entirely cached.
+ */
+int
+cache_read(uint32_t offset, unsigned char *buf, size_t count) {
+    uint32_t ofs, next, end = offset + count;
+    struct slot *s;
+    int line;
+
+    if (!inrange(offset, count) || cache_init())
+        return 0;
+
+    STATS_TIMER(t);
+    for (ofs = offset; ofs < end; ofs = next) {
+        line = ofs / CACHE_LINESIZE;
+        next = (line + 1) * CACHE_LINESIZE;
+        if (next > end)
+            next = end;
+
+        if (map[line] == NOSLOT)
+            goto miss;
+        s = &slots[map[line]];
+        if (s->lo > ofs % CACHE_LINESIZE ||
+            s->hi < next - line*CACHE_LINESIZE)
+                goto miss;
+    }
+
+    for (ofs = offset; ofs < end; ofs = next) {
+        line = ofs / CACHE_LINESIZE;
+        next = (line + 1) * CACHE_LINESIZE;
+        if (next > end)
+            next = end;
+
+        memcpy(buf + (ofs - offset), data + (size_t)map[line]*CACHE_LINESIZE +
+            ofs % CACHE_LINESIZE, next - ofs);
+        slots[map[line]].ref = 1;
+    }
+    STATS_STOP(t, STATS_CACHE_HIT, 1, count);
+    return 1;
+
+miss:
+    STATS_STOP(t, STATS_CACHE_MISS, 1, count);
+    return 0;
+}
+
+/**
+ * Stamp of a read, taken when it is sent to the device (see cache_fill()).
+ */
+unsigned long
+cache_stamp(void) {
+    return stampclock;
+}
+
+/* take the next slot that wasn't used since the last pass of the clock */
+static int
+cache_evict(void) {
+    int n;
+
+    while (slots[hand].line != NOSLOT && slots[hand].ref) {
+        slots[hand].ref = 0;
+        hand = (hand + 1) % nslots;
+    }
+
+    n = hand;
+    if (slots[n].line != NOSLOT)
+        map[slots[n].line] = NOSLOT;
+    hand = (hand + 1) % nslots;
+
+    return n;
+}
+
+/**
+ * Cache "count" bytes read at "offset". "stamp" is the value of cache_stamp()
+ * when the read was sent: the lines of the erase-blocks written since are not
+ * cached.
+ */
+void
+cache_fill(uint32_t offset, const unsigned char *buf, size_t count,
+    unsigned long stamp) {
+    uint32_t ofs, next, end = offset + count;
+    unsigned lo, hi;
+    struct slot *s;
+    int line;
+
+    if (!inrange(offset, count) || cache_init())
+        return;
+
+    for (ofs = offset; ofs < end; ofs = next) {
+        line = ofs / CACHE_LINESIZE;
+        next = (line + 1) * CACHE_LINESIZE;
+        if (next > end)
+            next = end;
+
+        if (written[line / LINESPERBLOCK] > stamp)
+            continue;
+
+        lo = ofs % CACHE_LINESIZE;
+        hi = next - line*CACHE_LINESIZE;
+        if (map[line] == NOSLOT) {
+            map[line] = cache_evict();
+            s = &slots[map[line]];
+            s->line = line;
+            s->lo = lo;
+            s->hi = hi;
+        } else {
+            // extend the valid range, replace it if they are disjoint
+            s = &slots[map[line]];
+            if (lo <= s->hi && hi >= s->lo) {
+                if (s->lo < lo)
+                    lo = s->lo;
+                if (s->hi > hi)
+                    hi = s->hi;
+            }
+            s->lo = lo;
+            s->hi = hi;
+        }
+        s->ref = 1;
+
+        memcpy(data + (size_t)map[line]*CACHE_LINESIZE + ofs % CACHE_LINESIZE,
+            buf + (ofs - offset), next - ofs);
+    }
+}
+
+/**
+ * Drop the lines of the erase-blocks written by a write of "count" bytes at
+ * "offset". Called before the write is sent.
+ */
+void
+cache_invalidate(uint32_t offset, size_t count) {
+    uint32_t block, last;
+
+    if (offset >= CACHE_END || count == 0)
+        return;
+    if (count > CACHE_END - offset)
+        count = CACHE_END - offset;
+
+    last = (offset + count - 1) / ERASEBLOCKSIZE;
+    for (block = offset / ERASEBLOCKSIZE; block <= last; block++) {
+        written[block] = ++stampclock;
+        if (slots == NULL)
+            continue;
+        for (int line = block*LINESPERBLOCK; line < (block+1)*LINESPERBLOCK;
+            line++) {
+                if (map[line] != NOSLOT) {
+                    slots[map[line]].line = NOSLOT;
+                    map[line] = NOSLOT;
+                }
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef EMS_CACHE_H
+#define EMS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ems.h"
+
+#define CACHE_LINESIZE 4096
+#define CACHE_DEFAULTSIZE ((size_t)1<<20)
+
+void cache_setsize(size_t);
+int cache_read(uint32_t, unsigned char *, size_t);
+unsigned long cache_stamp(void);
+void cache_fill(uint32_t, const unsigned char *, size_t, unsigned long);
+void cache_invalidate(uint32_t, size_t);
+
+#endif /* EMS_CACHE_H */
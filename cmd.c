@@ -16,10 +16,19 @@
 #include "flash.h"
 #include "image.h"
 #include "insert.h"
+#include "job.h"
+#include "listcache.h"
+#include "pack.h"
 #include "update.h"
 #include "updates.h"
 #include "cmd.h"
 #include "progress.h"
+#include "readq.h"
+#include "sparse.h"
+#include "store.h"
+#include "tune.h"
+#include "verify.h"
+#include "wear.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,9 +40,13 @@
 
 #include <unistd.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #define MENUTITLE "MENU#"
 
+/* header reads kept in flight by list() */
+#define LIST_DEPTH 16
+
 volatile sig_atomic_t int_state = 0, int_sig = 0;
 
 static void
@@ -98,73 +111,187 @@ blocksignals() {
     sigaction(SIGTTOU, &sa, NULL);
 }
 
-struct listing_rom {
-    ems_size_t offset;
-    struct header header;
-};
-
-struct listing {
-    int count;
-    struct listing_rom romlist[PAGESIZE/32768];
-};
+/**
+ * Check that a ROM the listing keeps starts at "offset" of the page: the
+ * header is valid, the size is a power of two, the ROM is aligned to its size
+ * and in the page boundaries. "buf" holds the bytes of the header used by
+ * header_validate() and header_decode().
+ *
+ * Returns 0 and decode the header into "header" if it is the case.
+ */
+static int
+list_rom(unsigned char *buf, ems_size_t offset, struct header *header) {
+    if (header_validate(buf) != 0)
+        return 1;
+    header_decode(header, buf);
+    if (header->romsize == 0 ||
+        (header->romsize & (header->romsize - 1)) != 0 ||
+        offset % header->romsize != 0 ||
+        offset + header->romsize > PAGESIZE) {
+            return 1;
+    }
+    return 0;
+}
 
 /**
- * Create a listing of the ROM.
- * The listing is guaranteed to represent a valid image:
- *   - no ROM overlapping
- *   - size is a power of two
- *   - ROMs are aligned to their size
- * ROMs that doesn't meet these conditions are discarded.
+ * Scan the page for the listing.
+ *
+ * Only the bytes of the headers used by header_validate() and header_decode()
+ * are read. The headers of the next 32 KB slots are read ahead with a read
+ * queue of LIST_DEPTH requests at least (the reads are small, their cost is
+ * mostly the latency), skipping the slots covered by the ROMs found. Those
+ * read before the ROM covering them was found are discarded.
  */
 static int
-list(int page, struct listing *listing) {
+list_scan(int page, struct listing *listing) {
+    static unsigned char raw[PAGESIZE/32768][HEADER_SIZE];
     struct header header;
-    unsigned char buf[HEADER_SIZE];
-    ems_size_t base, offset;
+    unsigned char *buf;
+    ems_size_t base, offset, readofs;
+    struct readq *rq;
+    uint32_t bufofs;
     int r;
 
     catchint();
 
     base = page * PAGESIZE;
 
+    rq = readq_newdepth(FROM_ROM, 0, LIST_DEPTH);
+
     listing->count = 0;
-    offset = 0;
+    offset = readofs = 0;
     do {
-        r = ems_read(FROM_ROM, base + offset, buf, HEADER_SIZE);
-        if (r != HEADER_SIZE) {
+        while (readofs < PAGESIZE &&
+            readq_submit(rq, base + readofs + HEADER_FIELDSOFS,
+            HEADER_FIELDSSIZE, raw[readofs/32768] + HEADER_FIELDSOFS) == 0) {
+                readofs += 32768;
+        }
+
+        r = readq_next(rq, &buf, &bufofs);
+        bufofs -= HEADER_FIELDSOFS;
+        if (r != HEADER_FIELDSSIZE) {
             warnx("flash read error (address=%"PRIuEMSSIZE")",
-                base + offset);
+                (ems_size_t)bufofs);
+            readq_free(rq);
             return 1;
         }
+        buf = raw[(bufofs - base)/32768];
 
-        /* Skip if it is not a valid header or the romsize code is incorrect
-           or the size is not a power of 2 or the ROM is not aligned or
-           not in page boundaries */
-        if (header_validate(buf) != 0) {
+        /* Skip the header of a slot covered by the last ROM found */
+        if (bufofs - base < offset)
+            continue;
+
+        if (list_rom(buf, offset, &header) != 0) {
             offset += 32768;
             continue;
         }
-        header_decode(&header, buf);
-        if (header.romsize == 0 ||
-            (header.romsize & (header.romsize - 1)) != 0 ||
-            offset % header.romsize != 0 ||
-            offset + header.romsize > PAGESIZE) {
-                offset += 32768;
-                continue;
-        }
 
         listing->romlist[listing->count].offset = offset;
         listing->romlist[listing->count].header = header;
         listing->count++;
 
         offset += header.romsize;
+        if (readofs < offset)
+            readofs = offset;
     } while (offset < PAGESIZE);
 
+    readq_free(rq);
+
     restoreint();
 
     return 0;
 }
 
+/**
+ * Read back the headers chosen by listcache_samples() to check a listing
+ * saved on the host.
+ *
+ * Returns:
+ *   0  the headers match the listing
+ *   1  they don't
+ *  -1  read error (a message has been printed)
+ */
+static int
+list_check(int page, struct listing *listing) {
+    static unsigned char raw[LISTCACHE_SAMPLES][HEADER_SIZE];
+    ems_size_t samples[LISTCACHE_SAMPLES], base, offset;
+    struct header header;
+    unsigned char *buf;
+    struct readq *rq;
+    uint32_t bufofs;
+    int n, r, i;
+
+    base = page * PAGESIZE;
+    n = listcache_samples(listing, samples);
+
+    rq = readq_newdepth(FROM_ROM, 0, LISTCACHE_SAMPLES);
+    for (i = 0; i < n; i++)
+        readq_submit(rq, base + samples[i] + HEADER_FIELDSOFS,
+            HEADER_FIELDSSIZE, raw[i] + HEADER_FIELDSOFS);
+
+    r = 0;
+    for (i = 0; i < n && r == 0; i++) {
+        struct listing_rom *rl = NULL;
+
+        if (readq_next(rq, &buf, &bufofs) != HEADER_FIELDSSIZE) {
+            warnx("flash read error (address=%"PRIuEMSSIZE")",
+                (ems_size_t)bufofs - HEADER_FIELDSOFS);
+            r = -1;
+            break;
+        }
+        offset = bufofs - HEADER_FIELDSOFS - base;
+        for (int j = 0; j < listing->count; j++)
+            if (listing->romlist[j].offset == offset)
+                rl = &listing->romlist[j];
+
+        if (list_rom(buf - HEADER_FIELDSOFS, offset, &header) != 0)
+            r = rl != NULL;
+        else
+            r = rl == NULL || strcmp(header.title, rl->header.title) != 0 ||
+                header.romsize != rl->header.romsize ||
+                header.enhancements != rl->header.enhancements ||
+                header.gbc_only != rl->header.gbc_only;
+    }
+    readq_free(rq);
+
+    return r;
+}
+
+/**
+ * Create a listing of the ROM.
+ * The listing is guaranteed to represent a valid image:
+ *   - no ROM overlapping
+ *   - size is a power of two
+ *   - ROMs are aligned to their size
+ * ROMs that doesn't meet these conditions are discarded.
+ *
+ * The listing saved on the host for the cart is used if the headers read back
+ * by list_check() match it (see listcache.c), otherwise the page is scanned
+ * and the listing saved.
+ */
+static int
+list(int page, struct listing *listing) {
+    char cartid[256];
+    int hasid;
+
+    if ((hasid = ems_cartid(cartid, sizeof(cartid)) == 0) &&
+        listcache_load(cartid, page, listing) == 0) {
+            switch (list_check(page, listing)) {
+            case 0:
+                return 0;
+            case -1:
+                return 1;
+            }
+    }
+
+    if (list_scan(page, listing))
+        return 1;
+    if (hasid)
+        listcache_save(cartid, page, listing);
+
+    return 0;
+}
+
 static char*
 strenh(int enh) {
     enh &= HEADER_ENH_ALL;
@@ -247,7 +374,22 @@ cmd_title(int page) {
 
 void
 cmd_delete(int page, int verbose, int argc, char **argv) {
+    struct listing listing;
+    char cartid[256];
+    int cached;
+
     blocksignals();
+
+    // the listing saved on the host is updated if there is one and it is valid
+    if (ems_cartid(cartid, sizeof(cartid)) == 0) {
+        cached = listcache_load(cartid, page, &listing) == 0 &&
+            list_check(page, &listing) == 0;
+        if (listcache_drop(cartid, page))
+            exit(1);
+    } else {
+        cached = 0;
+    }
+
     catchint();
     flash_init(NULL, checkint);
 
@@ -291,15 +433,35 @@ cmd_delete(int page, int verbose, int argc, char **argv) {
             warnx("%s", flash_lasterrorstr);
             exit(1);
         }
+
+        for (int j = 0; cached && j < listing.count; j++) {
+            if (listing.romlist[j].offset == offset) {
+                memmove(&listing.romlist[j], &listing.romlist[j+1],
+                    (listing.count - j - 1)*sizeof(listing.romlist[0]));
+                listing.count--;
+                break;
+            }
+        }
     }
     restoreint();
+
+    if (cached)
+        listcache_save(cartid, page, &listing);
 }
 
 void
 cmd_format(int page, int verbose) {
+    struct listing listing;
     ems_size_t base, offset;
+    char cartid[256];
+    int hasid;
 
     blocksignals();
+
+    if ((hasid = ems_cartid(cartid, sizeof(cartid)) == 0) &&
+        listcache_drop(cartid, page))
+            exit(1);
+
     catchint();
     flash_init(NULL, checkint);
 
@@ -314,17 +476,141 @@ cmd_format(int page, int verbose) {
         }
 
     restoreint();
+
+    if (hasid) {
+        listing.count = 0;
+        listcache_save(cartid, page, &listing);
+    }
+}
+
+/*
+ * --autotune command handling
+ */
+
+void
+cmd_autotune(int page, int verbose) {
+    struct listing listing;
+    ems_size_t base, scratch, readsize, writesize;
+    char used[PAGESIZE/ERASEBLOCKSIZE];
+    char devid[256];
+    int i;
+
+    blocksignals();
+
+    if (list(page, &listing))
+        exit(1);
+
+    /* use the last erase-block of the page not holding a ROM */
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < listing.count; i++) {
+        struct listing_rom *rl = &listing.romlist[i];
+        ems_size_t ofs;
+
+        for (ofs = rl->offset; ofs < rl->offset + rl->header.romsize;
+            ofs += 32768)
+                used[ofs / ERASEBLOCKSIZE] = 1;
+    }
+    for (i = PAGESIZE/ERASEBLOCKSIZE - 1; i >= 0 && used[i]; i--)
+        ;
+    if (i < 0)
+        errx(1, "no free erase-block on page %d to run the tests", page+1);
+
+    base = page * PAGESIZE;
+    scratch = base + i * ERASEBLOCKSIZE;
+
+    if (ems_devid(devid, sizeof(devid)) != 0)
+        errx(1, "can't identify the device");
+
+    if (verbose)
+        printf("Testing transfer sizes at address 0x%"PRIxLEAST32"...\n",
+            scratch);
+
+    catchint();
+    flash_init(NULL, checkint);
+    if (tune_run(scratch, verbose, checkint, &readsize, &writesize))
+        exit(1);
+    restoreint();
+
+    if (tune_save(devid, readsize, writesize))
+        exit(1);
+
+    printf("Read size: %"PRIuEMSSIZE" bytes\n", readsize);
+    printf("Write size: %"PRIuEMSSIZE" bytes\n", writesize);
 }
 
 /*
  * --restore and --dump commands handling
  */
 
+/**
+ * Restore a sparse image (see sparse.c): only the erase-blocks holding data are
+ * written. The ROMs of the cart whose header is in the others are deleted.
+ */
+static void
+restore_sparse(int page, int verbose, char *path, int diff) {
+    static struct sparse_image image;
+    struct progress_totals totals = {0};
+    struct listing current;
+    ems_size_t base, offset;
+    char cartid[256];
+    int hasid, i;
+
+    if (sparse_load(path, &image))
+        exit(1);
+
+    base = page * PAGESIZE;
+    for (i = 0; i < SPARSE_NBLOCKS; i++)
+        if (image.used[i]) {
+            totals.erase++;
+            totals.writef += ERASEBLOCKSIZE;
+        }
+    // the current content is read to find the blocks to rewrite
+    if (diff)
+        totals.read = totals.writef;
+
+    blocksignals();
+
+    if (list(page, &current))
+        exit(1);
+    if ((hasid = ems_cartid(cartid, sizeof(cartid)) == 0) &&
+        listcache_drop(cartid, page))
+            exit(1);
+
+    progress_start(totals);
+
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    for (i = 0; i < current.count; i++) {
+        offset = current.romlist[i].offset;
+        if (!image.used[offset/ERASEBLOCKSIZE] &&
+            flash_delete(base + offset, 2) != 0)
+                errx(1, "%s", flash_lasterrorstr);
+    }
+    if (flash_writeblocks(base, image.data, image.used, diff))
+        errx(1, "%s", flash_lasterrorstr);
+    restoreint();
+
+    if (verify_report(verbose))
+        exit(1);
+
+    if (hasid)
+        listcache_save(cartid, page, &image.listing);
+}
+
 void
-cmd_restore(int page, int verbose, char *path, int to) {
+cmd_restore(int page, int verbose, char *path, int to, int diff) {
     struct progress_totals totals = {0};
     struct stat buf;
-    ems_size_t base, size;
+    ems_size_t base, size, packsize;
+    char cartid[256];
+    int fd;
+
+    if (sparse_probe(path)) {
+        if (to != TO_ROM)
+            errx(1, "a sparse image can only be restored to a page");
+        restore_sparse(page, verbose, path, diff);
+        return;
+    }
 
     if (to == TO_ROM) {
         base = page * PAGESIZE;
@@ -337,26 +623,92 @@ cmd_restore(int page, int verbose, char *path, int to) {
         totals.writef= size;
     }
 
-    if (stat(path, &buf) == -1)
+    // the current content is read to find the blocks to rewrite
+    if (diff)
+        totals.read = size;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(1, "can't open %s", path);
+    if (fstat(fd, &buf) == -1)
         err(1, "can't stat %s", path);
-    if (buf.st_size != size)
+    // the content of a compressed image is checked when it is read
+    if (pack_probe(fd, &packsize) ? packsize != size : buf.st_size != size)
         errx(1, "file has an invalid size");
+    close(fd);
+
+    if (to == TO_ROM && ems_cartid(cartid, sizeof(cartid)) == 0 &&
+        listcache_drop(cartid, page))
+            exit(1);
 
     progress_start(totals);
 
     blocksignals();
     catchint();
     flash_init(verbose?progress:NULL, checkint);
-    if (flash_writef_to(to, base, size, path))
+    if ((diff ? flash_diffwritef_to : flash_writef_to)(to, base, size, path))
         errx(1, "%s", flash_lasterrorstr);
     restoreint();
+
+    if (verify_report(verbose))
+        exit(1);
+}
+
+/**
+ * Dump the ROMs of the page to a sparse image (see sparse.c). The free space is
+ * not read.
+ */
+static void
+dump_sparse(int page, int verbose, char *path) {
+    static struct sparse_image image;
+    struct progress_totals totals = {0};
+    struct listing *listing;
+    ems_size_t base, offset, end;
+    int i, j;
+
+    base = page * PAGESIZE;
+    listing = &image.listing;
+
+    blocksignals();
+
+    if (list(page, listing))
+        exit(1);
+    for (i = 0; i < listing->count; i++)
+        totals.read += listing->romlist[i].header.romsize;
+    memset(image.data, 0xff, PAGESIZE);
+
+    progress_start(totals);
+
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    // the adjacent ROMs are read at once
+    for (i = 0; i < listing->count; i = j) {
+        offset = end = listing->romlist[i].offset;
+        for (j = i; j < listing->count && listing->romlist[j].offset == end;
+            j++)
+                end += listing->romlist[j].header.romsize;
+
+        if (flash_readbuf_from(FROM_ROM, image.data + offset, end - offset,
+            base + offset))
+                errx(1, "%s", flash_lasterrorstr);
+    }
+    restoreint();
+
+    if (sparse_save(path, &image))
+        exit(1);
 }
 
 void
-cmd_dump(int page, int verbose, char *path, int from) {
+cmd_dump(int page, int verbose, char *path, int from, int sparse) {
     struct progress_totals totals = {0};
     ems_size_t base, size;
 
+    if (sparse) {
+        if (from != FROM_ROM)
+            errx(1, "a sparse image can only be made of a page");
+        dump_sparse(page, verbose, path);
+        return;
+    }
+
     if (from == FROM_ROM) {
         base = page * PAGESIZE;
         size = PAGESIZE;
@@ -375,6 +727,229 @@ cmd_dump(int page, int verbose, char *path, int from) {
     restoreint();
 }
 
+/*
+ * --dump --all and --restore --all: both pages of the cart, and its SRAM if
+ * asked for, in one archive, one after the other
+ */
+
+/**
+ * Set the ranges of an archive of the cart, with the SRAM if "sram" is
+ * non-zero. The pages are one range, read or written at once.
+ *
+ * Returns the number of ranges.
+ */
+static int
+all_ranges(struct flash_range *ranges, int sram) {
+    ranges[0] = (struct flash_range){FROM_ROM, 0, 2*PAGESIZE};
+    ranges[1] = (struct flash_range){FROM_SRAM, 0, SRAMSIZE};
+    return sram ? 2 : 1;
+}
+
+void
+cmd_dumpall(int verbose, char *path, int sram) {
+    struct progress_totals totals = {0};
+    struct flash_range ranges[2];
+    int n;
+
+    n = all_ranges(ranges, sram);
+    for (int i = 0; i < n; i++)
+        totals.read += ranges[i].size;
+
+    progress_start(totals);
+    blocksignals();
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    if (flash_readf_ranges(path, ranges, n))
+        errx(1, "%s", flash_lasterrorstr);
+    restoreint();
+}
+
+void
+cmd_restoreall(int verbose, char *path, int diff) {
+    struct progress_totals totals = {0};
+    struct flash_range ranges[2];
+    ems_size_t size;
+    struct stat buf;
+    char cartid[256];
+    int fd, n;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(1, "can't open %s", path);
+    if (fstat(fd, &buf) == -1)
+        err(1, "can't stat %s", path);
+    if (!pack_probe(fd, &size))
+        size = buf.st_size <= (off_t)(2*PAGESIZE + SRAMSIZE) ? buf.st_size : 0;
+    close(fd);
+    // the SRAM is restored if the archive has it
+    if (size != 2*PAGESIZE && size != 2*PAGESIZE + SRAMSIZE)
+        errx(1, "file has an invalid size");
+    n = all_ranges(ranges, size != 2*PAGESIZE);
+
+    totals.erase = 2*PAGESIZE / ERASEBLOCKSIZE;
+    for (int i = 0; i < n; i++)
+        totals.writef += ranges[i].size;
+    // the current content is read to find the blocks to rewrite
+    if (diff)
+        totals.read = totals.writef;
+
+    if (ems_cartid(cartid, sizeof(cartid)) == 0 && listcache_drop(cartid, -1))
+        exit(1);
+
+    progress_start(totals);
+
+    blocksignals();
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    if (flash_writef_ranges(path, ranges, n, diff))
+        errx(1, "%s", flash_lasterrorstr);
+    restoreint();
+
+    if (verify_report(verbose))
+        exit(1);
+}
+
+/*
+ * --snapshot, --history and --restore-snapshot commands handling
+ */
+
+/**
+ * Create a temporary file for an image of the SRAM. Exits on error.
+ */
+static void
+sram_tmpfile(char *path, size_t size) {
+    char *dir;
+    int fd;
+
+    if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+        dir = "/tmp";
+    if (snprintf(path, size, "%s/ems-flasher-XXXXXX", dir) >= size)
+        errx(1, "path of the temporary directory too long");
+    if ((fd = mkstemp(path)) == -1)
+        err(1, "can't create %s", path);
+    close(fd);
+}
+
+void
+cmd_snapshot(int verbose) {
+    struct progress_totals totals = {0};
+    struct store_snapshot snap;
+    char cartid[256], path[1024];
+    int added;
+
+    if (ems_cartid(cartid, sizeof(cartid)) != 0 ||
+        ems_fingerprint(&snap.print) != 0)
+            errx(1, "can't identify the cart");
+
+    sram_tmpfile(path, sizeof(path));
+
+    totals.read = SRAMSIZE;
+    progress_start(totals);
+    blocksignals();
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    if (flash_readf_from(FROM_SRAM, path, SRAMSIZE, 0)) {
+        remove(path);
+        errx(1, "%s", flash_lasterrorstr);
+    }
+    restoreint();
+
+    added = store_put(cartid, path, &snap);
+    remove(path);
+    if (added < 0)
+        exit(1);
+
+    printf("Snapshot %d: %d of %d blocks stored\n", snap.id, added,
+        STORE_NCHUNKS);
+}
+
+static int
+hash_compar(const void *pa, const void *pb) {
+    uint64_t a = *(uint64_t *)pa, b = *(uint64_t *)pb;
+
+    return a < b ? -1 : a > b;
+}
+
+void
+cmd_history(void) {
+    struct store_snapshot *snaps;
+    uint64_t *hashes;
+    char cartid[256], date[32];
+    int count, changed, stored;
+
+    if (ems_cartid(cartid, sizeof(cartid)) != 0)
+        errx(1, "can't identify the cart");
+    if (store_list(cartid, &snaps, &count))
+        exit(1);
+
+    printf("Snapshot  Date                 Changed blocks\n");
+    for (int i = 0; i < count; i++) {
+        changed = 0;
+        for (int j = 0; j < STORE_NCHUNKS; j++)
+            if (i == 0 || snaps[i].chunks[j] != snaps[i-1].chunks[j])
+                changed++;
+
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+            localtime(&snaps[i].time));
+        printf("%8d  %s  %2d\n", snaps[i].id, date, changed);
+    }
+
+    // the blocks shared by the snapshots are stored once
+    if ((hashes = malloc((count ? count : 1) * sizeof(snaps->chunks))) == NULL)
+        err(1, "malloc");
+    for (int i = 0; i < count; i++)
+        memcpy(hashes + i*STORE_NCHUNKS, snaps[i].chunks,
+            sizeof(snaps->chunks));
+    qsort(hashes, count*STORE_NCHUNKS, sizeof(*hashes), hash_compar);
+    stored = 0;
+    for (int i = 0; i < count*STORE_NCHUNKS; i++)
+        if (i == 0 || hashes[i] != hashes[i-1])
+            stored++;
+
+    putchar('\n');
+    printf("Snapshots: %d, stored: %d KB\n", count,
+        stored * (STORE_CHUNKSIZE >> 10));
+}
+
+void
+cmd_restoresnapshot(int verbose, int force, int id) {
+    struct progress_totals totals = {0};
+    char cartid[256], path[1024];
+    uint64_t print, snapprint;
+
+    if (ems_cartid(cartid, sizeof(cartid)) != 0 ||
+        ems_fingerprint(&print) != 0)
+            errx(1, "can't identify the cart");
+
+    sram_tmpfile(path, sizeof(path));
+    if (store_get(cartid, id, path, &snapprint)) {
+        remove(path);
+        exit(1);
+    }
+    // another cart plugged to the same port has the same identifier
+    if (snapprint != print && !force) {
+        remove(path);
+        errx(1, "snapshot %d was taken from a cart whose pages start with "
+            "other ROMs, use --force to restore it", id);
+    }
+
+    // only the blocks that differ from the snapshot are written
+    totals.read = SRAMSIZE;
+    totals.writef = SRAMSIZE;
+    progress_start(totals);
+    blocksignals();
+    catchint();
+    flash_init(verbose?progress:NULL, checkint);
+    if (flash_diffwritef_to(TO_SRAM, 0, SRAMSIZE, path)) {
+        remove(path);
+        errx(1, "%s", flash_lasterrorstr);
+    }
+    restoreint();
+    remove(path);
+
+    if (verify_report(verbose))
+        exit(1);
+}
+
 /*
  * --write command handling
  */
@@ -390,6 +965,20 @@ romfiles_compar_size_desc(const void *pa, const void *pb) {
     return 0;
 }
 
+/**
+ * isblank callback of image_plan(): ctx points to the offset of the page
+ */
+static int
+plan_isblank(ems_size_t offset, ems_size_t size, void *ctx) {
+    int blank;
+
+    if (flash_isblank(*(ems_size_t *)ctx + offset, size, &blank)) {
+        warnx("%s", flash_lasterrorstr);
+        return -1;
+    }
+    return blank;
+}
+
 /**
  * Validate a ROM file:
  *   - the header must be valid
@@ -461,33 +1050,55 @@ validate_romfile(char *path, struct romfile *romfile) {
     return 0;
 }
 
-void
-cmd_write(int page, int verbose, int force, int argc, char **argv) {
-    struct listing listing;
+/**
+ * Delete the ROMs at the offsets "deletes" of the page and write the ROM files
+ * "argv", planned at once on "listing", the ROMs of the page. "listing" is
+ * updated with the ROMs written.
+ *
+ * Returns 0 on success, 1 if the updates failed. Exits on the other errors.
+ */
+static int
+write_roms(int page, int verbose, int force, int ndeletes,
+    ems_size_t *deletes, int argc, char **argv, struct listing *listing) {
+    const unsigned long *wearcounts;
     struct image image;
-    ems_size_t freesize;
+    ems_size_t base, freesize;
     struct romfile *romfiles;
     struct romfile *menuromfile;
-
-    blocksignals();
-
-    if (argc == 0)
-        return;
+    struct rom **roms;
+    char cartid[256];
+    int hasid;
 
     image_init(&image);
+    base = page * PAGESIZE;
 
     menuromfile = romfiles = NULL;
     freesize = PAGESIZE;
 
-    if ((romfiles = malloc(argc*sizeof(*romfiles))) == NULL)
+    if (argc > 0 && (romfiles = malloc(argc*sizeof(*romfiles))) == NULL)
         err(1, "malloc");
 
     for (int i = 0; i < argc; i++)
         if (validate_romfile(argv[i], &romfiles[i]))
             exit(1);
 
-    if (list(page, &listing))
-        exit(1);
+    // the ROMs deleted are left out of the image
+    for (int i = 0; i < ndeletes; i++) {
+        int j;
+
+        for (j = 0; j < listing->count &&
+            listing->romlist[j].offset != deletes[i]; j++)
+                ;
+        if (j == listing->count)
+            errx(1, "no ROM at bank %d", (int)(deletes[i]/BANKSIZE));
+        memmove(&listing->romlist[j], &listing->romlist[j+1],
+            (listing->count - j - 1)*sizeof(listing->romlist[0]));
+        listing->count--;
+    }
+
+    hasid = ems_cartid(cartid, sizeof(cartid)) == 0;
+    if (argc == 0)
+        goto apply;
 
     /*
      * If present, remove the menu if:
@@ -498,19 +1109,19 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
      * Note: the menu is not deleted from the flash right now but it will be
      *       overwritten later.
      */
-    if (listing.count == 1 &&
-        listing.romlist[0].offset == 0 &&
-        strcmp(listing.romlist[0].header.title, MENUTITLE) == 0 &&
-        listing.romlist[0].header.romsize == 32768) {
+    if (listing->count == 1 &&
+        listing->romlist[0].offset == 0 &&
+        strcmp(listing->romlist[0].header.title, MENUTITLE) == 0 &&
+        listing->romlist[0].header.romsize == 32768) {
             if (romfiles[0].header.romsize == PAGESIZE ||
-                romfiles[0].header.enhancements != listing.romlist[0].header.enhancements) {
-                    listing.count--;
+                romfiles[0].header.enhancements != listing->romlist[0].header.enhancements) {
+                    listing->count--;
             }
     }
 
     /* Abort if there is no valid menu on a non empty page */
-    if (listing.count > 0 && (listing.romlist[0].offset != 0 ||
-        strcmp(listing.romlist[0].header.title, MENUTITLE) != 0)) {
+    if (listing->count > 0 && (listing->romlist[0].offset != 0 ||
+        strcmp(listing->romlist[0].header.title, MENUTITLE) != 0)) {
             errx(1, "error: no valid menu ROM found at bank 0");
     }
 
@@ -523,9 +1134,9 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
         int enh_ign_mask, enh_page, enh_incompat;
 
         /* Determine the enhancements enabled by the page */
-        if (listing.count > 0)
+        if (listing->count > 0)
             /* non empty page: those of the first ROM in flash (the menu) */
-            enh_page = listing.romlist[0].header.enhancements;
+            enh_page = listing->romlist[0].header.enhancements;
         else
             /*empty page:  those of the first ROM provided in arguments */
             enh_page = romfiles[0].header.enhancements;
@@ -535,8 +1146,8 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
          * on the page.
          */
         enh_ign_mask = 0;
-        for (int i = 0; i < listing.count; i++) {
-            int enh_rom = listing.romlist[i].header.enhancements;
+        for (int i = 0; i < listing->count; i++) {
+            int enh_rom = listing->romlist[i].header.enhancements;
             if (enh_page != enh_rom)
                 enh_ign_mask |= enh_page ^ enh_rom;
         }
@@ -575,7 +1186,7 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
      * a 4 MB ROM.
      * The hardware enh. will be set according to the first ROM file.
      */
-    if (listing.count == 0 && romfiles[0].header.romsize < PAGESIZE) {
+    if (listing->count == 0 && romfiles[0].header.romsize < PAGESIZE) {
         struct romfile *romf;
         char menupath[1024];
         char *menudir;
@@ -620,11 +1231,11 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
      * Create an image of the page with existing ROMs in flash.
      * (with the exception of the menu if it was removed in a previous step)
      */
-    for (int i = 0; i < listing.count; i++) {
+    for (int i = 0; i < listing->count; i++) {
         struct listing_rom *lsrom;
         struct rom *rom;
 
-        lsrom = &listing.romlist[i];
+        lsrom = &listing->romlist[i];
 
         if ((rom = malloc(sizeof(*rom))) == NULL)
             err(1, "malloc");
@@ -657,14 +1268,23 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
     }
 
     /*
-     * Insert ROM files ordered by size in descending order in the image to
-     * limit the fragmentation.
+     * Insert ROM files in the image at the layout costing the least, found by
+     * image_optimize(), or ordered by size in descending order to limit the
+     * fragmentation when the search takes too long or when image_plan()
+     * prices the layout found no better. Prefer the less worn erase-blocks
+     * when the cart is known.
      *
      * Ensure that there is no duplicate title.
      */
 
+    if ((wearcounts = wear_start()) != NULL)
+        insert_wear = wearcounts + page*(PAGESIZE/ERASEBLOCKSIZE);
+
     qsort(romfiles, argc, sizeof(*romfiles), romfiles_compar_size_desc);
 
+    if ((roms = malloc(argc*sizeof(*roms))) == NULL)
+        err(1, "malloc");
+
     for (int i = 0; i < argc; i++) {
         struct romfile *romf;
         struct rom *rom;
@@ -682,6 +1302,11 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
                     romf->header.title);
             }
         }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(romf->header.title, romfiles[j].header.title) == 0)
+                errx(1, "%s: duplicate title with %s: %s", romf->path,
+                    romfiles[j].path, romf->header.title);
+        }
 
         if ((rom = malloc(sizeof(*rom))) == NULL)
             err(1, "malloc");
@@ -689,35 +1314,104 @@ cmd_write(int page, int verbose, int force, int argc, char **argv) {
         rom->romsize = romf->header.romsize;
         rom->source.u.fileinfo = romf;
         rom->header = romf->header;
+        roms[i] = rom;
 
-        image_insert_defrag(&image, rom);
         if (freesize < romf->header.romsize)
             errx(1,"no space left on page");
         freesize -= romf->header.romsize;
     }
 
+    switch (image_optimize(&image, roms, argc, &update_defaultcost,
+        plan_isblank, &base, INSERT_DEFAULTBUDGET)) {
+    case -1:
+        if (verbose)
+            printf("Layout search stopped, inserting the ROMs one by one\n");
+        /* FALLTHROUGH */
+    case 1:
+        for (int i = 0; i < argc; i++)
+            image_insert_defrag(&image, roms[i]);
+    }
+    free(roms);
+
+apply:
     {
     struct updates *updates;
+    struct update_estimate est;
+    int r;
 
-    image_update(&image, &updates);
-    exit(apply_updates(page, verbose, updates));
+    if (argc > 0 && image_plan(&image, &update_defaultcost, plan_isblank,
+        &base, &updates))
+            errx(1, "can't plan the updates");
+    if (argc > 0 && verbose) {
+        update_estimate(updates, &update_defaultcost, &est);
+        printf("Estimated time: %.1f s, %d erase-block%s to erase\n",
+            est.time, est.erases, est.erases == 1 ? "" : "s");
+    }
+    if (hasid && listcache_drop(cartid, page))
+        exit(1);
+
+    if (ndeletes > 0) {
+        catchint();
+        flash_init(NULL, checkint);
+        for (int i = 0; i < ndeletes; i++) {
+            if (verbose)
+                printf("Deleting ROM at bank %d...\n",
+                    (int)(deletes[i]/BANKSIZE));
+            if (flash_delete(base + deletes[i], 2) != 0)
+                errx(1, "%s", flash_lasterrorstr);
+        }
+        restoreint();
+    }
+    if (argc == 0) {
+        if (hasid)
+            listcache_save(cartid, page, listing);
+        return 0;
+    }
+
+    r = apply_updates(page, verbose, updates);
+    if (verify_report(verbose))
+        r = 1;
+    if (r == 0) {
+        struct rom *rom;
+
+        listing->count = 0;
+        image_foreach(&image, rom) {
+            listing->romlist[listing->count].offset = rom->offset;
+            listing->romlist[listing->count].header = rom->header;
+            listing->count++;
+        }
+        if (hasid)
+            listcache_save(cartid, page, listing);
+    }
+    return r;
     }
 }
 
 void
-cmd_read(int page, int verbose, int argc, char **argv) {
-    struct listing  listing;
-    struct {struct listing_rom *rom; char *path;} *romfiles;
-    ems_size_t totalread;
-    char read_error;
-
-    if (argc == 0)
-	return;
+cmd_write(int page, int verbose, int force, int argc, char **argv) {
+    struct listing listing;
 
     blocksignals();
 
+    if (argc == 0)
+        return;
+
     if (list(page, &listing))
-	exit(1);
+        exit(1);
+
+    exit(write_roms(page, verbose, force, 0, NULL, argc, argv, &listing));
+}
+
+/**
+ * Read the ROMs of the BANK:FILE arguments "argv", found in "listing", the ROMs
+ * of the page.
+ */
+static void
+read_roms(int page, int verbose, int argc, char **argv,
+    struct listing *listing) {
+    struct {struct listing_rom *rom; char *path;} *romfiles;
+    ems_size_t totalread;
+    char read_error;
 
     if ((romfiles = malloc(argc * sizeof(*romfiles))) == NULL)
 	err(1, "malloc");
@@ -746,9 +1440,9 @@ cmd_read(int page, int verbose, int argc, char **argv) {
 	    errx(1, "invalid filename");
 
 	struct listing_rom *rom = NULL;
-	for (int i = 0; i < listing.count; i++) {
-	    if (listing.romlist[i].offset == offset) {
-		rom = &listing.romlist[i];
+	for (int i = 0; i < listing->count; i++) {
+	    if (listing->romlist[i].offset == offset) {
+		rom = &listing->romlist[i];
 		break;
 	    }
 	}
@@ -794,3 +1488,173 @@ cmd_read(int page, int verbose, int argc, char **argv) {
 
     restoreint();
 }
+
+void
+cmd_read(int page, int verbose, int argc, char **argv) {
+    struct listing  listing;
+
+    if (argc == 0)
+	return;
+
+    blocksignals();
+
+    if (list(page, &listing))
+	exit(1);
+
+    read_roms(page, verbose, argc, argv, &listing);
+}
+
+/*
+ * --jobs command handling
+ */
+
+enum {STEP_PENDING, STEP_RUNNING, STEP_DONE};
+
+static struct job job;
+static char *jobstate;
+
+/**
+ * atexit() handler: report the steps of the job that failed and those that
+ * were skipped after them
+ */
+static void
+jobs_report(void) {
+    int skipped = 0;
+
+    if (jobstate == NULL)
+        return;
+
+    for (int i = 0; i < job.count; i++) {
+        struct job_step *step = &job.steps[i];
+
+        if (jobstate[i] == STEP_RUNNING) {
+            warnx("%s:%d: failed: %s", job.path, step->line, step->text);
+        } else if (jobstate[i] == STEP_PENDING) {
+            warnx("%s:%d: skipped: %s", job.path, step->line, step->text);
+            skipped++;
+        }
+    }
+    if (skipped)
+        warnx("%d step%s skipped", skipped, skipped == 1 ? "" : "s");
+}
+
+/**
+ * Run the "n" deletions and writes "steps" on the page as one update of
+ * "listing".
+ *
+ * Returns 0 on success, 1 if the updates failed.
+ */
+static int
+jobs_write(int page, int verbose, int force, struct job_step *steps, int n,
+    struct listing *listing) {
+    ems_size_t *deletes;
+    char **files;
+    int ndeletes, nfiles, total;
+
+    total = 0;
+    for (int i = 0; i < n; i++)
+        total += steps[i].argc;
+    if ((deletes = malloc(total*sizeof(*deletes))) == NULL ||
+        (files = malloc(total*sizeof(*files))) == NULL)
+            err(1, "malloc");
+
+    ndeletes = nfiles = 0;
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < steps[i].argc; j++) {
+            if (steps[i].op == JOB_DELETE)
+                deletes[ndeletes++] = atoi(steps[i].argv[j]) * BANKSIZE;
+            else
+                files[nfiles++] = steps[i].argv[j];
+        }
+
+    return write_roms(page, verbose, force, ndeletes, deletes, nfiles, files,
+        listing);
+}
+
+void
+cmd_jobs(int verbose, int force, char *path) {
+    static struct listing listings[2];
+    int listed[2] = {0, 0};
+    int i, j, k;
+
+    if (job_load(path, &job))
+        exit(1);
+    if ((jobstate = calloc(job.count + 1, 1)) == NULL)
+        err(1, "malloc");
+
+    // the ROM files are checked before anything is written
+    for (i = 0; i < job.count; i++)
+        for (k = 0; job.steps[i].op == JOB_WRITE && k < job.steps[i].argc;
+            k++) {
+                struct romfile romfile;
+
+                if (validate_romfile(job.steps[i].argv[k], &romfile))
+                    exit(1);
+        }
+
+    blocksignals();
+    atexit(jobs_report);
+
+    for (i = 0; i < job.count; i = j) {
+        struct job_step *step = &job.steps[i];
+        int page = step->page;
+
+        // the consecutive deletions and writes on a page are planned at once
+        j = job_group(&job, i);
+
+        for (k = i; k < j; k++) {
+            jobstate[k] = STEP_RUNNING;
+            if (verbose)
+                printf("%s:%d: %s\n", job.path, job.steps[k].line,
+                    job.steps[k].text);
+        }
+
+        // the page is listed once, then the listing follows the steps
+        if ((step->op == JOB_WRITE || step->op == JOB_DELETE ||
+            step->op == JOB_READ) && !listed[page]) {
+                if (list(page, &listings[page]))
+                    exit(1);
+                listed[page] = 1;
+        }
+
+        /*
+         * The rule of main.c without --compress: a restore accepts compressed
+         * images and reads a plain image as it is, the dumps are plain.
+         */
+        flash_setpacked(step->op == JOB_RESTORE);
+
+        switch (step->op) {
+        case JOB_WRITE:
+        case JOB_DELETE:
+            if (jobs_write(page, verbose, force, step, j - i,
+                &listings[page]))
+                    exit(1);
+            break;
+        case JOB_READ:
+            read_roms(page, verbose, step->argc, step->argv, &listings[page]);
+            break;
+        case JOB_FORMAT:
+            cmd_format(page, verbose);
+            listings[page].count = 0;
+            listed[page] = 1;
+            break;
+        case JOB_DUMP:
+            if (page == JOB_SAVE)
+                cmd_dump(0, verbose, step->argv[0], FROM_SRAM, 0);
+            else
+                cmd_dump(page, verbose, step->argv[0], FROM_ROM, 0);
+            break;
+        case JOB_RESTORE:
+            if (page == JOB_SAVE) {
+                cmd_restore(0, verbose, step->argv[0], TO_SRAM, 0);
+            } else {
+                cmd_restore(page, verbose, step->argv[0], TO_ROM, 0);
+                listed[page] = 0;
+            }
+            break;
+        }
+
+        for (k = i; k < j; k++)
+            jobstate[k] = STEP_DONE;
+    }
+}
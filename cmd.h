@@ -16,9 +16,16 @@ void restoreint();
 void cmd_title(int);
 void cmd_delete(int, int, int, char**);
 void cmd_format(int, int);
-void cmd_restore(int, int, char*, int);
-void cmd_dump(int, int, char*, int);
+void cmd_autotune(int, int);
+void cmd_restore(int, int, char*, int, int);
+void cmd_dump(int, int, char*, int, int);
+void cmd_restoreall(int, char*, int);
+void cmd_dumpall(int, char*, int);
+void cmd_snapshot(int);
+void cmd_history(void);
+void cmd_restoresnapshot(int, int, int);
 void cmd_write(int, int, int, int, char**);
 void cmd_read(int, int, int, char**);
+void cmd_jobs(int, int, char*);
 
 #endif /* EMS_CMD_H */
@@ -4,7 +4,7 @@ libusb=libusb-1.0
 CC=${CC:-cc}
 CFLAGS=${CFLAGS:--g -Wall -Werror -pedantic -std=c99}
 
-unset noudevrules
+unset noudevrules nostats
 while [ $# -ne 0 ]; do
     case $1 in
     --prefix) shift; PREFIX=$1;;
@@ -13,10 +13,11 @@ while [ $# -ne 0 ]; do
     --mandir) shift; MANDIR=$1;;
     --udevrulesdir) shift; UDEVRULESDIR=$1;;
     --no-udevrules) noudevrules=1;;
+    --disable-stats) nostats=1;;
     *) cat >&2 << 'EOT'
 config.sh [ --prefix PREFIX ] [ --bindir BINDIR ] [ --datadir DATADIR ]
           [ --mandir MANDIR ] [ --udevrulesdir UDEVRULESDIR ]
-          [ --no-udevrules ]
+          [ --no-udevrules ] [ --disable-stats ]
 Generate config.h and Makefile
  --prefix       default prefix for the installation directories (/usr/local)
  --bindir       installation directory of the executables ($PREFIX/bin)
@@ -26,6 +27,7 @@ Generate config.h and Makefile
  --udevrulesdir installation directory of the udev rules ensuring access to
                 users to the USB device (/lib/udev/rules.d)
  --no-udevrules don't install the udev rules
+ --disable-stats don't compile the instrumentation used by --stats
 EOT
        exit 1
     ;;
@@ -112,14 +114,19 @@ if
     grep -q libpthread "$tmpd/lddout"
 then
     echo "$libusb seems to use libpthread"
-    pthread_ldflags="-lpthread"
     echo "#define USE_PTHREAD" >> "$tmpd/conf"
 else
     echo "$libusb doesn't seem to use libpthread. Fine."
 fi
+# the verification (--verify) uses a thread
+pthread_ldflags="-lpthread"
 
 echo "#define MENUDIR \"$DATADIR\"" >> "$tmpd/conf"
 
+if [ -n "$nostats" ]; then
+    echo "#define NOSTATS" >> "$tmpd/conf"
+fi
+
 echo '#endif' >> "$tmpd/conf"
 if ! cmp -s "$tmpd/conf" config.h; then
     mv "$tmpd/conf" config.h
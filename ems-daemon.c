@@ -0,0 +1,720 @@
+/*
+ * Daemon transport (backend "daemon[:PATH]") and the daemon itself
+ * (ems-flasherd, see ems_serve()).
+ *
+ * The daemon opens the device once and executes the commands of its clients,
+ * received on a Unix socket. The clients are served one at a time, each for
+ * as long as it stays connected, so a script running many commands on a cart
+ * pays the setup of the device (libusb initialization, device scan and
+ * interface claim) only once.
+ *
+ * The daemon keeps a cache of the ROM headers (the first HEADER_SIZE bytes of
+ * each 32 KB slot): the listing of a page done by every command is served from
+ * memory after the first one. Since all the writes go through the daemon, the
+ * cache is invalidated as the slots are written or erased.
+ *
+ * PATH is the socket of the daemon. The default is the value of EMS_SOCKET or
+ * ems-flasherd.sock in $XDG_RUNTIME_DIR, else in /tmp/ems-flasherd-UID. The
+ * directory of the default socket must belong to the user and be closed to
+ * the others, and both ends check that the other one runs as the same user.
+ *
+ * Protocol
+ *
+ *   Requests use the format of the device commands: an opcode followed by two
+ *   big endian 32 bits integers. Every request is answered, in order, by a big
+ *   endian 32 bits result followed by data for some requests.
+ *
+ *     DREQ_READ, DREQ_READ_SRAM, address, length
+ *         Result of ems_read() followed by the bytes read.
+ *     DREQ_WRITE, DREQ_WRITE_SRAM, number of commands, 0
+ *         Followed by the commands: DREQ_CMD, address, length and the data.
+ *         Result of ems_writev().
+ *     DREQ_DEVID, 0, 0
+ *         Result of ems_devid() followed, on success, by the length of the
+ *         identifier and the identifier.
+ *
+ *   Reads are asynchronous on the client side: several requests can be sent
+ *   before their answers are received (see readq.h).
+ */
+
+/* for sigaction() */
+#define _XOPEN_SOURCE 500
+/* for struct ucred */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ems.h"
+#include "ems-daemon.h"
+#include "header.h"
+#include "readq.h"
+
+#define DREQ_SIZE 9
+#define DREQ_MAXCOUNT (4*PAGESIZE)
+
+enum {
+    DREQ_READ = 'r', DREQ_READ_SRAM = 's',
+    DREQ_WRITE = 'w', DREQ_WRITE_SRAM = 'v',
+    DREQ_CMD = 'c', DREQ_DEVID = 'i'
+};
+
+#define SLOTSIZE 32768
+#define NSLOTS (2*PAGESIZE/SLOTSIZE)
+
+static void
+put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t
+get_be32(unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**
+ * Read or write exactly "count" bytes on the socket "fd".
+ *
+ * Returns 0 on success, -1 on error or if the peer closed the connection.
+ */
+static int
+xread(int fd, void *buf, size_t count) {
+    unsigned char *p = buf;
+    ssize_t n;
+
+    while (count > 0) {
+        if ((n = read(fd, p, count)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int
+xwrite(int fd, const void *buf, size_t count) {
+    const unsigned char *p = buf;
+    ssize_t n;
+
+    while (count > 0) {
+        if ((n = write(fd, p, count)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int
+send_req(int fd, int op, uint32_t a, uint32_t b) {
+    unsigned char req[DREQ_SIZE];
+
+    req[0] = op;
+    put_be32(req + 1, a);
+    put_be32(req + 5, b);
+    return xwrite(fd, req, DREQ_SIZE);
+}
+
+static int
+recv_result(int fd, int *result) {
+    unsigned char buf[4];
+
+    if (xread(fd, buf, 4) < 0)
+        return -1;
+    *result = (int32_t)get_be32(buf);
+    return 0;
+}
+
+/*
+ * Check that the directory "dir" of the default socket is a directory of the
+ * user closed to the others, creating it first if "create" is set. The socket
+ * of a directory writable by others could be replaced by someone else's.
+ */
+static int
+private_dir(const char *dir, int create) {
+    struct stat st;
+
+    if (create && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        warn("can't create %s", dir);
+        return -1;
+    }
+    if (lstat(dir, &st) < 0) {
+        warn("%s", dir);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 077) != 0) {
+            warnx("%s: not a directory private to the user", dir);
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Path of the socket of the daemon: "path" if not NULL or empty, EMS_SOCKET
+ * or the default, ems-flasherd.sock in $XDG_RUNTIME_DIR or else in
+ * /tmp/ems-flasherd-UID. The directory of the default is checked to be
+ * private to the user, and created if "create" is set (by the daemon).
+ *
+ * Returns NULL if the directory of the default is not private.
+ */
+const char *
+ems_daemon_socket(const char *path, int create) {
+    static char defpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char dir[sizeof(defpath)];
+    const char *runtime;
+
+    if (path != NULL && *path != '\0')
+        return path;
+    if ((path = getenv("EMS_SOCKET")) != NULL && *path != '\0')
+        return path;
+
+    if ((runtime = getenv("XDG_RUNTIME_DIR")) != NULL && *runtime == '/') {
+        // created by the system
+        snprintf(dir, sizeof(dir), "%s", runtime);
+        create = 0;
+    } else
+        snprintf(dir, sizeof(dir), "/tmp/ems-flasherd-%u",
+            (unsigned)getuid());
+    if (private_dir(dir, create) < 0)
+        return NULL;
+
+    if (snprintf(defpath, sizeof(defpath), "%s/ems-flasherd.sock", dir) >=
+        (int)sizeof(defpath)) {
+            warnx("%s: socket path too long", dir);
+            return NULL;
+    }
+    return defpath;
+}
+
+/*
+ * Check that the process at the other end of "fd" runs as the user: the
+ * daemon serves only the user and a client talks only to the user's daemon.
+ */
+static int
+peer_check(int fd) {
+    uid_t uid;
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        warn("SO_PEERCRED");
+        return -1;
+    }
+    uid = cred.uid;
+#else
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        warn("getpeereid");
+        return -1;
+    }
+#endif
+    if (uid != getuid()) {
+        warnx("the other end of the socket runs as another user (uid %u)",
+            (unsigned)uid);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sockaddr_set(struct sockaddr_un *sa, const char *path) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        warnx("%s: socket path too long", path);
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+/*
+ * Client
+ */
+
+struct daemon_ctx {
+    int fd;
+
+    /* reads sent and not answered yet, oldest first */
+    struct readq_req **pending;
+    int head, count, size;
+};
+
+/**
+ * Connect to the daemon. Returns NULL if it is not running.
+ */
+static void *
+daemon_open(const char *arg) {
+    struct daemon_ctx *ctx;
+    struct sockaddr_un sa;
+    const char *path;
+
+    if ((path = ems_daemon_socket(arg, 0)) == NULL ||
+        sockaddr_set(&sa, path) < 0)
+            return NULL;
+
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        err(1, "malloc");
+
+    if ((ctx->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        err(1, "socket");
+    if (connect(ctx->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        warn("can't connect to ems-flasherd (%s)", path);
+        close(ctx->fd);
+        free(ctx);
+        return NULL;
+    }
+    if (peer_check(ctx->fd) < 0) {
+        close(ctx->fd);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/**
+ * Receive the answer of the oldest pending read.
+ */
+static void
+daemon_complete(struct daemon_ctx *ctx) {
+    struct readq_req *req;
+    int r;
+
+    req = ctx->pending[ctx->head];
+    ctx->head = (ctx->head + 1) % ctx->size;
+    ctx->count--;
+
+    if (recv_result(ctx->fd, &r) < 0 ||
+        (r > 0 && (r > req->count || xread(ctx->fd, req->buf, r) < 0)))
+            r = -1;
+    req->result = r;
+}
+
+/* receive the answers of all the pending reads */
+static void
+daemon_drain(struct daemon_ctx *ctx) {
+    while (ctx->count > 0)
+        daemon_complete(ctx);
+}
+
+static void
+daemon_close(void *vctx) {
+    struct daemon_ctx *ctx = vctx;
+
+    daemon_drain(ctx);
+    close(ctx->fd);
+    free(ctx->pending);
+    free(ctx);
+}
+
+static int
+daemon_submit(void *vctx, int from, struct readq_req *req) {
+    struct daemon_ctx *ctx = vctx;
+
+    if (ctx->count == ctx->size) {
+        struct readq_req **p;
+        int size = ctx->size ? 2*ctx->size : READQ_MAXDEPTH;
+
+        if ((p = malloc(size * sizeof(*p))) == NULL)
+            err(1, "malloc");
+        for (int i = 0; i < ctx->count; i++)
+            p[i] = ctx->pending[(ctx->head + i) % ctx->size];
+        free(ctx->pending);
+        ctx->pending = p;
+        ctx->head = 0;
+        ctx->size = size;
+    }
+
+    if (send_req(ctx->fd, from == FROM_ROM ? DREQ_READ : DREQ_READ_SRAM,
+        req->offset, req->count) < 0)
+            return 1;
+
+    ctx->pending[(ctx->head + ctx->count) % ctx->size] = req;
+    ctx->count++;
+    return 0;
+}
+
+static void
+daemon_wait(void *vctx, struct readq_req *req) {
+    struct daemon_ctx *ctx = vctx;
+
+    while (req->result == READQ_PENDING && ctx->count > 0)
+        daemon_complete(ctx);
+    if (req->result == READQ_PENDING)
+        req->result = -1;
+}
+
+static const struct readq_backend daemon_readq = {
+    .submit = daemon_submit,
+    .wait = daemon_wait,
+    .release = NULL
+};
+
+static int
+daemon_read(void *vctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    struct daemon_ctx *ctx = vctx;
+    struct readq_req req = {offset, count, buf, READQ_PENDING};
+
+    if (daemon_submit(ctx, from, &req))
+        return -1;
+    daemon_wait(ctx, &req);
+
+    return req.result;
+}
+
+static int
+daemon_writev(void *vctx, int to, struct ems_iovec *iov, int iovcnt) {
+    struct daemon_ctx *ctx = vctx;
+    int r;
+
+    daemon_drain(ctx);
+
+    if (send_req(ctx->fd, to == TO_ROM ? DREQ_WRITE : DREQ_WRITE_SRAM,
+        iovcnt, 0) < 0)
+            return -1;
+    for (int i = 0; i < iovcnt; i++)
+        if (send_req(ctx->fd, DREQ_CMD, iov[i].offset, iov[i].count) < 0 ||
+            xwrite(ctx->fd, iov[i].buf, iov[i].count) < 0)
+                return -1;
+
+    if (recv_result(ctx->fd, &r) < 0)
+        return -1;
+    return r;
+}
+
+/**
+ * Get the identifier of the device served by the daemon: the settings of a
+ * cart are shared by its clients and the direct invocations.
+ */
+static int
+daemon_devid(void *vctx, char *buf, size_t size) {
+    struct daemon_ctx *ctx = vctx;
+    unsigned char lenbuf[4];
+    uint32_t len;
+    int r;
+
+    daemon_drain(ctx);
+
+    if (send_req(ctx->fd, DREQ_DEVID, 0, 0) < 0 ||
+        recv_result(ctx->fd, &r) < 0)
+            return -1;
+    if (r < 0)
+        return r;
+
+    if (xread(ctx->fd, lenbuf, 4) < 0 || (len = get_be32(lenbuf)) >= size ||
+        xread(ctx->fd, buf, len) < 0)
+            return -1;
+    buf[len] = '\0';
+
+    return 0;
+}
+
+const struct ems_backend ems_daemon_backend = {
+    .name = "daemon",
+    .descr = "cart opened by ems-flasherd, listening on the socket PATH",
+    .open = daemon_open,
+    .close = daemon_close,
+    .read = daemon_read,
+    .writev = daemon_writev,
+    .devid = daemon_devid,
+    .readq = &daemon_readq
+};
+
+/*
+ * Daemon
+ */
+
+struct server {
+    int verbose;
+    unsigned char *buf;
+    size_t bufsize;
+    struct ems_iovec *iov;
+    int iovsize;
+
+    /* header cache, see the top of the file */
+    unsigned char headers[NSLOTS][HEADER_SIZE];
+    char valid[NSLOTS];
+
+    unsigned long requests, cached;
+};
+
+static volatile sig_atomic_t serve_stop;
+
+static void
+serve_handler(int sig) {
+    serve_stop = 1;
+}
+
+/* grow the buffer to "size" bytes, keeping its content */
+static unsigned char *
+server_buf(struct server *s, size_t size) {
+    if (size > s->bufsize) {
+        if ((s->buf = realloc(s->buf, size)) == NULL)
+            err(1, "malloc");
+        s->bufsize = size;
+    }
+    return s->buf;
+}
+
+/**
+ * Read from the cart, through the header cache for the reads within the
+ * first HEADER_SIZE bytes of a slot.
+ */
+static int
+server_read(struct server *s, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    uint32_t slot = offset / SLOTSIZE, ofs = offset % SLOTSIZE;
+    int r;
+
+    if (from != FROM_ROM || slot >= NSLOTS || ofs + count > HEADER_SIZE)
+        return ems_read(from, offset, buf, count);
+
+    if (!s->valid[slot]) {
+        if ((r = ems_read(FROM_ROM, offset - ofs, s->headers[slot],
+            HEADER_SIZE)) != HEADER_SIZE)
+                return r < 0 ? r : ems_read(from, offset, buf, count);
+        s->valid[slot] = 1;
+    } else {
+        s->cached++;
+    }
+
+    memcpy(buf, s->headers[slot] + ofs, count);
+    return count;
+}
+
+/**
+ * Invalidate the headers of the slots written or erased by a write command.
+ */
+static void
+server_invalidate(struct server *s, uint32_t offset, size_t count) {
+    uint32_t first, last;
+
+    if (offset % ERASEBLOCKSIZE == 0 && count < ERASEBLOCKSIZE)
+        count = ERASEBLOCKSIZE;
+    if (count == 0)
+        return;
+
+    first = offset / SLOTSIZE;
+    last = (offset + count - 1) / SLOTSIZE;
+    for (uint32_t slot = first; slot <= last && slot < NSLOTS; slot++)
+        s->valid[slot] = 0;
+}
+
+/**
+ * Execute the requests of a client until it disconnects or sends an invalid
+ * request.
+ */
+static void
+server_client(struct server *s, int fd) {
+    unsigned char req[DREQ_SIZE], res[4];
+    uint32_t a, b;
+    int r;
+
+    while (!serve_stop && xread(fd, req, DREQ_SIZE) == 0) {
+        a = get_be32(req + 1);
+        b = get_be32(req + 5);
+        s->requests++;
+
+        switch (req[0]) {
+        case DREQ_READ:
+        case DREQ_READ_SRAM:
+            if (b > DREQ_MAXCOUNT)
+                return;
+            r = server_read(s, req[0] == DREQ_READ ? FROM_ROM : FROM_SRAM,
+                a, server_buf(s, b), b);
+            put_be32(res, r);
+            if (xwrite(fd, res, 4) < 0 ||
+                (r > 0 && xwrite(fd, s->buf, r) < 0))
+                    return;
+            break;
+
+        case DREQ_WRITE:
+        case DREQ_WRITE_SRAM: {
+            int to = req[0] == DREQ_WRITE ? TO_ROM : TO_SRAM;
+            size_t total = 0;
+
+            if (a > DREQ_MAXCOUNT)
+                return;
+            if (a > s->iovsize) {
+                free(s->iov);
+                if ((s->iov = malloc(a * sizeof(*s->iov))) == NULL)
+                    err(1, "malloc");
+                s->iovsize = a;
+            }
+
+            /* the commands are received first, their data is kept in s->buf */
+            for (uint32_t i = 0; i < a; i++) {
+                if (xread(fd, req, DREQ_SIZE) < 0 || req[0] != DREQ_CMD)
+                    return;
+                s->iov[i].offset = get_be32(req + 1);
+                s->iov[i].count = get_be32(req + 5);
+                if (s->iov[i].count > DREQ_MAXCOUNT - total)
+                    return;
+                server_buf(s, total + s->iov[i].count);
+                if (xread(fd, s->buf + total, s->iov[i].count) < 0)
+                    return;
+                total += s->iov[i].count;
+            }
+            for (uint32_t i = 0, ofs = 0; i < a; i++) {
+                s->iov[i].buf = s->buf + ofs;
+                ofs += s->iov[i].count;
+                if (to == TO_ROM)
+                    server_invalidate(s, s->iov[i].offset, s->iov[i].count);
+            }
+
+            r = ems_writev(to, s->iov, a);
+            put_be32(res, r);
+            if (xwrite(fd, res, 4) < 0)
+                return;
+            break;
+        }
+
+        case DREQ_DEVID: {
+            char devid[256];
+            unsigned char len[4];
+
+            r = ems_devid(devid, sizeof(devid));
+            put_be32(res, r);
+            if (xwrite(fd, res, 4) < 0)
+                return;
+            if (r == 0) {
+                put_be32(len, strlen(devid));
+                if (xwrite(fd, len, 4) < 0 ||
+                    xwrite(fd, devid, strlen(devid)) < 0)
+                        return;
+            }
+            break;
+        }
+
+        default:
+            warnx("invalid request from a client (%#x)", req[0]);
+            return;
+        }
+    }
+}
+
+/**
+ * Bind the socket "path", replacing a stale socket left by a daemon that is
+ * no longer running. Exits on error.
+ */
+static int
+server_listen(const char *path) {
+    struct sockaddr_un sa;
+    struct stat st;
+    mode_t mask;
+    int fd, probe;
+
+    if (sockaddr_set(&sa, path) < 0)
+        exit(1);
+
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            errx(1, "%s exists and is not a socket", path);
+        if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            err(1, "socket");
+        if (connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+            errx(1, "ems-flasherd is already running on %s", path);
+        close(probe);
+        unlink(path);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        err(1, "socket");
+
+    /* the socket gives access to the cart: only to the user */
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        err(1, "can't bind %s", path);
+    umask(mask);
+    if (listen(fd, 8) < 0)
+        err(1, "listen");
+
+    return fd;
+}
+
+/**
+ * Serve the device opened by ems_init() on the Unix socket "path" (see
+ * ems_daemon_socket()) until SIGINT, SIGTERM or SIGHUP.
+ *
+ * Returns 0 when stopped. Exits on error.
+ */
+int
+ems_serve(const char *path, int verbose) {
+    struct sigaction sa;
+    struct server *s;
+    int fd, cfd;
+
+    if ((path = ems_daemon_socket(path, 1)) == NULL)
+        exit(1);
+    fd = server_listen(path);
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        err(1, "malloc");
+    s->verbose = verbose;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    // no SA_RESTART: a blocking accept() or read() returns
+    sa.sa_handler = serve_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    if (verbose)
+        printf("listening on %s\n", path);
+
+    while (!serve_stop) {
+        if ((cfd = accept(fd, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(1, "accept");
+        }
+
+        if (peer_check(cfd) < 0) {
+            close(cfd);
+            continue;
+        }
+
+        s->requests = s->cached = 0;
+        server_client(s, cfd);
+        close(cfd);
+
+        if (verbose)
+            printf("client served: %lu requests, %lu headers from the "
+                "cache\n", s->requests, s->cached);
+    }
+
+    close(fd);
+    unlink(path);
+    free(s->buf);
+    free(s->iov);
+    free(s);
+
+    return 0;
+}
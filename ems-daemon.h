@@ -0,0 +1,7 @@
+#ifndef EMS_DAEMON_H
+#define EMS_DAEMON_H
+
+const char *ems_daemon_socket(const char *, int);
+int ems_serve(const char *, int);
+
+#endif /* EMS_DAEMON_H */
@@ -1,10 +1,11 @@
 /* 
- * Replace ems.c. Performs cartridge I/O operations on an image file.
+ * File transport (backend "file[:PATH]"). Performs cartridge I/O operations
+ * on an image file.
  * The file is an image of a full cartridge (2 pages). Use split -n2 to split
  * the image into two pages.
  *
- * Environment variables:
- *   IMAGEFILE: path to the image file (image.gb by default)
+ * The path of the image file is the argument of the backend or, if not given,
+ * the value of the IMAGEFILE environment variable (image.gb by default).
  *
  * Attention:
  *   - SRAM operations are not implemented.
@@ -12,7 +13,6 @@
  *     preceded by an odd number of writes, a write always succeeds on a
  *     non-blank erase-block, ...). See the Tech file.
  */
-#include <assert.h>
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,70 +22,82 @@
 
 #define DEFAULTIMAGEFILE "image.gb"
 
-static FILE *imagef;
-static char *imagepath;
+struct file_ctx {
+    FILE *imagef;
+    const char *imagepath;
+};
 
 /**
- * Init the flasher. Inits libusb and claims the device. Aborts if libusb
- * can't be initialized.
- *
- * TODO replace printed error with return code
+ * Open (or create) the image file. Exits on error.
+ */
+static void *
+file_open(const char *arg) {
+    struct file_ctx *ctx;
+
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        err(1, "malloc");
+
+    if ((ctx->imagepath = arg) == NULL || *arg == '\0')
+        if ((ctx->imagepath = getenv("IMAGEFILE")) == NULL)
+            ctx->imagepath = DEFAULTIMAGEFILE;
+
+    if ((ctx->imagef = fopen(ctx->imagepath, "r+b")) == NULL) {
+        if ((ctx->imagef = fopen(ctx->imagepath, "w+b")) == NULL)
+            err(1, "can't open (or create) %s", ctx->imagepath);
+    }
+
+    return ctx;
+}
+
+/**
+ * Get a string identifying the device: the path of the image file.
  *
  * Returns:
  *  0       Success
  *  < 0     Failure
  */
-int ems_init(void) {
-  //  char *mode;
-    void ems_deinit(void);
-
-    // call the cleanup when we're done
-    atexit(ems_deinit);
+static int
+file_devid(void *vctx, char *buf, size_t size) {
+    struct file_ctx *ctx = vctx;
+    int len;
 
-    if ((imagepath = getenv("IMAGEFILE")) == NULL)
-        imagepath = DEFAULTIMAGEFILE;
+    len = snprintf(buf, size, "file:%s", ctx->imagepath);
 
-    if ((imagef = fopen(imagepath, "r+b")) == NULL) {
-        if ((imagef = fopen(imagepath, "w+b")) == NULL)
-            err(1, "can't open (or create) %s", imagepath);
-    }
-
-    return 0;
+    return len >= 0 && len < size ? 0 : -1;
 }
 
 /**
- * Cleanup / release the device. Registered with atexit.
+ * Cleanup / release the device.
  */
-void ems_deinit(void) {
-    if (imagef != NULL)
-        fclose(imagef);
+static void
+file_close(void *vctx) {
+    struct file_ctx *ctx = vctx;
+
+    if (ctx->imagef != NULL)
+        fclose(ctx->imagef);
+    free(ctx);
 }
 
 /**
- * Read some bytes from the cart.
- *
- * Params:
- *  from    FROM_ROM or FROM_SRAM
- *  offset  absolute read address from the cart
- *  buf     buffer to read into (buffer must be at least count bytes)
- *  count   number of bytes to read
+ * Read some bytes from the cart (see ems_read()).
  *
  * Returns:
  *  >= 0    number of bytes read (will always == count)
  *  < 0     error sending command or reading data
  */
-int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
+static int
+file_read(void *vctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    struct file_ctx *ctx = vctx;
     size_t bytes;
 
-    assert(from == FROM_ROM || from == FROM_SRAM);
-
     if (from == FROM_SRAM)
         errx(1, "ems_read from SRAM is not supported");
 
-    if (fseek(imagef, offset, SEEK_SET) == -1)
+    if (fseek(ctx->imagef, offset, SEEK_SET) == -1)
         err(1, "seek (offset=%ld)", (long)offset);
-    if ((bytes = fread(buf, 1, count, imagef)) < count) {
-        if (ferror(imagef))
+    if ((bytes = fread(buf, 1, count, ctx->imagef)) < count) {
+        if (ferror(ctx->imagef))
             err(1, "read error (offset=%ld)", (long)offset);
         memset(&buf[bytes], 0xff, count - bytes);
     }
@@ -106,9 +118,9 @@ int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
  *  >= 0    number of bytes written (will always == count)
  *  < 0     error writing data
  */
-int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
-    assert(to == TO_ROM || to == TO_SRAM);
-
+static int
+file_write(struct file_ctx *ctx, int to, uint32_t offset, unsigned char *buf,
+    size_t count) {
     if (to == TO_SRAM)
         errx(1, "ems_write to SRAM not supported");
 
@@ -118,17 +130,46 @@ int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
 
         memset(buf, 0xff, 4096);
 
-        if (fseek(imagef, offset, SEEK_SET) == -1)
+        if (fseek(ctx->imagef, offset, SEEK_SET) == -1)
             err(1, "seek (offset=%ld)", (long)offset);
         for (remaining = ERASEBLOCKSIZE; remaining > 0; remaining -= 4096)
-            if (fwrite(buf, 1, 4096, imagef) < 4096)
+            if (fwrite(buf, 1, 4096, ctx->imagef) < 4096)
                 err(1, "write error (offset=%ld)", (long)offset);
     }
 
-    if (fseek(imagef, offset, SEEK_SET) == -1)
+    if (fseek(ctx->imagef, offset, SEEK_SET) == -1)
         err(1, "seek (offset=%ld)", (long)offset);
-    if (fwrite(buf, 1, count, imagef) < count)
+    if (fwrite(buf, 1, count, ctx->imagef) < count)
         err(1, "write error (offset=%ld)", (long)offset);
 
     return count;
 }
+
+/**
+ * Send several write commands (see ems_writev()).
+ *
+ * Returns:
+ *  >= 0    number of bytes written (will always == the sum of the counts)
+ *  < 0     error writing data
+ */
+static int
+file_writev(void *ctx, int to, struct ems_iovec *iov, int iovcnt) {
+    int i, written;
+
+    for (i = 0, written = 0; i < iovcnt; i++)
+        written += file_write(ctx, to, iov[i].offset, iov[i].buf,
+            iov[i].count);
+
+    return written;
+}
+
+const struct ems_backend ems_file_backend = {
+    .name = "file",
+    .descr = "image file of a cartridge (PATH or $IMAGEFILE)",
+    .open = file_open,
+    .close = file_close,
+    .read = file_read,
+    .writev = file_writev,
+    .devid = file_devid,
+    .readq = NULL
+};
@@ -0,0 +1,134 @@
+/*
+ * Memory transport (backend "mem[:PATH]"). Performs cartridge I/O operations
+ * on an image kept in memory: the fastest device to benchmark or profile the
+ * command stack.
+ *
+ * The flash memory is blank at startup unless PATH is given: it is then loaded
+ * from that image file (see ems-file.c). The changes are not written back.
+ * The SRAM is supported and blank at startup.
+ *
+ * Like ems-file.c, it doesn't simulate the quirks of the cartridge.
+ */
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+
+#define FLASHSIZE (2*PAGESIZE)
+
+struct mem_ctx {
+    unsigned char *flash, *sram;
+};
+
+/**
+ * Allocate the image and load it from "arg" if given. Exits on error.
+ */
+static void *
+mem_open(const char *arg) {
+    struct mem_ctx *ctx;
+    FILE *f;
+
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL ||
+        (ctx->flash = malloc(FLASHSIZE)) == NULL ||
+        (ctx->sram = malloc(SRAMSIZE)) == NULL)
+            err(1, "malloc");
+
+    memset(ctx->flash, 0xff, FLASHSIZE);
+    memset(ctx->sram, 0xff, SRAMSIZE);
+
+    if (arg != NULL && *arg != '\0') {
+        if ((f = fopen(arg, "rb")) == NULL)
+            err(1, "can't open %s", arg);
+        if (fread(ctx->flash, 1, FLASHSIZE, f) < FLASHSIZE && ferror(f))
+            err(1, "read error (%s)", arg);
+        fclose(f);
+    }
+
+    return ctx;
+}
+
+static void
+mem_close(void *vctx) {
+    struct mem_ctx *ctx = vctx;
+
+    free(ctx->flash);
+    free(ctx->sram);
+    free(ctx);
+}
+
+static int
+mem_devid(void *ctx, char *buf, size_t size) {
+    int len;
+
+    len = snprintf(buf, size, "mem");
+
+    return len >= 0 && len < size ? 0 : -1;
+}
+
+/**
+ * Return the memory of "space" holding [offset, offset+count[, NULL if out of
+ * bounds.
+ */
+static unsigned char *
+mem_ptr(struct mem_ctx *ctx, int space, uint32_t offset, size_t count) {
+    unsigned char *mem;
+    ems_size_t size;
+
+    if (space == FROM_ROM) {
+        mem = ctx->flash;
+        size = FLASHSIZE;
+    } else {
+        mem = ctx->sram;
+        size = SRAMSIZE;
+    }
+
+    if (offset > size || count > size - offset)
+        return NULL;
+
+    return mem + offset;
+}
+
+static int
+mem_read(void *ctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    unsigned char *p;
+
+    if ((p = mem_ptr(ctx, from, offset, count)) == NULL)
+        return -1;
+    memcpy(buf, p, count);
+
+    return count;
+}
+
+/**
+ * Write commands. A write at the start of an erase-block erases it first.
+ */
+static int
+mem_writev(void *ctx, int to, struct ems_iovec *iov, int iovcnt) {
+    unsigned char *p;
+    int i, written;
+
+    for (i = 0, written = 0; i < iovcnt; i++) {
+        if ((p = mem_ptr(ctx, to, iov[i].offset, iov[i].count)) == NULL)
+            return written;
+        if (to == TO_ROM && iov[i].offset % ERASEBLOCKSIZE == 0)
+            memset(p, 0xff, ERASEBLOCKSIZE);
+        memcpy(p, iov[i].buf, iov[i].count);
+        written += iov[i].count;
+    }
+
+    return written;
+}
+
+const struct ems_backend ems_mem_backend = {
+    .name = "mem",
+    .descr = "image in memory, loaded from PATH if given",
+    .open = mem_open,
+    .close = mem_close,
+    .read = mem_read,
+    .writev = mem_writev,
+    .devid = mem_devid,
+    .readq = NULL
+};
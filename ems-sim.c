@@ -0,0 +1,507 @@
+/*
+ * Simulator transport (backend "sim[:OPTIONS]"). Simulates the cartridge
+ * described in the Tech file, with its timings, on a virtual clock:
+ *
+ *   - every bulk transfer costs a fixed latency and the bytes transferred at
+ *     the USB rate (9 bytes per command plus the data)
+ *   - a write at the start of an erase-block erases it (about 1 s)
+ *   - the data written is programmed by chunks of 32 bytes; programming only
+ *     clears bits (1->0), it doesn't erase
+ *   - each erase-block supports a limited number of erase cycles, beyond which
+ *     the erasure fails and the block keeps its content
+ *   - a read preceded by an odd number of writes stalls: it fails after a
+ *     timeout
+ *
+ * The device processes the commands in order. The host waits for the
+ * transfers; writes are programmed in the background but delay the following
+ * commands. Reads submitted through a read queue overlap their latency.
+ *
+ * By default the clock is purely virtual: operations complete immediately
+ * and the simulated time is reported when the device is closed. With speed=N,
+ * the simulator sleeps to run N times faster than the real device.
+ *
+ * OPTIONS is a comma separated list of NAME=VALUE:
+ *   image=PATH   load the flash memory from PATH (see ems-file.c) and save it
+ *                back when closed, with the erase counters in PATH.wear
+ *   latency=US   latency of a bulk transfer, in microseconds (1000)
+ *   readrate=BPS, writerate=BPS
+ *                USB transfer rates, in bytes per second (1000000)
+ *   program=US   time to program 32 bytes, in microseconds (200)
+ *   erase=MS     time to erase an erase-block, in milliseconds (1000)
+ *   cycles=N     erase cycles supported by an erase-block (100000)
+ *   stall=MS     time a stalled read waits before failing (5000)
+ *   speed=N      run N times faster than the device, 0 not to sleep (0)
+ *   quiet=1      don't report the counters when closed
+ */
+
+/* for nanosleep() and clock_gettime() */
+#define _XOPEN_SOURCE 500
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ems.h"
+#include "ems-sim.h"
+#include "readq.h"
+
+#define FLASHSIZE (2*PAGESIZE)
+#define NBLOCKS (FLASHSIZE/ERASEBLOCKSIZE)
+#define PROGRAMSIZE 32
+
+#define US 1000ull
+#define MS 1000000ull
+#define SEC 1000000000ull
+
+struct sim_params {
+    char *image;
+    uint64_t latency, program, erase, stall;
+    double readrate, writerate, speed;
+    unsigned long cycles;
+    int quiet;
+};
+
+struct sim_ctx {
+    struct sim_params p;
+    unsigned char *flash, *sram;
+    unsigned long wear[NBLOCKS];
+    int oddwrites;
+
+    /* time of the host and time at which the device becomes idle */
+    uint64_t clock, devfree;
+    struct timespec start;
+
+    struct sim_stats st;
+};
+
+/* state of a read submitted through a read queue */
+struct sim_readreq {
+    uint64_t done;
+    int result;
+};
+
+static const struct readq_backend sim_readq_backend;
+
+static uint64_t
+xfertime(size_t bytes, double rate) {
+    return bytes * (SEC / rate);
+}
+
+static uint64_t
+max64(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+/**
+ * Advance the clock of the host to "t" and, if the simulation runs in real
+ * time, sleep until then.
+ */
+static void
+sim_advance(struct sim_ctx *ctx, uint64_t t) {
+    struct timespec now, ts;
+    int64_t delay;
+
+    ctx->clock = max64(ctx->clock, t);
+
+    if (ctx->p.speed <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    delay = ctx->clock / ctx->p.speed -
+        ((now.tv_sec - ctx->start.tv_sec) * (int64_t)SEC +
+        (now.tv_nsec - ctx->start.tv_nsec));
+    if (delay > 0) {
+        ts.tv_sec = delay / SEC;
+        ts.tv_nsec = delay % SEC;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+static void
+parse_options(struct sim_params *p, const char *arg) {
+    char *opts, *opt, *val;
+
+    p->image = NULL;
+    p->latency = 1000*US;
+    p->readrate = p->writerate = 1000000;
+    p->program = 200*US;
+    p->erase = 1000*MS;
+    p->cycles = 100000;
+    p->stall = 5000*MS;
+    p->speed = 0;
+    p->quiet = 0;
+
+    if (arg == NULL)
+        return;
+
+    if ((opts = strdup(arg)) == NULL)
+        err(1, "malloc");
+
+    for (opt = strtok(opts, ","); opt != NULL; opt = strtok(NULL, ",")) {
+        if ((val = strchr(opt, '=')) == NULL)
+            errx(1, "sim: option %s: NAME=VALUE expected", opt);
+        *val++ = '\0';
+
+        if (strcmp(opt, "image") == 0) {
+            if ((p->image = strdup(val)) == NULL)
+                err(1, "malloc");
+        } else if (strcmp(opt, "latency") == 0) {
+            p->latency = strtoull(val, NULL, 10) * US;
+        } else if (strcmp(opt, "readrate") == 0) {
+            p->readrate = strtod(val, NULL);
+        } else if (strcmp(opt, "writerate") == 0) {
+            p->writerate = strtod(val, NULL);
+        } else if (strcmp(opt, "program") == 0) {
+            p->program = strtoull(val, NULL, 10) * US;
+        } else if (strcmp(opt, "erase") == 0) {
+            p->erase = strtoull(val, NULL, 10) * MS;
+        } else if (strcmp(opt, "cycles") == 0) {
+            p->cycles = strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "stall") == 0) {
+            p->stall = strtoull(val, NULL, 10) * MS;
+        } else if (strcmp(opt, "speed") == 0) {
+            p->speed = strtod(val, NULL);
+        } else if (strcmp(opt, "quiet") == 0) {
+            p->quiet = atoi(val);
+        } else {
+            errx(1, "sim: unknown option %s", opt);
+        }
+    }
+
+    if (p->readrate <= 0 || p->writerate <= 0)
+        errx(1, "sim: transfer rates must be > 0");
+
+    free(opts);
+}
+
+static char *
+wearpath(const char *image) {
+    char *path;
+
+    if ((path = malloc(strlen(image) + sizeof(".wear"))) == NULL)
+        err(1, "malloc");
+    sprintf(path, "%s.wear", image);
+
+    return path;
+}
+
+/**
+ * Load the image and the erase counters, if any. Exits on error.
+ */
+static void
+sim_load(struct sim_ctx *ctx) {
+    char *path;
+    FILE *f;
+    int i;
+
+    if ((f = fopen(ctx->p.image, "rb")) != NULL) {
+        if (fread(ctx->flash, 1, FLASHSIZE, f) < FLASHSIZE && ferror(f))
+            err(1, "read error (%s)", ctx->p.image);
+        fclose(f);
+    }
+
+    path = wearpath(ctx->p.image);
+    if ((f = fopen(path, "r")) != NULL) {
+        for (i = 0; i < NBLOCKS; i++)
+            if (fscanf(f, "%lu", &ctx->wear[i]) != 1)
+                errx(1, "%s: invalid format", path);
+        fclose(f);
+    }
+    free(path);
+}
+
+static void
+sim_save(struct sim_ctx *ctx) {
+    char *path;
+    FILE *f;
+    int i;
+
+    if ((f = fopen(ctx->p.image, "wb")) == NULL ||
+        fwrite(ctx->flash, 1, FLASHSIZE, f) < FLASHSIZE ||
+        fclose(f) == EOF)
+            warn("can't save %s", ctx->p.image);
+
+    path = wearpath(ctx->p.image);
+    if ((f = fopen(path, "w")) != NULL) {
+        for (i = 0; i < NBLOCKS; i++)
+            fprintf(f, "%lu\n", ctx->wear[i]);
+        if (fclose(f) == EOF)
+            warn("can't save %s", path);
+    } else {
+        warn("can't save %s", path);
+    }
+    free(path);
+}
+
+static void *
+sim_open(const char *arg) {
+    struct sim_ctx *ctx;
+
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL ||
+        (ctx->flash = malloc(FLASHSIZE)) == NULL ||
+        (ctx->sram = malloc(SRAMSIZE)) == NULL)
+            err(1, "malloc");
+
+    parse_options(&ctx->p, arg);
+
+    memset(ctx->flash, 0xff, FLASHSIZE);
+    memset(ctx->sram, 0xff, SRAMSIZE);
+
+    if (ctx->p.image != NULL)
+        sim_load(ctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+
+    return ctx;
+}
+
+/**
+ * Get the counters of the simulator
+ */
+void
+ems_sim_stats(void *vctx, struct sim_stats *st) {
+    struct sim_ctx *ctx = vctx;
+
+    *st = ctx->st;
+    st->clock = ctx->clock;
+    st->maxwear = 0;
+    for (int i = 0; i < NBLOCKS; i++)
+        if (ctx->wear[i] > st->maxwear)
+            st->maxwear = ctx->wear[i];
+}
+
+static void
+sim_close(void *vctx) {
+    struct sim_ctx *ctx = vctx;
+    struct sim_stats st;
+
+    if (!ctx->p.quiet) {
+        ems_sim_stats(ctx, &st);
+        fprintf(stderr, "sim: %.3f s simulated, device busy %.3f s\n",
+            (double)st.clock / SEC, (double)st.devbusy / SEC);
+        fprintf(stderr, "sim: %lu reads (%lu bytes), %lu writes "
+            "(%lu bytes), %lu erases, %lu stalls\n", st.reads, st.readbytes,
+            st.writes, st.writebytes, st.erases, st.stalls);
+        if (st.wornerases > 0)
+            fprintf(stderr, "sim: %lu erases failed on worn blocks\n",
+                st.wornerases);
+    }
+
+    if (ctx->p.image != NULL)
+        sim_save(ctx);
+
+    free(ctx->p.image);
+    free(ctx->flash);
+    free(ctx->sram);
+    free(ctx);
+}
+
+static uint64_t
+sim_clock(void *vctx) {
+    struct sim_ctx *ctx = vctx;
+
+    return ctx->clock;
+}
+
+static int
+sim_devid(void *vctx, char *buf, size_t size) {
+    struct sim_ctx *ctx = vctx;
+    int len;
+
+    if (ctx->p.image != NULL)
+        len = snprintf(buf, size, "sim:%s", ctx->p.image);
+    else
+        len = snprintf(buf, size, "sim");
+
+    return len >= 0 && len < size ? 0 : -1;
+}
+
+/**
+ * Return the memory of "space" holding [offset, offset+count[, NULL if out of
+ * bounds.
+ */
+static unsigned char *
+sim_ptr(struct sim_ctx *ctx, int space, uint32_t offset, size_t count) {
+    unsigned char *mem;
+    ems_size_t size;
+
+    if (space == FROM_ROM) {
+        mem = ctx->flash;
+        size = FLASHSIZE;
+    } else {
+        mem = ctx->sram;
+        size = SRAMSIZE;
+    }
+
+    if (offset > size || count > size - offset)
+        return NULL;
+
+    return mem + offset;
+}
+
+/**
+ * Execute a read command submitted at the current time. Returns the result
+ * of the read and sets *done to the time the data is received.
+ */
+static int
+sim_doread(struct sim_ctx *ctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count, uint64_t *done) {
+    unsigned char *p;
+    uint64_t start;
+
+    if (ctx->oddwrites) {
+        ctx->st.stalls++;
+        *done = ctx->clock + ctx->p.stall;
+        warnx("sim: read stalled after an odd number of write commands");
+        return -ETIMEDOUT;
+    }
+
+    if ((p = sim_ptr(ctx, from, offset, count)) == NULL) {
+        *done = ctx->clock;
+        return -EINVAL;
+    }
+
+    start = max64(ctx->clock + ctx->p.latency, ctx->devfree);
+    *done = start + xfertime(count, ctx->p.readrate);
+    ctx->st.devbusy += *done - start;
+    ctx->devfree = *done;
+
+    memcpy(buf, p, count);
+    ctx->st.reads++;
+    ctx->st.readbytes += count;
+
+    return count;
+}
+
+static int
+sim_read(void *vctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    struct sim_ctx *ctx = vctx;
+    uint64_t done;
+    int r;
+
+    r = sim_doread(ctx, from, offset, buf, count, &done);
+    sim_advance(ctx, done);
+
+    return r;
+}
+
+static void
+sim_erase(struct sim_ctx *ctx, uint32_t offset) {
+    int blk = offset / ERASEBLOCKSIZE;
+
+    ctx->st.erases++;
+    if (ctx->wear[blk] >= ctx->p.cycles) {
+        ctx->st.wornerases++;
+        return;
+    }
+    ctx->wear[blk]++;
+    memset(ctx->flash + offset, 0xff, ERASEBLOCKSIZE);
+}
+
+/**
+ * Write commands sent in one bulk transfer. The host waits for the transfer;
+ * the device programs the data afterwards.
+ */
+static int
+sim_writev(void *vctx, int to, struct ems_iovec *iov, int iovcnt) {
+    struct sim_ctx *ctx = vctx;
+    uint64_t t, dev;
+    unsigned char *p;
+    size_t len, i;
+    int n, written;
+
+    for (n = 0, len = 0; n < iovcnt; n++)
+        len += 9 + iov[n].count;
+
+    t = max64(ctx->clock, ctx->devfree) + ctx->p.latency +
+        xfertime(len, ctx->p.writerate);
+
+    dev = t;
+    for (n = 0, written = 0; n < iovcnt; n++) {
+        if ((p = sim_ptr(ctx, to, iov[n].offset, iov[n].count)) == NULL)
+            break;
+
+        if (to == TO_ROM) {
+            if (iov[n].offset % ERASEBLOCKSIZE == 0) {
+                sim_erase(ctx, iov[n].offset);
+                dev += ctx->p.erase;
+            }
+            for (i = 0; i < iov[n].count; i++)
+                p[i] &= iov[n].buf[i];
+            dev += ctx->p.program *
+                ((iov[n].count + PROGRAMSIZE - 1) / PROGRAMSIZE);
+        } else {
+            memcpy(p, iov[n].buf, iov[n].count);
+        }
+
+        ctx->oddwrites = !ctx->oddwrites;
+        ctx->st.writes++;
+        ctx->st.writebytes += iov[n].count;
+        written += iov[n].count;
+    }
+
+    ctx->st.devbusy += dev - max64(ctx->clock, ctx->devfree);
+    ctx->devfree = dev;
+    sim_advance(ctx, t);
+
+    return written;
+}
+
+/*
+ * Asynchronous reads: the data is copied at submission, the clock advances
+ * when the request is waited for.
+ */
+
+static int
+sim_read_submit(void *vctx, int from, struct readq_req *req) {
+    struct sim_ctx *ctx = vctx;
+    struct sim_readreq *sreq;
+
+    if ((sreq = req->priv) == NULL) {
+        if ((sreq = malloc(sizeof(*sreq))) == NULL)
+            err(1, "malloc");
+        req->priv = sreq;
+    }
+
+    sreq->result = sim_doread(ctx, from, req->offset, req->buf, req->count,
+        &sreq->done);
+
+    return 0;
+}
+
+static void
+sim_read_wait(void *ctx, struct readq_req *req) {
+    struct sim_readreq *sreq = req->priv;
+
+    sim_advance(ctx, sreq->done);
+    req->result = sreq->result;
+}
+
+static void
+sim_read_release(void *ctx, struct readq_req *req) {
+    free(req->priv);
+    req->priv = NULL;
+}
+
+static const struct readq_backend sim_readq_backend = {
+    .submit = sim_read_submit,
+    .wait = sim_read_wait,
+    .release = sim_read_release
+};
+
+const struct ems_backend ems_sim_backend = {
+    .name = "sim",
+    .descr = "simulated cartridge with its timings and quirks",
+    .open = sim_open,
+    .close = sim_close,
+    .read = sim_read,
+    .writev = sim_writev,
+    .devid = sim_devid,
+    .readq = &sim_readq_backend,
+    .clock = sim_clock
+};
@@ -0,0 +1,21 @@
+#ifndef EMS_SIM_H
+#define EMS_SIM_H
+
+#include <stdint.h>
+
+/*
+ * struct sim_stats: counters of the simulator (see ems-sim.c)
+ *   clock: simulated time elapsed since the device was opened, in ns
+ *   devbusy: time the device spent processing commands, in ns
+ *   maxwear: highest erase count of the erase-blocks
+ */
+struct sim_stats {
+    uint64_t clock, devbusy;
+    unsigned long reads, writes, readbytes, writebytes;
+    unsigned long erases, wornerases, stalls;
+    unsigned long maxwear;
+};
+
+void ems_sim_stats(void *, struct sim_stats *);
+
+#endif /* EMS_SIM_H */
@@ -0,0 +1,524 @@
+/*
+ * USB transport: the EMS cartridge accessed with libusb (backend "usb").
+ */
+
+#define _XOPEN_SOURCE 500
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h> // FIXME this will (probably) go away with error coes
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* for htonl */
+
+#include <libusb.h>
+
+#include "ems.h"
+#include "readq.h"
+#include "config.h"
+
+/* magic numbers! */
+#define EMS_VID 0x4670
+#define EMS_PID 0x9394
+
+#define EMS_EP_SEND (2 | LIBUSB_ENDPOINT_OUT)
+#define EMS_EP_RECV (1 | LIBUSB_ENDPOINT_IN)
+
+enum {
+    CMD_READ    = 0xff,
+    CMD_WRITE   = 0x57,
+    CMD_READ_SRAM   = 0x6d,
+    CMD_WRITE_SRAM  = 0x4d,
+};
+
+#define ODDWRITESMSG "read refused: an odd number of write commands has " \
+                     "been sent, the device would block\n"
+
+/* number of command buffers reused by the write functions */
+#define POOLSIZE 4
+
+struct usb_ctx {
+    struct libusb_device_handle *devh;
+    int claimed;
+
+    /*
+     * The device blocks a read command preceded by an odd number of write
+     * commands (see the Tech file). Keep track of the parity of the write
+     * commands sent to refuse such a read instead of hanging.
+     */
+    int oddwrites;
+
+    struct {
+        unsigned char *buf;
+        size_t size;
+        int used;
+    } pool[POOLSIZE];
+};
+
+static const struct readq_backend usb_readq_backend;
+
+/**
+ * Attempt to find the EMS cart by vid/pid.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     failure
+ */
+static int find_ems_device(struct usb_ctx *ctx) {
+    ssize_t num_devices = 0;
+    libusb_device **device_list = NULL;
+    struct libusb_device_descriptor device_descriptor;
+    int i = 0;
+    int retval = 0;
+
+#define INSTALLUDEVMSG "Try running as root/sudo or update udev rules " \
+                       "(check Building and Installating instructions " \
+                       "in the README.md file for more info).\n"
+
+    num_devices = libusb_get_device_list(NULL, &device_list);
+    if (num_devices >= 0) {
+        for (; i < num_devices; ++i) {
+            (void) memset(&device_descriptor, 0, sizeof(device_descriptor));
+            retval = libusb_get_device_descriptor(device_list[i], &device_descriptor);
+            if (retval == 0) {
+                if (device_descriptor.idVendor == EMS_VID
+                    && device_descriptor.idProduct == EMS_PID) {
+                    retval = libusb_open(device_list[i], &ctx->devh);
+                    if (retval != 0) {
+                        /*
+                         * According to the documentation, devh will not
+                         * be populated on error, so it should remain
+                         * NULL.
+                         */
+                        fprintf(stderr, "Failed to open device (libusb error: %s).\n", libusb_error_name(retval));
+#ifdef __linux__                      
+                        if (retval == LIBUSB_ERROR_ACCESS) {
+                            fprintf(stderr, INSTALLUDEVMSG);
+                        }
+#endif
+                    }
+                    break;
+                }
+            } else {
+                fprintf(stderr, "Failed to get device description (libusb error: %s).\n", libusb_error_name(retval));
+            }
+        }
+        if (i == num_devices) {
+            fprintf(stderr, "Could not find device, is it plugged in?\n"
+                            "Or it's may be a permission issue. "
+                            INSTALLUDEVMSG);
+        }
+        libusb_free_device_list(device_list, 1);
+        device_list = NULL;
+    } else {
+      fprintf(stderr, "Failed to get device list: %s\n", libusb_error_name((int)num_devices));
+    }
+
+    return ctx->devh != NULL ? 0 : -EIO;
+}
+
+static void usb_close(void *);
+
+/**
+ * Init the flasher. Inits libusb and claims the device. Aborts if libusb
+ * can't be initialized.
+ *
+ * TODO replace printed error with return code
+ *
+ * Returns the context, NULL on failure.
+ */
+static void *
+usb_open(const char *arg) {
+    struct usb_ctx *ctx;
+    int r;
+
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        err(1, "malloc");
+
+    // mask asyn signals for the thread created by libusb_init()
+    // to make sure that handlers are invoked in the main thread.
+    // Include only signals whose handler is redirected in catchint()
+#ifdef USE_PTHREAD
+    sigset_t newmask, oldmask;
+    sigemptyset(&newmask);
+    sigaddset(&newmask, SIGHUP);
+    sigaddset(&newmask, SIGINT);
+    sigaddset(&newmask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
+#endif
+
+    r = libusb_init(NULL);
+    if (r < 0) {
+        fprintf(stderr, "failed to initialize libusb\n");
+        exit(1); // pretty much hosed
+    }
+
+#ifdef USE_PTHREAD
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+#endif
+
+    r = find_ems_device(ctx);
+    if (r < 0) {
+        usb_close(ctx);
+        return NULL;
+    }
+
+    r = libusb_claim_interface(ctx->devh, 0);
+    if (r < 0) {
+        fprintf(stderr, "usb_claim_interface error %d\n", r);
+        usb_close(ctx);
+        return NULL;
+    }
+
+    ctx->claimed = 1;
+
+    return ctx;
+}
+
+/**
+ * Get a string identifying the device: the USB bus and port it is plugged to.
+ * It is used as a key for per-device settings.
+ *
+ * Returns:
+ *  0       Success
+ *  < 0     Failure
+ */
+static int
+usb_devid(void *vctx, char *buf, size_t size) {
+    struct usb_ctx *ctx = vctx;
+    libusb_device *dev;
+    uint8_t ports[8];
+    int i, n, len;
+
+    dev = libusb_get_device(ctx->devh);
+    len = snprintf(buf, size, "usb-%d", libusb_get_bus_number(dev));
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (i = 0; i < n && len >= 0 && len < size; i++)
+        len += snprintf(buf + len, size - len, "%c%d", i == 0 ? '-' : '.',
+            ports[i]);
+
+    return len >= 0 && len < size ? 0 : -1;
+}
+
+/**
+ * Cleanup / release the device.
+ */
+static void
+usb_close(void *vctx) {
+    struct usb_ctx *ctx = vctx;
+
+    if (ctx->claimed)
+        libusb_release_interface(ctx->devh, 0);
+
+    libusb_close(ctx->devh);
+    libusb_exit(NULL);
+
+    for (int i = 0; i < POOLSIZE; i++)
+        free(ctx->pool[i].buf);
+    free(ctx);
+}
+
+/**
+ * Get a buffer of at least "size" bytes from the pool. Exit on memory
+ * allocation error.
+ */
+static unsigned char *
+pool_get(struct usb_ctx *ctx, size_t size) {
+    unsigned char *buf;
+    int i, n;
+
+    // prefer a free buffer that is big enough
+    for (i = 0, n = -1; i < POOLSIZE; i++) {
+        if (ctx->pool[i].used)
+            continue;
+        if (ctx->pool[i].size >= size) {
+            n = i;
+            break;
+        }
+        if (n == -1)
+            n = i;
+    }
+
+    if (n == -1) {
+        // pool exhausted
+        if ((buf = malloc(size)) == NULL)
+            err(1, "malloc");
+        return buf;
+    }
+
+    if (ctx->pool[n].size < size) {
+        if ((buf = realloc(ctx->pool[n].buf, size)) == NULL)
+            err(1, "malloc");
+        ctx->pool[n].buf = buf;
+        ctx->pool[n].size = size;
+    }
+    ctx->pool[n].used = 1;
+
+    return ctx->pool[n].buf;
+}
+
+/**
+ * Return a buffer obtained by pool_get()
+ */
+static void
+pool_put(struct usb_ctx *ctx, unsigned char *buf) {
+    for (int i = 0; i < POOLSIZE; i++) {
+        if (ctx->pool[i].buf == buf) {
+            ctx->pool[i].used = 0;
+            return;
+        }
+    }
+    free(buf);
+}
+
+/**
+ * Initialize a command buffer. Commands are a 1 byte command code followed by
+ * a 4 byte address and a 4 byte value.
+ *
+ * buf must point to a memory chunk of size >= 9 bytes
+ */
+static void ems_command_init(
+        unsigned char *buf, // buffer to init
+        unsigned char cmd,  // command to run
+        uint32_t addr,      // address
+        uint32_t val        // value
+) {
+    buf[0] = cmd;
+    *(uint32_t *)(buf + 1) = htonl(addr);
+    *(uint32_t *)(buf + 5) = htonl(val);
+}
+
+/**
+ * Read some bytes from the cart.
+ *
+ * Params:
+ *  from    FROM_ROM or FROM_SRAM
+ *  offset  absolute read address from the cart
+ *  buf     buffer to read into (buffer must be at least count bytes)
+ *  count   number of bytes to read
+ *
+ * Returns:
+ *  >= 0    number of bytes read (error if != count)
+ *  < 0     error sending command or reading data
+ */
+static int
+usb_read(void *vctx, int from, uint32_t offset, unsigned char *buf,
+    size_t count) {
+    struct usb_ctx *ctx = vctx;
+    int r, transferred;
+    unsigned char cmd;
+    unsigned char cmd_buf[9];
+
+    assert(from == FROM_ROM || from == FROM_SRAM);
+
+    if (ctx->oddwrites) {
+        fprintf(stderr, ODDWRITESMSG);
+        return -EDEADLK;
+    }
+
+    cmd = from == FROM_ROM ? CMD_READ : CMD_READ_SRAM;
+    ems_command_init(cmd_buf, cmd, offset, count);
+
+#ifdef DEBUG
+    int i;
+    for (i = 0; i < 9; ++i)
+        printf("%02x ", cmd_buf[i]);
+    printf("\n");
+#endif
+
+    // send the read command
+    r = libusb_bulk_transfer(ctx->devh, EMS_EP_SEND, cmd_buf, sizeof(cmd_buf), &transferred, 0);
+    if (r < 0)
+        return r;
+
+    // read the data
+    r = libusb_bulk_transfer(ctx->devh, EMS_EP_RECV, buf, count, &transferred, 0);
+    if (r < 0)
+        return r;
+
+    return transferred;
+}
+
+/**
+ * Send several write commands in one bulk transfer. Each vector is a write
+ * command with its data.
+ *
+ * Params:
+ *  to      TO_ROM or TO_SRAM
+ *  iov     write commands, in the order they must be executed
+ *  iovcnt  number of commands
+ *
+ * Returns:
+ *  >= 0    number of data bytes written (error if != the sum of the counts)
+ *  < 0     error writing data
+ */
+static int
+usb_writev(void *vctx, int to, struct ems_iovec *iov, int iovcnt) {
+    struct usb_ctx *ctx = vctx;
+    int i, r, transferred, written;
+    unsigned char cmd, *write_buf, *p;
+    size_t len;
+
+    assert(to == TO_ROM || to == TO_SRAM);
+    cmd = to == TO_ROM ? CMD_WRITE : CMD_WRITE_SRAM;
+
+    for (i = 0, len = 0; i < iovcnt; i++)
+        len += 9 + iov[i].count;
+
+    // thx libusb for having no scatter/gather io
+    write_buf = pool_get(ctx, len);
+
+    // set up the command buffers
+    for (i = 0, p = write_buf; i < iovcnt; i++) {
+        ems_command_init(p, cmd, iov[i].offset, iov[i].count);
+        memcpy(p + 9, iov[i].buf, iov[i].count);
+        p += 9 + iov[i].count;
+    }
+
+    r = libusb_bulk_transfer(ctx->devh, EMS_EP_SEND, write_buf, len, &transferred, 0);
+
+    pool_put(ctx, write_buf);
+
+    if (r < 0)
+        return r;
+
+    // number of data bytes sent and parity of the commands received
+    for (i = 0, written = 0; i < iovcnt && transferred >= 9; i++) {
+        if (transferred - 9 < iov[i].count) {
+            written += transferred - 9;
+            break;
+        }
+        written += iov[i].count;
+        transferred -= 9 + iov[i].count;
+        ctx->oddwrites = !ctx->oddwrites;
+    }
+
+    return written;
+}
+
+/*
+ * Asynchronous reads (see readq.c)
+ *
+ * A read request is made of two transfers: the command sent on the write end
+ * and the data received from the read end. Transfers submitted to an endpoint
+ * are processed in order, so several requests can be in flight.
+ */
+
+struct usb_readreq {
+    struct libusb_transfer *cmd, *data;
+    unsigned char cmd_buf[9];
+    int pending, done;
+};
+
+static void LIBUSB_CALL
+usb_read_cb(struct libusb_transfer *transfer) {
+    struct readq_req *req = transfer->user_data;
+    struct usb_readreq *ureq = req->priv;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (req->result == READQ_PENDING)
+            req->result = -EIO;
+        // the device will never answer a command it didn't receive
+        if (transfer == ureq->cmd && ureq->pending == 2)
+            libusb_cancel_transfer(ureq->data);
+    } else if (transfer == ureq->data && req->result == READQ_PENDING) {
+        req->result = transfer->actual_length;
+    }
+
+    if (--ureq->pending == 0)
+        ureq->done = 1;
+}
+
+static int
+usb_read_submit(void *vctx, int from, struct readq_req *req) {
+    struct usb_ctx *ctx = vctx;
+    struct usb_readreq *ureq;
+    unsigned char cmd;
+
+    assert(from == FROM_ROM || from == FROM_SRAM);
+    cmd = from == FROM_ROM ? CMD_READ : CMD_READ_SRAM;
+
+    if (ctx->oddwrites) {
+        fprintf(stderr, ODDWRITESMSG);
+        return 1;
+    }
+
+    if ((ureq = req->priv) == NULL) {
+        if ((ureq = malloc(sizeof(*ureq))) == NULL)
+            err(1, "malloc");
+        ureq->cmd = libusb_alloc_transfer(0);
+        ureq->data = libusb_alloc_transfer(0);
+        if (ureq->cmd == NULL || ureq->data == NULL)
+            err(1, "libusb_alloc_transfer");
+        req->priv = ureq;
+    }
+
+    ems_command_init(ureq->cmd_buf, cmd, req->offset, req->count);
+
+    libusb_fill_bulk_transfer(ureq->cmd, ctx->devh, EMS_EP_SEND, ureq->cmd_buf,
+        sizeof(ureq->cmd_buf), usb_read_cb, req, 0);
+    libusb_fill_bulk_transfer(ureq->data, ctx->devh, EMS_EP_RECV, req->buf,
+        req->count, usb_read_cb, req, 0);
+
+    ureq->done = 0;
+    ureq->pending = 0;
+
+    if (libusb_submit_transfer(ureq->cmd) < 0)
+        return 1;
+    ureq->pending++;
+
+    if (libusb_submit_transfer(ureq->data) < 0) {
+        // the command is on its way, wait for it before reporting the error
+        while (!ureq->done)
+            if (libusb_handle_events_completed(NULL, &ureq->done) < 0)
+                break;
+        return 1;
+    }
+    ureq->pending++;
+
+    return 0;
+}
+
+static void
+usb_read_wait(void *ctx, struct readq_req *req) {
+    struct usb_readreq *ureq = req->priv;
+    int r;
+
+    while (!ureq->done) {
+        r = libusb_handle_events_completed(NULL, &ureq->done);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "libusb_handle_events error: %s\n",
+                libusb_error_name(r));
+            exit(1);
+        }
+    }
+}
+
+static void
+usb_read_release(void *ctx, struct readq_req *req) {
+    struct usb_readreq *ureq = req->priv;
+
+    libusb_free_transfer(ureq->cmd);
+    libusb_free_transfer(ureq->data);
+    free(ureq);
+    req->priv = NULL;
+}
+
+static const struct readq_backend usb_readq_backend = {
+    .submit = usb_read_submit,
+    .wait = usb_read_wait,
+    .release = usb_read_release
+};
+
+const struct ems_backend ems_usb_backend = {
+    .name = "usb",
+    .descr = "EMS cartridge on USB (default)",
+    .open = usb_open,
+    .close = usb_close,
+    .read = usb_read,
+    .writev = usb_writev,
+    .devid = usb_devid,
+    .readq = &usb_readq_backend
+};
@@ -1,180 +1,182 @@
-#define _XOPEN_SOURCE 500
+/*
+ * Transport layer: dispatch the cartridge I/O operations to the backend
+ * selected by ems_init().
+ *
+ * A backend is specified as NAME or NAME:ARG, by the caller or by the
+ * EMS_BACKEND environment variable. The default is the USB cartridge.
+ *
+ *   usb          EMS cartridge on USB (ems-usb.c)
+ *   file[:PATH]  image file of a full cartridge (ems-file.c)
+ *   mem[:PATH]   image in memory, optionally loaded from a file (ems-mem.c)
+ *   sim[:OPTS]   simulated cartridge with its timings (ems-sim.c)
+ *   daemon[:PATH] cartridge opened by ems-flasherd (ems-daemon.c)
+ */
+
 #include <assert.h>
 #include <err.h>
-#include <errno.h>
-#include <signal.h>
-#include <stdio.h> // FIXME this will (probably) go away with error coes
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netinet/in.h>
-#include <arpa/inet.h> /* for htonl */
-
-#include <libusb.h>
 
+#include "cache.h"
 #include "ems.h"
-#include "config.h"
-
-/* magic numbers! */
-#define EMS_VID 0x4670
-#define EMS_PID 0x9394
-
-#define EMS_EP_SEND (2 | LIBUSB_ENDPOINT_OUT)
-#define EMS_EP_RECV (1 | LIBUSB_ENDPOINT_IN)
-
-enum {
-    CMD_READ    = 0xff,
-    CMD_WRITE   = 0x57,
-    CMD_READ_SRAM   = 0x6d,
-    CMD_WRITE_SRAM  = 0x4d,
+#include "hash.h"
+#include "header.h"
+#include "readq.h"
+#include "record.h"
+#include "stats.h"
+#include "wear.h"
+
+#define DEFAULTBACKEND "usb"
+
+static const struct ems_backend *backends[] = {
+    &ems_usb_backend,
+    &ems_file_backend,
+    &ems_mem_backend,
+    &ems_sim_backend,
+    &ems_daemon_backend,
+    NULL
 };
 
-static struct libusb_device_handle *devh = NULL;
-static int claimed = 0;
+static const struct ems_backend *backend;
+static void *backend_ctx;
 
 /**
- * Attempt to find the EMS cart by vid/pid.
- *
- * Returns:
- *  0       success
- *  < 0     failure
+ * Print the names and descriptions of the backends
  */
-static int find_ems_device(void) {
-    ssize_t num_devices = 0;
-    libusb_device **device_list = NULL;
-    struct libusb_device_descriptor device_descriptor;
-    int i = 0;
-    int retval = 0;
-
-#define INSTALLUDEVMSG "Try running as root/sudo or update udev rules " \
-                       "(check Building and Installating instructions " \
-                       "in the README.md file for more info).\n"
-
-    num_devices = libusb_get_device_list(NULL, &device_list);
-    if (num_devices >= 0) {
-        for (; i < num_devices; ++i) {
-            (void) memset(&device_descriptor, 0, sizeof(device_descriptor));
-            retval = libusb_get_device_descriptor(device_list[i], &device_descriptor);
-            if (retval == 0) {
-                if (device_descriptor.idVendor == EMS_VID
-                    && device_descriptor.idProduct == EMS_PID) {
-                    retval = libusb_open(device_list[i], &devh);
-                    if (retval != 0) {
-                        /*
-                         * According to the documentation, devh will not
-                         * be populated on error, so it should remain
-                         * NULL.
-                         */
-                        fprintf(stderr, "Failed to open device (libusb error: %s).\n", libusb_error_name(retval));
-#ifdef __linux__                      
-                        if (retval == LIBUSB_ERROR_ACCESS) {
-                            fprintf(stderr, INSTALLUDEVMSG);
-                        }
-#endif
-                    }
-                    break;
-                }
-            } else {
-                fprintf(stderr, "Failed to get device description (libusb error: %s).\n", libusb_error_name(retval));
-            }
-        }
-        if (i == num_devices) {
-            fprintf(stderr, "Could not find device, is it plugged in?\n"
-                            "Or it's may be a permission issue. "
-                            INSTALLUDEVMSG);
-        }
-        libusb_free_device_list(device_list, 1);
-        device_list = NULL;
-    } else {
-      fprintf(stderr, "Failed to get device list: %s\n", libusb_error_name((int)num_devices));
-    }
+void
+ems_listbackends(void) {
+    for (int i = 0; backends[i] != NULL; i++)
+        printf("  %-10s %s\n", backends[i]->name, backends[i]->descr);
+}
 
-    return devh != NULL ? 0 : -EIO;
+/**
+ * Cleanup / release the device. Registered with atexit.
+ */
+static void
+ems_deinit(void) {
+    readq_setbackend(NULL, NULL);
+    stats_setclock(NULL, NULL);
+    if (backend->close != NULL)
+        backend->close(backend_ctx);
+    backend = NULL;
 }
 
 /**
- * Init the flasher. Inits libusb and claims the device. Aborts if libusb
- * can't be initialized.
- *
- * TODO replace printed error with return code
+ * Open the device with the backend designated by "spec" (NAME[:ARG]). If spec
+ * is NULL, the EMS_BACKEND environment variable or, if not set, the default
+ * backend is used.
  *
  * Returns:
  *  0       Success
  *  < 0     Failure
  */
-int ems_init(void) {
-    int r;
-    void ems_deinit(void);
-
-    // call the cleanup when we're done
-    atexit(ems_deinit);
+int
+ems_init(const char *spec) {
+    const char *arg;
+    size_t namelen;
+    int i;
 
-    // mask asyn signals for the thread created by libusb_init()
-    // to make sure that handlers are invoked in the main thread.
-    // Include only signals whose handler is redirected in catchint()
-#ifdef USE_PTHREAD
-    sigset_t newmask, oldmask;
-    sigemptyset(&newmask);
-    sigaddset(&newmask, SIGHUP);
-    sigaddset(&newmask, SIGINT);
-    sigaddset(&newmask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &newmask, &oldmask);
-#endif
-
-    r = libusb_init(NULL);
-    if (r < 0) {
-        fprintf(stderr, "failed to initialize libusb\n");
-        exit(1); // pretty much hosed
-    }
+    assert(backend == NULL);
 
-#ifdef USE_PTHREAD
-    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-#endif
+    if (spec == NULL && ((spec = getenv("EMS_BACKEND")) == NULL ||
+        *spec == '\0'))
+            spec = DEFAULTBACKEND;
 
-    r = find_ems_device();
-    if (r < 0) {
-        return r;
+    if ((arg = strchr(spec, ':')) != NULL) {
+        namelen = arg - spec;
+        arg++;
+    } else {
+        namelen = strlen(spec);
     }
 
-    r = libusb_claim_interface(devh, 0);
-    if (r < 0) {
-        fprintf(stderr, "usb_claim_interface error %d\n", r);
-        return r;
+    for (i = 0; backends[i] != NULL; i++)
+        if (strlen(backends[i]->name) == namelen &&
+            strncmp(backends[i]->name, spec, namelen) == 0)
+                break;
+    if (backends[i] == NULL) {
+        fprintf(stderr, "unknown backend %.*s, available backends:\n",
+            (int)namelen, spec);
+        ems_listbackends();
+        return -1;
     }
 
-    claimed = 1;
+    if ((backend_ctx = backends[i]->open(arg)) == NULL)
+        return -1;
+    backend = backends[i];
+
+    // call the cleanup when we're done
+    atexit(ems_deinit);
+
+    readq_setbackend(backend->readq, backend_ctx);
+    if (backend->clock != NULL)
+        stats_setclock(backend->clock, backend_ctx);
+
     return 0;
 }
 
 /**
- * Cleanup / release the device. Registered with atexit.
+ * Get a string identifying the device. It is used as a key for per-device
+ * settings.
+ *
+ * Returns:
+ *  0       Success
+ *  < 0     Failure
+ */
+int
+ems_devid(char *buf, size_t size) {
+    if (backend == NULL || backend->devid == NULL)
+        return -1;
+    return backend->devid(backend_ctx, buf, size);
+}
+
+/**
+ * Get a string identifying the cartridge. It is used as a key for the data
+ * kept about a cartridge. The cartridge has no serial number: it is the name
+ * given by the EMS_CART environment variable, for the users plugging several
+ * carts to the same port, or the device (see ems_devid()).
+ *
+ * Returns:
+ *  0       Success
+ *  < 0     Failure
  */
-void ems_deinit(void) {
-    if (claimed)
-        libusb_release_interface(devh, 0);
+int
+ems_cartid(char *buf, size_t size) {
+    char *name;
+    int len;
 
-    libusb_close(devh);
-    libusb_exit(NULL);
+    if ((name = getenv("EMS_CART")) == NULL || *name == '\0')
+        return ems_devid(buf, size);
+
+    len = snprintf(buf, size, "cart:%s", name);
+    return len >= 0 && len < size ? 0 : -1;
 }
 
 /**
- * Initialize a command buffer. Commands are a 1 byte command code followed by
- * a 4 byte address and a 4 byte value.
+ * Get a fingerprint of the cartridge in "print": the hash of the headers at the
+ * start of the two pages, usually those of the menus. It tells apart the carts
+ * whose pages start differently when they share an identifier (see
+ * ems_cartid()) and stays while ROMs are written after the first ones.
  *
- * buf must point to a memory chunk of size >= 9 bytes
+ * Returns:
+ *  0       Success
+ *  < 0     Failure
  */
-static void ems_command_init(
-        unsigned char *buf, // buffer to init
-        unsigned char cmd,  // command to run
-        uint32_t addr,      // address
-        uint32_t val        // value
-) {
-    buf[0] = cmd;
-    *(uint32_t *)(buf + 1) = htonl(addr);
-    *(uint32_t *)(buf + 5) = htonl(val);
+int
+ems_fingerprint(uint64_t *print) {
+    unsigned char buf[2*HEADER_SIZE];
+
+    if (ems_read(FROM_ROM, 0, buf, HEADER_SIZE) != HEADER_SIZE ||
+        ems_read(FROM_ROM, PAGESIZE, buf + HEADER_SIZE, HEADER_SIZE) !=
+        HEADER_SIZE)
+            return -1;
+    *print = hash64(buf, sizeof(buf));
+    return 0;
 }
 
 /**
- * Read some bytes from the cart.
+ * Read some bytes from the cart. The flash memory is read through the cache
+ * (see cache.c).
  *
  * Params:
  *  from    FROM_ROM or FROM_SRAM
@@ -186,34 +188,41 @@ static void ems_command_init(
  *  >= 0    number of bytes read (error if != count)
  *  < 0     error sending command or reading data
  */
-int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
-    int r, transferred;
-    unsigned char cmd;
-    unsigned char cmd_buf[9];
+int
+ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
+    unsigned long stamp;
+    int r;
 
     assert(from == FROM_ROM || from == FROM_SRAM);
 
-    cmd = from == FROM_ROM ? CMD_READ : CMD_READ_SRAM;
-    ems_command_init(cmd_buf, cmd, offset, count);
+    if (from == FROM_ROM && cache_read(offset, buf, count))
+        return count;
+    stamp = cache_stamp();
 
-#ifdef DEBUG
-    int i;
-    for (i = 0; i < 9; ++i)
-        printf("%02x ", cmd_buf[i]);
-    printf("\n");
-#endif
-
-    // send the read command
-    r = libusb_bulk_transfer(devh, EMS_EP_SEND, cmd_buf, sizeof(cmd_buf), &transferred, 0);
-    if (r < 0)
-        return r;
-
-    // read the data
-    r = libusb_bulk_transfer(devh, EMS_EP_RECV, buf, count, &transferred, 0);
-    if (r < 0)
-        return r;
-
-    return transferred;
+    STATS_TIMER(t);
+    r = backend->read(backend_ctx, from, offset, buf, count);
+    STATS_STOP(t, from == FROM_ROM ? STATS_READ : STATS_READ_SRAM, 1,
+        r > 0 ? r : 0);
+    rec_read(from, offset, count, buf, r, 0);
+
+    if (from == FROM_ROM && r == count)
+        cache_fill(offset, buf, count, stamp);
+
+    return r;
+}
+
+/**
+ * Operation accounted for a write transfer: an erase if one of the commands
+ * starts an erase-block.
+ */
+static inline int
+stats_writeop(int to, struct ems_iovec *iov, int iovcnt) {
+    if (to == TO_SRAM)
+        return STATS_WRITE_SRAM;
+    for (int i = 0; i < iovcnt; i++)
+        if (iov[i].offset % ERASEBLOCKSIZE == 0)
+            return STATS_ERASE;
+    return STATS_WRITE;
 }
 
 /**
@@ -229,28 +238,43 @@ int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
  *  >= 0    number of bytes written (error if != count)
  *  < 0     error writing data
  */
-int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
-    int r, transferred;
-    unsigned char cmd;
-    unsigned char *write_buf;
+int
+ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
+    struct ems_iovec iov = {offset, buf, count};
+
+    return ems_writev(to, &iov, 1);
+}
+
+/**
+ * Send several write commands in one transfer. Each vector is a write command
+ * with its data. The cart blocks a read following an odd number of write
+ * commands in total (see the Tech file), whatever the number of commands of
+ * each transfer: the caller keeps the count even before reading.
+ *
+ * Params:
+ *  to      TO_ROM or TO_SRAM
+ *  iov     write commands, in the order they must be executed
+ *  iovcnt  number of commands
+ *
+ * Returns:
+ *  >= 0    number of data bytes written (error if != the sum of the counts)
+ *  < 0     error writing data
+ */
+int
+ems_writev(int to, struct ems_iovec *iov, int iovcnt) {
+    int r;
 
     assert(to == TO_ROM || to == TO_SRAM);
-    cmd = to == TO_ROM ? CMD_WRITE : CMD_WRITE_SRAM;
-
-    // thx libusb for having no scatter/gather io
-    write_buf = malloc(count + 9);
-    if (write_buf == NULL)
-        err(1, "malloc");
-    
-    // set up the command buffer
-    ems_command_init(write_buf, cmd, offset, count);
-    memcpy(write_buf + 9, buf, count);
-
-    r = libusb_bulk_transfer(devh, EMS_EP_SEND, write_buf, count + 9, &transferred, 0);
-    if (r == 0)
-        r = transferred>=9?transferred-9:0; // number of bytes sent on success
-
-    free(write_buf);
+
+    if (to == TO_ROM)
+        for (int i = 0; i < iovcnt; i++)
+            cache_invalidate(iov[i].offset, iov[i].count);
+
+    STATS_TIMER(t);
+    r = backend->writev(backend_ctx, to, iov, iovcnt);
+    STATS_STOP(t, stats_writeop(to, iov, iovcnt), iovcnt, r > 0 ? r : 0);
+    rec_writev(to, iov, iovcnt, r);
+    wear_writev(to, iov, iovcnt, r);
 
     return r;
 }
@@ -10,10 +10,56 @@ typedef uint_least32_t ems_size_t;
 #define PRIuEMSSIZE PRIuLEAST32
 #define SCNuEMSSIZE PRIuLEAST32
 
-int ems_init(void);
+/*
+ * struct ems_iovec: one write command of a batch sent by ems_writev()
+ */
+struct ems_iovec {
+    uint32_t offset;
+    unsigned char *buf;
+    size_t count;
+};
+
+/*
+ * struct ems_backend: a transport to the cartridge, selected at runtime by
+ * ems_init(). Every operation receives the context returned by open.
+ *   name, descr: name used to select the backend and a short description
+ *   open: open the device. "arg" is the part of the specification following
+ *         the name and a colon, or NULL. Returns NULL on failure (a message
+ *         has been printed).
+ *   close: release the device (optional)
+ *   read, writev: as ems_read() and ems_writev()
+ *   devid: as ems_devid()
+ *   readq: asynchronous reads (see readq.h), NULL if not supported
+ *   clock: time of the device in nanoseconds, for a simulated device with its
+ *          own clock (optional)
+ */
+struct readq_backend;
+
+struct ems_backend {
+    const char *name;
+    const char *descr;
+    void *(*open)(const char *arg);
+    void (*close)(void *ctx);
+    int (*read)(void *ctx, int from, uint32_t offset, unsigned char *buf,
+        size_t count);
+    int (*writev)(void *ctx, int to, struct ems_iovec *iov, int iovcnt);
+    int (*devid)(void *ctx, char *buf, size_t size);
+    const struct readq_backend *readq;
+    uint64_t (*clock)(void *ctx);
+};
+
+extern const struct ems_backend ems_usb_backend, ems_file_backend,
+    ems_mem_backend, ems_sim_backend, ems_daemon_backend;
+
+void ems_listbackends(void);
+int ems_init(const char *spec);
+int ems_devid(char *buf, size_t size);
+int ems_cartid(char *buf, size_t size);
+int ems_fingerprint(uint64_t *print);
 
 int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count);
 int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count);
+int ems_writev(int to, struct ems_iovec *iov, int iovcnt);
 
 #define FROM_ROM    1
 #define FROM_SRAM   2
@@ -11,11 +11,76 @@
  * The move operation delete the ROM from its source location only when it has
  * been copied completely.
  *
+ * diffwritef compares the file with the memory by erase-blocks (4 KB blocks
+ * for the SRAM) and rewrites only the blocks that differ. The header pieces of
+ * all the 32 KB slots of the rewritten erase-blocks are written last.
+ * writeblocks writes the erase-blocks of a page image in memory the same way,
+ * only those holding data (see sparse.c).
+ *
  * Global Variables
  *
  * flash_lastofs: higher address written on flash. This can be used to determine
  *   the last formated erase-block.
  *
+ * Reads
+ *
+ *   readf_from() and read() keep several read commands in flight with a read
+ *   queue (see readq.c).
+ *   move() streams the source through a read queue too: the reads of the
+ *   next blocks are queued before the current block is written, so the
+ *   device has a read to serve as soon as the writes (and an erasure) are
+ *   done and the host never waits for a read it could have issued earlier.
+ *   The data read ahead is bounded by the depth of the queue (--queue-depth).
+ *   The source is only read earlier than the writes need it.
+ *
+ * Writes
+ *
+ *   The write commands of a 4 KB block (READBLOCKSIZE) are sent in one USB
+ *   transfer with ems_writev(). A read can only follow an even number of
+ *   write commands (see the Tech file): what counts is the total sent, not
+ *   the number of commands of each batch. write_batch() makes a batch even
+ *   when it can and the header piece written last is two chunks, so that the
+ *   batch skipping it is even too.
+ *   When a batch fails, flash_lastofs is set to its first chunk: we can't know
+ *   which commands were executed.
+ *
+ *   Chunks of WRITEBLOCKSIZE bytes that are blank (all 0xFF) are not sent to
+ *   the flash memory: programming can only clear bits, so writing them
+ *   wouldn't change anything. The chunk at the start of an erase-block is
+ *   always sent since it triggers the erasure. A blank chunk is sent anyway
+ *   when it is needed to keep the number of commands even.
+ *
+ * Files
+ *
+ *   writef and diffwritef write the commands directly from the file mapped in
+ *   memory and readf_from reads to the output file, allocated and mapped
+ *   beforehand, without intermediate buffers (see fmap_open()). A file that
+ *   can't be mapped (pipe, terminal) is read in or written from memory.
+ *   readf_ranges and writef_ranges transfer several ranges of the memory
+ *   (both pages and the SRAM for --all) from or to one file the same way.
+ *
+ *   When enabled by flash_setpacked(), readf_from writes a compressed image
+ *   (see pack.c): the erase-blocks read are compressed by a worker thread
+ *   while the next ones are read. writef and diffwritef accept such an image,
+ *   checked entirely before anything is written, and wait for the blocks they
+ *   write next to be decompressed.
+ *
+ * Transfer sizes
+ *
+ *   Reads are made by chunks of flash_readsize bytes and write commands carry
+ *   flash_writesize bytes. They default to the sizes used by the software
+ *   from EMS (READBLOCKSIZE and WRITEBLOCKSIZE) and can be changed with
+ *   flash_settransfersizes() (see --autotune). The piece of header written last
+ *   is always written by chunks of WRITEBLOCKSIZE bytes.
+ *
+ * Verification
+ *
+ *   When enabled by flash_setverify(), writef, diffwritef, move and write read
+ *   back the data they write, by erase-block, and verify.c compares it with
+ *   the data written while the next erase-block is written. The data is read
+ *   back before the header piece written last, which is verified on its own.
+ *   The mismatches are reported by verify_report().
+ *
  * Progression status
  *
  *   progress_cb is called for every 4 KB of transfered bytes as required by
@@ -24,6 +89,9 @@
  *         writef, read, write: "size" bytes
  *         move: 2*"size" bytes
  *         erase: 0 bytes
+ *         diffwritef: "size" bytes read and "size" bytes written. The
+ *           blocks that are not rewritten are reported with the
+ *           PROGRESS_SKIP flag.
  *
  * Signals handling
  *
@@ -35,22 +103,42 @@
  *   recovering a partialy written ROM.
  */
 
+/* for posix_madvise() and posix_fallocate() */
+#define _XOPEN_SOURCE 600
+
 #include "ems.h"
 #include "flash.h"
+#include "pack.h"
 #include "progress.h"
+#include "readq.h"
+#include "stats.h"
+#include "verify.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 #include <errno.h>
 #include <err.h>
 
 #define NBSLOTS 3
 static unsigned char slot[NBSLOTS][ERASEBLOCKSIZE/2];
 
+static ems_size_t flash_readsize = READBLOCKSIZE;
+static ems_size_t flash_writesize = WRITEBLOCKSIZE;
+
 static void (*flash_progress_cb)(int, ems_size_t);
 static int (*flash_checkint_cb)(void);
 
+static int flash_verify;
+static struct verify_job *vjob;
+
+static int flash_packed;
+
 #define CHECKINT (flash_checkint_cb?flash_checkint_cb():0)
 #define PROGRESS(type, size)                                                   \
     do {                                                                       \
@@ -64,6 +152,257 @@ static int (*flash_checkint_cb)(void);
 #define xwarnx(...)\
     snprintf(flash_lasterrorstr, sizeof(flash_lasterrorstr), __VA_ARGS__)
 
+/**
+ * Returns non-zero if the "size" bytes of buf are 0xFF.
+ */
+static int
+is_blank(const unsigned char *buf, ems_size_t size) {
+    /* each byte equals the next one: memcmp() is faster than a loop */
+    return buf[0] == 0xff && memcmp(buf, buf + 1, size - 1) == 0;
+}
+
+/*
+ * Write commands of a batch being built by write_batch(), with the last blank
+ * chunk left out.
+ */
+struct batch {
+    struct ems_iovec iov[READBLOCKSIZE/WRITEBLOCKSIZE + 1];
+    int n;
+    ems_size_t blankofs;
+    unsigned char *blankbuf;
+};
+
+/**
+ * Add the command writing "len" bytes of buf to ofs, as commands covering the
+ * runs of chunks that are not blank (see the top of this file). Blank chunks
+ * are only left out of writes to the flash memory.
+ */
+static void
+batch_add(struct batch *b, int to, ems_size_t ofs, unsigned char *buf,
+    ems_size_t len) {
+    ems_size_t subofs, start;
+
+    if (to != TO_ROM) {
+        b->iov[b->n++] = (struct ems_iovec){ofs, buf, len};
+        return;
+    }
+
+    for (start = subofs = 0; subofs < len; subofs += WRITEBLOCKSIZE) {
+        if ((ofs + subofs)%ERASEBLOCKSIZE == 0 ||
+            !is_blank(buf + subofs, WRITEBLOCKSIZE))
+                continue;
+        if (subofs > start)
+            b->iov[b->n++] = (struct ems_iovec){ofs + start, buf + start,
+                subofs - start};
+        b->blankofs = ofs + subofs;
+        b->blankbuf = buf + subofs;
+        start = subofs + WRITEBLOCKSIZE;
+    }
+    if (len > start)
+        b->iov[b->n++] = (struct ems_iovec){ofs + start, buf + start,
+            len - start};
+}
+
+/**
+ * Write buf to offset in a single transfer with write commands of
+ * flash_writesize bytes, skipping the bytes in [skipofs, skipofs+skipsize).
+ * A command overlapping this range is replaced by commands of WRITEBLOCKSIZE
+ * bytes. size must be a multiple of WRITEBLOCKSIZE and not exceed
+ * READBLOCKSIZE.
+ *
+ * Returns non-zero in case of error.
+ */
+static int
+write_batch(int to, ems_size_t offset, unsigned char *buf, ems_size_t size,
+    ems_size_t skipofs, ems_size_t skipsize) {
+    struct batch b;
+    struct ems_iovec *iov = b.iov;
+    ems_size_t blockofs, len, subofs, total, lastofs;
+    int i, n;
+
+    b.n = 0;
+    b.blankbuf = NULL;
+    for (blockofs = 0; blockofs < size; blockofs += len) {
+        ems_size_t ofs = offset + blockofs;
+
+        len = size - blockofs < flash_writesize ? size - blockofs :
+            flash_writesize;
+
+        if (ofs < skipofs + skipsize && skipofs < ofs + len) {
+            for (subofs = 0; subofs < len; subofs += WRITEBLOCKSIZE) {
+                if (ofs + subofs >= skipofs &&
+                    ofs + subofs < skipofs + skipsize)
+                        continue;
+                batch_add(&b, to, ofs + subofs, buf + blockofs + subofs,
+                    WRITEBLOCKSIZE);
+            }
+        } else {
+            batch_add(&b, to, ofs, buf + blockofs, len);
+        }
+    }
+    n = b.n;
+
+    /* the blank chunks are already in the state a write would leave them */
+    lastofs = b.blankbuf != NULL ? b.blankofs : 0;
+    if (n > 0 && iov[n-1].offset + iov[n-1].count - WRITEBLOCKSIZE > lastofs)
+        lastofs = iov[n-1].offset + iov[n-1].count - WRITEBLOCKSIZE;
+
+    if (n == 0) {
+        if (b.blankbuf != NULL)
+            flash_lastofs = lastofs;
+        return 0;
+    }
+
+    /*
+     * Keep the number of commands even by splitting a command in two or, if
+     * they are all of WRITEBLOCKSIZE bytes, by sending a blank chunk.
+     */
+    if (n%2 != 0) {
+        for (i = n-1; i >= 0; i--)
+            if (iov[i].count >= 2*WRITEBLOCKSIZE)
+                break;
+        if (i >= 0) {
+            memmove(&iov[i+1], &iov[i], (n-i)*sizeof(*iov));
+            iov[i].count /= 2;
+            iov[i+1].offset += iov[i].count;
+            iov[i+1].buf += iov[i].count;
+            iov[i+1].count -= iov[i].count;
+            n++;
+        } else if (b.blankbuf != NULL) {
+            for (i = n; i > 0 && iov[i-1].offset > b.blankofs; i--)
+                iov[i] = iov[i-1];
+            iov[i] = (struct ems_iovec){b.blankofs, b.blankbuf,
+                WRITEBLOCKSIZE};
+            n++;
+        }
+    }
+
+    for (i = 0, total = 0; i < n; i++)
+        total += iov[i].count;
+
+    if (ems_writev(to, iov, n) != total) {
+        flash_lastofs = iov[0].offset;
+        return 1;
+    }
+    flash_lastofs = lastofs;
+
+    return 0;
+}
+
+/**
+ * Write the piece of the header kept aside by the write functions (see the top
+ * of this file). flash_lastofs is not updated: this is not the higher address
+ * written.
+ *
+ * Returns non-zero in case of error.
+ */
+static int
+write_header(int to, ems_size_t offset, unsigned char *buf, ems_size_t size) {
+    struct ems_iovec iov[2];
+    ems_size_t blockofs;
+    int n;
+
+    n = 0;
+    for (blockofs = 0; blockofs < size; blockofs += WRITEBLOCKSIZE)
+        iov[n++] = (struct ems_iovec){offset + 0x100 + blockofs,
+            buf + blockofs, WRITEBLOCKSIZE};
+
+    return ems_writev(to, iov, n) != size;
+}
+
+/**
+ * Read back the data of the current verify job and queue it.
+ *
+ * Returns non-zero on read error.
+ */
+static int
+verify_flush(void) {
+    ems_size_t readsize, ofs, len;
+    unsigned char *buf;
+    struct readq *rq;
+    int r = 0;
+
+    if (vjob == NULL)
+        return 0;
+
+    readsize = vjob->size < flash_readsize ? vjob->size : flash_readsize;
+    rq = readq_new(vjob->to, 0);
+    readq_stream(rq, vjob->offset, vjob->size, readsize, vjob->actual);
+    for (ofs = 0; ofs < vjob->size; ofs += len) {
+        len = vjob->size - ofs < readsize ? vjob->size - ofs : readsize;
+        if (readq_next(rq, &buf, NULL) != len) {
+            xwarnx("read error verifying flash memory");
+            r = FLASH_EUSB;
+            break;
+        }
+    }
+    readq_free(rq);
+
+    if (r == 0)
+        verify_put(vjob);
+    else
+        verify_cancel(vjob);
+    vjob = NULL;
+
+    return r;
+}
+
+/**
+ * Add "len" bytes written from buf to offset to the verify job, the bytes in
+ * [skipofs, skipofs+skipsize) being expected blank. The job is read back when
+ * its erase-block is complete or when the data is not contiguous.
+ *
+ * Returns non-zero on read error.
+ */
+static int
+verify_write(int to, ems_size_t offset, unsigned char *buf, ems_size_t len,
+    ems_size_t skipofs, ems_size_t skipsize) {
+    ems_size_t n;
+
+    if (!flash_verify)
+        return 0;
+
+    while (len > 0) {
+        if (vjob != NULL && (vjob->to != to ||
+            vjob->offset + vjob->size != offset) && verify_flush())
+                return FLASH_EUSB;
+        if (vjob == NULL)
+            vjob = verify_get(to, offset);
+
+        n = ERASEBLOCKSIZE - offset%ERASEBLOCKSIZE;
+        if (n > len)
+            n = len;
+        memcpy(vjob->expect + vjob->size, buf, n);
+        for (ems_size_t i = 0; i < n; i++)
+            if (offset + i >= skipofs && offset + i < skipofs + skipsize)
+                vjob->expect[vjob->size + i] = 0xff;
+        vjob->size += n;
+
+        offset += n;
+        buf += n;
+        len -= n;
+        if (offset%ERASEBLOCKSIZE == 0 && verify_flush())
+            return FLASH_EUSB;
+    }
+
+    return 0;
+}
+
+/**
+ * Complete the verification of a write function: read back the last data
+ * written if r is 0, forget it otherwise.
+ */
+static int
+verify_done(int r) {
+    if (r == 0)
+        return verify_flush();
+
+    if (vjob != NULL)
+        verify_cancel(vjob);
+    vjob = NULL;
+    return r;
+}
+
 void
 flash_init(void (*progress_cb)(int, ems_size_t), int (*checkint_cb)(void)) {
     flash_lastofs = -1;
@@ -76,260 +415,886 @@ flash_setprogresscb(void (*progress_cb)(int, ems_size_t)) {
     flash_progress_cb = progress_cb;
 }
 
+/**
+ * Enable or disable the verification of the data written (see the top of
+ * this file).
+ */
+void
+flash_setverify(int verify) {
+    flash_verify = verify;
+}
+
+/**
+ * Write the files read from the cart as compressed images and accept them
+ * when writing to it (see pack.c).
+ */
+void
+flash_setpacked(int packed) {
+    flash_packed = packed;
+}
+
+/**
+ * Set the size of the reads and of the write commands. Both must be powers of
+ * two, readsize between READBLOCKSIZE and FLASH_MAXREADSIZE and writesize
+ * between WRITEBLOCKSIZE and FLASH_MAXWRITESIZE.
+ *
+ * Returns non-zero if a size is invalid.
+ */
 int
-flash_writef_to(int to, ems_size_t offset, ems_size_t size, char *path) {
-    unsigned char blockbuf[WRITEBLOCKSIZE*2], blockbuf100[WRITEBLOCKSIZE*2];
-    ems_size_t blockofs, progress;
-    FILE *f;
-    int i, r;
+flash_settransfersizes(ems_size_t readsize, ems_size_t writesize) {
+    if (readsize < READBLOCKSIZE || readsize > FLASH_MAXREADSIZE ||
+        (readsize & (readsize - 1)) != 0)
+            return 1;
+    if (writesize < WRITEBLOCKSIZE || writesize > FLASH_MAXWRITESIZE ||
+        (writesize & (writesize - 1)) != 0)
+            return 1;
 
-    if ((f = fopen(path, "rb")) == NULL) {
+    flash_readsize = readsize;
+    flash_writesize = writesize;
+
+    return 0;
+}
+
+/**
+ * Report progression of a read of "size" bytes by units of READBLOCKSIZE
+ */
+static void
+progress_read(ems_size_t size) {
+    for (; size >= READBLOCKSIZE; size -= READBLOCKSIZE)
+        PROGRESS(PROGRESS_READ, READBLOCKSIZE);
+}
+
+/*
+ * struct fmap: a file mapped in memory by fmap_open()
+ *   buf, size: the content, size is the size of the mapping
+ *   mapped: zero if buf is an allocated copy of the file (it can't be mapped)
+ *   pack: the file is a compressed image, buf belongs to it (see fmap_wait())
+ */
+struct fmap {
+    int fd, write, mapped;
+    unsigned char *buf;
+    ems_size_t size;
+    struct pack *pack;
+};
+
+/**
+ * Map the first "size" bytes of the file "path" for reading or, if write is
+ * non-zero, create the file with "size" bytes and map it for writing. A file
+ * to read may be shorter: m->size is the size of its content.
+ *
+ * If flash_setpacked() was called, the file written is a compressed image and
+ * the file read may be one.
+ *
+ * Returns non-zero in case of error.
+ */
+static int
+fmap_open(struct fmap *m, char *path, ems_size_t size, int write) {
+    struct stat st;
+    ssize_t n;
+
+    STATS_TIMER(t);
+
+    m->write = write;
+    m->mapped = 0;
+    m->buf = NULL;
+    m->pack = NULL;
+    m->fd = write ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0666) :
+        open(path, O_RDONLY);
+    if (m->fd == -1) {
         xwarn("can't open %s", path);
         return FLASH_EFILE;
     }
+    if (fstat(m->fd, &st) == -1) {
+        xwarn("can't stat %s", path);
+        goto error;
+    }
 
-    progress = 0;
-    for (blockofs = 0; blockofs < size; blockofs += WRITEBLOCKSIZE*2) {    
-        if (fread(blockbuf, 1, WRITEBLOCKSIZE*2, f) < WRITEBLOCKSIZE*2) {
-            if (ferror(f)) {
-                xwarn("error reading %s", path);
-                fclose(f);
-                return FLASH_EFILE;
-            } else break;
+    m->size = size;
+    if (flash_packed && write) {
+        if ((m->pack = pack_create(m->fd, size, &m->buf)) == NULL) {
+            xwarnx("error writing %s: %s", path, pack_lasterrorstr);
+            goto error;
         }
+        return 0;
+    }
+    if (flash_packed && pack_probe(m->fd, NULL)) {
+        ems_size_t packsize;
 
-        if (to == TO_ROM && blockofs == 0x100) {
-            memcpy(blockbuf100, blockbuf, WRITEBLOCKSIZE*2);
-            continue;
+        if ((m->pack = pack_open(m->fd, &packsize, &m->buf)) == NULL) {
+            xwarnx("%s: %s", path, pack_lasterrorstr);
+            goto error;
         }
+        if (packsize < size)
+            m->size = packsize;
+        STATS_STOP(t, STATS_FILE_READ, 1, m->size);
+        return 0;
+    }
+    if (!write && S_ISREG(st.st_mode) && st.st_size < size)
+        m->size = st.st_size;
+
+    // an empty file can't be mapped
+    if (m->size == 0)
+        return 0;
+
+    if (S_ISREG(st.st_mode)) {
+        // allocate the blocks so that a full disk is not a SIGBUS
+        if (write && (errno = posix_fallocate(m->fd, 0, size)) != 0 &&
+            ((errno != EINVAL && errno != EOPNOTSUPP) ||
+            ftruncate(m->fd, size) == -1)) {
+                xwarn("can't allocate %s", path);
+                goto error;
+        }
+        m->buf = mmap(NULL, m->size, write ? PROT_READ | PROT_WRITE :
+            PROT_READ, write ? MAP_SHARED : MAP_PRIVATE, m->fd, 0);
+        if (m->buf != MAP_FAILED) {
+            m->mapped = 1;
+            posix_madvise(m->buf, m->size, POSIX_MADV_SEQUENTIAL);
+            if (!write)
+                STATS_STOP(t, STATS_FILE_READ, 1, m->size);
+            return 0;
+        }
+    }
+
+    if ((m->buf = malloc(m->size)) == NULL)
+        err(1, "malloc");
+    if (write)
+        return 0;
+
+    size = 0;
+    while (size < m->size && (n = read(m->fd, m->buf + size,
+        m->size - size)) != 0) {
+            if (n == -1 && errno != EINTR) {
+                xwarn("error reading %s", path);
+                goto error;
+            }
+            if (n > 0)
+                size += n;
+    }
+    m->size = size;
+    STATS_STOP(t, STATS_FILE_READ, 1, size);
+
+    return 0;
+
+error:
+    if (!m->mapped)
+        free(m->buf);
+    close(m->fd);
+    return FLASH_EFILE;
+}
+
+/**
+ * Unmap a file mapped by fmap_open(). The content of a file that couldn't be
+ * mapped for writing is written to it.
+ *
+ * Returns non-zero in case of error.
+ */
+static int
+fmap_close(struct fmap *m, char *path) {
+    ems_size_t ofs;
+    ssize_t n;
+    int r = 0;
+
+    STATS_TIMER(t);
+
+    if (m->pack != NULL) {
+        if (pack_close(m->pack)) {
+            xwarnx("error %s %s: %s", m->write ? "writing" : "reading", path,
+                pack_lasterrorstr);
+            r = FLASH_EFILE;
+        }
+    } else if (m->mapped) {
+        if (munmap(m->buf, m->size) == -1) {
+            xwarn("error writing %s", path);
+            r = FLASH_EFILE;
+        }
+    } else {
+        for (ofs = 0; m->write && ofs < m->size; ofs += n) {
+            if ((n = write(m->fd, m->buf + ofs, m->size - ofs)) == -1) {
+                if (errno != EINTR) {
+                    xwarn("error writing %s", path);
+                    r = FLASH_EFILE;
+                    break;
+                }
+                n = 0;
+            }
+        }
+        free(m->buf);
+    }
+
+    if (close(m->fd) == -1 && r == 0) {
+        xwarn("can't close %s", path);
+        r = FLASH_EFILE;
+    }
+
+    if (m->write)
+        STATS_STOP(t, STATS_FILE_WRITE, 1, m->size);
+
+    return r;
+}
+
+/**
+ * Use the "size" bytes of "buf" as a file, for the functions working on a
+ * mapped file. It is not closed.
+ */
+static void
+fmap_mem(struct fmap *m, unsigned char *buf, ems_size_t size) {
+    m->fd = -1;
+    m->write = m->mapped = 0;
+    m->buf = buf;
+    m->size = size;
+    m->pack = NULL;
+}
+
+/**
+ * Report that the first "size" bytes of a file opened for writing have been
+ * filled (the compressed image is written as the blocks are filled).
+ */
+static void
+fmap_filled(struct fmap *m, ems_size_t size) {
+    if (m->pack != NULL)
+        pack_filled(m->pack, size);
+}
+
+/**
+ * Wait for the first "size" bytes of a file opened for reading to be
+ * available (decompressed).
+ *
+ * Returns non-zero in case of error.
+ */
+static int
+fmap_wait(struct fmap *m, ems_size_t size, char *path) {
+    if (m->pack == NULL)
+        return 0;
+    if (pack_wait(m->pack, size < m->size ? size : m->size)) {
+        xwarnx("%s: %s", path, pack_lasterrorstr);
+        return FLASH_EFILE;
+    }
+    return 0;
+}
+
+static int
+writef_to(int to, ems_size_t offset, ems_size_t size, char *path) {
+    unsigned char blockbuf100[WRITEBLOCKSIZE*2], *buf;
+    ems_size_t blockofs, len, hdrsize;
+    struct fmap m;
+    int r;
+
+    if ((r = fmap_open(&m, path, size, 0)))
+        return r;
+
+    // a short file is written up to its last pair of chunks
+    if (m.size < size)
+        size = m.size - m.size%(WRITEBLOCKSIZE*2);
+
+    // the header block is written last when writing to the flash
+    hdrsize = to == TO_ROM ? WRITEBLOCKSIZE*2 : 0;
+    memset(blockbuf100, 0xff, sizeof(blockbuf100));
+    if ((r = fmap_wait(&m, 0x100 + hdrsize, path)))
+        goto out;
+    if (0x100 + hdrsize <= size)
+        memcpy(blockbuf100, m.buf + 0x100, hdrsize);
+
+    for (blockofs = 0; blockofs < size; blockofs += READBLOCKSIZE) {
+        len = size - blockofs < READBLOCKSIZE ? size - blockofs : READBLOCKSIZE;
+        buf = m.buf + blockofs;
 
         if (CHECKINT) {
             xwarnx("operation interrupted");
-            return FLASH_EINTR;
+            r = FLASH_EINTR;
+            goto out;
         }
 
-        for (i = 0; i < 2; i++) {
-            flash_lastofs = offset + blockofs + i*WRITEBLOCKSIZE;
-            r = ems_write(to, flash_lastofs, blockbuf + i*WRITEBLOCKSIZE,
-                          WRITEBLOCKSIZE);
-            if (r != WRITEBLOCKSIZE) {
+        if ((r = fmap_wait(&m, blockofs + len, path)))
+            goto out;
+        if (write_batch(to, offset + blockofs, buf, len, offset + 0x100,
+            hdrsize)) {
                 xwarnx("write error flashing %s", path);
-                fclose(f);
-                return FLASH_EUSB;
-            }
+                r = FLASH_EUSB;
+                goto out;
         }
+        if ((r = verify_write(to, offset + blockofs, buf, len,
+            offset + 0x100, hdrsize)))
+                goto out;
 
         if (to == TO_ROM && (offset + blockofs)%ERASEBLOCKSIZE == 0)
             PROGRESS(PROGRESS_ERASE, 0);
 
-        if ((progress += WRITEBLOCKSIZE*2)%READBLOCKSIZE == 0)
+        // the block with the header is accounted once the header is written
+        if (len == READBLOCKSIZE && (hdrsize == 0 || blockofs != 0))
             PROGRESS(PROGRESS_WRITEF, READBLOCKSIZE);
     }
 
     if (to == TO_ROM) {
-        for (i = 0; i < 2; i++) {
-            r = ems_write(to,
-                          offset + 0x100 + i*WRITEBLOCKSIZE,
-                          blockbuf100 + i*WRITEBLOCKSIZE,
-                          WRITEBLOCKSIZE);
-            if (r != WRITEBLOCKSIZE) {
-                xwarnx("write error flashing %s", path);
-                fclose(f);
-                return FLASH_EUSB;
+        // the data is read back while the header is still blank
+        if ((r = verify_flush()))
+            goto out;
+        if (write_header(to, offset, blockbuf100, hdrsize)) {
+            xwarnx("write error flashing %s", path);
+            r = FLASH_EUSB;
+            goto out;
+        }
+        if ((r = verify_write(to, offset + 0x100, blockbuf100, hdrsize, 0,
+            0)))
+                goto out;
+        PROGRESS(PROGRESS_WRITEF, READBLOCKSIZE);
+    }
+
+out:
+    if (fmap_close(&m, path) && r == 0)
+        r = FLASH_EFILE;
+    return r;
+}
+
+int
+flash_writef_to(int to, ems_size_t offset, ems_size_t size, char *path) {
+    int r;
+
+    STATS_TIMER(t);
+    r = verify_done(writef_to(to, offset, size, path));
+    STATS_STOP(t, STATS_FLASH_WRITEF, 1, size);
+
+    return r;
+}
+
+int
+flash_writef(ems_size_t offset, ems_size_t size, char *path) {
+    return flash_writef_to(TO_ROM, offset, size, path);
+}
+
+#define SLOTSIZE 32768
+#define HDRPIECE (WRITEBLOCKSIZE*2)
+
+/**
+ * Write the blocks of "m" from "fileofs" to [offset, offset+size[, the header
+ * pieces last. Only the blocks marked in "used", if not NULL, are written and,
+ * if "diff" is non-zero, those that differ from the memory (see the top of this
+ * file).
+ */
+static int
+write_blocks(int to, ems_size_t offset, ems_size_t size, struct fmap *m,
+    ems_size_t fileofs, const char *used, int diff, char *path) {
+    static unsigned char devbuf[ERASEBLOCKSIZE];
+    static unsigned char hdrbuf[2*PAGESIZE/SLOTSIZE][HDRPIECE];
+    ems_size_t hdrofs[2*PAGESIZE/SLOTSIZE];
+    ems_size_t blocksize, blockofs, len, readsize, subofs, hdrsize;
+    unsigned char *buf, *filebuf;
+    struct readq *rq;
+    int i, nhdr, r;
+
+    blocksize = to == TO_ROM ? ERASEBLOCKSIZE : READBLOCKSIZE;
+    hdrsize = to == TO_ROM ? HDRPIECE : 0;
+    rq = readq_new(to, 0);
+    nhdr = 0;
+
+    r = 0;
+    for (blockofs = 0; blockofs < size; blockofs += len) {
+        len = size - blockofs < blocksize ? size - blockofs : blocksize;
+        readsize = len < flash_readsize ? len : flash_readsize;
+
+        if (used != NULL && !used[blockofs/blocksize])
+            continue;
+
+        if (CHECKINT) {
+            xwarnx("operation interrupted");
+            r = FLASH_EINTR;
+            goto out;
+        }
+
+        filebuf = m->buf + fileofs + blockofs;
+
+        // the block is read entirely before writing anything
+        if (diff) {
+            readq_stream(rq, offset + blockofs, len, readsize, devbuf);
+            for (subofs = 0; subofs < len; subofs += readsize) {
+                ems_size_t count = len - subofs < readsize ? len - subofs :
+                    readsize;
+
+                if (readq_next(rq, &buf, NULL) != count) {
+                    xwarnx("read error comparing flash memory");
+                    r = FLASH_EUSB;
+                    goto out;
+                }
             }
+            progress_read(len);
+        }
+
+        if ((r = fmap_wait(m, fileofs + blockofs + len, path)))
+            goto out;
+        if (diff && memcmp(filebuf, devbuf, len) == 0) {
+            for (subofs = 0; subofs < len; subofs += READBLOCKSIZE)
+                PROGRESS(PROGRESS_WRITEF | PROGRESS_SKIP, READBLOCKSIZE);
+            if (to == TO_ROM)
+                PROGRESS(PROGRESS_ERASE | PROGRESS_SKIP, 0);
+            continue;
+        }
+
+        for (subofs = 0; subofs < len; subofs += READBLOCKSIZE) {
+            ems_size_t ofs = offset + blockofs + subofs;
+            ems_size_t slot = ofs - (blockofs + subofs)%SLOTSIZE;
+
+            // keep the header piece of the slot aside
+            if (hdrsize != 0 && (blockofs + subofs)%SLOTSIZE == 0) {
+                memcpy(hdrbuf[nhdr], filebuf + subofs + 0x100, hdrsize);
+                hdrofs[nhdr++] = slot;
+            }
+
+            if (write_batch(to, ofs, filebuf + subofs, READBLOCKSIZE,
+                slot + 0x100, hdrsize)) {
+                    xwarnx("write error flashing %s", path);
+                    r = FLASH_EUSB;
+                    goto out;
+            }
+            if ((r = verify_write(to, ofs, filebuf + subofs, READBLOCKSIZE,
+                slot + 0x100, hdrsize)))
+                    goto out;
+
+            if (to == TO_ROM && ofs%ERASEBLOCKSIZE == 0)
+                PROGRESS(PROGRESS_ERASE, 0);
+            // the block with a header is accounted once the header is written
+            if (hdrsize == 0 || (blockofs + subofs)%SLOTSIZE != 0)
+                PROGRESS(PROGRESS_WRITEF, READBLOCKSIZE);
         }
     }
 
-    PROGRESS(PROGRESS_WRITEF, READBLOCKSIZE);
+    if ((r = verify_flush()))
+        goto out;
+    for (i = 0; i < nhdr; i++) {
+        if (write_header(to, hdrofs[i], hdrbuf[i], hdrsize)) {
+            xwarnx("write error flashing %s", path);
+            r = FLASH_EUSB;
+            goto out;
+        }
+        if ((r = verify_write(to, hdrofs[i] + 0x100, hdrbuf[i], hdrsize, 0,
+            0)))
+                goto out;
+        PROGRESS(PROGRESS_WRITEF, READBLOCKSIZE);
+    }
 
-    if (fclose(f) == EOF) {
-        xwarn("can't close %s", path);
+out:
+    readq_free(rq);
+    return r;
+}
+
+static int
+diffwritef_to(int to, ems_size_t offset, ems_size_t size, char *path) {
+    struct fmap m;
+    int r;
+
+    if ((r = fmap_open(&m, path, size, 0)))
+        return r;
+    if (m.size < size) {
+        xwarnx("%s is too short", path);
+        fmap_close(&m, path);
         return FLASH_EFILE;
     }
-    return 0;
+
+    r = write_blocks(to, offset, size, &m, 0, NULL, 1, path);
+
+    if (fmap_close(&m, path) && r == 0)
+        r = FLASH_EFILE;
+    return r;
 }
 
+/**
+ * Write the file "path" to [offset, offset+size[, rewriting only the blocks
+ * that differ (see the top of this file). Reads the whole range.
+ */
 int
-flash_writef(ems_size_t offset, ems_size_t size, char *path) {
-    return flash_writef_to(TO_ROM, offset, size, path);
+flash_diffwritef_to(int to, ems_size_t offset, ems_size_t size, char *path) {
+    int r;
+
+    STATS_TIMER(t);
+    r = verify_done(diffwritef_to(to, offset, size, path));
+    STATS_STOP(t, STATS_FLASH_DIFFWRITEF, 1, size);
+
+    return r;
 }
 
+/**
+ * Write the erase-blocks of the page image "buf" marked in "used" to the page
+ * at "offset" (see write_blocks()). The others are not touched.
+ */
 int
-flash_readf_from(int from, char *path, ems_size_t size, ems_size_t offset) {
-    unsigned char buf[READBLOCKSIZE];
-    ems_size_t blockofs;
-    FILE *save_file = fopen(path, "w");
+flash_writeblocks(ems_size_t offset, unsigned char *buf, const char *used,
+    int diff) {
+    struct fmap m;
     int r;
 
-    if (save_file == NULL) {
-        xwarnx("can't open %s for writing", path);
+    STATS_TIMER(t);
+    fmap_mem(&m, buf, PAGESIZE);
+    r = verify_done(write_blocks(TO_ROM, offset, PAGESIZE, &m, 0, used, diff,
+        "the image"));
+    STATS_STOP(t, diff ? STATS_FLASH_DIFFWRITEF : STATS_FLASH_WRITEF, 1,
+        PAGESIZE);
+
+    return r;
+}
+
+/**
+ * Write the ranges of "path", one after the other in the file, to the memory
+ * (see write_blocks()), rewriting only the blocks that differ if "diff" is
+ * non-zero.
+ */
+int
+flash_writef_ranges(char *path, const struct flash_range *ranges, int n,
+    int diff) {
+    ems_size_t size, fileofs;
+    struct fmap m;
+    int i, r;
+
+    STATS_TIMER(t);
+
+    for (size = 0, i = 0; i < n; i++)
+        size += ranges[i].size;
+
+    if ((r = fmap_open(&m, path, size, 0)))
+        return r;
+    if (m.size < size) {
+        xwarnx("%s is too short", path);
+        fmap_close(&m, path);
         return FLASH_EFILE;
     }
 
-    for (blockofs = offset; blockofs + READBLOCKSIZE <= offset + size;
-        blockofs += READBLOCKSIZE) {
+    for (fileofs = 0, i = 0; i < n && r == 0; i++) {
+        r = write_blocks(ranges[i].space, ranges[i].offset, ranges[i].size,
+            &m, fileofs, NULL, diff, path);
+        fileofs += ranges[i].size;
+    }
+    r = verify_done(r);
+
+    if (fmap_close(&m, path) && r == 0)
+        r = FLASH_EFILE;
+    STATS_STOP(t, diff ? STATS_FLASH_DIFFWRITEF : STATS_FLASH_WRITEF, 1, size);
+
+    return r;
+}
+
+/**
+ * Read [offset, offset+size[ to the buffer of "m" from "fileofs".
+ */
+static int
+read_to(int from, struct fmap *m, ems_size_t fileofs, ems_size_t size,
+    ems_size_t offset) {
+    unsigned char *buf;
+    ems_size_t remain, len;
+    struct readq *rq;
+    int r;
+
+    rq = readq_new(from, 0);
+    readq_stream(rq, offset, size, flash_readsize, m->buf + fileofs);
+
+    r = 0;
+    for (remain = size; remain > 0; remain -= len) {
+        len = remain < flash_readsize ? remain : flash_readsize;
+
         if (CHECKINT) {
             xwarnx("operation interrupted");
-            return FLASH_EINTR;
+            r = FLASH_EINTR;
+            break;
         }
 
-        r = ems_read(from, blockofs, buf, READBLOCKSIZE);
-        if (r != READBLOCKSIZE) {
+        if (readq_next(rq, &buf, NULL) != len) {
             xwarnx("read error dumping flash memory");
-            return FLASH_EUSB;
-        }
-
-        r = fwrite(buf, READBLOCKSIZE, 1, save_file);
-        if (r != 1) {
-            xwarnx("error writing %s", path);
-            return FLASH_EFILE;
+            r = FLASH_EUSB;
+            break;
         }
+        fmap_filled(m, fileofs + size - remain + len);
 
-        PROGRESS(PROGRESS_READ, READBLOCKSIZE);
+        progress_read(len);
     }
 
-    if (fclose(save_file) == EOF) {
-        xwarn("can't close %s", path);
-        return FLASH_EFILE;
-    }
+    readq_free(rq);
 
-    return 0;
+    return r;
+}
+
+static int
+readf_from(int from, char *path, ems_size_t size, ems_size_t offset) {
+    struct fmap m;
+    int r;
+
+    size -= size%READBLOCKSIZE;
+
+    if ((r = fmap_open(&m, path, size, 1)))
+        return r;
+
+    // the data is read directly to the file
+    r = read_to(from, &m, 0, size, offset);
+
+    if (fmap_close(&m, path) && r == 0)
+        r = FLASH_EFILE;
+    return r;
 }
 
 int
-flash_move(ems_size_t offset, ems_size_t size, ems_size_t origoffset) {
-    unsigned char blockbuf[(READBLOCKSIZE < WRITEBLOCKSIZE)?WRITEBLOCKSIZE:READBLOCKSIZE];
-    unsigned char blockbuf100[WRITEBLOCKSIZE*2];
-    ems_size_t remain, src, dest, blockofs, progress;
-    int r, flipflop;
+flash_readf_from(int from, char *path, ems_size_t size, ems_size_t offset) {
+    int r;
+
+    STATS_TIMER(t);
+    r = readf_from(from, path, size, offset);
+    STATS_STOP(t, STATS_FLASH_READF, 1, size);
+
+    return r;
+}
+
+/**
+ * Read [offset, offset+size[ to "buf", like flash_readf_from().
+ */
+int
+flash_readbuf_from(int from, unsigned char *buf, ems_size_t size,
+    ems_size_t offset) {
+    struct fmap m;
+    int r;
+
+    STATS_TIMER(t);
+    fmap_mem(&m, buf, size);
+    r = read_to(from, &m, 0, size, offset);
+    STATS_STOP(t, STATS_FLASH_READF, 1, size);
+
+    return r;
+}
+
+/**
+ * Read the ranges of the memory to the file "path", one after the other, in
+ * one session (see flash_readf_from()).
+ */
+int
+flash_readf_ranges(char *path, const struct flash_range *ranges, int n) {
+    ems_size_t size, fileofs;
+    struct fmap m;
+    int i, r;
+
+    STATS_TIMER(t);
+
+    for (size = 0, i = 0; i < n; i++)
+        size += ranges[i].size;
+
+    if ((r = fmap_open(&m, path, size, 1)))
+        return r;
+
+    for (fileofs = 0, i = 0; i < n && r == 0; i++) {
+        r = read_to(ranges[i].space, &m, fileofs, ranges[i].size,
+            ranges[i].offset);
+        fileofs += ranges[i].size;
+    }
+
+    if (fmap_close(&m, path) && r == 0)
+        r = FLASH_EFILE;
+    STATS_STOP(t, STATS_FLASH_READF, 1, size);
+
+    return r;
+}
+
+static int
+move(ems_size_t offset, ems_size_t size, ems_size_t origoffset) {
+    unsigned char blockbuf100[WRITEBLOCKSIZE*2], *buf;
+    ems_size_t remain, src, dest, len, blockofs;
+    struct readq *rq;
+    int r;
 
     src = origoffset;
     dest = offset;
-    progress = 0;
-    flipflop = 0;
 
-    for (remain = size; remain > 0; remain -= READBLOCKSIZE) {
+    // the reads run ahead of the writes (see the top of this file)
+    rq = readq_new(FROM_ROM, flash_readsize);
+    readq_stream(rq, src, size, flash_readsize, NULL);
+
+    r = 0;
+    for (remain = size; remain > 0; remain -= len) {
+        len = remain < flash_readsize ? remain : flash_readsize;
+
         if (CHECKINT) {
             xwarnx("operation interrupted");
-            return FLASH_EINTR;
+            r = FLASH_EINTR;
+            goto out;
         }
 
-        r = ems_read(FROM_ROM, src, blockbuf, READBLOCKSIZE);
-        if (r != READBLOCKSIZE) {
+        if (readq_next(rq, &buf, NULL) != len) {
             xwarnx("read error updating flash memory");
-            return FLASH_EUSB;
+            r = FLASH_EUSB;
+            goto out;
         }
 
-        PROGRESS(PROGRESS_READ, READBLOCKSIZE);
+        progress_read(len);
 
-        for (blockofs = 0; blockofs < READBLOCKSIZE; blockofs += WRITEBLOCKSIZE) {
-            if (src == origoffset && blockofs == 0x100)  {
-                memcpy(blockbuf100, blockbuf+0x100, WRITEBLOCKSIZE*2);
-                blockofs += WRITEBLOCKSIZE;
-                continue;
-            }
+        if (src == origoffset)
+            memcpy(blockbuf100, buf+0x100, WRITEBLOCKSIZE*2);
 
-            if ((flipflop = 1-flipflop) && CHECKINT) {
+        for (blockofs = 0; blockofs < len; blockofs += READBLOCKSIZE) {
+            if (CHECKINT) {
                 xwarnx("operation interrupted");
-                return FLASH_EINTR;
+                r = FLASH_EINTR;
+                goto out;
             }
 
-            flash_lastofs = dest+blockofs;
-            r = ems_write(TO_ROM, flash_lastofs, blockbuf+blockofs,
-                    WRITEBLOCKSIZE);
-            if (r != WRITEBLOCKSIZE) {
+            if (write_batch(TO_ROM, dest + blockofs, buf + blockofs,
+                READBLOCKSIZE, offset + 0x100, WRITEBLOCKSIZE*2)) {
                     xwarnx("write error updating flash memory");
-                    return FLASH_EUSB;
+                    r = FLASH_EUSB;
+                    goto out;
             }
+            if ((r = verify_write(TO_ROM, dest + blockofs, buf + blockofs,
+                READBLOCKSIZE, offset + 0x100, WRITEBLOCKSIZE*2)))
+                    goto out;
 
-            if ((dest + blockofs)%ERASEBLOCKSIZE == WRITEBLOCKSIZE)
+            if ((dest + blockofs)%ERASEBLOCKSIZE == 0)
                 PROGRESS(PROGRESS_ERASE, 0);
 
-            if ((progress += WRITEBLOCKSIZE)%READBLOCKSIZE == 0)
+            if (src + blockofs != origoffset)
                 PROGRESS(PROGRESS_WRITE, READBLOCKSIZE);
         }
 
-        src += READBLOCKSIZE;
-        dest += READBLOCKSIZE;
+        src += len;
+        dest += len;
     }
+    readq_free(rq);
+    rq = NULL;
 
-    for (int i = 0; i < 2; i++) {
-        r = ems_write(TO_ROM,
-                      offset+0x100+i*WRITEBLOCKSIZE,
-                      blockbuf100+i*WRITEBLOCKSIZE,
-                      WRITEBLOCKSIZE);
-        if (r != WRITEBLOCKSIZE) {
-                xwarnx("write error updating flash memory");
-                return FLASH_EUSB;
-        }
+    if ((r = verify_flush()))
+        goto out;
+    if (write_header(TO_ROM, offset, blockbuf100, WRITEBLOCKSIZE*2)) {
+            xwarnx("write error updating flash memory");
+            r = FLASH_EUSB;
+            goto out;
     }
+    // the copy is verified before the source is deleted
+    if ((r = verify_write(TO_ROM, offset + 0x100, blockbuf100,
+        WRITEBLOCKSIZE*2, 0, 0)) || (r = verify_flush()))
+            goto out;
 
     PROGRESS(PROGRESS_WRITE, READBLOCKSIZE);
 
     return flash_delete(origoffset, 2);
+
+out:
+    readq_free(rq);
+    return r;
 }
 
 int
-flash_read(int slotn, ems_size_t size, ems_size_t offset) {
-    ems_size_t remain;
+flash_move(ems_size_t offset, ems_size_t size, ems_size_t origoffset) {
+    int r;
+
+    STATS_TIMER(t);
+    r = verify_done(move(offset, size, origoffset));
+    STATS_STOP(t, STATS_FLASH_MOVE, 1, size);
+
+    return r;
+}
+
+static int
+read_slot(int slotn, ems_size_t size, ems_size_t offset) {
+    ems_size_t remain, len;
     unsigned char *block;
+    struct readq *rq;
     int r;
 
-    block = slot[slotn];
+    rq = readq_new(FROM_ROM, 0);
+    readq_stream(rq, offset, size, flash_readsize, slot[slotn]);
+
+    for (remain = size; remain > 0; remain -= len) {
+        len = remain < flash_readsize ? remain : flash_readsize;
 
-    for (remain = size; remain > 0; remain -= READBLOCKSIZE) {
         if (CHECKINT) {
+            readq_free(rq);
             xwarnx("operation interrupted");
             return FLASH_EINTR;
         }
 
-        r = ems_read(FROM_ROM, offset, block, READBLOCKSIZE);
-        if (r != READBLOCKSIZE) {
+        r = readq_next(rq, &block, NULL);
+        if (r != len) {
+                readq_free(rq);
                 xwarnx("read error updating flash memory");
                 return FLASH_EUSB;
         }
 
-        block += READBLOCKSIZE;
-        offset += READBLOCKSIZE;
-
-        PROGRESS(PROGRESS_READ, READBLOCKSIZE);
+        progress_read(len);
     }
 
+    readq_free(rq);
+
     return 0;
 }
 
-/* doesn't test for signals */
 int
-flash_write(ems_size_t offset, ems_size_t size, int slotn) {
-    ems_size_t blockofs, progress;
-    unsigned char *buf;
+flash_read(int slotn, ems_size_t size, ems_size_t offset) {
     int r;
 
-    buf = slot[slotn];
-    progress = 0;
-    for (blockofs = 0; blockofs < size; blockofs += WRITEBLOCKSIZE) {
-        if (blockofs == 0x100)
-            continue;
+    STATS_TIMER(t);
+    r = read_slot(slotn, size, offset);
+    STATS_STOP(t, STATS_FLASH_READ, 1, size);
 
-        flash_lastofs = offset + blockofs;
-        r = ems_write(TO_ROM, flash_lastofs, buf + blockofs, WRITEBLOCKSIZE);
-        if (r != WRITEBLOCKSIZE) {
+    return r;
+}
+
+/**
+ * Check whether [offset, offset+size[ is blank (all 0xFF). *blank is set to 1
+ * if so, to 0 otherwise. The reads stop at the first data found.
+ *
+ * Returns non-zero in case of error.
+ */
+int
+flash_isblank(ems_size_t offset, ems_size_t size, int *blank) {
+    ems_size_t remain, len;
+    unsigned char *buf;
+    struct readq *rq;
+    int r = 0;
+
+    rq = readq_new(FROM_ROM, flash_readsize);
+    readq_stream(rq, offset, size, flash_readsize, NULL);
+
+    *blank = 1;
+    for (remain = size; remain > 0 && *blank; remain -= len) {
+        len = remain < flash_readsize ? remain : flash_readsize;
+
+        if (readq_next(rq, &buf, NULL) != len) {
+            xwarnx("read error checking flash memory");
+            r = FLASH_EUSB;
+            break;
+        }
+        *blank = is_blank(buf, len);
+    }
+
+    readq_free(rq);
+
+    return r;
+}
+
+/* doesn't test for signals */
+static int
+write_slot(ems_size_t offset, ems_size_t size, int slotn) {
+    ems_size_t blockofs, hdrsize;
+    unsigned char *buf;
+
+    // an even number of commands lets the data be read back
+    hdrsize = WRITEBLOCKSIZE*2;
+
+    buf = slot[slotn];
+    for (blockofs = 0; blockofs < size; blockofs += READBLOCKSIZE) {
+        if (write_batch(TO_ROM, offset + blockofs, buf + blockofs,
+            READBLOCKSIZE, offset + 0x100, hdrsize)) {
                 xwarnx("write error updating flash memory");
                 return FLASH_EUSB;
         }
+        if (verify_write(TO_ROM, offset + blockofs, buf + blockofs,
+            READBLOCKSIZE, offset + 0x100, hdrsize))
+                return FLASH_EUSB;
 
-        if ((offset + blockofs) % ERASEBLOCKSIZE == WRITEBLOCKSIZE)
+        if ((offset + blockofs) % ERASEBLOCKSIZE == 0)
             PROGRESS(PROGRESS_ERASE, 0);
 
-        if ((progress += WRITEBLOCKSIZE) % READBLOCKSIZE == 0)
+        if (blockofs != 0)
             PROGRESS(PROGRESS_WRITE, READBLOCKSIZE);
     }
 
-    r = ems_write(TO_ROM, offset + 0x100, buf + 0x100, WRITEBLOCKSIZE);
-    if (r != WRITEBLOCKSIZE) {
+    if (verify_flush())
+        return FLASH_EUSB;
+    if (write_header(TO_ROM, offset, buf + 0x100, hdrsize)) {
             xwarnx("write error updating flash memory");
             return FLASH_EUSB;
     }
+    if (verify_write(TO_ROM, offset + 0x100, buf + 0x100, hdrsize, 0, 0))
+        return FLASH_EUSB;
 
     PROGRESS(PROGRESS_WRITE, READBLOCKSIZE);
 
@@ -337,22 +1302,29 @@ flash_write(ems_size_t offset, ems_size_t size, int slotn) {
 }
 
 int
-flash_erase(ems_size_t offset) {
-    unsigned char blankbuf[32];
-    int i, r;
+flash_write(ems_size_t offset, ems_size_t size, int slotn) {
+    int r;
+
+    STATS_TIMER(t);
+    r = verify_done(write_slot(offset, size, slotn));
+    STATS_STOP(t, STATS_FLASH_WRITE, 1, size);
+
+    return r;
+}
+
+static int
+erase(ems_size_t offset) {
+    unsigned char blankbuf[WRITEBLOCKSIZE*2];
 
     if (CHECKINT)  {
         xwarnx("operation interrupted");
         return FLASH_EINTR;
     }
 
-    for (i = 0; i < 2; i++) {
-        memset(blankbuf, 0xff, 32);
-        r = ems_write(TO_ROM, flash_lastofs = offset + i*32, blankbuf, 32);
-        if (r != 32) {
-                xwarnx("write error updating flash memory");
-                return FLASH_EUSB;
-        }
+    memset(blankbuf, 0xff, sizeof(blankbuf));
+    if (write_batch(TO_ROM, offset, blankbuf, sizeof(blankbuf), 0, 0)) {
+            xwarnx("write error updating flash memory");
+            return FLASH_EUSB;
     }
 
     PROGRESS(PROGRESS_ERASE, 0);
@@ -361,25 +1333,53 @@ flash_erase(ems_size_t offset) {
 }
 
 int
-flash_delete(ems_size_t offset, int blocks) {
-    unsigned char zerobuf[32];
+flash_erase(ems_size_t offset) {
     int r;
 
+    STATS_TIMER(t);
+    r = erase(offset);
+    STATS_STOP(t, STATS_FLASH_ERASE, 1, 0);
+
+    return r;
+}
+
+static int
+delete_blocks(ems_size_t offset, int blocks) {
+    unsigned char zerobuf[32];
+    struct ems_iovec iov[2];
+    int n, batch;
+
     memset(zerobuf, 0, 32);
 
-    while (blocks--) {
-        if ((blocks+1)%2 == 0 && CHECKINT) {
+    while (blocks > 0) {
+        if (blocks%2 == 0 && CHECKINT) {
             xwarnx("operation interrupted");
             return FLASH_EINTR;
         }
 
-        r = ems_write(TO_ROM, offset + 0x130 - blocks*32, zerobuf, 32);
-        if (r != 32) {
+        // clear the chunks of the header by pair
+        batch = 2 - blocks%2;
+        for (n = 0; n < batch; n++, blocks--)
+            iov[n] = (struct ems_iovec){offset + 0x130 - (blocks-1)*32,
+                zerobuf, 32};
+
+        if (ems_writev(TO_ROM, iov, n) != n*32) {
             xwarnx("flash write error (address=%"PRIuEMSSIZE")",
-                    offset + 0x130 - blocks*32);
+                    (ems_size_t)iov[0].offset);
             return FLASH_EUSB;
         }
     }
 
     return 0;
 }
+
+int
+flash_delete(ems_size_t offset, int blocks) {
+    int r;
+
+    STATS_TIMER(t);
+    r = delete_blocks(offset, blocks);
+    STATS_STOP(t, STATS_FLASH_DELETE, 1, 0);
+
+    return r;
+}
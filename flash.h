@@ -6,18 +6,37 @@
 #define WRITEBLOCKSIZE 32
 #define READBLOCKSIZE 4096
 
+/* limits of the transfer sizes set by flash_settransfersizes() */
+#define FLASH_MAXREADSIZE ((ems_size_t)128<<10)
+#define FLASH_MAXWRITESIZE (READBLOCKSIZE/2)
+
 enum {FLASH_EUSB = 1, FLASH_EFILE, FLASH_EINTR};
 
+/* a part of a file transferred from or to [offset, offset+size[ of "space" */
+struct flash_range {
+    int space;
+    ems_size_t offset, size;
+};
+
 ems_size_t flash_lastofs;
 char flash_lasterrorstr[256];
 
 void flash_init(void (*)(int, ems_size_t), int (*)(void));
 void flash_setprogresscb(void (*)(int, ems_size_t));
+void flash_setverify(int);
+void flash_setpacked(int);
+int flash_settransfersizes(ems_size_t, ems_size_t);
 int flash_writef_to(int, ems_size_t, ems_size_t, char*);
 int flash_writef(ems_size_t, ems_size_t, char*);
+int flash_diffwritef_to(int, ems_size_t, ems_size_t, char*);
+int flash_writef_ranges(char *, const struct flash_range *, int, int);
+int flash_writeblocks(ems_size_t, unsigned char *, const char *, int);
 int flash_readf_from(int, char*, ems_size_t, ems_size_t);
+int flash_readf_ranges(char *, const struct flash_range *, int);
+int flash_readbuf_from(int, unsigned char *, ems_size_t, ems_size_t);
 int flash_move(ems_size_t, ems_size_t, ems_size_t);
 int flash_read(int, ems_size_t, ems_size_t);
+int flash_isblank(ems_size_t, ems_size_t, int *);
 int flash_write(ems_size_t, ems_size_t, int);
 int flash_erase(ems_size_t);
 int flash_delete(ems_size_t, int);
@@ -0,0 +1,19 @@
+/*
+ * Hash of the data compared with the cart or stored on the host.
+ */
+
+#include "hash.h"
+
+/**
+ * 64 bits FNV-1a hash
+ */
+uint64_t
+hash64(const unsigned char *buf, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= buf[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
@@ -0,0 +1,9 @@
+#ifndef EMS_HASH_H
+#define EMS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t hash64(const unsigned char *, size_t);
+
+#endif /* EMS_HASH_H */
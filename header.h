@@ -4,6 +4,10 @@
 #include "ems.h"
 
 #define HEADER_SIZE 336
+
+/* bytes of a header used by header_validate() and header_decode() */
+#define HEADER_FIELDSOFS 0x104
+#define HEADER_FIELDSSIZE (0x14E - HEADER_FIELDSOFS)
 #define HEADER_TITLE_SIZE 16
 
 enum header_enh {
@@ -1,18 +1,55 @@
+/* for clock_gettime() */
+#define _XOPEN_SOURCE 500
+
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "ems.h"
 #include "image.h"
 #include "insert.h"
+#include "update.h"
 
 ems_size_t insert_pagesize = PAGESIZE;
+const unsigned long *insert_wear;
 
 /*
  * Important: the struct image provided to these functions should be valid
  * (see update.h). The ROMs must have a size power of two.
  */
 
+/**
+ * Wear of the location of a ROM of "size" bytes at "offset": the highest erase
+ * count of its erase-blocks. 0 if insert_wear is not set.
+ */
+static unsigned long
+wear(ems_size_t offset, ems_size_t size) {
+    unsigned long w, max;
+    ems_size_t ofs;
+
+    if (insert_wear == NULL)
+        return 0;
+
+    max = 0;
+    ofs = offset - offset%ERASEBLOCKSIZE;
+    do {
+        if ((w = insert_wear[ofs/ERASEBLOCKSIZE]) > max)
+            max = w;
+        ofs += ERASEBLOCKSIZE;
+    } while (ofs < offset + size);
+
+    return max;
+}
+
 /**
  * Insert a ROM in an image using best-fit to limit the fragmentation (as ROM
  * size is always a power of two).
  *
+ * When several free locations fit best, the ROM is put in the least worn one
+ * according to insert_wear (the erase counts of the erase-blocks of the page),
+ * otherwise in the first one.
+ *
  * Returns non-zero in case of error.
  */
 int
@@ -21,6 +58,7 @@ image_insert(struct image *image, struct rom *newrom) {
         ems_size_t size;
         struct rom *prev;
         ems_size_t offset;
+        unsigned long wear;
     } bestfit;
     struct rom lastrom = {.offset = insert_pagesize}, *prev, *rom;
     ems_size_t offset;
@@ -30,6 +68,7 @@ image_insert(struct image *image, struct rom *newrom) {
     offset = 0;
     prev = NULL;
     bestfit.size = (ems_size_t)-1;
+    bestfit.wear = 0;
 
     /*
      * For each free contiguous space:
@@ -48,10 +87,16 @@ image_insert(struct image *image, struct rom *newrom) {
                     if (offset%bigest == 0 &&
                         cur-offset >= bigest) {
                             if (bigest >= newrom->romsize) {
-                                if (bestfit.size > bigest) {
-                                    bestfit.size = bigest;
-                                    bestfit.offset = offset;
-                                    bestfit.prev = prev;
+                                unsigned long w;
+
+                                w = wear(offset, newrom->romsize);
+                                if (bestfit.size > bigest ||
+                                    (bestfit.size == bigest &&
+                                    bestfit.wear > w)) {
+                                        bestfit.size = bigest;
+                                        bestfit.offset = offset;
+                                        bestfit.prev = prev;
+                                        bestfit.wear = w;
                                 }
                             }
                             break;
@@ -116,6 +161,9 @@ moverom(struct image *image, struct rom *destrom, ems_size_t destofs,
  * Defragment incrementally the image to make space for a ROM of "size" bytes,
  * aligned to its size.
  *
+ * The free spaces used are chosen by image_insert(), so the ties are broken
+ * toward the less worn erase-blocks too.
+ *
  * Note: it is guaranteed that ROMs are always moved from higher addresses to
  *       lower addresses. This is important for image_update().
  *
@@ -200,3 +248,577 @@ image_defrag(struct image *image, ems_size_t size) {
     }
     return 0;
 }
+
+/*
+ * Search for a layout of the image with new ROMs (image_optimize()).
+ *
+ * The ROMs are placed one at a time, the biggest first, at the aligned
+ * locations of their size: a ROM of the flash at its location or lower (see
+ * image_plan() in update.c: the ROMs move toward lower addresses, to another
+ * erase-block when they are smaller than an erase-block), a new ROM anywhere.
+ * The cost of a layout is the time to write the new and the moved ROMs, to
+ * erase their erase-blocks and to save and rewrite the small ROMs staying in
+ * these erase-blocks, with a struct update_cost. As image_plan() does, a small
+ * ROM written to blank space of an erase-block, not at its start, doesn't
+ * erase it: the free space of the erase-blocks holding ROMs of the flash is
+ * checked for blank units before the search.
+ *
+ * The search is a branch and bound: a branch is left when its cost and the
+ * least cost of the remaining ROMs reach the cost of the best layout found,
+ * initially the one of the greedy insertion (image_insert_defrag()), or when
+ * the remaining ROMs don't fit in the free space. The locations are tried in
+ * order of cost, then of fit and of wear as image_insert() does.
+ */
+
+#define NUNITS (PAGESIZE/MINROMSIZE)
+#define NBLOCKS (PAGESIZE/ERASEBLOCKSIZE)
+#define NLEVELS 8                       /* sizes from MINROMSIZE to PAGESIZE */
+#define NOWHERE ((ems_size_t)-1)
+#define EPSILON 1e-6
+
+/*
+ * struct item: a ROM to place
+ *   origin: its offset in flash, NOWHERE for a ROM to write
+ *   fixed: it stays where it is in the image (a ROM to write already placed)
+ *   level: log2 of its size in MINROMSIZE units
+ *   write: cost of writing it, moved from flash or from a file
+ *   save: cost of saving it and writing it back around an erasure
+ *   rest: least cost of the items from this one
+ *   need: number of items of each level from this one
+ *   small: units of the ROMs to write smaller than an erase-block, from this
+ *          one
+ */
+struct item {
+    struct rom *rom;
+    ems_size_t origin;
+    int fixed, level;
+    double write, save, rest;
+    int need[NLEVELS];
+    int small;
+};
+
+/*
+ * struct cand: a location of an item
+ *   delta: cost added by the item there
+ *   moved: least cost of moving the ROMs of the flash not placed yet there
+ *   fit: size of the free space around, in units, these ROMs being in place
+ */
+struct cand {
+    ems_size_t offset, fit;
+    unsigned long wear;
+    double delta, moved;
+};
+
+struct search {
+    const struct update_cost *cost;
+    int (*isblank)(ems_size_t, ems_size_t, void *);
+    void *ctx;
+    struct item *items;
+    int nitems, nunits, nlevels;
+    struct cand *cands;                 /* nunits per item */
+    ems_size_t *pos, *best;
+    char used[NUNITS];
+    char blank[NUNITS];                 /* free and blank */
+    int owner[NUNITS];                  /* item whose origin is there, or -1 */
+    int erased[NBLOCKS];                /* ROMs written erasing the block */
+    double saved[NBLOCKS];              /* cost of saving the ROMs staying */
+    double bestcost;
+    struct timespec deadline;
+    long nodes;
+    int found, timeout;
+};
+
+static int
+item_compar(const void *pa, const void *pb) {
+    const struct item *a = pa, *b = pb;
+
+    // the fixed ROMs first, then by size in descending order, the ROMs of the
+    // flash before the new ones
+    if (a->fixed != b->fixed)
+        return b->fixed - a->fixed;
+    if (a->level != b->level)
+        return b->level - a->level;
+    if ((a->origin == NOWHERE) != (b->origin == NOWHERE))
+        return a->origin == NOWHERE ? 1 : -1;
+    return a->origin < b->origin ? -1 : a->origin > b->origin;
+}
+
+static int
+cand_compar(const void *pa, const void *pb) {
+    const struct cand *a = pa, *b = pb;
+
+    if (a->delta + a->moved != b->delta + b->moved)
+        return a->delta + a->moved < b->delta + b->moved ? -1 : 1;
+    if (a->fit != b->fit)
+        return a->fit < b->fit ? -1 : 1;
+    if (a->wear != b->wear)
+        return a->wear < b->wear ? -1 : 1;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/**
+ * Check whether a small ROM of "size" bytes written at "offset" leaves its
+ * erase-block as it is (see update_appendable() in update.c).
+ */
+static int
+appendable(struct search *s, ems_size_t offset, ems_size_t size) {
+    if (offset%ERASEBLOCKSIZE == 0)
+        return 0;
+    for (ems_size_t u = offset/MINROMSIZE; u < (offset+size)/MINROMSIZE; u++)
+        if (!s->blank[u])
+            return 0;
+    return 1;
+}
+
+/**
+ * Put the item "it" at "offset".
+ *
+ * Returns the cost added.
+ */
+static double
+place(struct search *s, struct item *it, ems_size_t offset) {
+    ems_size_t size = it->rom->romsize;
+    int b = offset/ERASEBLOCKSIZE;
+    double delta;
+
+    memset(s->used + offset/MINROMSIZE, 1, size/MINROMSIZE);
+
+    if (offset == it->origin) {
+        if (size >= ERASEBLOCKSIZE)
+            return 0;
+        s->saved[b] += it->save;
+        return s->erased[b] ? it->save : 0;
+    }
+
+    delta = it->write;
+    if (size >= ERASEBLOCKSIZE)
+        delta += size/ERASEBLOCKSIZE * s->cost->erase;
+    else if (!appendable(s, offset, size) && s->erased[b]++ == 0)
+        delta += s->cost->erase + s->saved[b];
+    return delta;
+}
+
+/* undo place() */
+static void
+unplace(struct search *s, struct item *it, ems_size_t offset) {
+    ems_size_t size = it->rom->romsize;
+    int b = offset/ERASEBLOCKSIZE;
+
+    memset(s->used + offset/MINROMSIZE, 0, size/MINROMSIZE);
+
+    if (size >= ERASEBLOCKSIZE)
+        return;
+    if (offset == it->origin)
+        s->saved[b] -= it->save;
+    else if (!appendable(s, offset, size))
+        s->erased[b]--;
+}
+
+/**
+ * Check whether the items from "i" fit in the free space: the ROM sizes being
+ * powers of two, they fit if they can be put, the biggest first, in the free
+ * aligned locations, these being split as needed. "pre" counts the units used
+ * before each unit.
+ */
+static int
+fits(struct search *s, int i, const int *pre) {
+    int avail[NLEVELS] = {0};
+    int u, l;
+
+    for (u = 0; u < s->nunits; u += 1 << l) {
+        if (s->used[u]) {
+            l = 0;
+            continue;
+        }
+        for (l = s->nlevels - 1; l > 0; l--)
+            if (u % (1 << l) == 0 && u + (1 << l) <= s->nunits &&
+                pre[u + (1 << l)] == pre[u])
+                    break;
+        avail[l]++;
+    }
+
+    for (l = s->nlevels - 1; l >= 0; l--) {
+        if (avail[l] < s->items[i].need[l])
+            return 0;
+        if (l > 0)
+            avail[l-1] += 2*(avail[l] - s->items[i].need[l]);
+    }
+    return 1;
+}
+
+/**
+ * Least cost of the items from "i" in addition to their "rest": the ROMs of the
+ * flash whose location is taken move and the small ROMs to write that don't
+ * fit in the erase-blocks already erased or in blank space need others to be
+ * erased. "pre" counts the units used before each unit.
+ */
+static double
+bound(struct search *s, int i, const int *pre) {
+    int blockunits = ERASEBLOCKSIZE/MINROMSIZE;
+    int j, u, units;
+    double least;
+
+    least = 0;
+    for (j = i; j < s->nitems; j++) {
+        struct item *it = &s->items[j];
+        int u = it->origin/MINROMSIZE;
+
+        if (it->origin != NOWHERE &&
+            pre[u + it->rom->romsize/MINROMSIZE] != pre[u])
+                least += it->write;
+    }
+
+    units = s->items[i].small;
+    for (u = 0; u < s->nunits && units > 0; u++)
+        if (!s->used[u] && (s->erased[u/blockunits] || s->blank[u]))
+            units--;
+    if (units > 0)
+        least += (units + blockunits-1)/blockunits * s->cost->erase;
+
+    return least;
+}
+
+static int
+expired(struct search *s) {
+    struct timespec now;
+
+    if (s->timeout || (++s->nodes & 255) != 0)
+        return s->timeout;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > s->deadline.tv_sec || (now.tv_sec == s->deadline.tv_sec &&
+        now.tv_nsec >= s->deadline.tv_nsec))
+            s->timeout = 1;
+    return s->timeout;
+}
+
+static void
+search(struct search *s, int i, double cost) {
+    struct item *it = &s->items[i];
+    struct cand *cands = s->cands + i*s->nunits;
+    int pre[NUNITS + 1], inplace[NUNITS + 1];
+    int u, k, n, j, ncands;
+
+    if (expired(s) || cost + (i < s->nitems ? it->rest : 0) >=
+        s->bestcost - EPSILON)
+            return;
+
+    if (i == s->nitems) {
+        memcpy(s->best, s->pos, s->nitems*sizeof(*s->pos));
+        s->bestcost = cost;
+        s->found = 1;
+        return;
+    }
+
+    // the units used and those with the ROMs of the flash yet to place too
+    pre[0] = inplace[0] = 0;
+    for (u = 0; u < s->nunits; u++) {
+        pre[u+1] = pre[u] + s->used[u];
+        inplace[u+1] = inplace[u] + (s->used[u] || s->owner[u] > i);
+    }
+    if (!fits(s, i, pre) ||
+        cost + it->rest + bound(s, i, pre) >= s->bestcost - EPSILON)
+            return;
+
+    k = it->rom->romsize/MINROMSIZE;
+    ncands = 0;
+    for (u = 0; u + k <= s->nunits; u += k) {
+        ems_size_t offset = (ems_size_t)u*MINROMSIZE;
+        struct cand *c;
+
+        if (pre[u + k] != pre[u])
+            continue;
+        if (it->fixed && offset != it->rom->offset)
+            continue;
+        // a ROM of the flash stays or moves to a lower erase-block
+        if (it->origin != NOWHERE && offset != it->origin &&
+            (offset > it->origin || (k*MINROMSIZE < ERASEBLOCKSIZE &&
+            offset/ERASEBLOCKSIZE == it->origin/ERASEBLOCKSIZE)))
+                continue;
+        // the new ROMs of a size are interchangeable: put them in order
+        if (!it->fixed && it->origin == NOWHERE && i > 0 &&
+            !it[-1].fixed && it[-1].origin == NOWHERE &&
+            it[-1].level == it->level && offset <= s->pos[i-1])
+                continue;
+
+        c = &cands[ncands++];
+        c->offset = offset;
+        c->delta = place(s, it, offset);
+        unplace(s, it, offset);
+        c->moved = 0;
+        for (n = u, j = -1; n < u + k; n++)
+            if (s->owner[n] > i && s->owner[n] != j)
+                c->moved += s->items[j = s->owner[n]].write;
+        for (n = k; 2*n <= s->nunits; n *= 2) {
+            int base = u - u%(2*n);
+
+            if (inplace[base + 2*n] != inplace[base])
+                break;
+        }
+        c->fit = n;
+        c->wear = wear(offset, it->rom->romsize);
+    }
+    qsort(cands, ncands, sizeof(*cands), cand_compar);
+
+    for (n = 0; n < ncands && !s->timeout; n++) {
+        double delta = place(s, it, cands[n].offset);
+
+        s->pos[i] = cands[n].offset;
+        search(s, i + 1, cost + delta);
+        unplace(s, it, cands[n].offset);
+    }
+}
+
+/**
+ * Make in "copy" the layout of the greedy insertion of the new ROMs "roms" in
+ * a copy of the image, the copy of an item having its index in "copies".
+ *
+ * Returns non-zero if the insertion fails.
+ */
+static int
+greedy_layout(struct search *s, struct image *image, struct rom **roms, int n,
+    struct image *copy, struct rom *copies) {
+    struct rom *rom;
+    int i, k;
+
+    image_init(copy);
+    image_foreach(image, rom) {
+        for (k = 0; s->items[k].rom != rom; k++)
+            ;
+        copies[k] = *rom;
+        image_insert_tail(copy, &copies[k]);
+    }
+    for (i = 0; i < n; i++) {
+        for (k = 0; s->items[k].rom != roms[i]; k++)
+            ;
+        copies[k] = *roms[i];
+        if (image_insert_defrag(copy, &copies[k]))
+            return 1;
+    }
+    return 0;
+}
+
+/* cost of the layout of "copies" (see greedy_layout()) */
+static double
+layout_cost(struct search *s, struct rom *copies) {
+    double cost;
+    int k;
+
+    cost = 0;
+    for (k = 0; k < s->nitems; k++)
+        cost += place(s, &s->items[k], copies[k].offset);
+    for (k = s->nitems - 1; k >= 0; k--)
+        unplace(s, &s->items[k], copies[k].offset);
+    return cost;
+}
+
+static int
+rom_compar(const void *pa, const void *pb) {
+    const struct rom *a = *(struct rom * const *)pa;
+    const struct rom *b = *(struct rom * const *)pb;
+
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/**
+ * Time of the commands planned by image_plan() for the image "copy".
+ * DBL_MAX if the planning fails.
+ */
+static double
+plan_time(struct search *s, struct image *copy) {
+    struct update_estimate est;
+    struct updates *updates = NULL;
+    struct update *u;
+    int r;
+
+    r = image_plan(copy, s->cost, s->isblank, s->ctx, &updates);
+    if (r == 0)
+        update_estimate(updates, s->cost, &est);
+    while (updates != NULL && (u = SIMPLEQ_FIRST(updates)) != NULL) {
+        SIMPLEQ_REMOVE_HEAD(updates, updates);
+        free(u);
+    }
+    free(updates);
+
+    return r == 0 ? est.time : DBL_MAX;
+}
+
+/**
+ * Insert the new ROMs "roms" in the image at the layout costing the least
+ * according to "cost" (see above), if it costs less than the greedy insertion
+ * of the ROMs in this order with image_insert_defrag(). The layout found and
+ * the greedy one are compared by the time of the commands image_plan() makes
+ * for them, with "isblank" and "ctx" (see image_plan()): the greedy one is
+ * kept unless it takes longer.
+ *
+ * The search stops after "budget" seconds: the best layout found by then is
+ * used if it costs less than the greedy insertion.
+ *
+ * Returns 0 if the ROMs were inserted, 1 if the greedy insertion costs the
+ * least and -1 if the search was stopped without finding a better layout or
+ * failed. The image is left unchanged unless 0 is returned.
+ */
+int
+image_optimize(struct image *image, struct rom **roms, int n,
+    const struct update_cost *cost,
+    int (*isblank)(ems_size_t, ems_size_t, void *), void *ctx, double budget) {
+    struct search s = {.cost = cost, .isblank = isblank, .ctx = ctx};
+    struct rom *rom, **all = NULL, *copies = NULL;
+    struct image copy;
+    struct timespec now;
+    double greedy;
+    int i, k, r;
+
+    s.nunits = insert_pagesize/MINROMSIZE;
+    for (s.nlevels = 1; (1 << (s.nlevels - 1)) < s.nunits; s.nlevels++)
+        ;
+
+    s.nitems = n;
+    image_foreach(image, rom)
+        s.nitems++;
+    if ((s.items = calloc(s.nitems, sizeof(*s.items))) == NULL ||
+        (s.cands = malloc(s.nitems*s.nunits*sizeof(*s.cands))) == NULL ||
+        (s.pos = malloc(s.nitems*sizeof(*s.pos))) == NULL ||
+        (s.best = malloc(s.nitems*sizeof(*s.best))) == NULL ||
+        (all = malloc(s.nitems*sizeof(*all))) == NULL ||
+        (copies = malloc(s.nitems*sizeof(*copies))) == NULL) {
+            r = -1;
+            goto end;
+    }
+
+    k = 0;
+    image_foreach(image, rom)
+        all[k++] = rom;
+    for (i = 0; i < n; i++)
+        all[k++] = roms[i];
+
+    for (k = 0; k < s.nitems; k++) {
+        struct item *it = &s.items[k];
+        ems_size_t size;
+
+        it->rom = rom = all[k];
+        size = rom->romsize;
+        for (it->level = 0; (MINROMSIZE << it->level) < size; it->level++)
+            ;
+        it->save = update_xfertime(cost, size, cost->readrate) +
+            update_xfertime(cost, size, cost->writerate);
+        if (k >= s.nitems - n) {
+            it->origin = NOWHERE;
+            it->write = update_xfertime(cost, size, cost->writerate);
+        } else if (rom->source.type == ROM_SOURCE_FLASH &&
+            rom->offset == rom->source.u.origoffset) {
+                it->origin = rom->offset;
+                it->write = it->save;
+        } else {
+            it->origin = NOWHERE;
+            it->fixed = 1;
+            it->write = rom->source.type == ROM_SOURCE_FILE ?
+                update_xfertime(cost, size, cost->writerate) : it->save;
+        }
+    }
+    qsort(s.items, s.nitems, sizeof(*s.items), item_compar);
+
+    for (i = 0; i < s.nunits; i++)
+        s.owner[i] = -1;
+    for (k = 0; k < s.nitems; k++) {
+        struct item *it = &s.items[k];
+
+        if (it->origin != NOWHERE)
+            for (i = 0; i < it->rom->romsize/MINROMSIZE; i++)
+                s.owner[it->origin/MINROMSIZE + i] = k;
+    }
+
+    // the least costs: the ROMs to write are written
+    for (k = s.nitems - 1; k >= 0; k--) {
+        struct item *it = &s.items[k];
+
+        if (k < s.nitems - 1) {
+            it->rest = it[1].rest;
+            it->small = it[1].small;
+            memcpy(it->need, it[1].need, sizeof(it->need));
+        }
+        it->need[it->level]++;
+        if (it->origin == NOWHERE && it->rom->romsize < ERASEBLOCKSIZE)
+            it->small += it->rom->romsize/MINROMSIZE;
+        if (it->origin == NOWHERE) {
+            it->rest += it->write;
+            if (it->rom->romsize >= ERASEBLOCKSIZE)
+                it->rest += it->rom->romsize/ERASEBLOCKSIZE * cost->erase;
+        }
+    }
+
+    // the free units of the erase-blocks holding ROMs of the flash, but the
+    // first ones, may be written without erasing if they are blank
+    for (i = 0; isblank != NULL && s.items[0].small > 0 && i < s.nunits; i++) {
+        int blockunits = ERASEBLOCKSIZE/MINROMSIZE;
+        int first = i - i%blockunits, last = first + blockunits, u;
+
+        if (i == first || s.owner[i] != -1)
+            continue;
+        for (u = first; u < last && u < s.nunits && s.owner[u] == -1; u++)
+            ;
+        if (u == last || u == s.nunits)
+            continue;
+        if ((r = isblank((ems_size_t)i*MINROMSIZE, MINROMSIZE, ctx)) < 0) {
+            r = -1;
+            goto end;
+        }
+        s.blank[i] = r;
+    }
+
+    if (greedy_layout(&s, image, roms, n, &copy, copies)) {
+        s.bestcost = greedy = DBL_MAX;
+    } else {
+        s.bestcost = layout_cost(&s, copies);
+        greedy = plan_time(&s, &copy);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s.deadline.tv_sec = now.tv_sec + (time_t)budget;
+    s.deadline.tv_nsec = now.tv_nsec + (long)((budget - (time_t)budget)*1e9);
+    if (s.deadline.tv_nsec >= 1000000000) {
+        s.deadline.tv_sec++;
+        s.deadline.tv_nsec -= 1000000000;
+    }
+
+    search(&s, 0, 0);
+
+    if (!s.found) {
+        r = s.timeout || s.bestcost == DBL_MAX ? -1 : 1;
+        goto end;
+    }
+
+    // the greedy layout is kept unless the commands of the one found are faster
+    for (k = 0; k < s.nitems; k++) {
+        copies[k] = *s.items[k].rom;
+        copies[k].offset = s.best[k];
+        all[k] = &copies[k];
+    }
+    qsort(all, s.nitems, sizeof(*all), rom_compar);
+    image_init(&copy);
+    for (k = 0; k < s.nitems; k++)
+        image_insert_tail(&copy, all[k]);
+    if (plan_time(&s, &copy) >= greedy - EPSILON) {
+        r = 1;
+        goto end;
+    }
+
+    for (k = 0; k < s.nitems; k++) {
+        s.items[k].rom->offset = s.best[k];
+        all[k] = s.items[k].rom;
+    }
+    qsort(all, s.nitems, sizeof(*all), rom_compar);
+    image_init(image);
+    for (k = 0; k < s.nitems; k++)
+        image_insert_tail(image, all[k]);
+    r = 0;
+
+end:
+    free(s.items);
+    free(s.cands);
+    free(s.pos);
+    free(s.best);
+    free(all);
+    free(copies);
+    return r;
+}
@@ -3,11 +3,19 @@
 
 #include "ems.h"
 #include "image.h"
+#include "update.h"
+
+/* time given to image_optimize() by default, in seconds */
+#define INSERT_DEFAULTBUDGET 0.5
 
 ems_size_t insert_pagesize;
+/* erase counts of the erase-blocks of the page, NULL if unknown */
+extern const unsigned long *insert_wear;
 
 int image_insert(struct image*, struct rom*);
 int image_insert_defrag(struct image*, struct rom*);
 int image_defrag(struct image*, ems_size_t);
+int image_optimize(struct image*, struct rom**, int, const struct update_cost*,
+    int (*)(ems_size_t, ems_size_t, void *), void *, double);
 
 #endif /* EMS_INSERT_H */
@@ -0,0 +1,224 @@
+/*
+ * Job manifests (--jobs): a batch of operations run in one session.
+ *
+ * A manifest has one step per line:
+ *   write PAGE FILE...         write ROM files
+ *   delete PAGE BANK...        delete the ROMs at the banks
+ *   read PAGE BANK:FILE...     read the ROMs at the banks to files
+ *   format PAGE                delete all the ROMs of the page
+ *   dump PAGE|save FILE        dump the page or the SRAM to a file
+ *   restore PAGE|save FILE     restore the page or the SRAM from a file
+ * PAGE is 1 or 2. The words are separated by blanks and a word starting with
+ * '#' begins a comment, up to the end of the line.
+ *
+ * The whole manifest is checked when it is loaded: a manifest with an error
+ * isn't run at all.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "job.h"
+
+#define JOB_LINEMAX 1024
+#define JOB_BLANKS " \t\r\n"
+
+static const struct {
+    const char *name;
+    enum job_op op;
+    int save;                   /* the page may be "save" */
+    int minargs, maxargs;       /* maxargs -1: no limit */
+} ops[] = {
+    {"write", JOB_WRITE, 0, 1, -1},
+    {"delete", JOB_DELETE, 0, 1, -1},
+    {"read", JOB_READ, 0, 1, -1},
+    {"format", JOB_FORMAT, 0, 0, 0},
+    {"dump", JOB_DUMP, 1, 1, 1},
+    {"restore", JOB_RESTORE, 1, 1, 1},
+};
+
+#define NOPS ((int)(sizeof(ops)/sizeof(ops[0])))
+
+/* bank number at the start of "arg", -1 if invalid; "*end" follows it */
+static int
+parse_bank(char *arg, char **end) {
+    long l;
+
+    l = strtol(arg, end, 10);
+    if (*end == arg || l < 0 || l >= PAGESIZE/BANKSIZE)
+        return -1;
+    return l;
+}
+
+/**
+ * Split the line "buf" of the manifest into "step" and write its words to
+ * "step->text", which must have the size of "buf". The messages are prefixed
+ * with "where".
+ *
+ * Returns 0 on success, -1 if the line has no step, 1 on error (a message has
+ * been printed).
+ */
+static int
+parse_line(const char *where, char *buf, struct job_step *step) {
+    char *words[JOB_LINEMAX/2], *word, *p;
+    int nwords, i;
+
+    nwords = 0;
+    for (word = strtok(buf, JOB_BLANKS); word != NULL && word[0] != '#';
+        word = strtok(NULL, JOB_BLANKS))
+            words[nwords++] = word;
+    if (nwords == 0)
+        return -1;
+
+    for (i = 0; i < NOPS && strcmp(words[0], ops[i].name) != 0; i++)
+        ;
+    if (i == NOPS) {
+        warnx("%s: unknown operation: %s", where, words[0]);
+        return 1;
+    }
+    step->op = ops[i].op;
+
+    if (nwords < 2) {
+        warnx("%s: %s: page missing", where, words[0]);
+        return 1;
+    }
+    if (ops[i].save && strcmp(words[1], "save") == 0) {
+        step->page = JOB_SAVE;
+    } else if (strcmp(words[1], "1") == 0 || strcmp(words[1], "2") == 0) {
+        step->page = words[1][0] - '1';
+    } else {
+        warnx("%s: %s: invalid page (should be 1 or 2%s): %s", where,
+            words[0], ops[i].save ? " or save" : "", words[1]);
+        return 1;
+    }
+
+    step->argc = nwords - 2;
+    if (step->argc < ops[i].minargs ||
+        (ops[i].maxargs >= 0 && step->argc > ops[i].maxargs)) {
+            warnx("%s: %s: wrong number of arguments", where, words[0]);
+            return 1;
+    }
+    for (i = 2; i < nwords; i++) {
+        if (step->op == JOB_DELETE &&
+            (parse_bank(words[i], &p) < 0 || *p != '\0')) {
+                warnx("%s: invalid bank number: %s", where, words[i]);
+                return 1;
+        }
+        if (step->op == JOB_READ &&
+            (parse_bank(words[i], &p) < 0 || *p != ':' || p[1] == '\0')) {
+                warnx("%s: invalid argument (should be BANK:FILENAME): %s",
+                    where, words[i]);
+                return 1;
+        }
+    }
+
+    if ((step->argv = malloc((step->argc + 1)*sizeof(char *))) == NULL)
+        err(1, "malloc");
+    memcpy(step->argv, words + 2, step->argc*sizeof(char *));
+    step->argv[step->argc] = NULL;
+
+    for (p = step->text, i = 0; i < nwords; i++)
+        p += sprintf(p, i ? " %s" : "%s", words[i]);
+
+    return 0;
+}
+
+/**
+ * Find the steps planned as one update with the step "first": the consecutive
+ * deletions and writes on its page. The deletions of an update are made before
+ * its writes, so a deletion following a write starts another update.
+ *
+ * Returns the index of the step following the group.
+ */
+int
+job_group(const struct job *job, int first) {
+    const struct job_step *step = &job->steps[first];
+    int i, written;
+
+    if (step->op != JOB_WRITE && step->op != JOB_DELETE)
+        return first + 1;
+
+    written = 0;
+    for (i = first; i < job->count && job->steps[i].page == step->page; i++) {
+        if (job->steps[i].op == JOB_WRITE)
+            written = 1;
+        else if (job->steps[i].op != JOB_DELETE || written)
+            break;
+    }
+
+    return i;
+}
+
+/**
+ * Read the manifest "path" ("-" for the standard input) to "job" and check
+ * its steps.
+ *
+ * Returns 0 on success, 1 on error (messages have been printed, one for each
+ * line in error).
+ */
+int
+job_load(const char *path, struct job *job) {
+    char buf[JOB_LINEMAX], where[JOB_LINEMAX];
+    struct job_step step;
+    int line, errors, allocated, r;
+    size_t len;
+    char *copy;
+    FILE *f;
+
+    if (strcmp(path, "-") == 0) {
+        f = stdin;
+        path = "(stdin)";
+    } else if ((f = fopen(path, "r")) == NULL) {
+        warn("can't open %s", path);
+        return 1;
+    }
+
+    job->path = path;
+    job->count = 0;
+    job->steps = NULL;
+    allocated = errors = 0;
+
+    for (line = 1; fgets(buf, sizeof(buf), f) != NULL; line++) {
+        snprintf(where, sizeof(where), "%s:%d", path, line);
+
+        len = strlen(buf);
+        if (len == sizeof(buf) - 1 && buf[len - 1] != '\n' && !feof(f)) {
+            warnx("%s: line too long", where);
+            errors++;
+            break;
+        }
+
+        // the words and the text of the step point to the copy of the line
+        if ((copy = malloc(2*(len + 1))) == NULL)
+            err(1, "malloc");
+        memcpy(copy, buf, len + 1);
+        step.line = line;
+        step.text = copy + len + 1;
+        if ((r = parse_line(where, copy, &step)) != 0) {
+            free(copy);
+            if (r == 1)
+                errors++;
+            continue;
+        }
+
+        if (job->count == allocated) {
+            allocated = allocated ? 2*allocated : 16;
+            if ((job->steps = realloc(job->steps,
+                allocated*sizeof(*job->steps))) == NULL)
+                    err(1, "malloc");
+        }
+        job->steps[job->count++] = step;
+    }
+
+    if (ferror(f)) {
+        warn("error reading %s", path);
+        errors++;
+    }
+    if (f != stdin)
+        fclose(f);
+
+    return errors != 0;
+}
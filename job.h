@@ -0,0 +1,37 @@
+#ifndef EMS_JOB_H
+#define EMS_JOB_H
+
+/* page of the steps on the SRAM ("save" in the manifest) */
+#define JOB_SAVE -1
+
+enum job_op {JOB_WRITE, JOB_DELETE, JOB_READ, JOB_FORMAT, JOB_DUMP,
+    JOB_RESTORE};
+
+/*
+ * struct job_step: a line of a manifest
+ *   line: line number in the manifest
+ *   op: operation
+ *   page: 0 or 1, JOB_SAVE for a dump or a restore of the SRAM
+ *   argc, argv: the arguments following the page, as for the command of the
+ *               operation (ROM files, banks, BANK:FILE, image file)
+ *   text: the line, without the comment, for the messages
+ */
+struct job_step {
+    int line;
+    enum job_op op;
+    int page;
+    int argc;
+    char **argv;
+    char *text;
+};
+
+struct job {
+    const char *path;
+    int count;
+    struct job_step *steps;
+};
+
+int job_load(const char *, struct job *);
+int job_group(const struct job *, int);
+
+#endif /* EMS_JOB_H */
@@ -0,0 +1,266 @@
+/*
+ * Listings of the pages kept on the host, for the carts written only by this
+ * host.
+ *
+ * list() scans the headers of a page at each invocation. When the EMS_LISTFILE
+ * environment variable names a file, the listing of each page is saved there
+ * per cart (see ems_cartid()) and list() reads back only a few headers of the
+ * page (see listcache_samples()) to check that it still holds. The page is
+ * scanned again if a sample disagrees.
+ *
+ * The entry of a page is dropped before the page is written and saved again
+ * once the write has succeeded, so an interrupted command leaves no entry. The
+ * cart has no room for a generation counter: a write by another host or tool
+ * is only detected if it changed a sampled header.
+ *
+ * Each line of the file is the listing of a page followed by the cart
+ * identifier:
+ *   PAGE COUNT OFFSET:ROMSIZE:ENH:GBCONLY:TITLE ... CARTID
+ * where TITLE is in hexadecimal.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "header.h"
+#include "listcache.h"
+
+#define LISTCACHE_LINESIZE ((PAGESIZE/32768) * (4*11 + 2*HEADER_TITLE_SIZE) \
+    + 1024)
+
+static char *
+listcache_path(void) {
+    char *p;
+
+    if ((p = getenv("EMS_LISTFILE")) != NULL && *p != '\0')
+        return p;
+    return NULL;
+}
+
+/**
+ * Parse a line of the file, without its newline. "listing" may be NULL.
+ *
+ * Returns the cart identifier or NULL if the line is invalid.
+ */
+static char *
+parse_line(char *line, int *page, struct listing *listing) {
+    unsigned long n[4], end_prev;
+    char *p, *end;
+    int count;
+
+    p = line;
+    for (int i = 0; i < 2; i++) {
+        n[i] = strtoul(p, &end, 10);
+        if (end == p || *end != ' ')
+            return NULL;
+        p = end + 1;
+    }
+    if (n[0] >= 2 || n[1] > PAGESIZE/32768)
+        return NULL;
+    *page = n[0];
+    count = n[1];
+
+    end_prev = 0;
+    for (int i = 0; i < count; i++) {
+        struct listing_rom *rl = NULL;
+        size_t len;
+
+        for (int j = 0; j < 4; j++) {
+            n[j] = strtoul(p, &end, 10);
+            if (end == p || *end != ':')
+                return NULL;
+            p = end + 1;
+        }
+        /* the listing must be a valid image, as those made by list() */
+        if (n[1] == 0 || (n[1] & (n[1] - 1)) != 0 || n[0] % n[1] != 0 ||
+            n[0] < end_prev || n[0] + n[1] > PAGESIZE)
+                return NULL;
+        end_prev = n[0] + n[1];
+
+        if (listing != NULL) {
+            rl = &listing->romlist[i];
+            rl->offset = n[0];
+            rl->header.romsize = n[1];
+            rl->header.enhancements = n[2] & HEADER_ENH_ALL;
+            rl->header.gbc_only = n[3] != 0;
+        }
+
+        len = strspn(p, "0123456789abcdef");
+        if (len % 2 != 0 || len > 2*HEADER_TITLE_SIZE || p[len] != ' ')
+            return NULL;
+        if (rl != NULL) {
+            for (size_t j = 0; j < len/2; j++) {
+                unsigned c;
+
+                sscanf(p + 2*j, "%2x", &c);
+                rl->header.title[j] = c;
+            }
+            rl->header.title[len/2] = '\0';
+        }
+        p += len + 1;
+    }
+    if (listing != NULL)
+        listing->count = count;
+
+    return p;
+}
+
+/**
+ * Look up the listing of "page" on the cart "cartid".
+ *
+ * Returns 0 if found, 1 otherwise.
+ */
+int
+listcache_load(const char *cartid, int page, struct listing *listing) {
+    static char line[LISTCACHE_LINESIZE];
+    static struct listing l;
+    char *path, *id;
+    int found, p;
+    FILE *f;
+
+    if ((path = listcache_path()) == NULL)
+        return 1;
+    if ((f = fopen(path, "r")) == NULL)
+        return 1;
+
+    found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((id = parse_line(line, &p, &l)) != NULL && p == page &&
+            strcmp(id, cartid) == 0) {
+                *listing = l;
+                found = 1;
+        }
+    }
+    fclose(f);
+
+    return !found;
+}
+
+/**
+ * Replace the entries of "page" (-1 for both pages) of the cart "cartid" by
+ * "listing", or drop them if "listing" is NULL.
+ */
+static int
+listcache_update(const char *cartid, int page, const struct listing *listing) {
+    static char line[LISTCACHE_LINESIZE];
+    char tmppath[1024+8], *path, *id;
+    FILE *f, *tmp;
+    int p;
+
+    if ((path = listcache_path()) == NULL)
+        return 0;
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >=
+        sizeof(tmppath)) {
+            warnx("path of the listing file too long");
+            return 1;
+    }
+
+    if ((tmp = fopen(tmppath, "w")) == NULL) {
+        warn("can't create %s", tmppath);
+        return 1;
+    }
+
+    /* keep the entries of the other pages and carts */
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((id = parse_line(line, &p, NULL)) == NULL)
+                continue;
+            if ((page == -1 || p == page) && strcmp(id, cartid) == 0)
+                continue;
+            fprintf(tmp, "%s\n", line);
+        }
+        fclose(f);
+    }
+
+    if (listing != NULL) {
+        fprintf(tmp, "%d %d ", page, listing->count);
+        for (int i = 0; i < listing->count; i++) {
+            const struct listing_rom *rl = &listing->romlist[i];
+
+            fprintf(tmp, "%"PRIuEMSSIZE":%"PRIuEMSSIZE":%d:%d:",
+                rl->offset, rl->header.romsize, (int)rl->header.enhancements,
+                rl->header.gbc_only);
+            for (const char *c = rl->header.title; *c != '\0'; c++)
+                fprintf(tmp, "%02x", (unsigned char)*c);
+            fputc(' ', tmp);
+        }
+        fprintf(tmp, "%s\n", cartid);
+    }
+
+    if (fclose(tmp) == EOF) {
+        warn("error writing %s", tmppath);
+        remove(tmppath);
+        return 1;
+    }
+    if (rename(tmppath, path) == -1) {
+        warn("can't rename %s to %s", tmppath, path);
+        remove(tmppath);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Save the listing of "page" of the cart "cartid", replacing its previous
+ * entry.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+listcache_save(const char *cartid, int page, const struct listing *listing) {
+    return listcache_update(cartid, page, listing);
+}
+
+/**
+ * Drop the listing of "page" of the cart "cartid", of both pages if "page" is
+ * -1. Called before writing to the page.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+listcache_drop(const char *cartid, int page) {
+    return listcache_update(cartid, page, NULL);
+}
+
+/**
+ * Choose the offsets of the headers read back to validate "listing": those of
+ * the first and of the last ROMs and those of the first and of the last free
+ * 32 KB slots, where a ROM added by another host would likely be.
+ *
+ * Returns the number of offsets set in "offsets" (LISTCACHE_SAMPLES at most).
+ */
+int
+listcache_samples(const struct listing *listing, ems_size_t *offsets) {
+    ems_size_t ofs, firstfree, lastfree;
+    int n, i;
+
+    n = 0;
+    if (listing->count > 0)
+        offsets[n++] = listing->romlist[0].offset;
+    if (listing->count > 1)
+        offsets[n++] = listing->romlist[listing->count-1].offset;
+
+    firstfree = lastfree = PAGESIZE;
+    for (ofs = 0, i = 0; ofs < PAGESIZE; ofs += 32768) {
+        while (i < listing->count && listing->romlist[i].offset +
+            listing->romlist[i].header.romsize <= ofs)
+                i++;
+        if (i < listing->count && listing->romlist[i].offset <= ofs)
+            continue;
+        if (firstfree == PAGESIZE)
+            firstfree = ofs;
+        lastfree = ofs;
+    }
+    if (firstfree != PAGESIZE)
+        offsets[n++] = firstfree;
+    if (lastfree != firstfree)
+        offsets[n++] = lastfree;
+
+    return n;
+}
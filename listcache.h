@@ -0,0 +1,25 @@
+#ifndef EMS_LISTCACHE_H
+#define EMS_LISTCACHE_H
+
+#include "ems.h"
+#include "header.h"
+
+/* headers of the listing read back to validate an entry */
+#define LISTCACHE_SAMPLES 4
+
+struct listing_rom {
+    ems_size_t offset;
+    struct header header;
+};
+
+struct listing {
+    int count;
+    struct listing_rom romlist[PAGESIZE/32768];
+};
+
+int listcache_load(const char *, int, struct listing *);
+int listcache_save(const char *, int, const struct listing *);
+int listcache_drop(const char *, int);
+int listcache_samples(const struct listing *, ems_size_t *);
+
+#endif /* EMS_LISTCACHE_H */
@@ -6,8 +6,17 @@
 #include <string.h>
 
 #include "ems.h"
+#include "ems-daemon.h"
 #include "header.h"
 #include "cmd.h"
+#include "cache.h"
+#include "flash.h"
+#include "listcache.h"
+#include "readq.h"
+#include "record.h"
+#include "stats.h"
+#include "tune.h"
+#include "wear.h"
 
 // don't forget to bump this :P
 #define VERSION "0.04"
@@ -22,6 +31,13 @@ const int limits[3] = {0, PAGESIZE, SRAMSIZE};
 #define MODE_FORMAT 5
 #define MODE_RESTORE 6
 #define MODE_DUMP 7
+#define MODE_AUTOTUNE 8
+#define MODE_REPLAY 9
+#define MODE_DAEMON 10
+#define MODE_SNAPSHOT 11
+#define MODE_HISTORY 12
+#define MODE_RESTORESNAP 13
+#define MODE_JOBS 14
 
 /* options */
 typedef struct _options_t {
@@ -34,6 +50,16 @@ typedef struct _options_t {
     int rem_argc;
     char **rem_argv;
     int force;
+    int diff;
+    int verify;
+    int compress;
+    int sparse;
+    int all;
+    int queuedepth;
+    int cachesize;
+    char *backend;
+    int batch;
+    int snapshot;
 } options_t;
 
 // defaults
@@ -45,12 +71,18 @@ options_t opts = {
     .bank               = 0,
     .space              = 0,
     .force              = 0,
+    .diff               = 0,
+    .verify             = 0,
+    .compress           = 0,
+    .sparse             = 0,
+    .all                = 0,
+    .queuedepth         = READQ_DEFAULTDEPTH,
+    .cachesize          = CACHE_DEFAULTSIZE>>10,
+    .backend            = NULL,
+    .batch              = 0,
+    .snapshot           = 0,
 };
 
-// default blocksizes
-#define BLOCKSIZE_READ  4096
-#define BLOCKSIZE_WRITE 32
-
 /**
  * Usage
  */
@@ -59,12 +91,47 @@ void usage(char *name) {
     printf("\n");
     printf("Options:\n");
     printf(" --force              force writing of ROMs from different models "
-           "of Game Boy\n");
+           "of Game Boy,\n"
+           "                      or restoring a snapshot of another cart\n");
     printf(" --verbose            displays more information and a progress "
            "bar\n");
     printf(" --page PAGE          select cart page (1 or 2).\n");
     printf(" --save               force restore/dump to/from SRAM\n");
     printf(" --rom                force restore/dump to/from Flash\n");
+    printf(" --diff               with --restore, rewrite only the blocks "
+           "that differ\n");
+    printf(" --verify             with --write, --restore, --restore-snapshot "
+           "or --jobs,\n"
+           "                      read back and check the data written\n");
+    printf(" --compress           with --dump, write a compressed image "
+           "(--restore reads\n"
+           "                      both kinds)\n");
+    printf(" --all                with --dump or --restore, both pages in "
+           "one file, and the\n"
+           "                      SRAM with --save\n");
+    printf(" --sparse             with --dump, write only the ROMs of the "
+           "page and the\n"
+           "                      erase-blocks holding data are restored\n");
+    printf(" --queue-depth N      number of read commands kept in flight "
+           "(default: %d)\n", READQ_DEFAULTDEPTH);
+    printf(" --cache-size KB      memory caching the flash read during the "
+           "command, 0 to\n"
+           "                      disable (default: %d)\n",
+           (int)(CACHE_DEFAULTSIZE>>10));
+    printf(" --blocksize SIZE     size of the read (--read, --dump) or write "
+           "(--write,\n"
+           "                      --restore) commands, overrides --autotune\n");
+    printf(" --backend NAME[:ARG] device to use instead of the USB cart "
+           "(default: $EMS_BACKEND)\n");
+    printf(" --stats[=json]       print the counts and latencies of the "
+           "operations at exit\n");
+    printf(" --trace FILE         write a timeline of the operations in the "
+           "Chrome trace\n"
+           "                      format\n");
+    printf(" --record FILE        record the commands sent to the cart\n");
+    printf(" --batch N            with --replay, number of write commands per "
+           "transfer\n"
+           "                      (default: as recorded)\n");
     printf("\n");
     printf("Commands:\n");
     printf(" --read BANK:FILE...  read ROMs with the specified banks to "
@@ -77,6 +144,24 @@ void usage(char *name) {
     printf(" --delete BANK...     delete ROMs with the specified banks\n");
     printf(" --format             delete all ROMs of the specified page\n");
     printf(" --title              list page content\n");
+    printf(" --snapshot           save a snapshot of the SRAM in the store "
+           "on the host\n");
+    printf(" --history            list the snapshots of the SRAM of the "
+           "cart\n");
+    printf(" --restore-snapshot N restore the snapshot N of the SRAM, "
+           "rewriting only the\n"
+           "                      blocks that differ\n");
+    printf(" --jobs FILE          run the steps of the manifest FILE (- for "
+           "the standard\n"
+           "                      input) in one session\n");
+    printf(" --autotune           measure and save the best transfer sizes "
+           "for the cart\n");
+    printf(" --replay FILE        execute the commands recorded in FILE and "
+           "report the\n"
+           "                      time taken\n");
+    printf(" --daemon [SOCKET]    keep the cart open and serve the clients "
+           "of the daemon\n"
+           "                      backend (same as running ems-flasherd)\n");
     printf(" --version            print version number\n");
     printf(" --help               show this help\n");
     printf("\n");
@@ -87,6 +172,9 @@ void usage(char *name) {
            "SRAM.\n");
     printf("To select between ROM and SRAM, use ONE of the --save / --rom options.\n");
     printf("\n");
+    printf("Backends:\n");
+    ems_listbackends();
+    printf("\n");
     printf("Written by Mike Ryan <mikeryan@lacklustre.net> and others\n");
     printf("See web site for more info:\n");
     printf("    http://lacklustre.net/gb/ems/\n");
@@ -118,6 +206,25 @@ void get_options(int argc, char **argv) {
             {"save", 0, 0, 'S'},
             {"rom", 0, 0, 'R'},
             {"force", 0, 0, 'F'},
+            {"diff", 0, 0, 'I'},
+            {"verify", 0, 0, 'y'},
+            {"compress", 0, 0, 'Z'},
+            {"sparse", 0, 0, 'G'},
+            {"all", 0, 0, 'L'},
+            {"queue-depth", 1, 0, 'Q'},
+            {"cache-size", 1, 0, 'K'},
+            {"autotune", 0, 0, 'A'},
+            {"backend", 1, 0, 'B'},
+            {"stats", 2, 0, 'T'},
+            {"trace", 1, 0, 'X'},
+            {"record", 1, 0, 'C'},
+            {"replay", 0, 0, 'P'},
+            {"batch", 1, 0, 'N'},
+            {"daemon", 0, 0, 'D'},
+            {"snapshot", 0, 0, 'O'},
+            {"history", 0, 0, 'H'},
+            {"restore-snapshot", 1, 0, 'J'},
+            {"jobs", 0, 0, 'M'},
             {0, 0, 0, 0}
         };
 
@@ -167,13 +274,76 @@ void get_options(int argc, char **argv) {
                 if (opts.mode != 0) goto mode_error;
                 opts.mode = MODE_FORMAT;
                 break;
+            case 'A':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_AUTOTUNE;
+                break;
+            case 'B':
+                opts.backend = optarg;
+                break;
+            case 'T':
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    stats_enable(STATS_TEXT);
+                } else if (strcmp(optarg, "json") == 0) {
+                    stats_enable(STATS_JSON);
+                } else {
+                    printf("Error: --stats format must be text or json\n");
+                    usage(argv[0]);
+                }
+                atexit(stats_print);
+                break;
+            case 'X':
+                stats_trace(optarg);
+                break;
+            case 'C':
+                if (rec_open(optarg))
+                    exit(1);
+                atexit(rec_close);
+                break;
+            case 'P':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_REPLAY;
+                break;
+            case 'D':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_DAEMON;
+                break;
+            case 'O':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SNAPSHOT;
+                break;
+            case 'H':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_HISTORY;
+                break;
+            case 'J':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_RESTORESNAP;
+                optval = atoi(optarg);
+                if (optval < 1) {
+                    printf("Error: snapshot number must be > 0\n");
+                    usage(argv[0]);
+                }
+                opts.snapshot = optval;
+                break;
+            case 'M':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_JOBS;
+                break;
+            case 'N':
+                optval = atoi(optarg);
+                if (optval < 1) {
+                    printf("Error: batch must be > 0\n");
+                    usage(argv[0]);
+                }
+                opts.batch = optval;
+                break;
             case 's':
                 optval = atoi(optarg);
-                if (optval <= 0) {
-                    printf("Error: block size must be > 0\n");
+                if (optval <= 0 || (optval & (optval - 1)) != 0) {
+                    printf("Error: block size must be a power of two\n");
                     usage(argv[0]);
                 }
-                // TODO make sure it divides evenly into bank size
                 opts.blocksize = optval;
                 break;
             case 'b':
@@ -192,9 +362,42 @@ void get_options(int argc, char **argv) {
                 if (opts.space != 0) goto mode_error2;
                 opts.space = FROM_ROM;
                 break;
+            case 'I':
+                opts.diff = 1;
+                break;
+            case 'y':
+                opts.verify = 1;
+                break;
+            case 'Z':
+                opts.compress = 1;
+                break;
+            case 'G':
+                opts.sparse = 1;
+                break;
+            case 'L':
+                opts.all = 1;
+                break;
             case 'F':
                 opts.force = 1;
                 break;
+            case 'Q':
+                optval = atoi(optarg);
+                if (optval < 1 || optval > READQ_MAXDEPTH) {
+                    printf("Error: queue depth must range between 1 and %d\n",
+                        READQ_MAXDEPTH);
+                    usage(argv[0]);
+                }
+                opts.queuedepth = optval;
+                break;
+            case 'K':
+                optval = atoi(optarg);
+                if (optval < 0 || optval > (PAGESIZE>>9)) {
+                    printf("Error: cache size must range between 0 and %d KB\n",
+                        (int)(PAGESIZE>>9));
+                    usage(argv[0]);
+                }
+                opts.cachesize = optval;
+                break;
             default:
                 usage(argv[0]);
                 break;
@@ -205,22 +408,62 @@ void get_options(int argc, char **argv) {
     if (opts.mode == 0)
         goto mode_error;
 
+    if (opts.diff && opts.mode != MODE_RESTORE) {
+        printf("Error: --diff is only valid with --restore\n");
+        usage(argv[0]);
+    }
+
+    if (opts.verify && opts.mode != MODE_WRITE && opts.mode != MODE_RESTORE &&
+        opts.mode != MODE_RESTORESNAP && opts.mode != MODE_JOBS) {
+        printf("Error: --verify is only valid with --write, --restore, "
+            "--restore-snapshot or --jobs\n");
+        usage(argv[0]);
+    }
+
+    if (opts.compress && opts.mode != MODE_DUMP) {
+        printf("Error: --compress is only valid with --dump\n");
+        usage(argv[0]);
+    }
+
+    if (opts.sparse && (opts.mode != MODE_DUMP || opts.compress)) {
+        printf("Error: --sparse is only valid with --dump, without "
+            "--compress\n");
+        usage(argv[0]);
+    }
+
+    if (opts.all && ((opts.mode != MODE_DUMP && opts.mode != MODE_RESTORE) ||
+        opts.sparse)) {
+            printf("Error: --all is only valid with --dump or --restore, "
+                "without --sparse\n");
+            usage(argv[0]);
+    }
+
     opts.rem_argc = argc - optind;
     if (optind < argc)
         opts.rem_argv = &argv[optind];
 
-    if (opts.mode == MODE_FORMAT || opts.mode == MODE_TITLE) {
+    if (opts.mode == MODE_FORMAT || opts.mode == MODE_TITLE ||
+        opts.mode == MODE_AUTOTUNE || opts.mode == MODE_SNAPSHOT ||
+        opts.mode == MODE_HISTORY || opts.mode == MODE_RESTORESNAP) {
         if (optind < argc) {
             printf("Error: no argument expected\n");
             usage(argv[0]);
         }
+    } else if (opts.mode == MODE_DAEMON) {
+        if (optind + 1 < argc) {
+            printf("Error: at most one socket path expected\n");
+            usage(argv[0]);
+        }
+        if (optind < argc)
+            opts.file = argv[optind];
     } else if (opts.mode == MODE_DELETE) {
         if (optind >= argc) {
             printf("Error: you must provide bank numbers\n");
             usage(argv[0]);
         }
     } else if (opts.mode == MODE_WRITE || opts.mode == MODE_READ ||
-               opts.mode == MODE_RESTORE || opts.mode == MODE_DUMP) {
+               opts.mode == MODE_RESTORE || opts.mode == MODE_DUMP ||
+               opts.mode == MODE_REPLAY || opts.mode == MODE_JOBS) {
         // user didn't give a filename
         if (optind >= argc) {
             printf("Error: you must provide an %s filename\n", opts.mode == MODE_READ ? "output" : "input");
@@ -229,18 +472,14 @@ void get_options(int argc, char **argv) {
 
         // extra argument: ROM file
         opts.file = argv[optind];
-
-        // set a default blocksize if the user hasn't given one
-        if (opts.blocksize == 0)
-            opts.blocksize = (opts.mode == MODE_READ
-                || opts.mode == MODE_DUMP)? BLOCKSIZE_READ : BLOCKSIZE_WRITE;
     }
 
     return;
 
 mode_error:
     printf("Error: must supply exactly one of --read, --write, --dump, "
-           "--restore, --delete, --format or --title\n");
+           "--restore, --delete, --format, --title, --snapshot, --history, "
+           "--restore-snapshot, --jobs, --autotune, --replay or --daemon\n");
     usage(argv[0]);
 
 mode_error2:
@@ -248,24 +487,90 @@ mode_error2:
     usage(argv[0]);
 }
 
+/**
+ * Set the transfer sizes: the ones found by --autotune for this cart, if any,
+ * overridden by --blocksize.
+ */
+static void
+set_transfersizes(void) {
+    ems_size_t readsize = READBLOCKSIZE, writesize = WRITEBLOCKSIZE;
+    char devid[256];
+
+    if (ems_devid(devid, sizeof(devid)) == 0 &&
+        tune_load(devid, &readsize, &writesize) == 0 && opts.verbose)
+            printf("using tuned transfer sizes: read %"PRIuEMSSIZE
+                ", write %"PRIuEMSSIZE"\n", readsize, writesize);
+
+    if (flash_settransfersizes(readsize, writesize) != 0) {
+        warnx("ignoring invalid tuned transfer sizes, run --autotune again");
+        readsize = READBLOCKSIZE;
+        writesize = WRITEBLOCKSIZE;
+    }
+
+    if (opts.blocksize != 0) {
+        if (opts.mode == MODE_READ || opts.mode == MODE_DUMP)
+            readsize = opts.blocksize;
+        else
+            writesize = opts.blocksize;
+    }
+
+    if (flash_settransfersizes(readsize, writesize) != 0)
+        errx(1, "block size must range between %d and %"PRIuEMSSIZE
+            " for reads, %d and %d for writes", READBLOCKSIZE,
+            FLASH_MAXREADSIZE, WRITEBLOCKSIZE, FLASH_MAXWRITESIZE);
+}
+
 /**
  * Main
  */
 int main(int argc, char **argv) {
+    const char *progname;
     int r;
 
+    // invoked as ems-flasherd: the daemon
+    if ((progname = strrchr(argv[0], '/')) != NULL)
+        progname++;
+    else
+        progname = argv[0];
+    if (strcmp(progname, "ems-flasherd") == 0)
+        opts.mode = MODE_DAEMON;
+
     get_options(argc, argv);
 
+    // the daemon doesn't serve itself: EMS_BACKEND=daemon is for the clients
+    if (opts.mode == MODE_DAEMON && opts.backend == NULL &&
+        (opts.backend = getenv("EMS_BACKEND")) != NULL &&
+        strncmp(opts.backend, "daemon", 6) == 0)
+            opts.backend = "usb";
+    if (opts.mode == MODE_DAEMON && opts.backend != NULL &&
+        strncmp(opts.backend, "daemon", 6) == 0)
+            errx(1, "the daemon can't use the daemon backend");
+
+    readq_setdepth(opts.queuedepth);
+    flash_setverify(opts.verify);
+    // --restore accepts compressed images
+    flash_setpacked(opts.compress || opts.mode == MODE_RESTORE);
+    // the measures must see the device
+    if (opts.mode == MODE_AUTOTUNE || opts.mode == MODE_REPLAY)
+        opts.cachesize = 0;
+    cache_setsize((size_t)opts.cachesize<<10);
+
     if (opts.verbose)
         printf("trying to find EMS cart\n");
 
-    r = ems_init();
+    r = ems_init(opts.backend);
     if (r < 0)
         return 1;
 
     if (opts.verbose)
         printf("claimed EMS cart\n");
 
+    if (opts.mode == MODE_DAEMON)
+        return ems_serve(opts.file, opts.verbose);
+
+    if (opts.mode != MODE_AUTOTUNE)
+        set_transfersizes();
+
     // we'll need a buffer one way or another
     uint32_t base = opts.bank * PAGESIZE;
     if (opts.verbose)
@@ -278,7 +583,7 @@ int main(int argc, char **argv) {
         //are the last four characters .sav ?
         size_t namelen = strlen(opts.file);
 
-        if (opts.file[namelen - 4] == '.' &&
+        if (namelen >= 4 && opts.file[namelen - 4] == '.' &&
             tolower(opts.file[namelen - 3]) == 's' &&
             tolower(opts.file[namelen - 2]) == 'a' &&
             tolower(opts.file[namelen - 1]) == 'v') {
@@ -288,19 +593,49 @@ int main(int argc, char **argv) {
         }
     }
 
+    // count the erasures of the commands that may write the flash
+    if (opts.mode == MODE_WRITE || opts.mode == MODE_DELETE ||
+        opts.mode == MODE_FORMAT || opts.mode == MODE_JOBS ||
+        opts.mode == MODE_AUTOTUNE || opts.mode == MODE_REPLAY ||
+        (opts.mode == MODE_RESTORE && (opts.all || space == FROM_ROM)))
+            wear_start();
+
     // read the ROM and save it into the file
     if (opts.mode == MODE_READ) {
         cmd_read(opts.bank, opts.verbose, opts.rem_argc, opts.rem_argv);
+    } else if (opts.mode == MODE_DUMP && opts.all) {
+        cmd_dumpall(opts.verbose, opts.file, opts.space == FROM_SRAM);
+    } else if (opts.mode == MODE_RESTORE && opts.all) {
+        cmd_restoreall(opts.verbose, opts.file, opts.diff);
     } else if (opts.mode == MODE_DUMP) {
-        cmd_dump(opts.bank, opts.verbose, opts.file, space);
+        cmd_dump(opts.bank, opts.verbose, opts.file, space, opts.sparse);
     } else if (opts.mode == MODE_RESTORE) {
-        cmd_restore(opts.bank, opts.verbose, opts.file, space);
+        cmd_restore(opts.bank, opts.verbose, opts.file, space, opts.diff);
     } else if (opts.mode == MODE_WRITE) {
         cmd_write(opts.bank, opts.verbose, opts.force, opts.rem_argc, opts.rem_argv);
     } else if (opts.mode == MODE_DELETE) {
         cmd_delete(opts.bank, opts.verbose, opts.rem_argc, opts.rem_argv);
     } else if (opts.mode == MODE_FORMAT) {
         cmd_format(opts.bank, opts.verbose);
+    } else if (opts.mode == MODE_SNAPSHOT) {
+        cmd_snapshot(opts.verbose);
+    } else if (opts.mode == MODE_HISTORY) {
+        cmd_history();
+    } else if (opts.mode == MODE_RESTORESNAP) {
+        cmd_restoresnapshot(opts.verbose, opts.force, opts.snapshot);
+    } else if (opts.mode == MODE_JOBS) {
+        cmd_jobs(opts.verbose, opts.force, opts.file);
+    } else if (opts.mode == MODE_AUTOTUNE) {
+        cmd_autotune(opts.bank, opts.verbose);
+    } else if (opts.mode == MODE_REPLAY) {
+        char cartid[256];
+
+        // the commands replayed may write anywhere
+        if (ems_cartid(cartid, sizeof(cartid)) == 0 &&
+            listcache_drop(cartid, -1))
+                return 1;
+        if (rec_replay(opts.file, opts.batch, opts.verbose))
+            return 1;
     }
     // read the ROM header
     else if (opts.mode == MODE_TITLE) {
@@ -0,0 +1,596 @@
+/*
+ * Compressed images of a page or of the SRAM (--dump --compress).
+ *
+ * The image is compressed by chunks of PACK_CHUNKSIZE bytes, so that a chunk
+ * can be compressed as soon as it has been read from the cart and written to
+ * the cart as soon as it has been decompressed. The compression and the
+ * decompression run on a worker thread:
+ *   - pack_create() returns the buffer the image is read to. The caller
+ *     reports the bytes read with pack_filled() and the worker compresses and
+ *     writes the chunks completed while the next ones are read.
+ *   - pack_open() reads the whole file and checks it, nothing being written to
+ *     the cart if it is damaged. The worker decompresses the chunks in order
+ *     to the buffer returned and the caller waits with pack_wait() for those
+ *     it writes next.
+ *
+ * The codec is a LZ77 with a window of 64 KB: a sequence is a token, whose
+ * high nibble is the number of literals and the low one the length of the
+ * match minus 4 (15: the length continues in the next bytes, 255 meaning that
+ * another byte follows), the literals, then, unless it is the last sequence of
+ * the chunk, the distance of the match on 2 bytes (little-endian) and the rest
+ * of its length. A page mostly blank compresses to a few KB.
+ *
+ * The file is a header:
+ *   "EMSZ", version (1 byte), 3 bytes reserved, size of the image and size
+ *   of the chunks (4 bytes each)
+ * followed, for each chunk, by:
+ *   length of the data (4 bytes), flags (4 bytes, PACK_STORED if the data is
+ *   not compressed), hashes of the data and of the chunk (8 bytes each)
+ *   and the data
+ * The integers are little-endian, the hashes are those of hash64().
+ */
+
+/* for pread() */
+#define _XOPEN_SOURCE 600
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "pack.h"
+
+#define PACK_MAGIC "EMSZ"
+#define PACK_VERSION 1
+#define PACK_HEADERSIZE 16
+#define PACK_RECORDSIZE 24
+#define PACK_STORED 1
+
+/* largest image, both pages and the SRAM (--all) */
+#define PACK_MAXSIZE (2*PAGESIZE + SRAMSIZE)
+
+#define MINMATCH 4
+#define MAXDIST 65535
+#define HASHBITS 13
+
+char pack_lasterrorstr[256];
+
+/*
+ * struct pack: a compressed file being written or read
+ *   buf, size: the image
+ *   file, filesize: content of the file read
+ *   done: bytes of the image filled by the caller (writing) or decompressed
+ *         by the worker (reading)
+ *   stop: the caller closed the file
+ *   error: an error occured on the worker, described by errstr
+ */
+struct pack {
+    int fd, write;
+    unsigned char *buf;
+    ems_size_t size;
+    unsigned char *file;
+    size_t filesize;
+
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ems_size_t done;
+    int stop, error;
+    char errstr[sizeof(pack_lasterrorstr)];
+};
+
+static void
+put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> 8*i;
+}
+
+static uint32_t
+get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put_le64(unsigned char *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint64_t
+get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/* record an error of the worker, lock not held */
+static void
+pack_fail(struct pack *pk, const char *fmt, ...) {
+    va_list ap;
+
+    pthread_mutex_lock(&pk->lock);
+    va_start(ap, fmt);
+    vsnprintf(pk->errstr, sizeof(pk->errstr), fmt, ap);
+    va_end(ap);
+    pk->error = 1;
+    pthread_cond_broadcast(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+}
+
+static int
+writeall(int fd, const unsigned char *buf, size_t size) {
+    ssize_t n;
+
+    while (size > 0) {
+        if ((n = write(fd, buf, size)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* length beyond the nibble of the token */
+static size_t
+put_length(unsigned char *dst, size_t len) {
+    size_t n = 0;
+
+    for (; len >= 255; len -= 255)
+        dst[n++] = 255;
+    dst[n++] = len;
+    return n;
+}
+
+/* a sequence, the last one if "match" is 0 */
+static size_t
+put_sequence(unsigned char *dst, const unsigned char *lit, size_t nlit,
+    size_t match, size_t dist) {
+    size_t n = 1, mlen = match ? match - MINMATCH : 0;
+
+    dst[0] = (nlit < 15 ? nlit : 15) << 4 | (mlen < 15 ? mlen : 15);
+    if (nlit >= 15)
+        n += put_length(dst + n, nlit - 15);
+    memcpy(dst + n, lit, nlit);
+    n += nlit;
+    if (match) {
+        dst[n++] = dist;
+        dst[n++] = dist >> 8;
+        if (mlen >= 15)
+            n += put_length(dst + n, mlen - 15);
+    }
+    return n;
+}
+
+/**
+ * Compress the "size" bytes of "src" to "dst", which must hold
+ * PACK_BOUND(size) bytes.
+ *
+ * Returns the size of the compressed data.
+ */
+size_t
+pack_compress(const unsigned char *src, size_t size, unsigned char *dst) {
+    static uint32_t table[1<<HASHBITS];
+    size_t ip, anchor, op, ref, len;
+    uint32_t v, r;
+
+    memset(table, 0, sizeof(table));
+
+    ip = anchor = op = 0;
+    while (ip + MINMATCH <= size) {
+        memcpy(&v, src + ip, 4);
+        r = (v * 2654435761u) >> (32 - HASHBITS);
+        ref = table[r];
+        table[r] = ip;
+
+        if (ref >= ip || ip - ref > MAXDIST ||
+            memcmp(src + ref, src + ip, MINMATCH) != 0) {
+                ip++;
+                continue;
+        }
+
+        for (len = MINMATCH; ip + len < size && src[ref + len] ==
+            src[ip + len]; len++)
+                ;
+        op += put_sequence(dst + op, src + anchor, ip - anchor, len,
+            ip - ref);
+        ip += len;
+        anchor = ip;
+    }
+    op += put_sequence(dst + op, src + anchor, size - anchor, 0, 0);
+
+    return op;
+}
+
+/* length beyond the nibble of the token, (size_t)-1 if truncated */
+static size_t
+get_length(const unsigned char *src, size_t size, size_t *ip) {
+    size_t len = 0;
+    unsigned char b;
+
+    do {
+        if (*ip >= size)
+            return (size_t)-1;
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/**
+ * Decompress the "size" bytes of "src" to the "dstsize" bytes of "dst".
+ *
+ * Returns 0 on success, -1 if the data is invalid or doesn't decompress to
+ * exactly "dstsize" bytes.
+ */
+int
+pack_decompress(const unsigned char *src, size_t size, unsigned char *dst,
+    size_t dstsize) {
+    size_t ip, op, nlit, mlen, dist, ext;
+    unsigned char token;
+
+    ip = op = 0;
+    for (;;) {
+        if (ip >= size)
+            return -1;
+        token = src[ip++];
+
+        nlit = token >> 4;
+        if (nlit == 15) {
+            if ((ext = get_length(src, size, &ip)) == (size_t)-1)
+                return -1;
+            nlit += ext;
+        }
+        if (nlit > size - ip || nlit > dstsize - op)
+            return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // the last sequence has no match
+        if (ip == size)
+            return op == dstsize ? 0 : -1;
+
+        if (size - ip < 2)
+            return -1;
+        dist = src[ip] | src[ip+1] << 8;
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15) {
+            if ((ext = get_length(src, size, &ip)) == (size_t)-1)
+                return -1;
+            mlen += ext;
+        }
+        mlen += MINMATCH;
+        if (dist == 0 || dist > op || mlen > dstsize - op)
+            return -1;
+
+        // the match may overlap the bytes it produces
+        for (; mlen > 0; mlen--, op++)
+            dst[op] = dst[op - dist];
+    }
+}
+
+static void *
+pack_writer(void *arg) {
+    struct pack *pk = arg;
+    unsigned char *out, *chunk;
+    ems_size_t ofs, len, done;
+    size_t outlen;
+    uint32_t flags;
+
+    if ((out = malloc(PACK_RECORDSIZE + PACK_BOUND(PACK_CHUNKSIZE))) == NULL)
+        err(1, "malloc");
+
+    for (ofs = 0; ofs < pk->size; ofs += len) {
+        len = pk->size - ofs < PACK_CHUNKSIZE ? pk->size - ofs :
+            PACK_CHUNKSIZE;
+
+        pthread_mutex_lock(&pk->lock);
+        while (pk->done < ofs + len && !pk->stop)
+            pthread_cond_wait(&pk->cond, &pk->lock);
+        done = pk->done;
+        pthread_mutex_unlock(&pk->lock);
+        // the image wasn't read entirely
+        if (done < ofs + len)
+            break;
+
+        chunk = pk->buf + ofs;
+        outlen = pack_compress(chunk, len, out + PACK_RECORDSIZE);
+        flags = 0;
+        if (outlen >= len) {
+            memcpy(out + PACK_RECORDSIZE, chunk, len);
+            outlen = len;
+            flags = PACK_STORED;
+        }
+
+        put_le32(out, outlen);
+        put_le32(out + 4, flags);
+        put_le64(out + 8, hash64(out + PACK_RECORDSIZE, outlen));
+        put_le64(out + 16, hash64(chunk, len));
+        if (writeall(pk->fd, out, PACK_RECORDSIZE + outlen) == -1) {
+            pack_fail(pk, "write error: %s", strerror(errno));
+            break;
+        }
+    }
+
+    free(out);
+    return NULL;
+}
+
+static void *
+pack_reader(void *arg) {
+    struct pack *pk = arg;
+    const unsigned char *rec;
+    ems_size_t ofs, len;
+    size_t fileofs;
+    uint32_t datalen;
+    int stop;
+
+    fileofs = PACK_HEADERSIZE;
+    for (ofs = 0; ofs < pk->size; ofs += len) {
+        len = pk->size - ofs < PACK_CHUNKSIZE ? pk->size - ofs :
+            PACK_CHUNKSIZE;
+
+        pthread_mutex_lock(&pk->lock);
+        stop = pk->stop;
+        pthread_mutex_unlock(&pk->lock);
+        if (stop)
+            break;
+
+        // the records were checked by pack_open()
+        rec = pk->file + fileofs;
+        datalen = get_le32(rec);
+        if (get_le32(rec + 4) & PACK_STORED)
+            memcpy(pk->buf + ofs, rec + PACK_RECORDSIZE, len);
+        else if (pack_decompress(rec + PACK_RECORDSIZE, datalen,
+            pk->buf + ofs, len) != 0) {
+                pack_fail(pk, "invalid data in chunk at %#lx",
+                    (unsigned long)ofs);
+                break;
+        }
+        if (hash64(pk->buf + ofs, len) != get_le64(rec + 16)) {
+            pack_fail(pk, "checksum error in chunk at %#lx",
+                (unsigned long)ofs);
+            break;
+        }
+        fileofs += PACK_RECORDSIZE + datalen;
+
+        pthread_mutex_lock(&pk->lock);
+        pk->done = ofs + len;
+        pthread_cond_broadcast(&pk->cond);
+        pthread_mutex_unlock(&pk->lock);
+    }
+
+    return NULL;
+}
+
+static struct pack *
+pack_new(int fd, int write, ems_size_t size) {
+    struct pack *pk;
+
+    if ((pk = calloc(1, sizeof(*pk))) == NULL ||
+        (pk->buf = malloc(size ? size : 1)) == NULL)
+            err(1, "malloc");
+    pk->fd = fd;
+    pk->write = write;
+    pk->size = size;
+    pthread_mutex_init(&pk->lock, NULL);
+    pthread_cond_init(&pk->cond, NULL);
+
+    return pk;
+}
+
+static void
+pack_start(struct pack *pk, void *(*worker)(void *)) {
+    if ((errno = pthread_create(&pk->worker, NULL, worker, pk)) != 0)
+        err(1, "pthread_create");
+}
+
+static void
+pack_free(struct pack *pk) {
+    pthread_mutex_destroy(&pk->lock);
+    pthread_cond_destroy(&pk->cond);
+    free(pk->file);
+    free(pk->buf);
+    free(pk);
+}
+
+/**
+ * Check whether the file open on "fd" is a compressed image, without moving
+ * its offset, and get the size of the image if "size" isn't NULL.
+ *
+ * Returns 1 if it is, 0 if it isn't or can't be checked (not a regular file).
+ */
+int
+pack_probe(int fd, ems_size_t *size) {
+    unsigned char header[PACK_HEADERSIZE];
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, PACK_MAGIC, 4) != 0)
+            return 0;
+    if (size != NULL)
+        *size = get_le32(header + 8);
+    return 1;
+}
+
+/**
+ * Start writing a compressed image of "size" bytes to "fd". "*buf" is set to
+ * the buffer to read the image to (see pack_filled()).
+ *
+ * Returns NULL on error (see pack_lasterrorstr).
+ */
+struct pack *
+pack_create(int fd, ems_size_t size, unsigned char **buf) {
+    unsigned char header[PACK_HEADERSIZE] = PACK_MAGIC;
+    struct pack *pk;
+
+    header[4] = PACK_VERSION;
+    put_le32(header + 8, size);
+    put_le32(header + 12, PACK_CHUNKSIZE);
+    if (writeall(fd, header, sizeof(header)) == -1) {
+        snprintf(pack_lasterrorstr, sizeof(pack_lasterrorstr),
+            "write error: %s", strerror(errno));
+        return NULL;
+    }
+
+    pk = pack_new(fd, 1, size);
+    pack_start(pk, pack_writer);
+    *buf = pk->buf;
+
+    return pk;
+}
+
+/* record an error of pack_open() */
+static struct pack *
+open_error(struct pack *pk, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(pack_lasterrorstr, sizeof(pack_lasterrorstr), fmt, ap);
+    va_end(ap);
+    pack_free(pk);
+    return NULL;
+}
+
+/**
+ * Read the compressed image from "fd" and check its chunks. "*size" is set to
+ * the size of the image and "*buf" to the buffer it is decompressed to (see
+ * pack_wait()).
+ *
+ * Returns NULL if the file can't be read or is damaged (see
+ * pack_lasterrorstr).
+ */
+struct pack *
+pack_open(int fd, ems_size_t *size, unsigned char **buf) {
+    const unsigned char *rec;
+    size_t allocated, fileofs;
+    ems_size_t ofs, len;
+    uint32_t datalen, flags;
+    struct pack *pk;
+    ssize_t n;
+
+    pk = pack_new(fd, 0, 0);
+
+    allocated = 0;
+    for (;;) {
+        if (pk->filesize == allocated) {
+            allocated = allocated ? allocated*2 : 1<<20;
+            if ((pk->file = realloc(pk->file, allocated)) == NULL)
+                err(1, "malloc");
+        }
+        if ((n = read(fd, pk->file + pk->filesize, allocated -
+            pk->filesize)) == -1) {
+                if (errno == EINTR)
+                    continue;
+                return open_error(pk, "read error: %s", strerror(errno));
+        }
+        if (n == 0)
+            break;
+        pk->filesize += n;
+    }
+
+    if (pk->filesize < PACK_HEADERSIZE || memcmp(pk->file, PACK_MAGIC, 4) != 0)
+        return open_error(pk, "not a compressed image");
+    if (pk->file[4] != PACK_VERSION)
+        return open_error(pk, "unsupported version %d", pk->file[4]);
+    pk->size = get_le32(pk->file + 8);
+    if (pk->size > PACK_MAXSIZE ||
+        get_le32(pk->file + 12) != PACK_CHUNKSIZE)
+            return open_error(pk, "invalid header");
+
+    // check every chunk before anything is written
+    fileofs = PACK_HEADERSIZE;
+    for (ofs = 0; ofs < pk->size; ofs += len) {
+        len = pk->size - ofs < PACK_CHUNKSIZE ? pk->size - ofs :
+            PACK_CHUNKSIZE;
+
+        if (pk->filesize - fileofs < PACK_RECORDSIZE)
+            return open_error(pk, "truncated at chunk %#lx",
+                (unsigned long)ofs);
+        rec = pk->file + fileofs;
+        datalen = get_le32(rec);
+        flags = get_le32(rec + 4);
+        if (pk->filesize - fileofs - PACK_RECORDSIZE < datalen)
+            return open_error(pk, "truncated at chunk %#lx",
+                (unsigned long)ofs);
+        if ((flags & ~PACK_STORED) != 0 ||
+            ((flags & PACK_STORED) && datalen != len) ||
+            hash64(rec + PACK_RECORDSIZE, datalen) != get_le64(rec + 8))
+                return open_error(pk, "checksum error in chunk at %#lx",
+                    (unsigned long)ofs);
+        fileofs += PACK_RECORDSIZE + datalen;
+    }
+    if (fileofs != pk->filesize)
+        return open_error(pk, "garbage after the last chunk");
+
+    if ((pk->buf = realloc(pk->buf, pk->size ? pk->size : 1)) == NULL)
+        err(1, "malloc");
+    pack_start(pk, pack_reader);
+    *size = pk->size;
+    *buf = pk->buf;
+
+    return pk;
+}
+
+/**
+ * Report that the first "count" bytes of the image being written have been
+ * filled.
+ */
+void
+pack_filled(struct pack *pk, ems_size_t count) {
+    pthread_mutex_lock(&pk->lock);
+    pk->done = count;
+    pthread_cond_broadcast(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+}
+
+/**
+ * Wait for the first "count" bytes of the image being read to be
+ * decompressed.
+ *
+ * Returns 0 on success, non-zero on error (see pack_lasterrorstr).
+ */
+int
+pack_wait(struct pack *pk, ems_size_t count) {
+    int r;
+
+    pthread_mutex_lock(&pk->lock);
+    while (pk->done < count && !pk->error)
+        pthread_cond_wait(&pk->cond, &pk->lock);
+    if ((r = pk->error))
+        strcpy(pack_lasterrorstr, pk->errstr);
+    pthread_mutex_unlock(&pk->lock);
+
+    return r;
+}
+
+/**
+ * Wait for the chunks filled to be written, or stop the decompression, and
+ * free "pk". The file is not closed.
+ *
+ * Returns 0 on success, non-zero on error (see pack_lasterrorstr).
+ */
+int
+pack_close(struct pack *pk) {
+    int r;
+
+    pthread_mutex_lock(&pk->lock);
+    pk->stop = 1;
+    pthread_cond_broadcast(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+    pthread_join(pk->worker, NULL);
+
+    if ((r = pk->error))
+        strcpy(pack_lasterrorstr, pk->errstr);
+    pack_free(pk);
+
+    return r;
+}
@@ -0,0 +1,28 @@
+#ifndef EMS_PACK_H
+#define EMS_PACK_H
+
+#include <stddef.h>
+
+#include "ems.h"
+
+/* bytes compressed together, an erase-block of the flash memory */
+#define PACK_CHUNKSIZE ERASEBLOCKSIZE
+
+/* size of the buffer receiving the compression of n bytes */
+#define PACK_BOUND(n) ((n) + (n)/255 + 16)
+
+struct pack;
+
+extern char pack_lasterrorstr[];
+
+int pack_probe(int, ems_size_t *);
+struct pack *pack_create(int, ems_size_t, unsigned char **);
+struct pack *pack_open(int, ems_size_t *, unsigned char **);
+void pack_filled(struct pack *, ems_size_t);
+int pack_wait(struct pack *, ems_size_t);
+int pack_close(struct pack *);
+
+size_t pack_compress(const unsigned char *, size_t, unsigned char *);
+int pack_decompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+#endif /* EMS_PACK_H */
@@ -69,6 +69,7 @@ progress_start(struct progress_totals totals) {
  *     A transfer type: ERASE, WRITEF, READ, WRITE. This information is useful
  *     to estimate at best the transfer rate as it can differ from one type to
  *     another. REFRESH simply display the last status.
+ *     With the SKIP flag, the transfer is removed from the totals instead.
  *   bytes:
  *      The size of the chunk transfered.
  *
@@ -86,6 +87,14 @@ progress(int type, ems_size_t bytes) {
     double remtime, dt;
     long diff;
 
+    if (type != PROGRESS_REFRESH && (type & PROGRESS_SKIP)) {
+        type &= ~PROGRESS_SKIP;
+        bytes = type == PROGRESS_ERASE ? 1 : bytes;
+        progress_type[type].total -= bytes;
+        progress_type[type].remain -= bytes;
+        goto refresh;
+    }
+
     if (type == PROGRESS_REFRESH || prectime.tv_sec == 0)
         goto refresh;
 
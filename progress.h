@@ -9,6 +9,9 @@ enum {
     PROGRESS_TYPESNB
 };
 
+/* flag of a transfer that turned out to be unnecessary */
+#define PROGRESS_SKIP 0x100
+
 struct progress_totals {
     int erase, writef, write, read;
 };
@@ -0,0 +1,286 @@
+/*
+ * Read queue: keep several read commands in flight and deliver the data in
+ * order.
+ *
+ * A read queue holds up to "depth" outstanding requests (see readq_setdepth()).
+ * Requests are either submitted one by one with readq_submit() or generated
+ * from a sequential range set by readq_stream(). readq_next() waits for the
+ * oldest request and returns its data. Before returning, the queue is refilled
+ * so the device keeps working while the caller processes the data.
+ *
+ * The requests are executed by a backend (see readq.h). When no backend is set,
+ * requests are executed synchronously with ems_read() at submission time. This
+ * is the case of the software transports and of the test mocks.
+ *
+ * Once a request has failed, no other request is submitted: the remaining
+ * requests are only completed and the error is returned by readq_next() in
+ * order.
+ *
+ * The flash memory is read through the cache (see cache.c): the requests it
+ * can serve are completed at submission without going to the backend.
+ *
+ * Buffers
+ *
+ *   The data is read in a buffer owned by the queue (bufsize given to
+ *   readq_new()) unless the caller provides the destination. A buffer returned
+ *   by readq_next() stays valid until the next call to readq_next() or
+ *   readq_free().
+ */
+
+#include <err.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "ems.h"
+#include "readq.h"
+#include "record.h"
+#include "stats.h"
+
+struct readq {
+    int from, depth, size;
+    int head, count, failed;
+    size_t bufsize;
+    struct readq_req *reqs;
+    unsigned char *bufs;
+
+    /* sequential range set by readq_stream() */
+    uint32_t streamofs;
+    ems_size_t streamremain;
+    size_t streamblock;
+    unsigned char *streamdst;
+};
+
+static const struct readq_backend *readq_backend;
+static void *readq_ctx;
+static int readq_depth = READQ_DEFAULTDEPTH;
+
+void
+readq_setbackend(const struct readq_backend *backend, void *ctx) {
+    readq_backend = backend;
+    readq_ctx = ctx;
+}
+
+void
+readq_setdepth(int depth) {
+    if (depth < 1)
+        depth = 1;
+    if (depth > READQ_MAXDEPTH)
+        depth = READQ_MAXDEPTH;
+    readq_depth = depth;
+}
+
+/**
+ * Create a read queue for FROM_ROM or FROM_SRAM. bufsize is the size of the
+ * buffers owned by the queue, it may be 0 if the caller always provides the
+ * destination of the reads.
+ *
+ * Exit on memory allocation error.
+ */
+struct readq *
+readq_new(int from, size_t bufsize) {
+    return readq_newdepth(from, bufsize, readq_depth);
+}
+
+/**
+ * Same as readq_new() with "depth" requests in flight at most instead of the
+ * depth set by readq_setdepth(), if it is higher. Used for small reads, whose
+ * cost is mostly the latency.
+ */
+struct readq *
+readq_newdepth(int from, size_t bufsize, int depth) {
+    struct readq *rq;
+
+    if ((rq = calloc(1, sizeof(*rq))) == NULL)
+        err(1, "malloc");
+
+    if (depth < readq_depth)
+        depth = readq_depth;
+    if (depth > READQ_MAXDEPTH)
+        depth = READQ_MAXDEPTH;
+
+    rq->from = from;
+    rq->depth = depth;
+    /* one more slot for the buffer lent to the caller by readq_next() */
+    rq->size = rq->depth + 1;
+    rq->bufsize = bufsize;
+
+    if ((rq->reqs = calloc(rq->size, sizeof(*rq->reqs))) == NULL)
+        err(1, "malloc");
+    if (bufsize > 0 && (rq->bufs = malloc(rq->size * bufsize)) == NULL)
+        err(1, "malloc");
+
+    return rq;
+}
+
+/**
+ * Returns non-zero if no more request can be submitted for now.
+ */
+int
+readq_full(struct readq *rq) {
+    return rq->count >= rq->depth || rq->failed;
+}
+
+/**
+ * Queue a read of "count" bytes at "offset". The data is read in "dst" or, if
+ * it is NULL, in a buffer of the queue.
+ *
+ * Returns non-zero if the request was not queued: the queue is full or a
+ * previous request has failed.
+ */
+int
+readq_submit(struct readq *rq, uint32_t offset, size_t count,
+    unsigned char *dst) {
+    struct readq_req *req;
+    int n;
+
+    if (readq_full(rq))
+        return 1;
+
+    n = (rq->head + rq->count) % rq->size;
+    req = &rq->reqs[n];
+
+    if (dst == NULL) {
+        if (count > rq->bufsize)
+            errx(1, "internal error: readq_submit: count > bufsize");
+        dst = rq->bufs + n*rq->bufsize;
+    }
+
+    req->offset = offset;
+    req->count = count;
+    req->buf = dst;
+    req->result = READQ_PENDING;
+    req->cached = 0;
+    rq->count++;
+
+    if (readq_backend == NULL) {
+        req->result = ems_read(rq->from, offset, dst, count);
+    } else if (rq->from == FROM_ROM && cache_read(offset, dst, count)) {
+        req->result = count;
+        req->cached = 1;
+    } else {
+        req->stamp = cache_stamp();
+        STATS_START(req->stime);
+        if (readq_backend->submit(readq_ctx, rq->from, req))
+            req->result = -1;
+    }
+
+    if (req->result != READQ_PENDING && req->result != (int)count)
+        rq->failed = 1;
+
+    return 0;
+}
+
+static void
+readq_fill(struct readq *rq) {
+    while (rq->streamremain > 0 && !readq_full(rq)) {
+        size_t count;
+
+        count = rq->streamblock;
+        if (count > rq->streamremain)
+            count = rq->streamremain;
+
+        readq_submit(rq, rq->streamofs, count, rq->streamdst);
+
+        rq->streamofs += count;
+        rq->streamremain -= count;
+        if (rq->streamdst != NULL)
+            rq->streamdst += count;
+    }
+}
+
+/**
+ * Read "size" bytes starting at "offset" by chunks of "blocksize" bytes. The
+ * requests are generated as the queue drains. If "dst" is not NULL, the data
+ * is read directly to it, otherwise blocksize must not exceed the size of the
+ * buffers of the queue.
+ */
+void
+readq_stream(struct readq *rq, uint32_t offset, ems_size_t size,
+    size_t blocksize, unsigned char *dst) {
+
+    rq->streamofs = offset;
+    rq->streamremain = size;
+    rq->streamblock = blocksize;
+    rq->streamdst = dst;
+
+    readq_fill(rq);
+}
+
+/**
+ * Wait for the oldest request and set *buf (and *offset if not NULL) to its
+ * data.
+ *
+ * Returns:
+ *   > 0   number of bytes read (error if different from the count requested)
+ *   0     no request left
+ *   < 0   error (as returned by ems_read())
+ */
+int
+readq_next(struct readq *rq, unsigned char **buf, uint32_t *offset) {
+    struct readq_req *req;
+    int r;
+
+    readq_fill(rq);
+
+    if (rq->count == 0)
+        return 0;
+
+    req = &rq->reqs[rq->head];
+    if (req->result == READQ_PENDING)
+        readq_backend->wait(readq_ctx, req);
+
+    r = req->result;
+
+    // reads done synchronously are accounted and cached by ems_read()
+    if (readq_backend != NULL && !req->cached) {
+        STATS_STOP_ASYNC(req->stime, rq->from == FROM_ROM ? STATS_READ :
+            STATS_READ_SRAM, 1, r > 0 ? r : 0);
+        rec_read(rq->from, req->offset, req->count, req->buf, r, 1);
+        if (rq->from == FROM_ROM && r == (int)req->count)
+            cache_fill(req->offset, req->buf, req->count, req->stamp);
+    }
+    if (r != (int)req->count)
+        rq->failed = 1;
+
+    *buf = req->buf;
+    if (offset != NULL)
+        *offset = req->offset;
+
+    rq->head = (rq->head + 1) % rq->size;
+    rq->count--;
+
+    readq_fill(rq);
+
+    return r;
+}
+
+/**
+ * Free a read queue. Outstanding requests are completed first: the device
+ * would send their data anyway.
+ */
+void
+readq_free(struct readq *rq) {
+    if (rq == NULL)
+        return;
+
+    for (; rq->count > 0; rq->count--) {
+        struct readq_req *req = &rq->reqs[rq->head];
+
+        if (req->result == READQ_PENDING)
+            readq_backend->wait(readq_ctx, req);
+        if (readq_backend != NULL && !req->cached)
+            rec_read(rq->from, req->offset, req->count, req->buf,
+                req->result, 1);
+        rq->head = (rq->head + 1) % rq->size;
+    }
+
+    if (readq_backend != NULL && readq_backend->release != NULL) {
+        for (int i = 0; i < rq->size; i++)
+            if (rq->reqs[i].priv != NULL)
+                readq_backend->release(readq_ctx, &rq->reqs[i]);
+    }
+
+    free(rq->reqs);
+    free(rq->bufs);
+    free(rq);
+}
@@ -0,0 +1,65 @@
+#ifndef EMS_READQ_H
+#define EMS_READQ_H
+
+#include <limits.h>
+
+#include "ems.h"
+
+#define READQ_DEFAULTDEPTH 8
+#define READQ_MAXDEPTH 64
+
+#define READQ_PENDING INT_MIN
+
+/*
+ * struct readq_req: a read request handed to a backend.
+ *   offset, count, buf: parameters of the read, as for ems_read()
+ *   result: READQ_PENDING until the request is completed. Then, the value
+ *           ems_read() would have returned.
+ *   stime: time of submission (see stats.h)
+ *   cached: served by the cache without going to the backend (see cache.h)
+ *   stamp: stamp of the cache at submission
+ *   priv: private data of the backend. It is kept when the request is reused
+ *         and released by readq_free() with the release operation.
+ *
+ * struct readq_backend: asynchronous read operations. They receive the context
+ *   given to readq_setbackend().
+ *   submit: start the read. Returns non-zero if the request couldn't be
+ *           submitted. The backend may complete the request immediately.
+ *   wait: block until the request is completed.
+ *   release: free the private data of a request (optional).
+ *
+ * Requests are submitted in order and the backend must process them in that
+ * order on the device.
+ */
+
+struct readq_req {
+    uint32_t offset;
+    size_t count;
+    unsigned char *buf;
+    int result;
+    uint64_t stime;
+    int cached;
+    unsigned long stamp;
+    void *priv;
+};
+
+struct readq_backend {
+    int (*submit)(void *, int, struct readq_req *);
+    void (*wait)(void *, struct readq_req *);
+    void (*release)(void *, struct readq_req *);
+};
+
+struct readq;
+
+void readq_setbackend(const struct readq_backend *, void *);
+void readq_setdepth(int);
+struct readq *readq_new(int, size_t);
+struct readq *readq_newdepth(int, size_t, int);
+int readq_full(struct readq *);
+int readq_submit(struct readq *, uint32_t, size_t, unsigned char *);
+void readq_stream(struct readq *, uint32_t, ems_size_t, size_t,
+    unsigned char *);
+int readq_next(struct readq *, unsigned char **, uint32_t *);
+void readq_free(struct readq *);
+
+#endif /* EMS_READQ_H */
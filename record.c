@@ -0,0 +1,177 @@
+/*
+ * Record of the commands sent to the device (--record). See replay.c for the
+ * replay.
+ *
+ * Record format
+ *
+ *   The file starts with the 8 bytes REC_MAGIC, followed by a record per
+ *   command. Integers are little endian.
+ *
+ *     offset 0 (1 byte):   opcode of the command (see the Tech file)
+ *     offset 1 (1 byte):   flags
+ *                            REC_ASYNC: read in flight in a read queue
+ *                            REC_NEWXFER: first write command of a transfer
+ *                            REC_PAYLOAD: the data follows the record
+ *     offset 2 (4 bytes):  address
+ *     offset 6 (4 bytes):  length
+ *     offset 10 (4 bytes): result, as returned by ems_read() or the number of
+ *                          bytes of this command written by ems_writev()
+ *     offset 14 (8 bytes): time of the command in ns (see stats_now())
+ *     offset 22 (8 bytes): hash of the data read or written (see hash64())
+ *     offset 30:           data of write commands
+
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "record.h"
+#include "stats.h"
+
+static FILE *rec_file;
+
+static void
+put_le(unsigned char *p, uint64_t v, int size) {
+    for (int i = 0; i < size; i++)
+        p[i] = v >> (8*i);
+}
+
+static uint64_t
+get_le(unsigned char *p, int size) {
+    uint64_t v = 0;
+
+    for (int i = size - 1; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/**
+ * Record the commands to the file "path".
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+rec_open(const char *path) {
+    if ((rec_file = fopen(path, "wb")) == NULL) {
+        warn("can't create %s", path);
+        return 1;
+    }
+    if (fwrite(REC_MAGIC, 8, 1, rec_file) != 1) {
+        warn("error writing %s", path);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+rec_put(int opcode, int flags, uint32_t addr, uint32_t len, int result,
+    unsigned char *data, size_t datalen) {
+    unsigned char hdr[REC_HDRSIZE];
+
+    hdr[0] = opcode;
+    hdr[1] = flags;
+    put_le(hdr + 2, addr, 4);
+    put_le(hdr + 6, len, 4);
+    put_le(hdr + 10, (uint32_t)result, 4);
+    put_le(hdr + 14, stats_now(), 8);
+    put_le(hdr + 22, hash64(data, datalen), 8);
+
+    if (fwrite(hdr, REC_HDRSIZE, 1, rec_file) != 1 ||
+        ((flags & REC_PAYLOAD) && fwrite(data, len, 1, rec_file) != 1)) {
+            warn("error writing the record");
+            fclose(rec_file);
+            rec_file = NULL;
+    }
+}
+
+/**
+ * Record a read command of "count" bytes at "offset" in "from" that returned
+ * "result" in "buf". "async" is non-zero if the read was in flight in a read
+ * queue.
+ */
+void
+rec_read(int from, uint32_t offset, size_t count, unsigned char *buf,
+    int result, int async) {
+    if (rec_file == NULL)
+        return;
+
+    rec_put(from == FROM_ROM ? REC_READ : REC_READ_SRAM,
+        async ? REC_ASYNC : 0, offset, count, result, buf,
+        result > 0 ? result : 0);
+}
+
+/**
+ * Record the write commands of a transfer, "result" being the value returned
+ * by ems_writev().
+ */
+void
+rec_writev(int to, struct ems_iovec *iov, int iovcnt, int result) {
+    int i, r;
+
+    if (rec_file == NULL)
+        return;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (result < 0) {
+            r = result;
+        } else {
+            r = result < iov[i].count ? result : iov[i].count;
+            result -= r;
+        }
+        rec_put(to == TO_ROM ? REC_WRITE : REC_WRITE_SRAM,
+            REC_PAYLOAD | (i == 0 ? REC_NEWXFER : 0), iov[i].offset,
+            iov[i].count, r, iov[i].buf, iov[i].count);
+    }
+}
+
+void
+rec_close(void) {
+    if (rec_file == NULL)
+        return;
+
+    if (fclose(rec_file) == EOF)
+        warn("error writing the record");
+    rec_file = NULL;
+}
+
+/**
+ * Read the next record of "f". The data of a write is allocated.
+ *
+ * Returns 1 if a record was read, 0 at the end of the file. Exits on error.
+ */
+int
+rec_get(FILE *f, struct rec *rec) {
+    unsigned char hdr[REC_HDRSIZE];
+    size_t n;
+
+    if ((n = fread(hdr, 1, REC_HDRSIZE, f)) == 0 && !ferror(f))
+        return 0;
+    if (n < REC_HDRSIZE)
+        errx(1, "truncated or unreadable record");
+
+    rec->opcode = hdr[0];
+    rec->flags = hdr[1];
+    rec->addr = get_le(hdr + 2, 4);
+    rec->len = get_le(hdr + 6, 4);
+    rec->result = (int32_t)get_le(hdr + 10, 4);
+    rec->time = get_le(hdr + 14, 8);
+    rec->hash = get_le(hdr + 22, 8);
+    rec->data = NULL;
+
+    if (rec->opcode != REC_READ && rec->opcode != REC_READ_SRAM &&
+        rec->opcode != REC_WRITE && rec->opcode != REC_WRITE_SRAM)
+            errx(1, "invalid record (opcode %#x)", rec->opcode);
+
+    if (rec->flags & REC_PAYLOAD) {
+        if ((rec->data = malloc(rec->len)) == NULL)
+            err(1, "malloc");
+        if (fread(rec->data, rec->len, 1, f) != 1)
+            errx(1, "truncated or unreadable record");
+    }
+
+    return 1;
+}
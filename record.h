@@ -0,0 +1,35 @@
+#ifndef EMS_RECORD_H
+#define EMS_RECORD_H
+
+#include <stdio.h>
+
+#include "ems.h"
+
+#define REC_MAGIC "EMSREC\0\1"
+#define REC_HDRSIZE 30
+
+/* opcodes of the commands, as sent to the device */
+enum {
+    REC_READ = 0xff, REC_WRITE = 0x57,
+    REC_READ_SRAM = 0x6d, REC_WRITE_SRAM = 0x4d
+};
+
+enum {REC_ASYNC = 1, REC_NEWXFER = 2, REC_PAYLOAD = 4};
+
+/* a record, see record.c for the format */
+struct rec {
+    int opcode, flags;
+    uint32_t addr, len;
+    int32_t result;
+    uint64_t time, hash;
+    unsigned char *data;
+};
+
+int rec_open(const char *);
+void rec_read(int, uint32_t, size_t, unsigned char *, int, int);
+void rec_writev(int, struct ems_iovec *, int, int);
+void rec_close(void);
+int rec_get(FILE *, struct rec *);
+int rec_replay(const char *, int, int);
+
+#endif /* EMS_RECORD_H */
@@ -0,0 +1,211 @@
+/*
+ * Replay of a record of commands (--replay), see record.c for the format.
+ *
+ * The commands are executed in order on the current backend (typically the
+ * simulator or an image file) with the settings of this invocation:
+ * consecutive reads are kept in flight by a read queue (--queue-depth) and
+ * consecutive write commands are sent by transfers of "batch" commands or,
+ * if batch is 0, as they were recorded. The time taken and the reads whose
+ * data differ from the record are reported.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "readq.h"
+#include "record.h"
+#include "stats.h"
+
+static int
+is_read(struct rec *rec) {
+    return rec->opcode == REC_READ || rec->opcode == REC_READ_SRAM;
+}
+
+static int
+rec_from(struct rec *rec) {
+    return rec->opcode == REC_READ || rec->opcode == REC_WRITE ?
+        FROM_ROM : FROM_SRAM;
+}
+
+struct replay {
+    unsigned long reads, writes, xfers, mismatches, errors;
+
+    /* reads in flight, with their expected length and hash */
+    struct readq *rq;
+    int rqfrom;
+    struct {
+        size_t len;
+        uint64_t hash;
+    } inflight[READQ_MAXDEPTH+1];
+    int ninflight, head;
+
+    /* write commands of the transfer being built */
+    struct ems_iovec *iov;
+    int iovcnt, iovsize, to;
+};
+
+/* complete the oldest read in flight and check its data */
+static void
+replay_next(struct replay *rp) {
+    unsigned char *buf;
+    size_t len;
+    int r;
+
+    r = readq_next(rp->rq, &buf, NULL);
+    len = rp->inflight[rp->head].len;
+
+    rp->reads++;
+    if (r != len)
+        rp->errors++;
+    else if (hash64(buf, len) != rp->inflight[rp->head].hash)
+        rp->mismatches++;
+    free(buf);
+
+    rp->head = (rp->head + 1) % (READQ_MAXDEPTH+1);
+    rp->ninflight--;
+}
+
+/* complete the reads in flight */
+static void
+replay_drain(struct replay *rp) {
+    if (rp->rq == NULL)
+        return;
+
+    while (rp->ninflight > 0)
+        replay_next(rp);
+    readq_free(rp->rq);
+    rp->rq = NULL;
+}
+
+/* send the write commands of the transfer being built */
+static void
+replay_flush(struct replay *rp) {
+    size_t total = 0;
+
+    if (rp->iovcnt == 0)
+        return;
+
+    for (int i = 0; i < rp->iovcnt; i++)
+        total += rp->iov[i].count;
+    if (ems_writev(rp->to, rp->iov, rp->iovcnt) != total)
+        rp->errors++;
+
+    rp->writes += rp->iovcnt;
+    rp->xfers++;
+    for (int i = 0; i < rp->iovcnt; i++)
+        free(rp->iov[i].buf);
+    rp->iovcnt = 0;
+}
+
+static void
+replay_read(struct replay *rp, struct rec *rec) {
+    unsigned char *buf;
+    int n;
+
+    replay_flush(rp);
+
+    if (rp->rq != NULL && rp->rqfrom != rec_from(rec))
+        replay_drain(rp);
+    if (rp->rq == NULL) {
+        rp->rq = readq_new(rec_from(rec), 0);
+        rp->rqfrom = rec_from(rec);
+    }
+
+    // make room: complete the oldest read
+    if (readq_full(rp->rq) && rp->ninflight > 0)
+        replay_next(rp);
+
+    if ((buf = malloc(rec->len)) == NULL)
+        err(1, "malloc");
+    if (readq_submit(rp->rq, rec->addr, rec->len, buf)) {
+        free(buf);
+        rp->reads++;
+        rp->errors++;
+        return;
+    }
+
+    n = (rp->head + rp->ninflight) % (READQ_MAXDEPTH+1);
+    rp->inflight[n].len = rec->len;
+    rp->inflight[n].hash = rec->hash;
+    rp->ninflight++;
+}
+
+static void
+replay_write(struct replay *rp, struct rec *rec, int batch) {
+    replay_drain(rp);
+
+    if (rp->iovcnt > 0 && (rp->to != rec_from(rec) ||
+        (batch == 0 && (rec->flags & REC_NEWXFER)) ||
+        (batch > 0 && rp->iovcnt == batch)))
+            replay_flush(rp);
+
+    if (rp->iovcnt == rp->iovsize) {
+        rp->iovsize = rp->iovsize ? rp->iovsize * 2 : 64;
+        if ((rp->iov = realloc(rp->iov, rp->iovsize * sizeof(*rp->iov))) ==
+            NULL)
+                err(1, "malloc");
+    }
+
+    rp->to = rec_from(rec);
+    rp->iov[rp->iovcnt].offset = rec->addr;
+    rp->iov[rp->iovcnt].buf = rec->data;
+    rp->iov[rp->iovcnt].count = rec->len;
+    rp->iovcnt++;
+}
+
+/**
+ * Replay the record "path" on the current backend, sending the write commands
+ * by transfers of "batch" commands (0: as recorded).
+ *
+ * Returns 0 if all the commands succeeded, 1 otherwise. Exits if the record is
+ * invalid.
+ */
+int
+rec_replay(const char *path, int batch, int verbose) {
+    struct replay rp;
+    struct rec rec;
+    uint64_t start, first, last;
+    unsigned long n;
+    char magic[8];
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        err(1, "can't open %s", path);
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, REC_MAGIC, 8) != 0)
+        errx(1, "%s: not a record of ems-flasher", path);
+
+    memset(&rp, 0, sizeof(rp));
+    first = last = 0;
+    start = stats_now();
+
+    for (n = 0; rec_get(f, &rec); n++) {
+        if (n == 0)
+            first = rec.time;
+        last = rec.time;
+
+        if (is_read(&rec))
+            replay_read(&rp, &rec);
+        else
+            replay_write(&rp, &rec, batch);
+    }
+    replay_drain(&rp);
+    replay_flush(&rp);
+
+    fclose(f);
+    free(rp.iov);
+
+    printf("Replayed %lu commands: %lu reads, %lu writes in %lu transfers\n",
+        n, rp.reads, rp.writes, rp.xfers);
+    printf("Time: %.3f s (recorded: %.3f s)\n",
+        (stats_now() - start) / 1e9, (last - first) / 1e9);
+    if (rp.mismatches > 0 || verbose)
+        printf("Reads differing from the record: %lu\n", rp.mismatches);
+    if (rp.errors > 0)
+        printf("Failed commands: %lu\n", rp.errors);
+
+    return rp.errors > 0;
+}
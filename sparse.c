@@ -0,0 +1,319 @@
+/*
+ * Sparse images of a page (--dump --sparse).
+ *
+ * Only the ROMs of the page are read (the free space is considered blank) and
+ * only the non-blank extents of the page are kept, with the listing of the
+ * ROMs and the hashes of the erase-blocks. --restore writes only the
+ * erase-blocks holding data or a part of a ROM: a blank erase-block of a ROM
+ * must be erased on the cart.
+ *
+ * The file is a header:
+ *   "EMSS", version (1 byte), 3 bytes reserved, size of the page, number of
+ *   ROMs and number of extents (4 bytes each)
+ * followed by the ROMs of the listing:
+ *   offset, size (4 bytes each), enhancements, gbc_only (1 byte each),
+ *   2 bytes reserved, title (16 bytes, padded with NULs)
+ * the hashes of the erase-blocks of the page (8 bytes each) and the extents:
+ *   offset, length (4 bytes each) and the data
+ * The integers are little-endian. The extents are multiples of SPARSE_GRAIN
+ * bytes, in order.
+ *
+ * The file is checked entirely when it is loaded: the hashes of the
+ * erase-blocks must match the data and the listing the headers of the ROMs.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "header.h"
+#include "listcache.h"
+#include "sparse.h"
+
+#define SPARSE_MAGIC "EMSS"
+#define SPARSE_VERSION 1
+#define SPARSE_HEADERSIZE 20
+#define SPARSE_ROMSIZE (12 + HEADER_TITLE_SIZE)
+
+static void
+put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> 8*i;
+}
+
+static uint32_t
+get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int
+is_blank(const unsigned char *buf, ems_size_t size) {
+    for (ems_size_t i = 0; i < size; i++)
+        if (buf[i] != 0xff)
+            return 0;
+    return 1;
+}
+
+/**
+ * Find the first extent of "data" from "ofs".
+ *
+ * Returns its offset, PAGESIZE if there is none, and sets "*end" to its end.
+ */
+static ems_size_t
+next_extent(const unsigned char *data, ems_size_t ofs, ems_size_t *end) {
+    for (; ofs < PAGESIZE && is_blank(data + ofs, SPARSE_GRAIN);
+        ofs += SPARSE_GRAIN)
+            ;
+    for (*end = ofs; *end < PAGESIZE && !is_blank(data + *end, SPARSE_GRAIN);
+        *end += SPARSE_GRAIN)
+            ;
+    return ofs;
+}
+
+/**
+ * Check whether the file "path" is a sparse image.
+ *
+ * Returns 1 if it is, 0 if it isn't or can't be read.
+ */
+int
+sparse_probe(const char *path) {
+    unsigned char magic[4];
+    FILE *f;
+    int r;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return 0;
+    r = fread(magic, sizeof(magic), 1, f) == 1 &&
+        memcmp(magic, SPARSE_MAGIC, 4) == 0;
+    fclose(f);
+
+    return r;
+}
+
+/**
+ * Set "image->used": the erase-blocks holding data and those covered by a ROM
+ * of the listing, whose blank parts must be blank on the cart too.
+ */
+static void
+set_used(struct sparse_image *image) {
+    struct listing *listing = &image->listing;
+    ems_size_t ofs;
+    int i;
+
+    for (i = 0; i < SPARSE_NBLOCKS; i++)
+        image->used[i] = !is_blank(image->data + i*ERASEBLOCKSIZE,
+            ERASEBLOCKSIZE);
+
+    for (i = 0; i < listing->count; i++)
+        for (ofs = listing->romlist[i].offset; ofs <
+            listing->romlist[i].offset + listing->romlist[i].header.romsize;
+            ofs += ERASEBLOCKSIZE)
+                image->used[ofs/ERASEBLOCKSIZE] = 1;
+}
+
+/**
+ * Write the page "image->data", whose ROMs are "image->listing", to the file
+ * "path". Sets "image->hashes" and "image->used".
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+sparse_save(const char *path, struct sparse_image *image) {
+    unsigned char buf[SPARSE_ROMSIZE];
+    ems_size_t ofs, end, nextents;
+    FILE *f;
+    int i, ok;
+
+    nextents = 0;
+    for (ofs = 0; (ofs = next_extent(image->data, ofs, &end)) < PAGESIZE;
+        ofs = end)
+            nextents++;
+
+    for (i = 0; i < SPARSE_NBLOCKS; i++)
+        image->hashes[i] = hash64(image->data + i*ERASEBLOCKSIZE,
+            ERASEBLOCKSIZE);
+    set_used(image);
+
+    if ((f = fopen(path, "wb")) == NULL) {
+        warn("can't create %s", path);
+        return 1;
+    }
+
+    memset(buf, 0, SPARSE_HEADERSIZE);
+    memcpy(buf, SPARSE_MAGIC, 4);
+    buf[4] = SPARSE_VERSION;
+    put_le32(buf + 8, PAGESIZE);
+    put_le32(buf + 12, image->listing.count);
+    put_le32(buf + 16, nextents);
+    fwrite(buf, SPARSE_HEADERSIZE, 1, f);
+
+    for (i = 0; i < image->listing.count; i++) {
+        struct listing_rom *rl = &image->listing.romlist[i];
+
+        memset(buf, 0, sizeof(buf));
+        put_le32(buf, rl->offset);
+        put_le32(buf + 4, rl->header.romsize);
+        buf[8] = rl->header.enhancements;
+        buf[9] = rl->header.gbc_only;
+        memcpy(buf + 12, rl->header.title, strlen(rl->header.title));
+        fwrite(buf, SPARSE_ROMSIZE, 1, f);
+    }
+
+    for (i = 0; i < SPARSE_NBLOCKS; i++) {
+        put_le32(buf, image->hashes[i]);
+        put_le32(buf + 4, image->hashes[i] >> 32);
+        fwrite(buf, 8, 1, f);
+    }
+
+    for (ofs = 0; (ofs = next_extent(image->data, ofs, &end)) < PAGESIZE;
+        ofs = end) {
+        put_le32(buf, ofs);
+        put_le32(buf + 4, end - ofs);
+        fwrite(buf, 8, 1, f);
+        fwrite(image->data + ofs, end - ofs, 1, f);
+    }
+
+    ok = !ferror(f);
+    if (fclose(f) == EOF || !ok) {
+        warn("error writing %s", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* read "size" bytes or print an error */
+static int
+readf(FILE *f, const char *path, unsigned char *buf, size_t size) {
+    if (fread(buf, size, 1, f) == 1)
+        return 0;
+    if (ferror(f))
+        warn("error reading %s", path);
+    else
+        warnx("%s is truncated", path);
+    return 1;
+}
+
+/**
+ * Read the sparse image "path" to "image" and check it.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+sparse_load(const char *path, struct sparse_image *image) {
+    unsigned char buf[SPARSE_ROMSIZE];
+    ems_size_t ofs, len, end_prev, nextents;
+    struct listing *listing;
+    FILE *f;
+    int i, c;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        warn("can't open %s", path);
+        return 1;
+    }
+
+    if (readf(f, path, buf, SPARSE_HEADERSIZE))
+        goto error;
+    if (memcmp(buf, SPARSE_MAGIC, 4) != 0 || buf[4] != SPARSE_VERSION ||
+        get_le32(buf + 8) != PAGESIZE ||
+        get_le32(buf + 12) > PAGESIZE/32768) {
+            warnx("%s: not a sparse image of a page", path);
+            goto error;
+    }
+    listing = &image->listing;
+    listing->count = get_le32(buf + 12);
+    nextents = get_le32(buf + 16);
+
+    end_prev = 0;
+    for (i = 0; i < listing->count; i++) {
+        struct listing_rom *rl = &listing->romlist[i];
+
+        if (readf(f, path, buf, SPARSE_ROMSIZE))
+            goto error;
+        rl->offset = get_le32(buf);
+        rl->header.romsize = get_le32(buf + 4);
+        rl->header.enhancements = buf[8] & HEADER_ENH_ALL;
+        rl->header.gbc_only = buf[9] != 0;
+        memcpy(rl->header.title, buf + 12, HEADER_TITLE_SIZE);
+        rl->header.title[HEADER_TITLE_SIZE] = '\0';
+
+        /* the listing must be a valid image, as those made by list() */
+        if (rl->header.romsize < 32768 ||
+            (rl->header.romsize & (rl->header.romsize - 1)) != 0 ||
+            rl->offset % rl->header.romsize != 0 || rl->offset < end_prev ||
+            rl->offset + rl->header.romsize > PAGESIZE) {
+                warnx("%s: invalid listing", path);
+                goto error;
+        }
+        end_prev = rl->offset + rl->header.romsize;
+    }
+
+    for (i = 0; i < SPARSE_NBLOCKS; i++) {
+        if (readf(f, path, buf, 8))
+            goto error;
+        image->hashes[i] = get_le32(buf) | (uint64_t)get_le32(buf + 4) << 32;
+    }
+
+    memset(image->data, 0xff, PAGESIZE);
+    end_prev = 0;
+    for (; nextents > 0; nextents--) {
+        if (readf(f, path, buf, 8))
+            goto error;
+        ofs = get_le32(buf);
+        len = get_le32(buf + 4);
+        if (ofs < end_prev || ofs > PAGESIZE || len == 0 ||
+            len > PAGESIZE - ofs || ofs % SPARSE_GRAIN != 0 ||
+            len % SPARSE_GRAIN != 0) {
+                warnx("%s: invalid extent", path);
+                goto error;
+        }
+        if (readf(f, path, image->data + ofs, len))
+            goto error;
+        end_prev = ofs + len;
+    }
+    if ((c = getc(f)) != EOF) {
+        warnx("%s: garbage after the last extent", path);
+        goto error;
+    }
+    fclose(f);
+
+    for (i = 0; i < SPARSE_NBLOCKS; i++) {
+        unsigned char *block = image->data + i*ERASEBLOCKSIZE;
+
+        if (hash64(block, ERASEBLOCKSIZE) != image->hashes[i]) {
+            warnx("%s: checksum error in erase-block %d", path, i);
+            return 1;
+        }
+    }
+
+    // the listing describes the data
+    for (i = 0; i < listing->count; i++) {
+        struct listing_rom *rl = &listing->romlist[i];
+        struct header header;
+
+        if (header_validate(image->data + rl->offset) != 0) {
+            warnx("%s: no ROM at the offset %"PRIuEMSSIZE" of the listing",
+                path, rl->offset);
+            return 1;
+        }
+        header_decode(&header, image->data + rl->offset);
+        if (strcmp(header.title, rl->header.title) != 0 ||
+            header.romsize != rl->header.romsize ||
+            header.enhancements != rl->header.enhancements ||
+            header.gbc_only != rl->header.gbc_only) {
+                warnx("%s: the listing doesn't match the ROM at the offset "
+                    "%"PRIuEMSSIZE, path, rl->offset);
+                return 1;
+        }
+    }
+    set_used(image);
+
+    return 0;
+
+error:
+    fclose(f);
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef EMS_SPARSE_H
+#define EMS_SPARSE_H
+
+#include <stdint.h>
+
+#include "ems.h"
+#include "listcache.h"
+
+/* granularity of the extents, a pair of write commands */
+#define SPARSE_GRAIN 64
+
+#define SPARSE_NBLOCKS (PAGESIZE/ERASEBLOCKSIZE)
+
+/*
+ * struct sparse_image: a page image made of the ROMs only
+ *   listing: the ROMs of the page
+ *   data: the page, blank (0xFF) out of the extents
+ *   hashes: hashes of the erase-blocks of the page (see hash64())
+ *   used: non-zero for the erase-blocks holding data or a part of a ROM
+ */
+struct sparse_image {
+    struct listing listing;
+    unsigned char data[PAGESIZE];
+    uint64_t hashes[SPARSE_NBLOCKS];
+    char used[SPARSE_NBLOCKS];
+};
+
+int sparse_probe(const char *);
+int sparse_save(const char *, struct sparse_image *);
+int sparse_load(const char *, struct sparse_image *);
+
+#endif /* EMS_SPARSE_H */
@@ -0,0 +1,256 @@
+/*
+ * Statistics (--stats): count, number of commands, bytes and latency of the
+ * USB transfers, of the file I/O, of the flash_* functions and of the update
+ * commands. The same operations are written to the timeline of --trace (see
+ * trace.c).
+ *
+ * Latencies are measured in nanoseconds on the clock of the transport backend
+ * when it has one (the virtual clock of the simulator) or on the monotonic
+ * clock of the system. They are kept in histograms with 4 buckets per power of
+ * two (precision of about 20%) from which the percentiles are computed.
+ *
+ * A write transfer counts as an erase when one of its commands starts an
+ * erase-block. The reads of the flash memory served by the cache (see cache.c)
+ * are accounted as cache-hit instead of read, those it couldn't serve as
+ * cache-miss in addition to read. Reads completed through a read queue are accounted from their
+ * submission.
+ */
+
+/* for clock_gettime() */
+#define _XOPEN_SOURCE 500
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define NBUCKETS 256
+
+/* consumers of the operations recorded (stats_enabled) */
+#define STATS_SUMMARY 1
+#define STATS_TRACE 2
+
+#ifndef NOSTATS
+
+static const struct {
+    const char *name, *cat;
+} ops[STATS_OPSNB] = {
+    {"read", "usb"}, {"read-sram", "usb"}, {"write", "usb"},
+    {"write-sram", "usb"}, {"erase", "usb"},
+    {"file-read", "file"}, {"file-write", "file"},
+    {"flash_writef", "flash"}, {"flash_readf", "flash"},
+    {"flash_move", "flash"}, {"flash_read", "flash"},
+    {"flash_write", "flash"}, {"flash_erase", "flash"},
+    {"flash_delete", "flash"}, {"flash_diffwritef", "flash"},
+    {"update-writef", "update"}, {"update-move", "update"},
+    {"update-write", "update"}, {"update-read", "update"},
+    {"update-erase", "update"},
+    {"cache-hit", "cache"}, {"cache-miss", "cache"}
+};
+
+static struct {
+    unsigned long count, cmds, bytes;
+    uint64_t total, max;
+    unsigned long hist[NBUCKETS];
+} stats[STATS_OPSNB];
+
+int stats_enabled;
+static int stats_format;
+
+static uint64_t (*stats_clock)(void *);
+static void *stats_clockctx;
+
+/**
+ * Enable the statistics. They are printed by stats_print() in the format
+ * STATS_TEXT or STATS_JSON.
+ */
+void
+stats_enable(int format) {
+    stats_enabled |= STATS_SUMMARY;
+    stats_format = format;
+}
+
+/**
+ * Write the operations to the trace file "path". Exits on error.
+ */
+void
+stats_trace(const char *path) {
+    if (trace_open(path))
+        exit(1);
+    atexit(trace_close);
+    stats_enabled |= STATS_TRACE;
+}
+
+/**
+ * Use the clock "clock" instead of the clock of the system. NULL restores the
+ * clock of the system.
+ */
+void
+stats_setclock(uint64_t (*clock)(void *), void *ctx) {
+    stats_clock = clock;
+    stats_clockctx = ctx;
+}
+
+/**
+ * Current time, in nanoseconds
+ */
+uint64_t
+stats_now(void) {
+    struct timespec ts;
+
+    if (stats_clock != NULL)
+        return stats_clock(stats_clockctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bucket(uint64_t v) {
+    int msb;
+
+    if (v < 4)
+        return v;
+    for (msb = 2; (v >> msb) > 1; msb++)
+        ;
+    return (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+}
+
+/* highest value held by bucket "n" */
+static uint64_t
+bucket_max(int n) {
+    int msb;
+
+    if (n < 3)
+        return n;
+    n++;
+    msb = n / 4 + 1;
+    return ((uint64_t)(4 + n % 4) << (msb - 2)) - 1;
+}
+
+/**
+ * Account an operation of "cmds" commands and "bytes" bytes started at
+ * "start" (as returned by stats_now()). "async" is non-zero if the operation
+ * may overlap with others.
+ */
+void
+stats_record(int op, unsigned long cmds, unsigned long bytes, uint64_t start,
+    int async) {
+    uint64_t end, lat;
+
+    end = stats_now();
+    lat = end - start;
+
+    if (stats_enabled & STATS_TRACE)
+        trace_span(ops[op].name, ops[op].cat, start, end, cmds, bytes, async);
+    if (!(stats_enabled & STATS_SUMMARY))
+        return;
+
+    stats[op].count++;
+    stats[op].cmds += cmds;
+    stats[op].bytes += bytes;
+    stats[op].total += lat;
+    if (lat > stats[op].max)
+        stats[op].max = lat;
+    stats[op].hist[bucket(lat)]++;
+}
+
+/* latency under which "pct" percents of the operations completed */
+static uint64_t
+percentile(int op, int pct) {
+    unsigned long target, cum;
+    int n;
+
+    target = (stats[op].count * pct + 99) / 100;
+    for (n = 0, cum = 0; n < NBUCKETS; n++) {
+        cum += stats[op].hist[n];
+        if (cum >= target)
+            break;
+    }
+
+    return bucket_max(n) < stats[op].max ? bucket_max(n) : stats[op].max;
+}
+
+/**
+ * Print the statistics on the standard error if they are enabled
+ */
+void
+stats_print(void) {
+    int op, first;
+
+    if (!(stats_enabled & STATS_SUMMARY))
+        return;
+
+    if (stats_format == STATS_JSON) {
+        fprintf(stderr, "{\"operations\": {");
+        for (op = 0, first = 1; op < STATS_OPSNB; op++) {
+            if (stats[op].count == 0)
+                continue;
+            fprintf(stderr, "%s\n  \"%s\": {\"count\": %lu, \"commands\": %lu, "
+                "\"bytes\": %lu, \"total_ns\": %llu, \"p50_ns\": %llu, "
+                "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+                first ? "" : ",", ops[op].name, stats[op].count,
+                stats[op].cmds, stats[op].bytes,
+                (unsigned long long)stats[op].total,
+                (unsigned long long)percentile(op, 50),
+                (unsigned long long)percentile(op, 90),
+                (unsigned long long)percentile(op, 99),
+                (unsigned long long)stats[op].max);
+            first = 0;
+        }
+        fprintf(stderr, "\n}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-14s %7s %7s %9s %9s %8s %8s %8s %8s %8s\n",
+        "operation", "count", "cmds", "bytes", "KB/s", "total s", "p50 ms",
+        "p90 ms", "p99 ms", "max ms");
+    for (op = 0; op < STATS_OPSNB; op++) {
+        if (stats[op].count == 0)
+            continue;
+        fprintf(stderr, "%-14s %7lu %7lu %9lu %9.1f %8.3f %8.3f %8.3f %8.3f "
+            "%8.3f\n", ops[op].name, stats[op].count, stats[op].cmds,
+            stats[op].bytes,
+            stats[op].total ? stats[op].bytes / 1.024 / stats[op].total *
+                1e6 : 0,
+            stats[op].total / 1e9, percentile(op, 50) / 1e6,
+            percentile(op, 90) / 1e6, percentile(op, 99) / 1e6,
+            stats[op].max / 1e6);
+    }
+}
+
+#else
+
+void
+stats_enable(int format) {
+    errx(1, "statistics are not compiled in (see config.sh)");
+}
+
+void
+stats_trace(const char *path) {
+    errx(1, "tracing is not compiled in (see config.sh)");
+}
+
+void
+stats_setclock(uint64_t (*clock)(void *), void *ctx) {
+}
+
+uint64_t
+stats_now(void) {
+    return 0;
+}
+
+void
+stats_record(int op, unsigned long cmds, unsigned long bytes, uint64_t start,
+    int async) {
+}
+
+void
+stats_print(void) {
+}
+
+#endif /* NOSTATS */
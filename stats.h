@@ -0,0 +1,67 @@
+#ifndef EMS_STATS_H
+#define EMS_STATS_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Operations accounted by --stats and traced by --trace (see stats.c)
+ */
+enum {
+    STATS_READ, STATS_READ_SRAM, STATS_WRITE, STATS_WRITE_SRAM, STATS_ERASE,
+    STATS_FILE_READ, STATS_FILE_WRITE,
+    STATS_FLASH_WRITEF, STATS_FLASH_READF, STATS_FLASH_MOVE, STATS_FLASH_READ,
+    STATS_FLASH_WRITE, STATS_FLASH_ERASE, STATS_FLASH_DELETE,
+    STATS_FLASH_DIFFWRITEF,
+    STATS_UPDATE_WRITEF, STATS_UPDATE_MOVE, STATS_UPDATE_WRITE,
+    STATS_UPDATE_READ, STATS_UPDATE_ERASE,
+    STATS_CACHE_HIT, STATS_CACHE_MISS,
+    STATS_OPSNB
+};
+
+enum {STATS_TEXT, STATS_JSON};
+
+/*
+ * Instrumentation. Compiles to nothing when NOSTATS is defined
+ * (config.sh --disable-stats).
+ *
+ *   STATS_TIMER(t);
+ *   ... operation ...
+ *   STATS_STOP(t, op, commands, bytes);
+ *
+ * STATS_START(t) sets an existing variable, of type uint64_t, instead.
+ * STATS_STOP_ASYNC() is used for operations that overlap with others (reads
+ * in flight in a read queue).
+ *
+ * The arguments of STATS_STOP() are evaluated only when the statistics are
+ * enabled.
+ */
+#ifndef NOSTATS
+
+extern int stats_enabled;
+
+#define STATS_TIMER(t) uint64_t t = stats_enabled ? stats_now() : 0
+#define STATS_START(t) ((t) = stats_enabled ? stats_now() : 0)
+#define STATS_STOP(t, op, cmds, bytes) \
+    (stats_enabled ? stats_record((op), (cmds), (bytes), (t), 0) : (void)0)
+#define STATS_STOP_ASYNC(t, op, cmds, bytes) \
+    (stats_enabled ? stats_record((op), (cmds), (bytes), (t), 1) : (void)0)
+
+#else
+
+#define STATS_TIMER(t)
+#define STATS_START(t) ((void)0)
+#define STATS_STOP(t, op, cmds, bytes) ((void)0)
+#define STATS_STOP_ASYNC(t, op, cmds, bytes) ((void)0)
+
+#endif
+
+void stats_enable(int);
+void stats_trace(const char *);
+void stats_setclock(uint64_t (*)(void *), void *);
+uint64_t stats_now(void);
+void stats_record(int, unsigned long, unsigned long, uint64_t, int);
+void stats_print(void);
+
+#endif /* EMS_STATS_H */
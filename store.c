@@ -0,0 +1,339 @@
+/*
+ * Snapshots of the SRAM of the carts, kept on the host.
+ *
+ * The SRAM is stored by chunks of STORE_CHUNKSIZE bytes named by their hash
+ * (see hash64()): the chunks that didn't change since a previous snapshot, of
+ * any cart, aren't stored again. The store is the directory named by the
+ * EMS_STORE environment variable or ~/.ems-flasher-store:
+ *   chunks/HASH  a chunk, HASH being its hash in hexadecimal
+ *   snapshots    one line per snapshot (see ems_cartid() and
+ *                ems_fingerprint()):
+ *                  ID TIME HASH0 ... HASH31 FINGERPRINT CARTID
+ *
+ * A chunk whose hash is already in the store is compared with the stored one:
+ * a collision is an error rather than a snapshot restoring other data. The
+ * chunks read back are checked against their hash.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "store.h"
+
+#define STORE_DIRNAME ".ems-flasher-store"
+#define STORE_LINESIZE ((STORE_NCHUNKS+1)*17 + 1024)
+
+/**
+ * Set "buf" to the path of "name" in the store, the store itself if "name" is
+ * NULL.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+static int
+store_path(char *buf, size_t size, const char *name) {
+    char *p;
+    int len;
+
+    if ((p = getenv("EMS_STORE")) != NULL && *p != '\0')
+        len = snprintf(buf, size, "%s", p);
+    else if ((p = getenv("HOME")) != NULL)
+        len = snprintf(buf, size, "%s/%s", p, STORE_DIRNAME);
+    else
+        len = snprintf(buf, size, "./%s", STORE_DIRNAME);
+
+    if (len >= 0 && len < size && name != NULL)
+        len += snprintf(buf + len, size - len, "/%s", name);
+    if (len < 0 || len >= size) {
+        warnx("path of the store too long");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+chunk_path(char *buf, size_t size, uint64_t h) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "chunks/%016"PRIx64, h);
+    return store_path(buf, size, name);
+}
+
+/**
+ * Add a chunk to the store, unless it is already there.
+ *
+ * Returns 1 if the chunk was added, 0 if it was there, -1 on error (a message
+ * has been printed).
+ */
+static int
+put_chunk(const unsigned char *buf, uint64_t h) {
+    unsigned char stored[STORE_CHUNKSIZE];
+    char path[1024], tmppath[1024+8];
+    size_t n;
+    FILE *f;
+    int ok;
+
+    if (chunk_path(path, sizeof(path), h))
+        return -1;
+
+    if ((f = fopen(path, "rb")) != NULL) {
+        n = fread(stored, 1, sizeof(stored), f);
+        fclose(f);
+        if (n == sizeof(stored) && memcmp(stored, buf, n) == 0)
+            return 0;
+        if (n == sizeof(stored) && hash64(stored, n) == h) {
+            warnx("hash collision with %s, snapshot not saved", path);
+            return -1;
+        }
+        // a damaged chunk is replaced
+    }
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    if ((f = fopen(tmppath, "wb")) == NULL) {
+        warn("can't create %s", tmppath);
+        return -1;
+    }
+    ok = fwrite(buf, STORE_CHUNKSIZE, 1, f) == 1;
+    if (fclose(f) == EOF || !ok) {
+        warn("error writing %s", tmppath);
+        remove(tmppath);
+        return -1;
+    }
+    if (rename(tmppath, path) == -1) {
+        warn("can't rename %s to %s", tmppath, path);
+        remove(tmppath);
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Read a chunk of the store and check it.
+ */
+static int
+get_chunk(unsigned char *buf, uint64_t h) {
+    char path[1024];
+    FILE *f;
+    int ok;
+
+    if (chunk_path(path, sizeof(path), h))
+        return 1;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        warn("can't open %s", path);
+        return 1;
+    }
+    ok = fread(buf, STORE_CHUNKSIZE, 1, f) == 1;
+    fclose(f);
+
+    if (!ok || hash64(buf, STORE_CHUNKSIZE) != h) {
+        warnx("%s is damaged", path);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse a line of the snapshot list, without its newline.
+ *
+ * Returns the cart identifier or NULL if the line is invalid.
+ */
+static char *
+parse_line(char *line, struct store_snapshot *snap) {
+    char *p, *end;
+
+    p = line;
+    snap->id = strtol(p, &end, 10);
+    if (end == p || *end != ' ' || snap->id < 1)
+        return NULL;
+    p = end + 1;
+
+    snap->time = strtoll(p, &end, 10);
+    if (end == p || *end != ' ')
+        return NULL;
+    p = end + 1;
+
+    for (int i = 0; i < STORE_NCHUNKS; i++) {
+        snap->chunks[i] = strtoull(p, &end, 16);
+        if (end == p || *end != ' ')
+            return NULL;
+        p = end + 1;
+    }
+
+    snap->print = strtoull(p, &end, 16);
+    if (end == p || *end != ' ')
+        return NULL;
+
+    return end + 1;
+}
+
+/**
+ * Get the snapshots of the cart "cartid", oldest first. "*snaps" is
+ * allocated, it is NULL if there is no snapshot.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+store_list(const char *cartid, struct store_snapshot **snaps, int *count) {
+    static char line[STORE_LINESIZE];
+    struct store_snapshot snap;
+    char path[1024], *id;
+    int size;
+    FILE *f;
+
+    *snaps = NULL;
+    *count = size = 0;
+
+    if (store_path(path, sizeof(path), "snapshots"))
+        return 1;
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        warn("can't open %s", path);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((id = parse_line(line, &snap)) == NULL || strcmp(id, cartid) != 0)
+            continue;
+
+        if (*count == size) {
+            size = size ? size*2 : 16;
+            if ((*snaps = realloc(*snaps, size * sizeof(**snaps))) == NULL)
+                err(1, "malloc");
+        }
+        (*snaps)[(*count)++] = snap;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+/**
+ * Store the SRAM image "path" as a new snapshot of the cart "cartid", set in
+ * "snap". The fingerprint of the cart is taken from "snap".
+ *
+ * Returns the number of chunks added to the store, -1 on error (a message has
+ * been printed).
+ */
+int
+store_put(const char *cartid, const char *path, struct store_snapshot *snap) {
+    static unsigned char sram[SRAMSIZE];
+    struct store_snapshot *snaps;
+    char dir[1024];
+    int count, added, r;
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        warn("can't open %s", path);
+        return -1;
+    }
+    if (fread(sram, SRAMSIZE, 1, f) != 1) {
+        warnx("can't read %s", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (store_path(dir, sizeof(dir), NULL))
+        return -1;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        warn("can't create %s", dir);
+        return -1;
+    }
+    if (store_path(dir, sizeof(dir), "chunks"))
+        return -1;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        warn("can't create %s", dir);
+        return -1;
+    }
+
+    added = 0;
+    for (int i = 0; i < STORE_NCHUNKS; i++) {
+        unsigned char *chunk = sram + i*STORE_CHUNKSIZE;
+
+        snap->chunks[i] = hash64(chunk, STORE_CHUNKSIZE);
+        if ((r = put_chunk(chunk, snap->chunks[i])) < 0)
+            return -1;
+        added += r;
+    }
+
+    if (store_list(cartid, &snaps, &count))
+        return -1;
+    snap->id = count > 0 ? snaps[count-1].id + 1 : 1;
+    snap->time = time(NULL);
+    free(snaps);
+
+    // the chunks are stored before the snapshot refers to them
+    if (store_path(dir, sizeof(dir), "snapshots"))
+        return -1;
+    if ((f = fopen(dir, "a")) == NULL) {
+        warn("can't open %s", dir);
+        return -1;
+    }
+    fprintf(f, "%d %lld ", snap->id, (long long)snap->time);
+    for (int i = 0; i < STORE_NCHUNKS; i++)
+        fprintf(f, "%016"PRIx64" ", snap->chunks[i]);
+    fprintf(f, "%016"PRIx64" %s\n", snap->print, cartid);
+    if (fclose(f) == EOF) {
+        warn("error writing %s", dir);
+        return -1;
+    }
+
+    return added;
+}
+
+/**
+ * Write the snapshot "id" of the cart "cartid" to the file "path" and set
+ * "print" to the fingerprint of the cart it was taken from.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+store_get(const char *cartid, int id, const char *path, uint64_t *print) {
+    static unsigned char sram[SRAMSIZE];
+    struct store_snapshot *snaps, *snap;
+    int count, r;
+    FILE *f;
+
+    if (store_list(cartid, &snaps, &count))
+        return 1;
+    snap = NULL;
+    for (int i = 0; i < count; i++)
+        if (snaps[i].id == id)
+            snap = &snaps[i];
+    if (snap == NULL) {
+        warnx("no snapshot %d for this cart", id);
+        free(snaps);
+        return 1;
+    }
+
+    *print = snap->print;
+    r = 0;
+    for (int i = 0; i < STORE_NCHUNKS && r == 0; i++)
+        r = get_chunk(sram + i*STORE_CHUNKSIZE, snap->chunks[i]);
+    free(snaps);
+    if (r)
+        return 1;
+
+    if ((f = fopen(path, "wb")) == NULL) {
+        warn("can't create %s", path);
+        return 1;
+    }
+    r = fwrite(sram, SRAMSIZE, 1, f) != 1;
+    if (fclose(f) == EOF || r) {
+        warn("error writing %s", path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef EMS_STORE_H
+#define EMS_STORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ems.h"
+
+#define STORE_CHUNKSIZE 4096
+#define STORE_NCHUNKS (SRAMSIZE/STORE_CHUNKSIZE)
+
+/*
+ * struct store_snapshot: SRAM of a cart at a time
+ *   id: number of the snapshot, from 1 for each cart
+ *   time: time it was taken
+ *   chunks: hashes of the 4 KB chunks of the SRAM
+ *   print: fingerprint of the cart (see ems_fingerprint())
+ */
+struct store_snapshot {
+    int id;
+    time_t time;
+    uint64_t chunks[STORE_NCHUNKS];
+    uint64_t print;
+};
+
+int store_put(const char *, const char *, struct store_snapshot *);
+int store_get(const char *, int, const char *, uint64_t *);
+int store_list(const char *, struct store_snapshot **, int *);
+
+#endif /* EMS_STORE_H */
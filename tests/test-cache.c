@@ -0,0 +1,168 @@
+/*
+ * Test case for cache.c: checks that reads are served only when all their
+ * bytes are cached, that writes invalidate their erase-blocks, that the data of
+ * a read in flight during a write is not cached and that the memory used is
+ * bounded.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "test-flash.h"
+#include "../ems.h"
+#include "../cache.h"
+
+#define LINE CACHE_LINESIZE
+#define HDRSIZE 336
+
+static unsigned char buf[2*ERASEBLOCKSIZE], data[2*ERASEBLOCKSIZE];
+
+static unsigned char
+pattern(uint32_t ofs) {
+    return (ofs ^ ofs >> 8 ^ ofs >> 16) & 0xff;
+}
+
+/* cache "count" bytes read at "offset" */
+static void
+fill(uint32_t offset, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        data[i] = pattern(offset + i);
+    cache_fill(offset, data, count, cache_stamp());
+}
+
+/* read from the cache and check the data */
+static int
+hit(uint32_t offset, size_t count) {
+    memset(buf, 0, count);
+    if (!cache_read(offset, buf, count))
+        return 0;
+    for (size_t i = 0; i < count; i++)
+        TEST_ASSERT(buf[i] == pattern(offset + i));
+    return 1;
+}
+
+static void
+setup(void) {
+    cache_setsize(CACHE_DEFAULTSIZE);
+}
+
+static void
+test_hit(void) {
+    uint32_t ofs = PAGESIZE + 64*KB;
+
+    TEST_ASSERT(!hit(ofs, LINE));
+    fill(ofs, 16*KB);
+    TEST_ASSERT(hit(ofs, 16*KB));
+    TEST_ASSERT(hit(ofs + LINE, LINE));
+    TEST_ASSERT(hit(ofs + 0x100, HDRSIZE));
+    TEST_ASSERT(hit(ofs + LINE - 16, 32));
+    TEST_ASSERT(!hit(ofs + 12*KB, 8*KB));
+}
+
+static void
+test_partial(void) {
+    /* a header is cached alone, the rest of its line is not */
+    fill(32*KB, HDRSIZE);
+    TEST_ASSERT(hit(32*KB, HDRSIZE));
+    TEST_ASSERT(hit(32*KB + 16, 64));
+    TEST_ASSERT(!hit(32*KB, LINE));
+
+    /* the ranges touching the valid one extend it */
+    fill(32*KB + HDRSIZE, LINE - HDRSIZE);
+    TEST_ASSERT(hit(32*KB, LINE));
+}
+
+static void
+test_invalidate(void) {
+    fill(0, 2*ERASEBLOCKSIZE);
+
+    /* a write anywhere in an erase-block invalidates it entirely */
+    cache_invalidate(ERASEBLOCKSIZE + 0x100, 32);
+    TEST_ASSERT(hit(0, ERASEBLOCKSIZE));
+    TEST_ASSERT(!hit(ERASEBLOCKSIZE, LINE));
+    TEST_ASSERT(!hit(2*ERASEBLOCKSIZE - LINE, LINE));
+
+    /* a write across two erase-blocks invalidates both */
+    fill(ERASEBLOCKSIZE, LINE);
+    cache_invalidate(ERASEBLOCKSIZE - 32, 64);
+    TEST_ASSERT(!hit(0, LINE));
+    TEST_ASSERT(!hit(ERASEBLOCKSIZE, LINE));
+}
+
+static void
+test_stamp(void) {
+    unsigned long stamp;
+
+    memset(data, 0, 2*LINE);
+
+    /* the data of a read sent before a write to its erase-block is stale */
+    stamp = cache_stamp();
+    cache_invalidate(0, 32);
+    cache_fill(0, data, LINE, stamp);
+    TEST_ASSERT(!hit(0, LINE));
+
+    /* not the data of the other erase-blocks */
+    for (int i = 0; i < LINE; i++)
+        data[i] = pattern(ERASEBLOCKSIZE + i);
+    cache_fill(ERASEBLOCKSIZE, data, LINE, stamp);
+    TEST_ASSERT(hit(ERASEBLOCKSIZE, LINE));
+}
+
+static void
+test_bound(void) {
+    cache_setsize(2*LINE);
+
+    fill(0, LINE);
+    fill(LINE, LINE);
+    TEST_ASSERT(hit(LINE, LINE));
+
+    /* the first line hasn't been read since it was cached */
+    fill(2*LINE, LINE);
+    TEST_ASSERT(!hit(0, LINE));
+    TEST_ASSERT(hit(LINE, LINE));
+    TEST_ASSERT(hit(2*LINE, LINE));
+
+    /* a read bigger than the cache */
+    fill(0, 4*LINE);
+    TEST_ASSERT(!hit(0, 4*LINE));
+}
+
+static void
+test_disabled(void) {
+    cache_setsize(0);
+
+    fill(0, LINE);
+    TEST_ASSERT(!hit(0, LINE));
+}
+
+static void
+test_range(void) {
+    /* the end of the flash memory */
+    fill(2*PAGESIZE - LINE, LINE);
+    TEST_ASSERT(hit(2*PAGESIZE - LINE, LINE));
+    fill(2*PAGESIZE - LINE, 2*LINE);
+    TEST_ASSERT(!hit(2*PAGESIZE - LINE, 2*LINE));
+    cache_invalidate(2*PAGESIZE - 32, 64);
+    TEST_ASSERT(!hit(2*PAGESIZE - LINE, LINE));
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, NULL);
+
+    TEST(test_hit);
+    TEST(test_partial);
+    TEST(test_invalidate);
+    TEST(test_stamp);
+    TEST(test_bound);
+    TEST(test_disabled);
+    TEST(test_range);
+
+    test_done();
+}
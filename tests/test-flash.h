@@ -1,2 +1,4 @@
 #define KB 1024
 #define MB (KB*KB)
+
+extern int writev_calls;
@@ -17,9 +17,15 @@
 #include "../ems.h"
 #include "../flash.h"
 #include "../progress.h"
+#include "../readq.h"
+#include "../verify.h"
 
 #define BUF_FF (-1)
 #define BUF_00 (-2)
+#define BUF_HALF_FF (-3)
+
+/* data read ahead by flash_move() */
+#define AHEAD (READQ_DEFAULTDEPTH*READBLOCKSIZE)
 
 /* struct mock_call: expected parameters and value to return for a call to
  * ems_read() or ems_write().
@@ -29,6 +35,8 @@
  * value:
  *   - BUF_FF represents a buffer filled with "count" 0xff bytes
  *   - BUF_00 represents a buffer filled with "count" zero bytes
+ *   - BUF_HALF_FF, for ems_read() only, represents a buffer whose first half
+ *     is filled with zero bytes and the second half with 0xff bytes
  *   - another value represents a buffer filled with "count" divided by 32
  *     chunks of 32 bytes. The first chunk starts with the value (copied with
  *     memcpy()). The value of the other bytes doesn't matter. The second chunk
@@ -56,6 +64,9 @@ SIMPLEQ_HEAD(mock_calls, mock_call) mock_calls = \
 
 static ems_size_t oldflashlastofs;
 
+/* write commands sent, a read must follow an even number of them */
+static int mock_writes;
+
 static struct mock_call*
 mock_create(int func, int from, uint32_t offset, uint32_t buf, size_t count) {
     struct mock_call *call = emalloc(sizeof(*call));
@@ -93,7 +104,10 @@ mock_call_check(int func, int from, uint32_t offset, unsigned char *buf,
             abort();
         }
 
-    if (func == CALL_EMS_READ) {
+    if (func == CALL_EMS_READ && expect->buf == BUF_HALF_FF) {
+        memset(buf, 0, count/2);
+        memset(buf + count/2, 0xff, count - count/2);
+    } else if (func == CALL_EMS_READ) {
         for (i = 0; i < count; i += WRITEBLOCKSIZE) {
             data = mock_expected->buf+i;
             memcpy(buf+i, &data, sizeof(data));
@@ -130,6 +144,7 @@ ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
     int r;
 
     r = mock_call_check(CALL_EMS_WRITE, to, offset, buf, count);
+    mock_writes++;
 
     mock_expected = SIMPLEQ_NEXT(mock_expected, calls);
 
@@ -143,6 +158,10 @@ int
 ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
     int r;
 
+    if (mock_writes%2 != 0) {
+        warnx("mock: read after an odd number of write commands");
+        abort();
+    }
     r = mock_call_check(CALL_EMS_READ, from, offset, buf, count);
 
     mock_expected = SIMPLEQ_NEXT(mock_expected, calls);
@@ -197,16 +216,129 @@ test_write(void) {
     int i;
 
     for (i = 0; i < size; i += WRITEBLOCKSIZE)
-        if (i != 0x100)
+        if (i != 0x100 && i != 0x120)
             mock(ems_write(TO_ROM, dest+i, BUF_00 /*src+i*/, WRITEBLOCKSIZE),
                 WRITEBLOCKSIZE);
     mock(ems_write(TO_ROM, dest+0x100, BUF_00 /* src+0x100 */, WRITEBLOCKSIZE),
         WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x120, BUF_00 /* src+0x120 */, WRITEBLOCKSIZE),
+        WRITEBLOCKSIZE);
 
     mock_expected = SIMPLEQ_FIRST(&mock_calls);
 
     TEST_ASSERT(!flash_write(dest, size, 0));
     TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+    /* one batch per 4 KB block and one for the header */
+    TEST_ASSERT(writev_calls == size/READBLOCKSIZE + 1);
+}
+
+static void
+test_write_blank(void) {
+    ems_size_t src = 1*MB, dest = 4*64*KB, size = READBLOCKSIZE;
+    int i;
+
+    /* the second half of the ROM is blank */
+    mock(ems_read(FROM_ROM, src, BUF_HALF_FF, READBLOCKSIZE), READBLOCKSIZE);
+    for (i = 0; i < size/2; i += WRITEBLOCKSIZE)
+        if (i != 0x100 && i != 0x120)
+            mock(ems_write(TO_ROM, dest+i, BUF_00, WRITEBLOCKSIZE),
+                WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x100, BUF_00, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x120, BUF_00, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+
+    /* read back in the same session */
+    mock(ems_read(FROM_ROM, dest, dest, READBLOCKSIZE), READBLOCKSIZE);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_read(0, size, src));
+    TEST_ASSERT(!flash_write(dest, size, 0));
+    TEST_ASSERT(!flash_read(0, size, dest));
+}
+
+static void
+test_write_writesize(void) {
+    ems_size_t dest = 4*64*KB, size = 64*KB, ws = 2*WRITEBLOCKSIZE;
+    int i;
+
+    TEST_ASSERT(!flash_settransfersizes(READBLOCKSIZE, ws));
+
+    /*
+     * The command covering the header piece at 0x100 is skipped, the last
+     * command of the first block is split to keep an even number of commands.
+     */
+    for (i = 0; i < size; i += ws) {
+        if (i == 0x100)
+            continue;
+        if (i == READBLOCKSIZE-ws) {
+            mock(ems_write(TO_ROM, dest+i, BUF_00, WRITEBLOCKSIZE),
+                WRITEBLOCKSIZE);
+            mock(ems_write(TO_ROM, dest+i+WRITEBLOCKSIZE, BUF_00,
+                WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+        } else {
+            mock(ems_write(TO_ROM, dest+i, BUF_00, ws), ws);
+        }
+    }
+    mock(ems_write(TO_ROM, dest+0x100, BUF_00, WRITEBLOCKSIZE),
+        WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x120, BUF_00, WRITEBLOCKSIZE),
+        WRITEBLOCKSIZE);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_write(dest, size, 0));
+    TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+}
+
+static void
+test_move_writesize(void) {
+    ems_size_t src = 2*MB, dest = 1*MB, size = 32*KB, ws = 2*WRITEBLOCKSIZE;
+    int i;
+
+    TEST_ASSERT(!flash_settransfersizes(READBLOCKSIZE, ws));
+
+    /* the ROM fits in the data read ahead */
+    for (i = 0; i < size; i += READBLOCKSIZE)
+        mock(ems_read(FROM_ROM, src+i, src+i, READBLOCKSIZE), READBLOCKSIZE);
+
+    /*
+     * First block: the command at 0x100 is skipped, the last command is split
+     * to keep an even number of commands.
+     */
+    for (i = 0; i < READBLOCKSIZE-ws; i += ws)
+        if (i != 0x100)
+            mock(ems_write(TO_ROM, dest+i, src+i, ws), ws);
+    for (; i < READBLOCKSIZE; i += WRITEBLOCKSIZE)
+        mock(ems_write(TO_ROM, dest+i, src+i, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+
+    for (; i < size; i += ws)
+        mock(ems_write(TO_ROM, dest+i, src+i, ws), ws);
+    mock(ems_write(TO_ROM, dest+0x100, src+0x100, WRITEBLOCKSIZE),
+        WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x120, src+0x120, WRITEBLOCKSIZE),
+        WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, src+0x110, BUF_00, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, src+0x130, BUF_00, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_move(dest, size, src));
+    TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+}
+
+static void
+test_read_readsize(void) {
+    ems_size_t src = 3*64*KB, size = 64*KB, rs = 32*KB;
+    int i;
+
+    TEST_ASSERT(!flash_settransfersizes(rs, WRITEBLOCKSIZE));
+
+    for (i = 0; i < size; i += rs)
+        mock(ems_read(FROM_ROM, src+i, src+i, rs), rs);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_read(0, size, src));
 }
 
 static void
@@ -214,12 +346,17 @@ test_move(void) {
     ems_size_t src = 2*MB, dest = 1*MB, size = 256*KB;
     int i, j;
 
-    for (i = 0; i < size; i += READBLOCKSIZE) {
-        mock(ems_read(FROM_ROM, src+i, src+i, READBLOCKSIZE), READBLOCKSIZE);
+    /* the reads run READQ_DEFAULTDEPTH blocks ahead of the writes */
+    for (i = 0; i < size + AHEAD; i += READBLOCKSIZE) {
+        if (i < size)
+            mock(ems_read(FROM_ROM, src+i, src+i, READBLOCKSIZE),
+                READBLOCKSIZE);
+        if (i < AHEAD)
+            continue;
         for (j=0; j < READBLOCKSIZE ;j += WRITEBLOCKSIZE) {
-            if (i+j != 0x100 && i+j != 0x120)
-                mock(ems_write(TO_ROM, dest+i+j, src+i+j, WRITEBLOCKSIZE),
-                    WRITEBLOCKSIZE);
+            if (i-AHEAD+j != 0x100 && i-AHEAD+j != 0x120)
+                mock(ems_write(TO_ROM, dest+i-AHEAD+j, src+i-AHEAD+j,
+                    WRITEBLOCKSIZE), WRITEBLOCKSIZE);
         }
     }
     mock(ems_write(TO_ROM, dest+0x100, src+0x100, WRITEBLOCKSIZE),
@@ -277,6 +414,183 @@ test_writef(void) {
 
     TEST_ASSERT(!flash_writef(dest, size, tmpf));
     TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+    TEST_ASSERT(writev_calls == size/READBLOCKSIZE + 1);
+    eremove(tmpf);
+}
+
+/* a plain image is written as it is when compressed ones are accepted */
+static void
+test_writef_packed(void) {
+    flash_setpacked(1);
+    test_writef();
+}
+
+static void
+test_writef_blank(void) {
+    ems_size_t dest = 124*KB;
+    ems_size_t size = 3*READBLOCKSIZE;
+    FILE *f;
+    char *tmpf;
+    int i;
+
+    tmpf = ecreatetmpf(0);
+    if ((f = fopen(tmpf, "wb")) == NULL) {
+        warn("error: can't create temp file: %s", tmpf);
+        abort();
+    }
+
+    /*
+     * First block: data with 3 blank chunks at 0x200. The next blocks are
+     * blank, the second one starts the erase-block at 128 KB.
+     */
+    for (i = 0; i < size; i += WRITEBLOCKSIZE) {
+        char buf[WRITEBLOCKSIZE];
+        ems_size_t data = i;
+
+        memset(buf, 0xff, WRITEBLOCKSIZE);
+        if (i < READBLOCKSIZE && (i < 0x200 || i >= 0x260)) {
+            memset(buf, 0, WRITEBLOCKSIZE);
+            memcpy(buf, &data, sizeof(data));
+        }
+
+        if (fwrite(buf, WRITEBLOCKSIZE, 1, f) != 1) {
+            warn("error: can't write to temp file: %s", tmpf);
+            abort();
+        }
+    }
+    if (fclose(f) == EOF) {
+        warn("error: can't close temp file");
+        abort();
+    }
+
+    /* a blank chunk is sent to keep the number of commands even */
+    for (i = 0; i < READBLOCKSIZE; i += WRITEBLOCKSIZE) {
+        if (i == 0x100 || i == 0x120 || i == 0x200 || i == 0x220)
+            continue;
+        if (i == 0x240)
+            mock(ems_write(TO_ROM, dest+i, BUF_FF, WRITEBLOCKSIZE),
+                WRITEBLOCKSIZE);
+        else
+            mock(ems_write(TO_ROM, dest+i, i, WRITEBLOCKSIZE),
+                WRITEBLOCKSIZE);
+    }
+    mock(ems_write(TO_ROM, 128*KB, BUF_FF, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, 128*KB+READBLOCKSIZE-WRITEBLOCKSIZE, BUF_FF,
+        WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x100, 0x100, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+    mock(ems_write(TO_ROM, dest+0x120, 0x120, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_writef(dest, size, tmpf));
+    TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+    /* no batch for the third block */
+    TEST_ASSERT(writev_calls == 3);
+    eremove(tmpf);
+}
+
+static void
+test_diffwritef(void) {
+    ems_size_t dest = 256*KB;
+    ems_size_t size = 2*ERASEBLOCKSIZE;
+    FILE *f;
+    char *tmpf;
+    int i, s;
+
+    tmpf = ecreatetmpf(0);
+    if ((f = fopen(tmpf, "wb")) == NULL) {
+        warn("error: can't create temp file: %s", tmpf);
+        abort();
+    }
+
+    for (i = 0; i < size; i += WRITEBLOCKSIZE) {
+        char buf[WRITEBLOCKSIZE];
+        ems_size_t data = i;
+
+        memset(buf, 0, WRITEBLOCKSIZE);
+        memcpy(buf, &data, sizeof(data));
+
+        if (fwrite(buf, WRITEBLOCKSIZE, 1, f) != 1) {
+            warn("error: can't write to temp file: %s", tmpf);
+            abort();
+        }
+    }
+    if (fclose(f) == EOF) {
+        warn("error: can't close temp file");
+        abort();
+    }
+
+    /* the first erase-block matches the file */
+    for (i = 0; i < ERASEBLOCKSIZE; i += READBLOCKSIZE)
+        mock(ems_read(FROM_ROM, dest+i, i, READBLOCKSIZE), READBLOCKSIZE);
+
+    /* the second one differs: it is rewritten, the headers last */
+    for (i = ERASEBLOCKSIZE; i < size; i += READBLOCKSIZE)
+        mock(ems_read(FROM_ROM, dest+i, 0x80000000+i, READBLOCKSIZE),
+            READBLOCKSIZE);
+    for (i = ERASEBLOCKSIZE; i < size; i += WRITEBLOCKSIZE)
+        if (i%(32*KB) != 0x100 && i%(32*KB) != 0x120)
+            mock(ems_write(TO_ROM, dest+i, i, WRITEBLOCKSIZE),
+                WRITEBLOCKSIZE);
+    for (s = ERASEBLOCKSIZE; s < size; s += 32*KB) {
+        mock(ems_write(TO_ROM, dest+s+0x100, s+0x100, WRITEBLOCKSIZE),
+            WRITEBLOCKSIZE);
+        mock(ems_write(TO_ROM, dest+s+0x120, s+0x120, WRITEBLOCKSIZE),
+            WRITEBLOCKSIZE);
+    }
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    TEST_ASSERT(!flash_diffwritef_to(TO_ROM, dest, size, tmpf));
+    TEST_ASSERT(flash_lastofs == dest+size-WRITEBLOCKSIZE);
+    /* one batch per 4 KB block rewritten and one per header */
+    TEST_ASSERT(writev_calls == ERASEBLOCKSIZE/READBLOCKSIZE + 4);
+    eremove(tmpf);
+}
+
+static void
+test_writef_verify(void) {
+    ems_size_t size = 2*READBLOCKSIZE;
+    FILE *f;
+    char *tmpf;
+    int i;
+
+    tmpf = ecreatetmpf(0);
+    if ((f = fopen(tmpf, "wb")) == NULL) {
+        warn("error: can't create temp file: %s", tmpf);
+        abort();
+    }
+
+    for (i = 0; i < size; i += WRITEBLOCKSIZE) {
+        char buf[WRITEBLOCKSIZE];
+        ems_size_t data = i;
+
+        memset(buf, 0, WRITEBLOCKSIZE);
+        memcpy(buf, &data, sizeof(data));
+
+        if (fwrite(buf, WRITEBLOCKSIZE, 1, f) != 1) {
+            warn("error: can't write to temp file: %s", tmpf);
+            abort();
+        }
+    }
+    if (fclose(f) == EOF) {
+        warn("error: can't close temp file");
+        abort();
+    }
+
+    for (i = 0; i < size; i += WRITEBLOCKSIZE)
+        mock(ems_write(TO_SRAM, i, i, WRITEBLOCKSIZE), WRITEBLOCKSIZE);
+
+    /* the data is read back, the second block differs */
+    mock(ems_read(FROM_SRAM, 0, 0, READBLOCKSIZE), READBLOCKSIZE);
+    mock(ems_read(FROM_SRAM, READBLOCKSIZE, 1, READBLOCKSIZE), READBLOCKSIZE);
+
+    mock_expected = SIMPLEQ_FIRST(&mock_calls);
+
+    flash_setverify(1);
+    TEST_ASSERT(!flash_writef_to(TO_SRAM, 0, size, tmpf));
+    TEST_ASSERT(mock_expected == NULL);
+    TEST_ASSERT(verify_report(0) == 1);
     eremove(tmpf);
 }
 
@@ -312,8 +626,16 @@ main(int argc, char **argv) {
     TEST(test_erase);
     TEST(test_read);
     TEST(test_write);
+    TEST(test_write_blank);
+    TEST(test_write_writesize);
+    TEST(test_move_writesize);
+    TEST(test_read_readsize);
     TEST(test_move);
     TEST(test_writef);
+    TEST(test_writef_packed);
+    TEST(test_writef_blank);
+    TEST(test_diffwritef);
+    TEST(test_writef_verify);
     TEST(test_delete1);
     TEST(test_delete2);
 
@@ -37,12 +37,14 @@ strtolist() {
 #
 # $1: the image string
 # $2: the page size
+# $3: if not empty, the time budget of image_optimize() in seconds
 #
 # Temporary files (in $tmpd): image, insert, new, validateupdate
 testdefrag() {
-    local image PAGESIZE freerommaxsize freetotal
+    local image PAGESIZE OPTIMIZE freerommaxsize freetotal
     image=$1
     PAGESIZE=$2
+    OPTIMIZE=$3
 
     strtolist $image > "$tmpd/image"
 
@@ -85,10 +87,11 @@ testdefrag() {
 
     size=$((freerommaxsize*2))
     while [ $size -le $freetotal ]; do
-        msg="ok $count - testing defrag() with $image and a ROM of $((size>>10)) KB"
+        msg="ok $count - testing ${OPTIMIZE:+image_optimize() and }defrag() with $image and a ROM of $((size>>10)) KB"
         printf "0\t\t$size\n" > "$tmpd/new"
         if cat "$tmpd/image" "$tmpd/new" |
-            PAGESIZE=$PAGESIZE ./test-insertupdate.sh >/dev/null
+            env ${OPTIMIZE:+OPTIMIZE=$OPTIMIZE} PAGESIZE=$PAGESIZE \
+                ./test-insertupdate.sh >/dev/null
         then
             echo "$msg"
         else
@@ -134,6 +137,11 @@ while read image; do
    testdefrag $image $((256<<10))
 done < "$tmpd/images"
 
+# The same with the layout search of image_optimize()
+while read image; do
+   testdefrag $image $((256<<10)) 0.5
+done < "$tmpd/images"
+
 ### Test an image of 4 MB filled with a ROM of 32KB every 64 KB ###
 i=0 image=
 while [ $i -lt 64 ]; do
@@ -143,4 +151,83 @@ done
 
 testdefrag $image $((4<<20))
 
+### Test the planning of a ROM written to blank space ###
+
+# ROM kept at 0, new ROM at 32 KB in the same erase-block
+plan() {
+    printf '\t0\t32768\nnew\t\t32768\n' | ./test-insertupdate | sed '1,/^$/d' |
+        tr '\t\n' ' ;'
+}
+
+msg="ok $count - the erase-block is rewritten when the space is not blank"
+if [ "$(plan)" = "read 0 32768 0;write 0 32768 0;writef 32768 32768 new;" ]
+then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
+msg="ok $count - the ROM is written alone to blank space"
+if [ "$(BLANK=1 plan)" = "writef 32768 32768 new;" ]; then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
+### Test the layout search ###
+
+# Two 32 KB ROMs at 64 KB and 96 KB: the greedy insertion puts a new 64 KB ROM
+# at 0 and rewrites the ROMs of the erase-block, the search uses the blank
+# erase-block at 128 KB
+msg="ok $count - image_optimize() writes the ROM without moving the others"
+if [ "$(printf '\t65536\t32768\n\t98304\t32768\nnew\t\t65536\n' |
+    OPTIMIZE=0.5 PAGESIZE=$((256<<10)) ./test-insertupdate | sed '1,/^$/d' |
+    tr '\t\n' ' ;')" = "writef 131072 65536 new;" ]
+then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
+# A ROM of 32 KB at 0: a new ROM of 32 KB is written to the blank space after
+# it rather than to the start of another erase-block, which would erase it
+msg="ok $count - image_optimize() appends the ROM to a partly filled erase-block"
+if [ "$(printf '\t0\t32768\nnew\t\t32768\n' |
+    BLANK=1 OPTIMIZE=0.5 PAGESIZE=$((256<<10)) ./test-insertupdate |
+    sed '1,/^$/d' | tr '\t\n' ' ;')" = "writef 32768 32768 new;" ]
+then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
+### Test the choice of the less worn erase-block ###
+
+# Two free erase-blocks of 128 KB at 128 KB and 384 KB in a page of 512 KB
+insert() {
+    printf '\t0\t131072\n\t262144\t131072\nnew\t\t131072\n' |
+        PAGESIZE=$((512<<10)) ./test-insertupdate |
+        awk -F'\t' '$1 == "new" {print $4}'
+}
+
+msg="ok $count - the ROM is put in the first free location fitting best"
+if [ "$(insert)" = 131072 ]; then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
+msg="ok $count - the ROM is put in the less worn free location fitting best"
+if [ "$(WEAR='0 5 0 1' insert)" = 393216 ]; then
+    echo "$msg"
+else
+    echo "not $msg"
+fi
+count=$((count+1))
+
 echo "1..$((count-1))"
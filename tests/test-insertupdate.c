@@ -11,17 +11,37 @@
 
 void dumpimage(struct image *);
 
+/* isblank callback of image_plan(): the free space is blank */
+static int
+allblank(ems_size_t offset, ems_size_t size, void *ctx) {
+    return 1;
+}
+
 int
 main(int argc, char **argv) {
     struct image image;
     struct updates *updates;
+    struct rom **roms = NULL;
     char line[128];
-    int linen;
-    char *s;
+    int linen, nroms = 0;
+    char *s, *optimize;
 
     if ((s = getenv("PAGESIZE")) != NULL)
         (void)sscanf(s, "%"SCNuEMSSIZE, &insert_pagesize);
 
+    // WEAR: erase counts of the erase-blocks, separated by spaces
+    if ((s = getenv("WEAR")) != NULL) {
+        static unsigned long wear[PAGESIZE/ERASEBLOCKSIZE];
+
+        for (int i = 0; i < PAGESIZE/ERASEBLOCKSIZE && *s != '\0'; i++)
+            wear[i] = strtoul(s, &s, 10);
+        insert_wear = wear;
+    }
+
+    // OPTIMIZE: the new ROMs are inserted by image_optimize() with this
+    // budget in seconds, one by one if it fails
+    optimize = getenv("OPTIMIZE");
+
     image_init(&image);
 
     for (linen = 1; fgets(line, sizeof(line), stdin) != NULL; linen++) {
@@ -54,7 +74,11 @@ main(int argc, char **argv) {
             if ((rom->source.u.fileinfo = malloc(strlen(path)+1)) == NULL)
                 err(1, "malloc");
             strcpy(rom->source.u.fileinfo, path);
-            if (image_insert_defrag(&image, rom))
+            if (optimize != NULL) {
+                if ((roms = realloc(roms, (nroms+1)*sizeof(*roms))) == NULL)
+                    err(1, "malloc");
+                roms[nroms++] = rom;
+            } else if (image_insert_defrag(&image, rom))
                 errx(1, "insert_defrag() failed for "
                     "linen = %d path=%s size=%"PRIuEMSSIZE, linen, path, size);
         }
@@ -62,10 +86,21 @@ main(int argc, char **argv) {
     if (ferror(stdin))
         err(1, "fgets");
 
+    if (optimize != NULL && image_optimize(&image, roms, nroms,
+        &update_defaultcost, getenv("BLANK") != NULL ? allblank : NULL, NULL,
+        atof(optimize)) != 0) {
+            for (int i = 0; i < nroms; i++)
+                if (image_insert_defrag(&image, roms[i]))
+                    errx(1, "insert_defrag() failed for path=%s",
+                        (char *)roms[i]->source.u.fileinfo);
+    }
+
     dumpimage(&image);
     putchar('\n');
-    if (image_update(&image, &updates))
-        errx(1, "update");
+    // with BLANK set, the ROMs are written without erasing when possible
+    if (image_plan(&image, &update_defaultcost,
+        getenv("BLANK") != NULL ? allblank : NULL, NULL, &updates))
+            errx(1, "update");
 
     {
     struct update *u;
@@ -0,0 +1,146 @@
+/*
+ * Test case for job.c: checks that the steps of a manifest are read with their
+ * line numbers, that the deletions and writes are grouped without changing
+ * their order and that a manifest with an invalid step is rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "test.h"
+#include "../job.h"
+
+static struct job job;
+static char *path;
+
+static void
+writemanifest(const char *text) {
+    FILE *f;
+
+    if ((f = fopen(path, "w")) == NULL || fputs(text, f) == EOF ||
+        fclose(f) == EOF)
+            err(1, "%s", path);
+}
+
+static void
+setup(void) {
+    path = ecreatetmpf(0);
+}
+
+static void
+teardown(void) {
+    eremove(path);
+}
+
+static void
+test_steps(void) {
+    struct job_step *step;
+
+    writemanifest(
+        "# a comment\n"
+        "delete 1 32 64\n"
+        "\n"
+        "write 2  a.gb\tb.gb   # and another\n"
+        "read 1 32:a.gb\n"
+        "format 2\n"
+        "dump save game.sav\n"
+        "restore 1 page.bin");
+    TEST_ASSERT(job_load(path, &job) == 0);
+    TEST_ASSERT(job.count == 6);
+
+    step = &job.steps[0];
+    TEST_ASSERT(step->line == 2 && step->op == JOB_DELETE && step->page == 0);
+    TEST_ASSERT(step->argc == 2);
+    TEST_ASSERT(strcmp(step->argv[1], "64") == 0);
+
+    step = &job.steps[1];
+    TEST_ASSERT(step->line == 4 && step->op == JOB_WRITE && step->page == 1);
+    TEST_ASSERT(step->argc == 2);
+    TEST_ASSERT(strcmp(step->argv[0], "a.gb") == 0);
+    TEST_ASSERT(strcmp(step->argv[1], "b.gb") == 0);
+    TEST_ASSERT(strcmp(step->text, "write 2 a.gb b.gb") == 0);
+
+    TEST_ASSERT(job.steps[2].op == JOB_READ && job.steps[2].argc == 1);
+    TEST_ASSERT(job.steps[3].op == JOB_FORMAT && job.steps[3].argc == 0);
+    TEST_ASSERT(job.steps[4].op == JOB_DUMP && job.steps[4].page == JOB_SAVE);
+
+    /* the last line has no newline */
+    step = &job.steps[5];
+    TEST_ASSERT(step->line == 8 && step->op == JOB_RESTORE);
+    TEST_ASSERT(strcmp(step->argv[0], "page.bin") == 0);
+}
+
+static void
+test_groups(void) {
+    writemanifest(
+        "delete 1 32\n"
+        "write 1 a.gb\n"
+        "write 1 b.gb\n"
+        "delete 1 64\n"
+        "write 1 c.gb\n"
+        "write 2 d.gb\n"
+        "read 2 0:d.gb\n"
+        "delete 2 0\n");
+    TEST_ASSERT(job_load(path, &job) == 0);
+
+    /* the deletion following the writes may delete a.gb or b.gb */
+    TEST_ASSERT(job_group(&job, 0) == 3);
+    TEST_ASSERT(job_group(&job, 3) == 5);
+    TEST_ASSERT(job_group(&job, 5) == 6);
+    TEST_ASSERT(job_group(&job, 6) == 7);
+    TEST_ASSERT(job_group(&job, 7) == 8);
+}
+
+static void
+test_empty(void) {
+    writemanifest("# nothing to do\n\n");
+    TEST_ASSERT(job_load(path, &job) == 0);
+    TEST_ASSERT(job.count == 0);
+}
+
+static void
+reject(const char *text) {
+    writemanifest(text);
+    TEST_ASSERT(job_load(path, &job) != 0);
+}
+
+static void
+test_invalid(void) {
+    reject("erase 1\n");
+    reject("write\n");
+    reject("write 3 a.gb\n");
+    reject("write save a.gb\n");
+    reject("write 1\n");
+    reject("format 1 a.gb\n");
+    reject("dump 1\n");
+    reject("dump 1 a.bin b.bin\n");
+    reject("delete 1 256\n");
+    reject("delete 1 3x\n");
+    reject("read 1 32\n");
+    reject("read 1 32:\n");
+    reject("read 1 x:a.gb\n");
+
+    /* a valid line doesn't hide an invalid one */
+    reject("format 1\nformat 4\nformat 2\n");
+}
+
+static void
+test_missing(void) {
+    TEST_ASSERT(job_load("/nonexistent/manifest", &job) != 0);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_steps);
+    TEST(test_groups);
+    TEST(test_empty);
+    TEST(test_invalid);
+    TEST(test_missing);
+
+    test_done();
+}
@@ -0,0 +1,164 @@
+/*
+ * Test case for listcache.c: checks that the listings are kept per cart and
+ * page, that the invalid entries are ignored and the choice of the headers
+ * read back.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "../ems.h"
+#include "../listcache.h"
+
+#define KB 1024
+
+static char *path;
+static struct listing listing;
+
+static void
+setup(void) {
+    path = ecreatetmpf(0);
+    if (setenv("EMS_LISTFILE", path, 1) == -1)
+        err(1, "setenv");
+
+    listing.count = 3;
+    listing.romlist[0].offset = 0;
+    listing.romlist[0].header = (struct header){"MENU#", 32*KB, 0, 0};
+    listing.romlist[1].offset = 512*KB;
+    listing.romlist[1].header = (struct header){"A ROM", 512*KB,
+        HEADER_ENH_GBC, 1};
+    listing.romlist[2].offset = 2048*KB;
+    listing.romlist[2].header = (struct header){"", 1024*KB, 0, 0};
+}
+
+static void
+teardown(void) {
+    remove(path);
+}
+
+static int
+equal(struct listing *a, struct listing *b) {
+    if (a->count != b->count)
+        return 0;
+    for (int i = 0; i < a->count; i++) {
+        struct listing_rom *ra = &a->romlist[i], *rb = &b->romlist[i];
+
+        if (ra->offset != rb->offset || strcmp(ra->header.title,
+            rb->header.title) != 0 || ra->header.romsize != rb->header.romsize ||
+            ra->header.enhancements != rb->header.enhancements ||
+            ra->header.gbc_only != rb->header.gbc_only)
+                return 0;
+    }
+    return 1;
+}
+
+static void
+test_save(void) {
+    struct listing l;
+
+    TEST_ASSERT(listcache_load("cart:a", 0, &l) == 1);
+    TEST_ASSERT(listcache_save("cart:a", 0, &listing) == 0);
+    TEST_ASSERT(listcache_load("cart:a", 0, &l) == 0);
+    TEST_ASSERT(equal(&l, &listing));
+
+    /* the other pages and carts are unknown */
+    TEST_ASSERT(listcache_load("cart:a", 1, &l) == 1);
+    TEST_ASSERT(listcache_load("cart:b", 0, &l) == 1);
+
+    /* an empty page */
+    listing.count = 0;
+    TEST_ASSERT(listcache_save("cart:a", 0, &listing) == 0);
+    TEST_ASSERT(listcache_load("cart:a", 0, &l) == 0);
+    TEST_ASSERT(l.count == 0);
+}
+
+static void
+test_drop(void) {
+    struct listing l;
+
+    TEST_ASSERT(listcache_save("cart:a", 0, &listing) == 0);
+    TEST_ASSERT(listcache_save("cart:a", 1, &listing) == 0);
+    TEST_ASSERT(listcache_save("cart:b", 0, &listing) == 0);
+
+    TEST_ASSERT(listcache_drop("cart:a", 0) == 0);
+    TEST_ASSERT(listcache_load("cart:a", 0, &l) == 1);
+    TEST_ASSERT(listcache_load("cart:a", 1, &l) == 0);
+    TEST_ASSERT(listcache_load("cart:b", 0, &l) == 0);
+
+    /* both pages */
+    TEST_ASSERT(listcache_drop("cart:a", -1) == 0);
+    TEST_ASSERT(listcache_load("cart:a", 1, &l) == 1);
+    TEST_ASSERT(listcache_load("cart:b", 0, &l) == 0);
+}
+
+static void
+test_invalid(void) {
+    static const char *lines[] = {
+        "0 1 0:32768:0:0:41 cart:a\n",          // valid
+        "0 1 16384:32768:0:0:41 cart:a\n",      // not aligned
+        "0 1 0:49152:0:0:41 cart:a\n",          // not a power of two
+        "0 2 0:65536:0:0:41 32768:32768:0:0:42 cart:a\n", // overlapping
+        "0 1 0:32768:0:0:4 cart:a\n",           // bad title
+        "0 2 0:32768:0:0:41 cart:a\n",          // truncated
+        "2 0 cart:a\n",                         // bad page
+    };
+    struct listing l;
+    FILE *f;
+
+    for (int i = 0; i < sizeof(lines)/sizeof(*lines); i++) {
+        if ((f = fopen(path, "w")) == NULL)
+            err(1, "fopen");
+        fputs(lines[i], f);
+        fclose(f);
+        TEST_ASSERT(listcache_load("cart:a", 0, &l) == (i != 0));
+    }
+}
+
+static void
+test_samples(void) {
+    ems_size_t samples[LISTCACHE_SAMPLES];
+
+    /* the first and the last ROMs, the first and the last free slots */
+    TEST_ASSERT(listcache_samples(&listing, samples) == 4);
+    TEST_ASSERT(samples[0] == 0);
+    TEST_ASSERT(samples[1] == 2048*KB);
+    TEST_ASSERT(samples[2] == 32*KB);
+    TEST_ASSERT(samples[3] == PAGESIZE - 32*KB);
+
+    /* a single free slot */
+    listing.count = 0;
+    for (ems_size_t ofs = 0; ofs < PAGESIZE; ofs += 32*KB) {
+        if (ofs == 160*KB)
+            continue;
+        listing.romlist[listing.count].offset = ofs;
+        listing.romlist[listing.count].header.romsize = 32*KB;
+        listing.count++;
+    }
+    TEST_ASSERT(listcache_samples(&listing, samples) == 3);
+    TEST_ASSERT(samples[1] == PAGESIZE - 32*KB);
+    TEST_ASSERT(samples[2] == 160*KB);
+
+    /* an empty page */
+    listing.count = 0;
+    TEST_ASSERT(listcache_samples(&listing, samples) == 2);
+    TEST_ASSERT(samples[0] == 0);
+    TEST_ASSERT(samples[1] == PAGESIZE - 32*KB);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_save);
+    TEST(test_drop);
+    TEST(test_invalid);
+    TEST(test_samples);
+
+    test_done();
+}
@@ -0,0 +1,194 @@
+/*
+ * Test case for pack.c: checks that the codec restores the data compressed,
+ * that an image written by chunks is read back and that a damaged image is
+ * rejected before any chunk is returned.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "../ems.h"
+#include "../pack.h"
+
+#define IMAGESIZE (3*PACK_CHUNKSIZE + 4096)
+
+static unsigned char data[IMAGESIZE], buf[IMAGESIZE];
+static unsigned char packed[PACK_BOUND(IMAGESIZE)];
+static char *path;
+
+/* blank, repeated and random data */
+static void
+fill(unsigned char *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (i%65536 < 30000)
+            p[i] = 0xff;
+        else if (i%65536 < 50000)
+            p[i] = "nintendo"[i%8];
+        else
+            p[i] = rand();
+    }
+}
+
+static void
+setup(void) {
+    srand(1);
+    fill(data, IMAGESIZE);
+    path = ecreatetmpf(0);
+}
+
+static void
+teardown(void) {
+    eremove(path);
+}
+
+static void
+roundtrip(const unsigned char *src, size_t size) {
+    size_t n;
+
+    n = pack_compress(src, size, packed);
+    TEST_ASSERT(n <= PACK_BOUND(size));
+    memset(buf, 0, size);
+    TEST_ASSERT(pack_decompress(packed, n, buf, size) == 0);
+    TEST_ASSERT(memcmp(buf, src, size) == 0);
+}
+
+static void
+test_codec(void) {
+    static unsigned char random[PACK_CHUNKSIZE], blank[PACK_CHUNKSIZE];
+    size_t n;
+
+    roundtrip(data, PACK_CHUNKSIZE);
+    roundtrip(data, 3);
+    roundtrip(data, 0);
+
+    for (int i = 0; i < PACK_CHUNKSIZE; i++)
+        random[i] = rand();
+    roundtrip(random, PACK_CHUNKSIZE);
+
+    memset(blank, 0xff, sizeof(blank));
+    roundtrip(blank, PACK_CHUNKSIZE);
+    TEST_ASSERT(pack_compress(blank, PACK_CHUNKSIZE, packed) < 1024);
+
+    /* a truncated or too short output is an error */
+    n = pack_compress(data, PACK_CHUNKSIZE, packed);
+    TEST_ASSERT(pack_decompress(packed, n - 1, buf, PACK_CHUNKSIZE) != 0);
+    TEST_ASSERT(pack_decompress(packed, n, buf, PACK_CHUNKSIZE - 1) != 0);
+}
+
+static void
+writeimage(void) {
+    unsigned char *image;
+    struct pack *pk;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_TRUNC)) == -1)
+        err(1, "%s", path);
+    TEST_ASSERT((pk = pack_create(fd, IMAGESIZE, &image)) != NULL);
+    /* filled by pieces, as the cart is read */
+    for (size_t ofs = 0; ofs < IMAGESIZE; ofs += 4096) {
+        memcpy(image + ofs, data + ofs, 4096);
+        pack_filled(pk, ofs + 4096);
+    }
+    TEST_ASSERT(pack_close(pk) == 0);
+    close(fd);
+}
+
+static struct pack *
+openimage(ems_size_t *size, unsigned char **image) {
+    struct pack *pk;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(1, "%s", path);
+    TEST_ASSERT(pack_probe(fd, size) == 1);
+    TEST_ASSERT(*size == IMAGESIZE);
+    pk = pack_open(fd, size, image);
+    close(fd);
+    return pk;
+}
+
+static void
+test_image(void) {
+    unsigned char *image;
+    struct pack *pk;
+    ems_size_t size;
+
+    writeimage();
+
+    TEST_ASSERT((pk = openimage(&size, &image)) != NULL);
+    TEST_ASSERT(size == IMAGESIZE);
+    TEST_ASSERT(pack_wait(pk, PACK_CHUNKSIZE) == 0);
+    TEST_ASSERT(memcmp(image, data, PACK_CHUNKSIZE) == 0);
+    TEST_ASSERT(pack_wait(pk, IMAGESIZE) == 0);
+    TEST_ASSERT(memcmp(image, data, IMAGESIZE) == 0);
+    TEST_ASSERT(pack_close(pk) == 0);
+
+    /* closed before the end */
+    TEST_ASSERT((pk = openimage(&size, &image)) != NULL);
+    TEST_ASSERT(pack_close(pk) == 0);
+}
+
+static void
+test_notpacked(void) {
+    ems_size_t size;
+    FILE *f;
+    int fd;
+
+    if ((f = fopen(path, "wb")) == NULL || fwrite(data, 4096, 1, f) != 1 ||
+        fclose(f) == EOF)
+            err(1, "%s", path);
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(1, "%s", path);
+    TEST_ASSERT(pack_probe(fd, &size) == 0);
+    close(fd);
+}
+
+static void
+test_damaged(void) {
+    unsigned char *image;
+    ems_size_t size;
+    long end;
+    FILE *f;
+    int c;
+
+    writeimage();
+
+    /* a byte near the end */
+    if ((f = fopen(path, "r+b")) == NULL)
+        err(1, "%s", path);
+    fseek(f, 0, SEEK_END);
+    end = ftell(f);
+    fseek(f, end - 100, SEEK_SET);
+    c = fgetc(f);
+    fseek(f, end - 100, SEEK_SET);
+    fputc(c ^ 1, f);
+    fclose(f);
+    TEST_ASSERT(openimage(&size, &image) == NULL);
+    TEST_ASSERT(strstr(pack_lasterrorstr, "checksum") != NULL);
+
+    /* truncated */
+    writeimage();
+    if (truncate(path, end - 1) == -1)
+        err(1, "%s", path);
+    TEST_ASSERT(openimage(&size, &image) == NULL);
+    TEST_ASSERT(strstr(pack_lasterrorstr, "truncated") != NULL);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_codec);
+    TEST(test_image);
+    TEST(test_notpacked);
+    TEST(test_damaged);
+
+    test_done();
+}
@@ -0,0 +1,257 @@
+/*
+ * Test case for readq.c: checks that the data is delivered in order, that the
+ * number of requests in flight is bounded by the depth of the queue and that
+ * no request is submitted after an error.
+ *
+ * The asynchronous backend is simulated: requests are completed, in reverse
+ * order, only when the queue waits for one of them.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "test-flash.h"
+#include "../ems.h"
+#include "../readq.h"
+
+#define DEPTH 4
+#define HDRSIZE 336
+
+static struct readq_req *inflight[READQ_MAXDEPTH+1];
+static int ninflight, maxinflight, nsubmitted, nreleased;
+static uint32_t nextofs, error_ofs;
+
+static unsigned char
+pattern(uint32_t ofs) {
+    return (ofs ^ ofs >> 8 ^ ofs >> 16) & 0xff;
+}
+
+static void
+fill(uint32_t offset, unsigned char *buf, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        buf[i] = pattern(offset + i);
+}
+
+static int
+checkbuf(uint32_t offset, unsigned char *buf, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        if (buf[i] != pattern(offset + i))
+            return 1;
+    return 0;
+}
+
+/*
+ * Synchronous path (no backend)
+ */
+int
+ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
+    TEST_ASSERT(from == FROM_ROM);
+    TEST_ASSERT(offset == nextofs);
+    TEST_ASSERT(error_ofs == -1 || offset <= error_ofs);
+    nextofs += count;
+    if (offset == error_ofs)
+        return -1;
+    fill(offset, buf, count);
+    return count;
+}
+
+/*
+ * Simulated asynchronous backend
+ */
+static int
+sw_submit(void *ctx, int from, struct readq_req *req) {
+    TEST_ASSERT(from == FROM_ROM);
+    TEST_ASSERT(req->offset == nextofs);
+    TEST_ASSERT(req->result == READQ_PENDING);
+    nextofs += req->count;
+
+    if (req->priv == NULL)
+        req->priv = emalloc(1);
+
+    inflight[ninflight++] = req;
+    nsubmitted++;
+    if (ninflight > maxinflight)
+        maxinflight = ninflight;
+    return 0;
+}
+
+static void
+sw_wait(void *ctx, struct readq_req *req) {
+    TEST_ASSERT(ninflight > 0);
+    while (ninflight > 0) {
+        struct readq_req *r = inflight[--ninflight];
+        if (r->offset == error_ofs) {
+            r->result = -1;
+        } else {
+            fill(r->offset, r->buf, r->count);
+            r->result = r->count;
+        }
+    }
+    TEST_ASSERT(req->result != READQ_PENDING);
+}
+
+static void
+sw_release(void *ctx, struct readq_req *req) {
+    free(req->priv);
+    req->priv = NULL;
+    nreleased++;
+}
+
+static const struct readq_backend sw_backend = {
+    .submit = sw_submit,
+    .wait = sw_wait,
+    .release = sw_release
+};
+
+static void
+setup(void) {
+    readq_setbackend(NULL, NULL);
+    readq_setdepth(DEPTH);
+    ninflight = maxinflight = nsubmitted = nreleased = 0;
+    nextofs = 0;
+    error_ofs = -1;
+}
+
+static void
+stream(ems_size_t size, size_t blocksize) {
+    struct readq *rq;
+    unsigned char *buf;
+    uint32_t ofs, expofs;
+    int r;
+
+    rq = readq_new(FROM_ROM, blocksize);
+    readq_stream(rq, 0, size, blocksize, NULL);
+
+    for (expofs = 0; expofs < size; expofs += blocksize) {
+        r = readq_next(rq, &buf, &ofs);
+        TEST_ASSERT(r == blocksize);
+        TEST_ASSERT(ofs == expofs);
+        TEST_ASSERT(!checkbuf(ofs, buf, blocksize));
+    }
+    TEST_ASSERT(readq_next(rq, &buf, &ofs) == 0);
+
+    readq_free(rq);
+    TEST_ASSERT(nextofs == size);
+}
+
+static void
+test_sync(void) {
+    stream(256*KB, 4*KB);
+}
+
+static void
+test_async(void) {
+    readq_setbackend(&sw_backend, NULL);
+    stream(256*KB, 4*KB);
+    TEST_ASSERT(maxinflight == DEPTH);
+    TEST_ASSERT(nreleased == DEPTH+1);
+}
+
+static void
+test_async_depth1(void) {
+    readq_setbackend(&sw_backend, NULL);
+    readq_setdepth(1);
+    stream(64*KB, 4*KB);
+    TEST_ASSERT(maxinflight == 1);
+}
+
+static void
+test_dst(void) {
+    unsigned char *dst, *buf;
+    struct readq *rq;
+    ems_size_t size = 64*KB;
+    int i;
+
+    readq_setbackend(&sw_backend, NULL);
+    dst = emalloc(size);
+
+    rq = readq_new(FROM_ROM, 0);
+    readq_stream(rq, 0, size, 4*KB, dst);
+    for (i = 0; i < size/(4*KB); i++) {
+        TEST_ASSERT(readq_next(rq, &buf, NULL) == 4*KB);
+        TEST_ASSERT(buf == dst + i*4*KB);
+    }
+    readq_free(rq);
+
+    TEST_ASSERT(!checkbuf(0, dst, size));
+}
+
+static void
+test_submit(void) {
+    struct readq *rq;
+    unsigned char *buf;
+    uint32_t ofs;
+    int i;
+
+    readq_setbackend(&sw_backend, NULL);
+
+    rq = readq_new(FROM_ROM, HDRSIZE);
+    for (i = 0; i < DEPTH; i++)
+        TEST_ASSERT(!readq_submit(rq, i*HDRSIZE, HDRSIZE, NULL));
+    TEST_ASSERT(readq_full(rq));
+    TEST_ASSERT(readq_submit(rq, i*HDRSIZE, HDRSIZE, NULL));
+
+    TEST_ASSERT(readq_next(rq, &buf, &ofs) == HDRSIZE);
+    TEST_ASSERT(ofs == 0);
+    TEST_ASSERT(!readq_full(rq));
+
+    /* outstanding requests are completed by readq_free() */
+    readq_free(rq);
+    TEST_ASSERT(ninflight == 0);
+}
+
+static void
+error(void) {
+    struct readq *rq;
+    unsigned char *buf;
+    uint32_t ofs;
+    int r;
+
+    error_ofs = 12*KB;
+
+    rq = readq_new(FROM_ROM, 4*KB);
+    readq_stream(rq, 0, 64*KB, 4*KB, NULL);
+    for (ofs = 0; ofs < error_ofs; ofs += 4*KB)
+        TEST_ASSERT(readq_next(rq, &buf, NULL) == 4*KB);
+    r = readq_next(rq, &buf, &ofs);
+    TEST_ASSERT(r < 0);
+    TEST_ASSERT(ofs == error_ofs);
+    TEST_ASSERT(readq_full(rq));
+    readq_free(rq);
+}
+
+static void
+test_error_sync(void) {
+    error();
+    TEST_ASSERT(nextofs == error_ofs + 4*KB);
+}
+
+static void
+test_error_async(void) {
+    readq_setbackend(&sw_backend, NULL);
+    error();
+    /* the requests already in flight when the error occurred are completed */
+    TEST_ASSERT(ninflight == 0);
+    TEST_ASSERT(nextofs <= error_ofs + DEPTH*4*KB);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, NULL);
+
+    TEST(test_sync);
+    TEST(test_async);
+    TEST(test_async_depth1);
+    TEST(test_dst);
+    TEST(test_submit);
+    TEST(test_error_sync);
+    TEST(test_error_async);
+
+    test_done();
+}
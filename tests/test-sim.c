@@ -0,0 +1,228 @@
+/*
+ * Test case for ems-sim.c: checks the quirks of the cartridge modeled by the
+ * simulator (erasure, programming, wear, odd writes) and its virtual clock.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "../cache.h"
+#include "../ems.h"
+#include "../ems-sim.h"
+#include "../readq.h"
+
+#define OPTS "quiet=1,latency=1000,readrate=1000000,writerate=1000000," \
+             "program=200,erase=1000,stall=5000"
+
+#define MS 1000000ull
+
+static void *ctx;
+
+/* synchronous path of readq.c */
+int
+ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
+    return ems_sim_backend.read(ctx, from, offset, buf, count);
+}
+
+static int
+simwrite(int to, uint32_t offset, unsigned char *buf, size_t count) {
+    struct ems_iovec iov = {offset, buf, count};
+
+    return ems_sim_backend.writev(ctx, to, &iov, 1);
+}
+
+/* write two commands so that reads don't stall */
+static void
+write2(uint32_t offset, unsigned char *buf) {
+    struct ems_iovec iov[2] = {
+        {offset, buf, 32},
+        {offset + 32, buf + 32, 32}
+    };
+
+    TEST_ASSERT(ems_sim_backend.writev(ctx, TO_ROM, iov, 2) == 64);
+}
+
+static uint64_t
+simclock(void) {
+    struct sim_stats st;
+
+    ems_sim_stats(ctx, &st);
+    return st.clock;
+}
+
+static void
+setup(void) {
+    readq_setbackend(NULL, NULL);
+    readq_setdepth(8);
+    // the writes are sent to the backend without invalidating the cache
+    cache_setsize(0);
+    ctx = ems_sim_backend.open(OPTS);
+}
+
+static void
+teardown(void) {
+    ems_sim_backend.close(ctx);
+}
+
+static void
+test_blank(void) {
+    unsigned char buf[4096];
+
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, 0, buf, 4096) == 4096);
+    for (int i = 0; i < 4096; i++)
+        TEST_ASSERT(buf[i] == 0xff);
+
+    /* latency + 4096 bytes at 1 MB/s */
+    TEST_ASSERT(simclock() == 1*MS + 4096*1000);
+}
+
+static void
+test_program(void) {
+    unsigned char buf[64], rbuf[64];
+    uint32_t ofs = ERASEBLOCKSIZE + 64;
+
+    memset(buf, 0, 64);
+    write2(ERASEBLOCKSIZE, buf);
+
+    /* programming only clears bits */
+    memset(buf, 0xf0, 64);
+    write2(ofs, buf);
+    memset(buf, 0x3c, 64);
+    write2(ofs, buf);
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, ofs, rbuf, 64) == 64);
+    for (int i = 0; i < 64; i++)
+        TEST_ASSERT(rbuf[i] == 0x30);
+
+    /* writing at the start of the erase-block erases it */
+    write2(ERASEBLOCKSIZE, buf);
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, ofs, rbuf, 64) == 64);
+    for (int i = 0; i < 64; i++)
+        TEST_ASSERT(rbuf[i] == 0xff);
+}
+
+static void
+test_erase_time(void) {
+    unsigned char buf[64];
+    uint64_t t;
+
+    memset(buf, 0, 64);
+    write2(0, buf);
+
+    /* the host doesn't wait for the erasure... */
+    t = simclock();
+    TEST_ASSERT(t < 1000*MS);
+
+    /* ...but the next command does */
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, 0, buf, 64) == 64);
+    TEST_ASSERT(simclock() >= 1000*MS + 2*200000);
+}
+
+static void
+test_oddwrites(void) {
+    unsigned char buf[32];
+
+    memset(buf, 0, 32);
+    TEST_ASSERT(simwrite(TO_ROM, 32, buf, 32) == 32);
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, 0, buf, 32) ==
+        -ETIMEDOUT);
+    TEST_ASSERT(simclock() >= 5000*MS);
+
+    TEST_ASSERT(simwrite(TO_ROM, 64, buf, 32) == 32);
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, 0, buf, 32) == 32);
+}
+
+static void
+test_wear(void) {
+    struct sim_stats st;
+    unsigned char buf[64], rbuf[64];
+
+    ems_sim_backend.close(ctx);
+    ctx = ems_sim_backend.open(OPTS ",cycles=2");
+
+    memset(buf, 0x55, 64);
+    write2(0, buf);
+    memset(buf, 0xaa, 64);
+    write2(0, buf);
+
+    /* third erase fails: the data is programmed over the old one */
+    memset(buf, 0xff, 64);
+    write2(0, buf);
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_ROM, 0, rbuf, 64) == 64);
+    for (int i = 0; i < 64; i++)
+        TEST_ASSERT(rbuf[i] == 0xaa);
+
+    ems_sim_stats(ctx, &st);
+    TEST_ASSERT(st.erases == 3);
+    TEST_ASSERT(st.wornerases == 1);
+    TEST_ASSERT(st.maxwear == 2);
+}
+
+static void
+test_sram(void) {
+    unsigned char buf[64], rbuf[64];
+    uint64_t t;
+
+    memset(buf, 0x12, 64);
+    TEST_ASSERT(simwrite(TO_SRAM, 0, buf, 32) == 32);
+    TEST_ASSERT(simwrite(TO_SRAM, 32, buf + 32, 32) == 32);
+    t = simclock();
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_SRAM, 0, rbuf, 64) == 64);
+    TEST_ASSERT(memcmp(buf, rbuf, 64) == 0);
+    /* no programming time, no erasure */
+    TEST_ASSERT(simclock() == t + 1*MS + 64*1000);
+
+    TEST_ASSERT(ems_sim_backend.read(ctx, FROM_SRAM, SRAMSIZE - 32, rbuf,
+        64) < 0);
+}
+
+static uint64_t
+readall(int depth) {
+    struct readq *rq;
+    unsigned char *buf;
+    uint64_t t;
+
+    t = simclock();
+    readq_setdepth(depth);
+    rq = readq_new(FROM_ROM, 4096);
+    readq_stream(rq, 0, 64*4096, 4096, NULL);
+    while (readq_next(rq, &buf, NULL) == 4096)
+        ;
+    readq_free(rq);
+
+    return simclock() - t;
+}
+
+static void
+test_pipeline(void) {
+    uint64_t tsync, tasync;
+
+    readq_setbackend(ems_sim_backend.readq, ctx);
+    tsync = readall(1);
+    tasync = readall(8);
+
+    TEST_ASSERT(tsync == 64 * (1*MS + 4096*1000));
+    /* the latency is paid once */
+    TEST_ASSERT(tasync == 1*MS + 64 * 4096*1000);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_blank);
+    TEST(test_program);
+    TEST(test_erase_time);
+    TEST(test_oddwrites);
+    TEST(test_wear);
+    TEST(test_sram);
+    TEST(test_pipeline);
+
+    test_done();
+}
@@ -0,0 +1,172 @@
+/*
+ * Test case for sparse.c: checks that a page is restored from the extents
+ * saved, that the erase-blocks holding data or a part of a ROM are found and
+ * that a damaged image or a listing not matching the ROMs is rejected.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "../ems.h"
+#include "../header.h"
+#include "../sparse.h"
+
+#define KB 1024
+#define MB (KB*KB)
+
+extern const unsigned char nintylogo[0x30];
+
+static struct sparse_image image, loaded;
+static char *path;
+
+/* a ROM of 32 KB << "code" at "offset" with some data, added to the listing */
+static void
+addrom(ems_size_t offset, int code, const char *title) {
+    unsigned char *rom = image.data + offset;
+    struct listing_rom *rl;
+    unsigned char chk;
+
+    memcpy(rom + 0x104, nintylogo, sizeof(nintylogo));
+    memset(rom + 0x134, 0, 0x14d - 0x134);
+    memcpy(rom + 0x134, title, strlen(title));
+    rom[0x148] = code;
+    chk = 0;
+    for (int i = 0x134; i < 0x14d; i++)
+        chk -= rom[i] + 1;
+    rom[0x14d] = chk;
+
+    // data at the end of the ROM
+    memset(rom + (32*KB << code) - 1000, 0x42, 900);
+
+    rl = &image.listing.romlist[image.listing.count++];
+    rl->offset = offset;
+    header_decode(&rl->header, rom);
+}
+
+static void
+setup(void) {
+    memset(&image, 0, sizeof(image));
+    memset(image.data, 0xff, PAGESIZE);
+    addrom(0, 0, "MENU#");
+    addrom(256*KB, 3, "A ROM");
+    path = ecreatetmpf(0);
+}
+
+static void
+teardown(void) {
+    eremove(path);
+}
+
+static void
+test_roundtrip(void) {
+    long size;
+    FILE *f;
+
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+    TEST_ASSERT(sparse_probe(path) == 1);
+
+    /* the blank space is not saved */
+    if ((f = fopen(path, "rb")) == NULL)
+        err(1, "%s", path);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    TEST_ASSERT(size < 8*KB);
+
+    TEST_ASSERT(sparse_load(path, &loaded) == 0);
+    TEST_ASSERT(memcmp(loaded.data, image.data, PAGESIZE) == 0);
+    TEST_ASSERT(memcmp(loaded.hashes, image.hashes,
+        sizeof(image.hashes)) == 0);
+    TEST_ASSERT(loaded.listing.count == 2);
+    TEST_ASSERT(loaded.listing.romlist[1].offset == 256*KB);
+    TEST_ASSERT(strcmp(loaded.listing.romlist[1].header.title, "A ROM") == 0);
+    TEST_ASSERT(loaded.listing.romlist[1].header.romsize == 256*KB);
+
+    /* the erase-blocks with a header or the data at the end of a ROM */
+    for (int i = 0; i < SPARSE_NBLOCKS; i++)
+        TEST_ASSERT(loaded.used[i] == (i == 0 || i == 2 || i == 3));
+}
+
+static void
+test_blankrom(void) {
+    /* a ROM of 512 KB at 1 MB with data in its first and last erase-blocks */
+    addrom(1*MB, 4, "B ROM");
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+    TEST_ASSERT(sparse_load(path, &loaded) == 0);
+
+    /* the blank erase-blocks of the ROM are restored too */
+    for (int i = 8; i < 12; i++)
+        TEST_ASSERT(image.used[i] && loaded.used[i]);
+    TEST_ASSERT(!loaded.used[12]);
+}
+
+static void
+test_notsparse(void) {
+    FILE *f;
+
+    if ((f = fopen(path, "wb")) == NULL || fwrite(image.data, 4*KB, 1, f) != 1 ||
+        fclose(f) == EOF)
+            err(1, "%s", path);
+    TEST_ASSERT(sparse_probe(path) == 0);
+    TEST_ASSERT(sparse_load(path, &loaded) != 0);
+}
+
+static void
+test_damaged(void) {
+    long size;
+    FILE *f;
+    int c;
+
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+
+    /* a byte of the last extent */
+    if ((f = fopen(path, "r+b")) == NULL)
+        err(1, "%s", path);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, size - 10, SEEK_SET);
+    c = fgetc(f);
+    fseek(f, size - 10, SEEK_SET);
+    fputc(c ^ 1, f);
+    fclose(f);
+    TEST_ASSERT(sparse_load(path, &loaded) != 0);
+
+    /* truncated */
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+    if (truncate(path, size - 1) == -1)
+        err(1, "%s", path);
+    TEST_ASSERT(sparse_load(path, &loaded) != 0);
+}
+
+static void
+test_listing(void) {
+    /* a ROM of the listing whose header isn't there */
+    image.listing.romlist[1].offset = 512*KB;
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+    TEST_ASSERT(sparse_load(path, &loaded) != 0);
+
+    /* a ROM whose title differs */
+    image.listing.romlist[1].offset = 256*KB;
+    strcpy(image.listing.romlist[1].header.title, "B ROM");
+    TEST_ASSERT(sparse_save(path, &image) == 0);
+    TEST_ASSERT(sparse_load(path, &loaded) != 0);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_roundtrip);
+    TEST(test_blankrom);
+    TEST(test_notsparse);
+    TEST(test_damaged);
+    TEST(test_listing);
+
+    test_done();
+}
@@ -0,0 +1,146 @@
+/*
+ * Test case for store.c: checks that the chunks of the snapshots are stored
+ * once, that the snapshots are numbered per cart and that a damaged chunk is
+ * not restored.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <err.h>
+
+#include "test.h"
+#include "../ems.h"
+#include "../store.h"
+
+static char dir[] = ".tmp_XXXXXX", sram[sizeof(dir) + 8];
+static unsigned char data[SRAMSIZE], buf[SRAMSIZE];
+
+static void
+writesram(void) {
+    FILE *f;
+
+    if ((f = fopen(sram, "wb")) == NULL || fwrite(data, SRAMSIZE, 1, f) != 1 ||
+        fclose(f) == EOF)
+            err(1, "%s", sram);
+}
+
+static void
+readsram(void) {
+    FILE *f;
+
+    if ((f = fopen(sram, "rb")) == NULL || fread(buf, SRAMSIZE, 1, f) != 1 ||
+        fclose(f) == EOF)
+            err(1, "%s", sram);
+}
+
+static void
+setup(void) {
+    if (mkdtemp(dir) == NULL)
+        err(1, "mkdtemp");
+    if (setenv("EMS_STORE", dir, 1) == -1)
+        err(1, "setenv");
+    snprintf(sram, sizeof(sram), "%s/sram", dir);
+
+    for (int i = 0; i < SRAMSIZE; i++)
+        data[i] = i*7 + i/STORE_CHUNKSIZE;
+}
+
+static void
+teardown(void) {
+    char cmd[sizeof(dir) + 16];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+static void
+test_put(void) {
+    struct store_snapshot snap, *snaps;
+    int count;
+
+    snap.print = 0x1234;
+    writesram();
+    TEST_ASSERT(store_put("cart:a", sram, &snap) == STORE_NCHUNKS);
+    TEST_ASSERT(snap.id == 1);
+
+    /* only the chunk changed is added */
+    data[5*STORE_CHUNKSIZE + 10] ^= 0xff;
+    writesram();
+    TEST_ASSERT(store_put("cart:a", sram, &snap) == 1);
+    TEST_ASSERT(snap.id == 2);
+
+    /* the chunks are shared by the carts, not the numbers */
+    TEST_ASSERT(store_put("cart:b", sram, &snap) == 0);
+    TEST_ASSERT(snap.id == 1);
+
+    TEST_ASSERT(store_list("cart:a", &snaps, &count) == 0);
+    TEST_ASSERT(count == 2);
+    TEST_ASSERT(snaps[0].id == 1 && snaps[1].id == 2);
+    TEST_ASSERT(snaps[0].print == 0x1234);
+    for (int i = 0; i < STORE_NCHUNKS; i++)
+        TEST_ASSERT((snaps[0].chunks[i] == snaps[1].chunks[i]) == (i != 5));
+    free(snaps);
+}
+
+static void
+test_get(void) {
+    struct store_snapshot snap;
+    uint64_t print;
+
+    snap.print = 0xabcd;
+    writesram();
+    TEST_ASSERT(store_put("cart:a", sram, &snap) >= 0);
+    data[0] ^= 0xff;
+    writesram();
+    snap.print = 0xef01;
+    TEST_ASSERT(store_put("cart:a", sram, &snap) >= 0);
+
+    TEST_ASSERT(store_get("cart:a", 1, sram, &print) == 0);
+    TEST_ASSERT(print == 0xabcd);
+    readsram();
+    data[0] ^= 0xff;
+    TEST_ASSERT(memcmp(buf, data, SRAMSIZE) == 0);
+
+    TEST_ASSERT(store_get("cart:a", 3, sram, &print) == 1);
+    TEST_ASSERT(store_get("cart:b", 1, sram, &print) == 1);
+}
+
+static void
+test_damaged(void) {
+    struct store_snapshot snap;
+    char path[sizeof(dir) + 32];
+    uint64_t print;
+    FILE *f;
+
+    snap.print = 0;
+    writesram();
+    TEST_ASSERT(store_put("cart:a", sram, &snap) >= 0);
+
+    snprintf(path, sizeof(path), "%s/chunks/%016llx", dir,
+        (unsigned long long)snap.chunks[3]);
+    if ((f = fopen(path, "r+b")) == NULL)
+        err(1, "%s", path);
+    fputc(data[3*STORE_CHUNKSIZE] ^ 1, f);
+    fclose(f);
+
+    TEST_ASSERT(store_get("cart:a", 1, sram, &print) == 1);
+
+    /* a new snapshot repairs it */
+    TEST_ASSERT(store_put("cart:a", sram, &snap) == 1);
+    TEST_ASSERT(store_get("cart:a", 1, sram, &print) == 0);
+}
+
+int
+main(int argc, char **argv) {
+    test_init(argc, argv, setup, teardown);
+
+    TEST(test_put);
+    TEST(test_get);
+    TEST(test_damaged);
+
+    test_done();
+}
@@ -0,0 +1,27 @@
+/*
+ * ems_writev() on top of the ems_write() mock of a test case: the commands
+ * are passed to ems_write() one by one, until the first error.
+ * writev_calls counts the batches.
+ */
+
+#include "../ems.h"
+
+int writev_calls;
+
+int
+ems_writev(int to, struct ems_iovec *iov, int iovcnt) {
+    int i, r, written;
+
+    writev_calls++;
+
+    for (i = 0, written = 0; i < iovcnt; i++) {
+        r = ems_write(to, iov[i].offset, iov[i].buf, iov[i].count);
+        if (r < 0)
+            return r;
+        written += r;
+        if (r != iov[i].count)
+            break;
+    }
+
+    return written;
+}
@@ -0,0 +1,88 @@
+/*
+ * Timeline of a session in the Chrome trace event format (--trace), to be
+ * loaded in chrome://tracing or Perfetto.
+ *
+ * The operations recorded by stats.c are written as complete events ("X") on
+ * the thread of the host: they nest as the calls do (update command, flash_*
+ * function, USB transfer). Reads in flight in a read queue overlap and are
+ * written as async events ("b" and "e"), shown on their own track.
+ *
+ * The arguments of an event are the number of commands and of bytes.
+ */
+
+#include <err.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+#define TRACE_PID 1
+#define TRACE_TID 1
+
+static FILE *trace_file;
+static unsigned long trace_nextid;
+
+/**
+ * Create the trace file "path".
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+trace_open(const char *path) {
+    if ((trace_file = fopen(path, "w")) == NULL) {
+        warn("can't create %s", path);
+        return 1;
+    }
+
+    fprintf(trace_file, "{\"traceEvents\": [\n"
+        "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+        "\"args\": {\"name\": \"ems-flasher\"}},\n"
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+        "\"args\": {\"name\": \"host\"}}", TRACE_PID, TRACE_PID, TRACE_TID);
+
+    return 0;
+}
+
+/**
+ * Write the span of the operation "name" of the category "cat" from "start"
+ * to "end" (in ns). "async" is non-zero for an operation that may overlap with
+ * others.
+ */
+void
+trace_span(const char *name, const char *cat, uint64_t start, uint64_t end,
+    unsigned long cmds, unsigned long bytes, int async) {
+    if (trace_file == NULL)
+        return;
+
+    if (!async) {
+        fprintf(trace_file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+            "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, "
+            "\"tid\": %d, \"args\": {\"commands\": %lu, \"bytes\": %lu}}",
+            name, cat, start / 1e3, (end - start) / 1e3, TRACE_PID,
+            TRACE_TID, cmds, bytes);
+        return;
+    }
+
+    trace_nextid++;
+    fprintf(trace_file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+        "\"ph\": \"b\", \"id\": %lu, \"ts\": %.3f, \"pid\": %d, \"tid\": %d, "
+        "\"args\": {\"commands\": %lu, \"bytes\": %lu}}",
+        name, cat, trace_nextid, start / 1e3, TRACE_PID, TRACE_TID, cmds,
+        bytes);
+    fprintf(trace_file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+        "\"ph\": \"e\", \"id\": %lu, \"ts\": %.3f, \"pid\": %d, \"tid\": %d}",
+        name, cat, trace_nextid, end / 1e3, TRACE_PID, TRACE_TID);
+}
+
+/**
+ * Terminate and close the trace file
+ */
+void
+trace_close(void) {
+    if (trace_file == NULL)
+        return;
+
+    fprintf(trace_file, "\n]}\n");
+    if (fclose(trace_file) == EOF)
+        warn("error writing the trace file");
+    trace_file = NULL;
+}
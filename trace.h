@@ -0,0 +1,11 @@
+#ifndef EMS_TRACE_H
+#define EMS_TRACE_H
+
+#include <stdint.h>
+
+int trace_open(const char *);
+void trace_span(const char *, const char *, uint64_t, uint64_t,
+    unsigned long, unsigned long, int);
+void trace_close(void);
+
+#endif /* EMS_TRACE_H */
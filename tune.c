@@ -0,0 +1,361 @@
+/*
+ * Autotuning of the transfer sizes (--autotune).
+ *
+ * tune_run() measures the throughput of the candidate sizes on a scratch
+ * erase-block and picks the fastest one that transferred the data correctly:
+ *
+ *   - write sizes from WRITEBLOCKSIZE to FLASH_MAXWRITESIZE: the first
+ *     READBLOCKSIZE bytes of the scratch block are written untimed to trigger
+ *     the erase, then TUNE_WRITESIZE bytes are written by commands of the
+ *     candidate size and read back for verification. A new pattern is used for
+ *     every candidate so stale data can't pass the verification. The sizes
+ *     above a failing one are not tried.
+ *   - read sizes from READBLOCKSIZE to FLASH_MAXREADSIZE: the whole scratch
+ *     block, filled with a known pattern, is read through a read queue.
+ *
+ * The scratch block is erased when done. The results are saved per device (see
+ * ems_devid()) in the file named by the EMS_TUNEFILE environment variable or
+ * in ~/.ems-flasher-tune. Each line of this file is:
+ *   READSIZE WRITESIZE DEVID
+ */
+
+/* for clock_gettime() */
+#define _XOPEN_SOURCE 500
+
+#include "ems.h"
+#include "flash.h"
+#include "readq.h"
+#include "tune.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#define TUNE_WRITESIZE ((ems_size_t)32<<10)
+#define TUNE_FILENAME ".ems-flasher-tune"
+
+static unsigned char tune_pattern[ERASEBLOCKSIZE];
+static unsigned char tune_buf[ERASEBLOCKSIZE];
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill the pattern buffer with pseudo-random bytes (xorshift)
+ */
+static void
+fill_pattern(uint32_t seed) {
+    uint32_t x = seed * 2654435761u | 1;
+
+    for (ems_size_t i = 0; i < ERASEBLOCKSIZE; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        tune_pattern[i] = x;
+    }
+}
+
+/**
+ * Write "size" bytes of the pattern at "offset" with commands of "writesize"
+ * bytes, READBLOCKSIZE bytes per transfer.
+ */
+static int
+write_pattern(ems_size_t offset, ems_size_t size, ems_size_t writesize) {
+    struct ems_iovec iov[READBLOCKSIZE/WRITEBLOCKSIZE];
+    ems_size_t blockofs, ofs;
+    int n;
+
+    for (blockofs = 0; blockofs < size; blockofs += READBLOCKSIZE) {
+        n = 0;
+        for (ofs = 0; ofs < READBLOCKSIZE; ofs += writesize) {
+            iov[n].offset = offset + blockofs + ofs;
+            iov[n].buf = tune_pattern + (offset + blockofs + ofs) %
+                ERASEBLOCKSIZE;
+            iov[n].count = writesize;
+            n++;
+        }
+        if (ems_writev(TO_ROM, iov, n) != READBLOCKSIZE)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read "size" bytes at "offset" in tune_buf by chunks of "readsize" bytes
+ */
+static int
+read_buf(ems_size_t offset, ems_size_t size, ems_size_t readsize) {
+    struct readq *rq;
+    unsigned char *buf;
+    int r;
+
+    rq = readq_new(FROM_ROM, 0);
+    readq_stream(rq, offset, size, readsize, tune_buf);
+    while ((r = readq_next(rq, &buf, NULL)) > 0)
+        if (r != readsize)
+            break;
+    readq_free(rq);
+
+    return r != 0;
+}
+
+/**
+ * Erase the scratch block. It is done without flash_erase() that refuses to
+ * run once interrupted.
+ */
+static int
+erase(ems_size_t offset) {
+    unsigned char blank[WRITEBLOCKSIZE];
+    struct ems_iovec iov[2];
+
+    memset(blank, 0xff, sizeof(blank));
+    for (int i = 0; i < 2; i++) {
+        iov[i].offset = offset + i*WRITEBLOCKSIZE;
+        iov[i].buf = blank;
+        iov[i].count = WRITEBLOCKSIZE;
+    }
+
+    if (ems_writev(TO_ROM, iov, 2) != 2*WRITEBLOCKSIZE) {
+        warnx("write error erasing the scratch erase-block");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+check_buf(ems_size_t offset, ems_size_t size) {
+    return memcmp(tune_buf, tune_pattern + offset % ERASEBLOCKSIZE, size);
+}
+
+/**
+ * Measure the read and write sizes on the erase-block at "scratch". The data of
+ * this erase-block is lost. "checkint" is called between the measures.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+tune_run(ems_size_t scratch, int verbose, int (*checkint)(void),
+    ems_size_t *readsize, ems_size_t *writesize) {
+    double t, rate, bestrate;
+    ems_size_t size;
+    int seed;
+
+    seed = 0;
+
+    bestrate = 0;
+    *writesize = 0;
+    for (size = WRITEBLOCKSIZE; size <= FLASH_MAXWRITESIZE; size *= 2) {
+        if (checkint())
+            goto interrupted;
+
+        fill_pattern(++seed);
+
+        /* trigger the erase and wait for its completion */
+        if (write_pattern(scratch, READBLOCKSIZE, WRITEBLOCKSIZE) ||
+            ems_read(FROM_ROM, scratch, tune_buf, READBLOCKSIZE) !=
+            READBLOCKSIZE)
+                goto usb_error;
+
+        t = now();
+        if (write_pattern(scratch + READBLOCKSIZE, TUNE_WRITESIZE,
+            size) != 0) {
+                if (verbose)
+                    printf("write size %5"PRIuEMSSIZE": transfer error\n",
+                        size);
+                break;
+        }
+        /* reading waits for the completion of the writes */
+        if (ems_read(FROM_ROM, scratch, tune_buf, READBLOCKSIZE) !=
+            READBLOCKSIZE)
+                goto usb_error;
+        rate = TUNE_WRITESIZE / (now() - t);
+
+        if (read_buf(scratch + READBLOCKSIZE, TUNE_WRITESIZE,
+            READBLOCKSIZE) != 0)
+                goto usb_error;
+        if (check_buf(scratch + READBLOCKSIZE, TUNE_WRITESIZE) != 0) {
+            if (verbose)
+                printf("write size %5"PRIuEMSSIZE": verification failed\n",
+                    size);
+            break;
+        }
+
+        if (verbose)
+            printf("write size %5"PRIuEMSSIZE": %6.1f KB/s\n", size,
+                rate / 1024);
+        if (rate > bestrate) {
+            bestrate = rate;
+            *writesize = size;
+        }
+    }
+    if (*writesize == 0) {
+        warnx("no write size transferred the data correctly");
+        goto fail;
+    }
+
+    /* fill the whole erase-block with a known pattern */
+    if (checkint())
+        goto interrupted;
+    fill_pattern(++seed);
+    if (write_pattern(scratch, ERASEBLOCKSIZE, *writesize) != 0)
+        goto usb_error;
+
+    bestrate = 0;
+    *readsize = 0;
+    for (size = READBLOCKSIZE; size <= FLASH_MAXREADSIZE; size *= 2) {
+        if (checkint())
+            goto interrupted;
+
+        memset(tune_buf, 0, sizeof(tune_buf));
+        t = now();
+        if (read_buf(scratch, ERASEBLOCKSIZE, size) != 0) {
+            if (verbose)
+                printf("read size %6"PRIuEMSSIZE": transfer error\n", size);
+            break;
+        }
+        rate = ERASEBLOCKSIZE / (now() - t);
+        if (check_buf(scratch, ERASEBLOCKSIZE) != 0) {
+            if (verbose)
+                printf("read size %6"PRIuEMSSIZE": verification failed\n",
+                    size);
+            break;
+        }
+
+        if (verbose)
+            printf("read size %6"PRIuEMSSIZE": %6.1f KB/s\n", size,
+                rate / 1024);
+        if (rate > bestrate) {
+            bestrate = rate;
+            *readsize = size;
+        }
+    }
+    if (*readsize == 0) {
+        warnx("no read size transferred the data correctly");
+        goto fail;
+    }
+
+    return erase(scratch);
+
+usb_error:
+    warnx("transfer error during the tests");
+    return 1;
+
+interrupted:
+    warnx("operation interrupted");
+fail:
+    erase(scratch);
+    return 1;
+}
+
+static char *
+tune_path(void) {
+    static char path[1024];
+    char *p;
+
+    if ((p = getenv("EMS_TUNEFILE")) != NULL && *p != '\0')
+        return p;
+
+    if ((p = getenv("HOME")) == NULL)
+        p = ".";
+    if (snprintf(path, sizeof(path), "%s/%s", p, TUNE_FILENAME) >=
+        sizeof(path)) {
+            warnx("path of the tuning file too long");
+            return NULL;
+    }
+
+    return path;
+}
+
+/**
+ * Look up the sizes saved for the device "devid".
+ *
+ * Returns 0 if found, 1 otherwise.
+ */
+int
+tune_load(const char *devid, ems_size_t *readsize, ems_size_t *writesize) {
+    char line[1024], *path;
+    ems_size_t rs, ws;
+    int n, found;
+    FILE *f;
+
+    if ((path = tune_path()) == NULL)
+        return 1;
+    if ((f = fopen(path, "r")) == NULL)
+        return 1;
+
+    found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%"SCNuEMSSIZE" %"SCNuEMSSIZE" %n", &rs, &ws,
+            &n) == 2 && strcmp(line + n, devid) == 0) {
+                *readsize = rs;
+                *writesize = ws;
+                found = 1;
+        }
+    }
+    fclose(f);
+
+    return !found;
+}
+
+/**
+ * Save the sizes of the device "devid", replacing its previous entry.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+int
+tune_save(const char *devid, ems_size_t readsize, ems_size_t writesize) {
+    char line[1024], tmppath[1024+8], *path;
+    ems_size_t rs, ws;
+    FILE *f, *tmp;
+    int n;
+
+    if ((path = tune_path()) == NULL)
+        return 1;
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >=
+        sizeof(tmppath)) {
+            warnx("path of the tuning file too long");
+            return 1;
+    }
+
+    if ((tmp = fopen(tmppath, "w")) == NULL) {
+        warn("can't create %s", tmppath);
+        return 1;
+    }
+
+    /* keep the entries of the other devices */
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (sscanf(line, "%"SCNuEMSSIZE" %"SCNuEMSSIZE" %n", &rs, &ws,
+                &n) == 2 && strcmp(line + n, devid) == 0)
+                    continue;
+            fprintf(tmp, "%s\n", line);
+        }
+        fclose(f);
+    }
+
+    fprintf(tmp, "%"PRIuEMSSIZE" %"PRIuEMSSIZE" %s\n", readsize, writesize,
+        devid);
+
+    if (fclose(tmp) == EOF) {
+        warn("error writing %s", tmppath);
+        remove(tmppath);
+        return 1;
+    }
+    if (rename(tmppath, path) == -1) {
+        warn("can't rename %s to %s", tmppath, path);
+        remove(tmppath);
+        return 1;
+    }
+
+    return 0;
+}
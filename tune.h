@@ -0,0 +1,10 @@
+#ifndef EMS_TUNE_H
+#define EMS_TUNE_H
+
+#include "ems.h"
+
+int tune_load(const char *, ems_size_t *, ems_size_t *);
+int tune_save(const char *, ems_size_t, ems_size_t);
+int tune_run(ems_size_t, int, int (*)(void), ems_size_t *, ems_size_t *);
+
+#endif /* EMS_TUNE_H */
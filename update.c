@@ -4,6 +4,36 @@
 
 #define ERASEBLOCKNB(ofs) ((ofs)/ERASEBLOCKSIZE)
 
+/* size of the transfers made by flash.c */
+#define XFERSIZE 4096
+
+/*
+ * Default cost model: the timings of the EMS cart as simulated by ems-sim.c.
+ * Writes are bound by the programming of the chunks (200 us per 32 bytes).
+ */
+const struct update_cost update_defaultcost = {
+    .erase = 1.0,
+    .command = 0.001,
+    .readrate = 1000000,
+    .writerate = 140000
+};
+
+/*
+ * struct plan: parameters of image_plan()
+ */
+struct plan {
+    const struct update_cost *cost;
+    int (*isblank)(ems_size_t, ems_size_t, void *);
+    void *ctx;
+};
+
+/* time to transfer "size" bytes at "rate" bytes per second */
+double
+update_xfertime(const struct update_cost *cost, ems_size_t size,
+    double rate) {
+    return size/rate + (size + XFERSIZE-1)/XFERSIZE*cost->command;
+}
+
 /**
  * Add an update (command) to a struct updates (see update.h for the data
  * format)
@@ -53,17 +83,70 @@ update_bigrom(struct updates *updates, struct rom *rom) {
     return 0;
 }
 
-static int
-update_smallroms(struct updates *updates, struct rom *from) {
-    struct rom *cur;
-    int r, slot;
-
 #define FOREACH_SMALLROM(from, cur)                                            \
     for ((cur) = (from);                                                       \
         (cur) != NULL &&                                                       \
             ERASEBLOCKNB((cur)->offset) == ERASEBLOCKNB((from)->offset);       \
         (cur) = image_next(cur))
 
+/* the ROM must be written: it is new or it is moved */
+#define TOFLASH(rom) ((rom)->source.type == ROM_SOURCE_FILE ||                \
+    (rom)->offset != (rom)->source.u.origoffset)
+
+/**
+ * Check whether the ROMs to flash in the erase-block of "from" can be written
+ * without erasing it: the ROMs already in the erase-block don't move and the
+ * destinations are blank. The destinations are checked with isblank only when
+ * the time it takes is less than the time it would save according to the cost
+ * model.
+ *
+ * Returns 1 if the erase-block can be appended to, 0 if not and -1 if isblank
+ * failed.
+ */
+static int
+update_appendable(struct plan *plan, struct rom *from) {
+    const struct update_cost *cost = plan->cost;
+    double probe, saving;
+    struct rom *cur;
+    int r;
+
+    if (plan->isblank == NULL)
+        return 0;
+
+    probe = 0;
+    saving = cost->erase;
+    FOREACH_SMALLROM(from, cur) {
+        if (!TOFLASH(cur)) {
+            // saved and rewritten around the erasure otherwise
+            saving += update_xfertime(cost, cur->romsize, cost->readrate);
+            saving += update_xfertime(cost, cur->romsize, cost->writerate);
+            continue;
+        }
+        // a write at the start of the erase-block erases it
+        if (cur->offset%ERASEBLOCKSIZE == 0)
+            return 0;
+        if (cur->source.type == ROM_SOURCE_FLASH &&
+            ERASEBLOCKNB(cur->source.u.origoffset) == ERASEBLOCKNB(from->offset))
+                return 0;
+        probe += update_xfertime(cost, cur->romsize, cost->readrate);
+    }
+    if (probe >= saving)
+        return 0;
+
+    FOREACH_SMALLROM(from, cur) {
+        if (TOFLASH(cur) &&
+            (r = plan->isblank(cur->offset, cur->romsize, plan->ctx)) != 1)
+                return r;
+    }
+
+    return 1;
+}
+
+static int
+update_smallroms(struct updates *updates, struct rom *from) {
+    struct rom *cur;
+    int r, slot;
+
     /*
      * Save in memory the ROMs present in the erase-block: the moved ROMs
      * originating from the same erase block and the untouched ROMs.
@@ -107,6 +190,34 @@ update_smallroms(struct updates *updates, struct rom *from) {
     return 0;
 }
 
+/**
+ * Write the ROMs to flash in the erase-block of "from", without erasing it
+ * (see update_appendable()).
+ */
+static int
+update_append(struct updates *updates, struct rom *from) {
+    struct rom *cur;
+    int r;
+
+    FOREACH_SMALLROM(from, cur) {
+        if (!TOFLASH(cur))
+            continue;
+        if ((r = update_bigrom(updates, cur)) != 0)
+            return r;
+    }
+    return 0;
+}
+
+/**
+ * Generate I/O commands to be applied to the original image to obtain the
+ * new image. Same as image_plan() without cost model: every erase-block
+ * receiving small ROMs is erased.
+ */
+int
+image_update(struct image *image, struct updates **updates) {
+    return image_plan(image, &update_defaultcost, NULL, NULL, updates);
+}
+
 /**
  * Generate I/O commands to be applied to the original image to obtain the
  * new image.
@@ -117,12 +228,23 @@ update_smallroms(struct updates *updates, struct rom *from) {
  * command cannot be overwritten by a previous command. This keeps us from doing
  * a topological sorting.
  *
+ * The small ROMs are grouped by erase-block: the ROMs of the erase-block that
+ * don't move are saved, the erase-block is erased and all its ROMs are
+ * written. When the ROMs already present don't move, isblank(offset, size,
+ * ctx) is used to check whether the destinations of the other ones are blank
+ * (see update_appendable()): they are then written without erasing anything.
+ * isblank returns 1 if the range is blank, 0 if not and -1 on error. It may be
+ * NULL. The offsets are relative to the page.
+ *
  * image must be valid (see image.h) and the ROMs must have a size power of two.
  *
  * Returns non-zero in case of error.
  */
 int
-image_update(struct image *image, struct updates **updates) {
+image_plan(struct image *image, const struct update_cost *cost,
+    int (*isblank)(ems_size_t, ems_size_t, void *), void *ctx,
+    struct updates **updates) {
+    struct plan plan = {cost, isblank, ctx};
     struct rom *rom;
     int r;
 
@@ -159,8 +281,11 @@ image_update(struct image *image, struct updates **updates) {
                     from = prev;
             }
 
-            if ((r = update_smallroms(*updates, from)))
-                return r;
+            if ((r = update_appendable(&plan, from)) < 0)
+                return 1;
+            if ((r = r ? update_append(*updates, from) :
+                update_smallroms(*updates, from)))
+                    return r;
 
             /* 
              * Compute next = last ROM of the erase-block, so the next iteration
@@ -175,3 +300,42 @@ image_update(struct image *image, struct updates **updates) {
 
     return 0;
 }
+
+/**
+ * Estimate the time and the number of erasures of a list of commands with the
+ * cost model "cost".
+ */
+void
+update_estimate(struct updates *updates, const struct update_cost *cost,
+    struct update_estimate *est) {
+    struct update *u;
+    ems_size_t dstofs, size;
+
+    est->time = 0;
+    est->erases = 0;
+
+    updates_foreach(updates, u) {
+        switch (u->cmd) {
+        case UPDATE_CMD_WRITEF:
+        case UPDATE_CMD_MOVE:
+        case UPDATE_CMD_WRITE:
+            dstofs = u->rom->offset;
+            size = u->rom->romsize;
+            est->time += update_xfertime(cost, size, cost->writerate);
+            if (u->cmd == UPDATE_CMD_MOVE)
+                est->time += update_xfertime(cost, size, cost->readrate);
+            if (dstofs%ERASEBLOCKSIZE == 0)
+                est->erases += (size + ERASEBLOCKSIZE-1)/ERASEBLOCKSIZE;
+            break;
+        case UPDATE_CMD_READ:
+            est->time += update_xfertime(cost, u->update_read_size,
+                cost->readrate);
+            break;
+        case UPDATE_CMD_ERASE:
+            est->time += cost->command;
+            est->erases++;
+            break;
+        }
+    }
+    est->time += est->erases * cost->erase;
+}
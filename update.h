@@ -73,6 +73,33 @@ struct update {
 #define updates_next(u) SIMPLEQ_NEXT(u, updates)
 #define updates_init(us) SIMPLEQ_INIT(us)
 
+/*
+ * struct update_cost: cost model of a device, used by image_plan() to choose
+ * the commands and by update_estimate()
+ *   erase: time to erase an erase-block, in seconds
+ *   command: overhead of a transfer of up to 4 KB, in seconds
+ *   readrate, writerate: bytes read or written per second
+ *
+ * struct update_estimate: predicted cost of a list of commands
+ *   time: in seconds
+ *   erases: number of erase-blocks erased
+ */
+struct update_cost {
+    double erase, command, readrate, writerate;
+};
+
+struct update_estimate {
+    double time;
+    int erases;
+};
+
+extern const struct update_cost update_defaultcost;
+
 int image_update(struct image*, struct updates**);
+int image_plan(struct image *, const struct update_cost *,
+    int (*)(ems_size_t, ems_size_t, void *), void *, struct updates **);
+void update_estimate(struct updates *, const struct update_cost *,
+    struct update_estimate *);
+double update_xfertime(const struct update_cost *, ems_size_t, double);
 
 #endif /* EMS_UPDATE_H */
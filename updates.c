@@ -15,6 +15,43 @@
 #include "update.h"
 #include "flash.h"
 #include "progress.h"
+#include "stats.h"
+
+/**
+ * Operation and number of bytes accounted for an update command (see
+ * stats.h)
+ */
+static inline int
+stats_updateop(struct update *u) {
+    switch (u->cmd) {
+    case UPDATE_CMD_WRITEF:
+        return STATS_UPDATE_WRITEF;
+    case UPDATE_CMD_MOVE:
+        return STATS_UPDATE_MOVE;
+    case UPDATE_CMD_WRITE:
+        return STATS_UPDATE_WRITE;
+    case UPDATE_CMD_READ:
+        return STATS_UPDATE_READ;
+    default:
+        return STATS_UPDATE_ERASE;
+    }
+}
+
+static inline unsigned long
+stats_updatesize(struct update *u) {
+    switch (u->cmd) {
+    case UPDATE_CMD_WRITEF:
+        return u->update_writef_size;
+    case UPDATE_CMD_MOVE:
+        return u->update_move_size;
+    case UPDATE_CMD_WRITE:
+        return u->update_write_size;
+    case UPDATE_CMD_READ:
+        return u->update_read_size;
+    default:
+        return 0;
+    }
+}
 
 /**
  * Update the flash memory
@@ -89,6 +126,7 @@ apply_updates(int page, int verbose, struct updates *updates) {
         }
 
         r = 0;
+        STATS_TIMER(t);
         switch (u->cmd) {
         case UPDATE_CMD_WRITEF: {
             struct romfile *romfile;
@@ -133,6 +171,7 @@ apply_updates(int page, int verbose, struct updates *updates) {
             progress_newline();
             errx(1, "internal error: bad update command (%d)", u->cmd);
         }
+        STATS_STOP(t, stats_updateop(u), 1, stats_updatesize(u));
 
         if (r) {
             progress_newline();
@@ -0,0 +1,169 @@
+/*
+ * Verification of the data written (--verify).
+ *
+ * flash.c copies the data it writes to a job, by erase-block, reads the
+ * erase-block back to the job when it is complete and queues the job. A worker
+ * thread hashes the expected and the actual data of the queued jobs while the
+ * next erase-block is written: the cost of the verification is the time taken
+ * to read the data back.
+ *
+ * There are VERIFY_JOBS jobs: verify_get() waits for the oldest one to be
+ * hashed when they are all in use. The erase-blocks whose hashes differ are
+ * reported by verify_report().
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ems.h"
+#include "hash.h"
+#include "verify.h"
+
+#define VERIFY_JOBS 2
+
+enum {JOB_FREE, JOB_FILLING, JOB_QUEUED};
+
+static struct verify_job jobs[VERIFY_JOBS];
+static int jobstate[VERIFY_JOBS];
+static int nextjob;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int started;
+
+/* results */
+static struct {
+    int to;
+    ems_size_t offset;
+} *bad;
+static int nbad, badsize;
+static ems_size_t verified;
+
+/* record the erase-block of a job as mismatching, lock held */
+static void
+addbad(struct verify_job *job) {
+    ems_size_t block = job->offset - job->offset%ERASEBLOCKSIZE;
+
+    for (int i = 0; i < nbad; i++)
+        if (bad[i].to == job->to && bad[i].offset == block)
+            return;
+
+    if (nbad == badsize) {
+        badsize = badsize ? badsize*2 : 16;
+        if ((bad = realloc(bad, badsize * sizeof(*bad))) == NULL)
+            err(1, "malloc");
+    }
+    bad[nbad].to = job->to;
+    bad[nbad].offset = block;
+    nbad++;
+}
+
+static void *
+verify_worker(void *arg) {
+    int n = 0;
+
+    for (;;) {
+        struct verify_job *job = &jobs[n];
+        int match;
+
+        pthread_mutex_lock(&lock);
+        while (jobstate[n] != JOB_QUEUED)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        match = hash64(job->expect, job->size) ==
+            hash64(job->actual, job->size);
+
+        pthread_mutex_lock(&lock);
+        if (!match)
+            addbad(job);
+        verified += job->size;
+        jobstate[n] = JOB_FREE;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        n = (n + 1) % VERIFY_JOBS;
+    }
+
+    return NULL;
+}
+
+/**
+ * Get a job to verify "to" from "offset". The job is empty. Waits for a job to
+ * be available and starts the worker on the first call. Exits on error.
+ */
+struct verify_job *
+verify_get(int to, ems_size_t offset) {
+    struct verify_job *job;
+
+    pthread_mutex_lock(&lock);
+    if (!started) {
+        if ((errno = pthread_create(&worker, NULL, verify_worker, NULL)) != 0)
+            err(1, "pthread_create");
+        started = 1;
+    }
+    while (jobstate[nextjob] != JOB_FREE)
+        pthread_cond_wait(&cond, &lock);
+    jobstate[nextjob] = JOB_FILLING;
+    pthread_mutex_unlock(&lock);
+
+    job = &jobs[nextjob];
+    job->to = to;
+    job->offset = offset;
+    job->size = 0;
+
+    return job;
+}
+
+/**
+ * Queue a job obtained by verify_get() once its actual data has been read.
+ */
+void
+verify_put(struct verify_job *job) {
+    pthread_mutex_lock(&lock);
+    jobstate[job - jobs] = JOB_QUEUED;
+    nextjob = (job - jobs + 1) % VERIFY_JOBS;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Give back a job without verifying it (the write failed).
+ */
+void
+verify_cancel(struct verify_job *job) {
+    pthread_mutex_lock(&lock);
+    jobstate[job - jobs] = JOB_FREE;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Wait for the queued jobs and print the mismatching erase-blocks.
+ *
+ * Returns the number of mismatching erase-blocks.
+ */
+int
+verify_report(int verbose) {
+    int i, n;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < VERIFY_JOBS; i++)
+        while (jobstate[i] == JOB_QUEUED)
+            pthread_cond_wait(&cond, &lock);
+    n = nbad;
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n; i++)
+        warnx("verify: mismatch in the %s erase-block at 0x%06"PRIXLEAST32,
+            bad[i].to == TO_ROM ? "flash" : "SRAM", bad[i].offset);
+    if (verbose && started)
+        printf("Verified %"PRIuEMSSIZE" KB, %d mismatching erase-block%s\n",
+            verified/1024, n, n == 1 ? "" : "s");
+
+    return n;
+}
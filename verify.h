@@ -0,0 +1,24 @@
+#ifndef EMS_VERIFY_H
+#define EMS_VERIFY_H
+
+#include "ems.h"
+
+/*
+ * struct verify_job: an erase-block, or a part of it, to verify
+ *   to: TO_ROM or TO_SRAM
+ *   offset, size: range written
+ *   expect: data written
+ *   actual: data read back
+ */
+struct verify_job {
+    int to;
+    ems_size_t offset, size;
+    unsigned char expect[ERASEBLOCKSIZE], actual[ERASEBLOCKSIZE];
+};
+
+struct verify_job *verify_get(int, ems_size_t);
+void verify_put(struct verify_job *);
+void verify_cancel(struct verify_job *);
+int verify_report(int);
+
+#endif /* EMS_VERIFY_H */
@@ -0,0 +1,215 @@
+/*
+ * Erase counts of the erase-blocks of the carts, kept on the host.
+ *
+ * Each erase-block has a life of 100000 erase cycles. The erasures are counted
+ * as the write commands starting an erase-block are sent by ems_writev() (see
+ * wear_writev()), whatever the command, and the counts are used by
+ * image_insert() to put the ROMs in the less worn erase-blocks (see
+ * insert_wear).
+ *
+ * The counts are saved at the exit, per cart (see ems_cartid() and
+ * ems_fingerprint()), in the file named by the EMS_WEARFILE environment
+ * variable or in ~/.ems-flasher-wear. Each line of this file is the
+ * WEAR_NBLOCKS counts followed by the fingerprint and the identifier of the
+ * cart:
+ *   COUNT0 COUNT1 ... COUNT63 FINGERPRINT CARTID
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ems.h"
+#include "wear.h"
+
+#define WEAR_FILENAME ".ems-flasher-wear"
+#define WEAR_LINESIZE (WEAR_NBLOCKS*11 + 1024)
+
+/* erase counts of the cart counting the erasures, see wear_start() */
+static unsigned long wear_counts[WEAR_NBLOCKS];
+static char wear_key[256 + 17];  /* fingerprint and identifier */
+static int wear_started, wear_changed;
+
+static char *
+wear_path(void) {
+    static char path[1024];
+    char *p;
+
+    if ((p = getenv("EMS_WEARFILE")) != NULL && *p != '\0')
+        return p;
+
+    if ((p = getenv("HOME")) == NULL)
+        p = ".";
+    if (snprintf(path, sizeof(path), "%s/%s", p, WEAR_FILENAME) >=
+        sizeof(path)) {
+            warnx("path of the wear file too long");
+            return NULL;
+    }
+
+    return path;
+}
+
+/**
+ * Parse a line of the wear file, without its newline. "counts" may be NULL.
+ *
+ * Returns the cart identifier or NULL if the line is invalid.
+ */
+static char *
+parse_line(char *line, unsigned long *counts) {
+    char *p, *end;
+    unsigned long n;
+
+    p = line;
+    for (int i = 0; i < WEAR_NBLOCKS; i++) {
+        n = strtoul(p, &end, 10);
+        if (end == p || *end != ' ')
+            return NULL;
+        if (counts != NULL)
+            counts[i] = n;
+        p = end + 1;
+    }
+
+    return p;
+}
+
+/**
+ * Look up the erase counts of the cart "cartid" (its fingerprint and
+ * identifier). The counts are set to 0 if the
+ * cart is unknown.
+ *
+ * Returns 0 if found, 1 otherwise.
+ */
+static int
+wear_load(const char *cartid, unsigned long *counts) {
+    static char line[WEAR_LINESIZE];
+    unsigned long c[WEAR_NBLOCKS];
+    char *path, *id;
+    int found;
+    FILE *f;
+
+    memset(counts, 0, WEAR_NBLOCKS*sizeof(*counts));
+
+    if ((path = wear_path()) == NULL)
+        return 1;
+    if ((f = fopen(path, "r")) == NULL)
+        return 1;
+
+    found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((id = parse_line(line, c)) != NULL && strcmp(id, cartid) == 0) {
+            memcpy(counts, c, sizeof(c));
+            found = 1;
+        }
+    }
+    fclose(f);
+
+    return !found;
+}
+
+/**
+ * Save the erase counts of the cart "cartid", replacing its previous entry.
+ *
+ * Returns 0 on success, 1 on error (a message has been printed).
+ */
+static int
+wear_save(const char *cartid, const unsigned long *counts) {
+    static char line[WEAR_LINESIZE];
+    char tmppath[1024+8], *path, *id;
+    FILE *f, *tmp;
+
+    if ((path = wear_path()) == NULL)
+        return 1;
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >=
+        sizeof(tmppath)) {
+            warnx("path of the wear file too long");
+            return 1;
+    }
+
+    if ((tmp = fopen(tmppath, "w")) == NULL) {
+        warn("can't create %s", tmppath);
+        return 1;
+    }
+
+    /* keep the entries of the other carts */
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((id = parse_line(line, NULL)) != NULL &&
+                strcmp(id, cartid) == 0)
+                    continue;
+            fprintf(tmp, "%s\n", line);
+        }
+        fclose(f);
+    }
+
+    for (int i = 0; i < WEAR_NBLOCKS; i++)
+        fprintf(tmp, "%lu ", counts[i]);
+    fprintf(tmp, "%s\n", cartid);
+
+    if (fclose(tmp) == EOF) {
+        warn("error writing %s", tmppath);
+        remove(tmppath);
+        return 1;
+    }
+    if (rename(tmppath, path) == -1) {
+        warn("can't rename %s to %s", tmppath, path);
+        remove(tmppath);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* atexit() handler: save the counts once */
+static void
+wear_end(void) {
+    if (wear_changed)
+        wear_save(wear_key, wear_counts);
+}
+
+/**
+ * Count the erasures of the cart from now on, if it can be identified: its
+ * counts are loaded and saved at the exit.
+ *
+ * Returns the erase counts of the two pages, NULL if the cart is unknown.
+ */
+const unsigned long *
+wear_start(void) {
+    char cartid[256];
+    uint64_t print;
+
+    if (wear_started)
+        return wear_counts;
+    if (ems_cartid(cartid, sizeof(cartid)) != 0 ||
+        ems_fingerprint(&print) != 0)
+            return NULL;
+
+    snprintf(wear_key, sizeof(wear_key), "%016"PRIx64" %s", print, cartid);
+    wear_load(wear_key, wear_counts);
+    wear_started = 1;
+    atexit(wear_end);
+    return wear_counts;
+}
+
+/**
+ * Count the erase-blocks erased by the write commands sent by ems_writev(),
+ * those starting an erase-block, when the counting is started. "written" is
+ * the result of ems_writev(): the commands not sent entirely are not counted.
+ */
+void
+wear_writev(int to, struct ems_iovec *iov, int iovcnt, int written) {
+    if (!wear_started || to != TO_ROM)
+        return;
+
+    for (int i = 0; i < iovcnt && written >= (int)iov[i].count; i++) {
+        written -= iov[i].count;
+        if (iov[i].offset%ERASEBLOCKSIZE == 0 &&
+            iov[i].offset < WEAR_NBLOCKS*ERASEBLOCKSIZE) {
+                wear_counts[iov[i].offset/ERASEBLOCKSIZE]++;
+                wear_changed = 1;
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef EMS_WEAR_H
+#define EMS_WEAR_H
+
+#include "ems.h"
+
+/* erase-blocks of the two pages */
+#define WEAR_NBLOCKS (2*PAGESIZE/ERASEBLOCKSIZE)
+
+const unsigned long *wear_start(void);
+void wear_writev(int, struct ems_iovec *, int, int);
+
+#endif /* EMS_WEAR_H */